@@ -22,6 +22,7 @@
 #include <wchar.h>
 
 #include "node_shared.h"
+#include "node_dict.h"
 
 /*
 * These macros provide short convenient names for structure members,
@@ -151,7 +152,7 @@ static void NODE_INTERNAL_FUNC free_nodes(dnode_t *node, dnode_t *nil)
 
 dict_t * NODE_INTERNAL_FUNC dict_create()
 {
-	dict_t *new = node_malloc(sizeof *new);
+	dict_t *new = malloc(sizeof *new);
 	
 	if (new) {
 		new->nilnode.left = &new->nilnode;
@@ -237,7 +238,7 @@ dnode_t * NODE_INTERNAL_FUNC dict_ensure_existsA(dict_t *dict, const char *key )
 	/* not found - create */
 	keylen = strlen(key)+1;
 	size = sizeof(dnode_t) + sizeof(char)*keylen - DNODE_KEY_BASE_LENGTH;
-	root = (dnode_t *)node_malloc( size );
+	root = (dnode_t *)malloc( size );
 	if (root != NULL) 
 	{
 		strcpy_s( (char *)(root->dict_key), keylen, key );
@@ -312,10 +313,10 @@ dnode_t * NODE_INTERNAL_FUNC dict_ensure_existsW(dict_t *dict, const wchar_t *ke
 
 	/* not found - create */
 	size = sizeof(dnode_t) + sizeof(wchar_t)*(keylen + 1) - DNODE_KEY_BASE_LENGTH;
-	root = (dnode_t *)node_malloc( size );
+	root = (dnode_t *)malloc( size );
 	if (root != NULL) 
 	{
-		wcscpy_s( (wchar_t *)(root->dict_key), keylen, key );
+		wcscpy_s( (wchar_t *)(root->dict_key), keylen + 1, key );
 		
 		dict_insert_internal( dict, parent, root, result );
 		
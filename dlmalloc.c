@@ -1109,6 +1109,13 @@ size_t mspace_footprint(mspace msp);
 */
 size_t mspace_max_footprint(mspace msp);
 
+/*
+  mspace_set_footprint_limit() caps the bytes the space may obtain from
+  the system; allocations that would need more fail instead. 0 means no
+  limit. (Backported from dlmalloc 2.8.4.)
+*/
+size_t mspace_set_footprint_limit(mspace msp, size_t bytes);
+
 
 #if !NO_MALLINFO
 /*
@@ -2000,6 +2007,7 @@ struct malloc_state {
   tbinptr    treebins[NTREEBINS];
   size_t     footprint;
   size_t     max_footprint;
+  size_t     footprint_limit; /* zero means no limit */
   flag_t     mflags;
 #if USE_LOCKS
   MLOCK_T    mutex;     /* locate lock among fields that rarely change */
@@ -3340,6 +3348,15 @@ static void* __fastcall sys_alloc(mstate m, size_t nb) {
 
   init_mparams();
 
+  /* Refuse growth past the footprint limit */
+  if (m->footprint_limit != 0) {
+    size_t fp = m->footprint + granularity_align(nb + TOP_FOOT_SIZE + SIZE_T_ONE);
+    if (fp <= m->footprint || fp > m->footprint_limit) {
+      MALLOC_FAILURE_ACTION;
+      return 0;
+    }
+  }
+
   /* Directly map large chunks */
   if (use_mmap(m) && nb >= mparams.mmap_threshold) {
     void* mem = mmap_alloc(m, nb);
@@ -4763,23 +4780,39 @@ void mspace_malloc_stats(mspace msp) {
 }
 
 size_t mspace_footprint(mspace msp) {
-  size_t result;
+  size_t result = 0;
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
     result = ms->footprint;
   }
-  USAGE_ERROR_ACTION(ms,ms);
+  else {
+    USAGE_ERROR_ACTION(ms,ms);
+  }
   return result;
 }
 
 
 size_t mspace_max_footprint(mspace msp) {
-  size_t result;
+  size_t result = 0;
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
     result = ms->max_footprint;
   }
-  USAGE_ERROR_ACTION(ms,ms);
+  else {
+    USAGE_ERROR_ACTION(ms,ms);
+  }
+  return result;
+}
+
+size_t mspace_set_footprint_limit(mspace msp, size_t bytes) {
+  size_t result = 0;
+  mstate ms = (mstate)msp;
+  if (ok_magic(ms)) {
+    result = ms->footprint_limit = bytes;
+  }
+  else {
+    USAGE_ERROR_ACTION(ms,ms);
+  }
   return result;
 }
 
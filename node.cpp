@@ -17,6 +17,7 @@
 
 #include "node.h"
 #include "node_shared.h"
+#include "node_dict.h"
 
 #include "git-version.h"
 
@@ -24,12 +25,10 @@
  Node Library Configuration Definitions
  **************************************/
 
-/* define exactly one of the next two */
-//#define HASH_USES_MOD				/* use % operator and prime-number bucket counts */
-#define HASH_USES_BITMASK			/* use & operator and power-of-two bucket counts (slightly faster) */
-
-/* optional, only valid if HASH_USES_BITMASK */
-//#define HASH_AUTO_RESIZE			/* auto-resize hashes if they get very large */
+/* automatic: probe hash control bytes a group at a time with SSE2, which every x64 has */
+#if defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 ) || defined(__SSE2__)
+#define HASH_USES_SSE2
+#endif
 
 /* optional: reasonable speed improvement */
 //#define WITH_FASTCALL				/* internal functions use __fastcall calling convention */
@@ -38,56 +37,134 @@
 /* optional: small speed improvement when hashes used frequently */
 #define USE_BAGS					/* allocate extra space after node for (small) string storage instead of using free store */
 
+/* optional, x64 with USE_DL_MALLOC only: links between nodes are 32-bit offsets (see node_link_t) */
+//#define NODE_COMPACT_LINKS
+// opt-in and untested here: it changes node_t, so it needs defining with USE_DL_MALLOC for both the
+// library and its users, and no project configuration in this tree does either
+
 /***********************************
  Error checking on above definitions
  ***********************************/
 
-#ifndef HASH_USES_MOD
-#ifndef HASH_USES_BITMASK
-#error Must define either HASH_USES_BITMASK or HASH_USES_MOD
-#endif
-#endif
-
-#ifdef HASH_USES_MOD
-#ifdef HASH_USES_BITMASK
-#error Must define only one of HASH_USES_BITMASK or HASH_USES_MOD
+#ifdef NODE_COMPACT_LINKS
+#if !defined(USE_DL_MALLOC) || !_WIN64
+#error NODE_COMPACT_LINKS needs USE_DL_MALLOC on x64
 #endif
 #endif
 
-#ifdef HASH_USES_MOD
-#ifdef HASH_AUTO_RESIZE
-#error Hash is only resizable if HASH_USES_BITMASK
+#ifdef HASH_USES_SSE2
+#include <emmintrin.h>
 #endif
+#ifdef _MSC_VER
+#include <intrin.h>
 #endif
 
-#define HASH_LOAD_FACTOR	16
-#define NEEDS_REBALANCE(pn)		( (pn)->nHashBuckets < (1<<NODE_HASH_BITS) && (pn)->nHashElements > HASH_LOAD_FACTOR * (pn)->nHashBuckets )
-
 #define DIMENSION( A ) ( (sizeof A)/(sizeof A[0]) )
 
 /* Malloc specials */
 #ifdef USE_DL_MALLOC
 extern "C" extern struct malloc_state _gm_;
 
+#define NODE_CACHE_ARENAS	4		/* arenas each thread keeps a private node cache for */
+#define NODE_STAT_ARENAS	4		/* arenas each thread keeps a share of the statistics for */
+#define NODE_CACHE_BATCH	64		/* nodes moved between a thread cache and its arena at a time */
+#define NODE_SLAB_SIZE		0x10000		/* default node slab size; slabs are always a multiple of this */
+#define NODE_BUMP_SIZE		0x100000	/* minimum slab size for NODE_ARENA_MONOTONIC allocations */
+#define NODE_PAGE_SIZE		0x1000		/* stride for NODE_ARENA_PREFAULT */
+#define NODE_CHUNK_SIZE		0x10000		/* slabs are aligned to this; no node straddles a chunk */
+#define NODE_CHUNK_HEADER	MEMORY_ALLOCATION_ALIGNMENT	/* the arena pointer starting every chunk but a slab's first */
+#define NODE_LINK_SPAN		0x400000000	/* NODE_COMPACT_LINKS: address space reserved per arena for its node slabs */
+
+/* nodes don't carry their arena: it is the first pointer of the chunk they were carved from */
+#define GET_ARENA( pn )		( *reinterpret_cast<node_arena **>( (uintptr_t)(pn) & ~(uintptr_t)(NODE_CHUNK_SIZE - 1) ) )
+
+/* per-thread arena statistics; node_arena_stats sums them over all threads */
+struct node_stat_counts
+{
+	INT_PTR nNodes;					/* allocs minus frees */
+	INT_PTR cbStrings;				/* string values and names outside the bag */
+	INT_PTR cbData;					/* data values outside the bag */
+	INT_PTR cbBuckets;				/* hash tables outside the bag */
+	INT_PTR nBagHits;
+	INT_PTR nBagMisses;
+};
+
 struct node_arena
 {
 	struct va
 	{
-		va( va * p ) : next(p) {}
+		va( va * p ) : pArena(NULL), next(p), nSize(0), nPad(0) {}
+		node_arena * pArena;		/* first, like every chunk header: see GET_ARENA */
 		va * next;
+		size_t nSize;
+		size_t nPad;				/* keeps the nodes after it MEMORY_ALLOCATION_ALIGNMENT aligned */
 	};
 
+	SLIST_HEADER slBatches;			/* batches of free nodes, pushed and popped lock-free by thread caches */
 	mspace pSpace;
-	node_t * pnFreeList;
-	CRITICAL_SECTION csFreeList;
+	size_t nSpaceSize;				/* initial mspace capacity, for recreating it on reset */
+	CRITICAL_SECTION csSlabs;		/* only held while carving a new batch out of the slabs */
 	va * pVA;
+	va * pVASpare;					/* slabs emptied by node_arena_reset, reused before new ones are allocated */
+	char * pcSlabNext;				/* next uncarved node in the newest slab */
+	char * pcSlabEnd;
+	size_t nSlabSize;				/* size of each node slab */
+	size_t nBumpSize;				/* size of each bump slab */
+	int nFlags;						/* NODE_ARENA_* */
+	va * pVABump;					/* NODE_ARENA_MONOTONIC: slabs node_malloc bumps through */
+	va * pVABumpSpare;
+	char * pcBumpNext;
+	char * pcBumpEnd;
+	long nSerial;					/* changes when the arena is deleted; thread caches check it */
+	node_arena * pnaNextDead;		/* deleted arenas are kept for reuse so stale caches can read nSerial */
+	volatile LONG nBatchedNodes;	/* free nodes on slBatches */
+	size_t nSlabs;					/* node and bump slabs, guarded by csSlabs */
+	size_t cbSlabs;
+	node_stat_counts statsRetired;	/* counts from thread caches that were evicted or exited, guarded by g_csArenas */
+	SLIST_HEADER slRemote;			/* nodes other threads freed, waiting for the owner to free them */
+	volatile DWORD dwOwner;			/* thread that allocates from the arena; 0 for the (locked) global arena */
+	size_t cbBudget;				/* most bytes of slabs plus mspace footprint the arena may hold; 0 for no limit */
+#ifdef NODE_COMPACT_LINKS
+	char * pcSpan;					/* reserved on first use; node slabs are committed from it so links fit in 32 bits */
+	char * pcSpanNext;				/* first uncommitted byte of the span */
+#endif
+};
+
+struct node_arena g_GlobalArena = { {0}, &_gm_, 0, {0}, NULL, NULL, NULL, NULL, NODE_SLAB_SIZE, NODE_BUMP_SIZE, 0, NULL, NULL, NULL, NULL, 1, NULL, 0, 0, 0, {0}, {0}, 0, 0 };
+
+static long g_nArenaSerial = 1;
+static node_arena * g_pnaDeadArenas = NULL;
+static struct node_tls * g_ptlsThreads = NULL;	/* every thread's TLS, so statistics can be summed */
+static CRITICAL_SECTION g_csArenas;				/* guards the three above and statsRetired */
+
+/* a thread's private stack of free nodes for one arena */
+struct node_cache
+{
+	node_arena * pArena;
+	long nSerial;					/* pArena->nSerial when the cache was claimed */
+	node_t * pnHead;				/* free nodes, linked by pnNext */
+	int nCount;
+	INT_PTR nNodes;					/* allocs minus frees through this cache */
 };
 
-struct node_arena g_GlobalArena = { &_gm_, NULL, {0}, 0 };
+/* a thread's share of one arena's statistics; kept apart from the node caches so that counting
+   a string or a table never claims or evicts a cache */
+struct node_stat_slot
+{
+	node_arena * pArena;
+	long nSerial;					/* pArena->nSerial when the slot was claimed */
+	node_stat_counts stats;
+};
+
+#define NODE_STAT_CTX( ptls, pArena, expr )	(void)( node_stats_find( (ptls), (pArena) )->stats.expr )
+
+/* the context for internal calls whose caller didn't pass one: only the node caches need it */
+#define NODE_CACHE_CTX	GetTLS()
 
 static void inline nfree( node_arena * pArena, void * pv )
 {
-	mspace_free( pArena->pSpace, pv );
+	if( !(pArena->nFlags & NODE_ARENA_MONOTONIC) )
+		mspace_free( pArena->pSpace, pv );
 }
 #else
 struct node_arena
@@ -95,6 +172,13 @@ struct node_arena
 	int nDummy;
 };
 
+#define NODE_STAT_CTX( ptls, pArena, expr )	(void)(ptls)
+
+#define NODE_CACHE_CTX	NULL
+
+/* only one arena without USE_DL_MALLOC */
+#define GET_ARENA( pn )		(&g_GlobalArena)
+
 struct node_arena g_GlobalArena = {0};
 static void inline nfree( node_arena * , void * pv )
 {
@@ -118,9 +202,47 @@ typedef void (*node_assert_func_internal_t)( void * psExpr, const char * psFile,
  Module Classes for TLS
  **********************/
 
+/* the first cache line boundary at or after pv, in a block allocated with CACHE_LINE - 1 bytes to spare */
+#define CACHE_LINE				64
+#define CACHE_ALIGN( pv )		( (void *)( ( (uintptr_t)(pv) + CACHE_LINE - 1 ) & ~(uintptr_t)( CACHE_LINE - 1 ) ) )
+
+/* a thread's read sections, which writers to shared hashes look at before freeing what they took out;
+   records are never freed, so writers walk g_pReaders without a lock, and an exited thread's is reused.
+   Each has a cache line of its own, so one thread beginning a section does not stall another's */
+struct node_reader
+{
+	node_reader * pNext;
+	volatile LONG nEpoch;			/* g_nReadEpoch when the outermost section began; 0 outside one */
+	int nDepth;						/* sections this thread is in */
+	volatile LONG bInUse;			/* a thread has it */
+	char abPad[CACHE_LINE - sizeof(node_reader *) - 3 * sizeof(LONG)];
+};
+
+static node_reader * volatile g_pReaders = NULL;
+static volatile LONG g_nReadEpoch = 1;		/* moved on by writers each time they set aside what they retired */
+
 struct node_tls
 {
-	node_tls() : nCodePage(CP_ACP), pfError(NULL), pfMemory(NULL), pfAssert(NULL), pArena(&g_GlobalArena), psSourceFile(NULL), nSourceLine(-1) {}
+	node_tls() : nCodePage(CP_ACP), pfError(NULL), pfMemory(NULL), pfAssert(NULL), pArena(&g_GlobalArena), psSourceFile(NULL), nSourceLine(-1), nError(NODE_ERROR_NONE), pReader(NULL)
+	{
+#ifdef USE_DL_MALLOC
+		memset( aCache, 0, sizeof(aCache) );
+		iCacheVictim = 0;
+		memset( aStats, 0, sizeof(aStats) );
+		iStatVictim = 0;
+
+		EnterCriticalSection( &g_csArenas );
+		ptlsPrev = NULL;
+		ptlsNext = g_ptlsThreads;
+		if( ptlsNext != NULL )
+			ptlsNext->ptlsPrev = this;
+		g_ptlsThreads = this;
+		LeaveCriticalSection( &g_csArenas );
+#endif
+	}
+#ifdef USE_DL_MALLOC
+	~node_tls();
+#endif
 	int nCodePage;
 	node_error_func_t pfError;
 	node_memory_func_t pfMemory;
@@ -128,6 +250,16 @@ struct node_tls
 	node_arena * pArena;
 	const char * psSourceFile;
 	int nSourceLine;
+	int nError;						/* NODE_ERROR_*: first allocation failure since node_clear_error */
+	node_reader * pReader;			/* claimed by the thread's first read section */
+#ifdef USE_DL_MALLOC
+	node_cache aCache[NODE_CACHE_ARENAS];
+	int iCacheVictim;				/* next cache to hand back when all are in use */
+	node_stat_slot aStats[NODE_STAT_ARENAS];
+	int iStatVictim;				/* next slot to fold into its arena when all are in use */
+	node_tls * ptlsNext;			/* g_ptlsThreads list */
+	node_tls * ptlsPrev;
+#endif
 };
 
 static int m_dwTLSIndex = -1;
@@ -188,6 +320,11 @@ static inline int& GetTLS_source_line()
 	return GetTLS()->nSourceLine;
 }
 
+static inline int& GetTLS_nError()
+{
+	return GetTLS()->nError;
+}
+
 #define node_nCodePage		GetTLS_nCodePage()
 #define node_pfError		GetTLS_pfError()
 #define node_pfMemory		GetTLS_pfMemory()
@@ -195,6 +332,7 @@ static inline int& GetTLS_source_line()
 #define node_pArena			GetTLS_pArena()
 #define node_source_file	GetTLS_source_file()
 #define node_source_line	GetTLS_source_line()
+#define node_nError			GetTLS_nError()
 
 #ifdef _DEBUG
 class set_debug_allocator
@@ -271,6 +409,12 @@ static int node_nDebugRef = 0;
 static int node_nDebugHashPerf = 0;
 #endif
 
+/* name interning: while node_bIntern is set, names are shared through the intern tables */
+static int node_bIntern = FALSE;
+static dict_t * node_pdictNamesA = NULL;
+static dict_t * node_pdictNamesW = NULL;
+static CRITICAL_SECTION node_csNames;		/* guards both tables and the refcounts in them */
+
 /* spaces - to avoid fputc               1234567890123456 */
 static const char    node_acSpaces[] =  "                ";
 static const wchar_t node_wcSpaces[] = L"                ";
@@ -295,13 +439,7 @@ static inline void byte_to_strW( wchar_t *& ps, unsigned int b )
  Private Named Constants
  ***********************/
 
-#ifdef HASH_USES_BITMASK
-#define DEFAULT_HASHBUCKETS 8
-#endif
-
-#ifdef HASH_USES_MOD
-#define DEFAULT_HASHBUCKETS 17
-#endif
+#define DEFAULT_HASHSLOTS 4		/* a table of 4 fits the bag on x64 */
 
 #define LOTS_OF_MEMORY 0x10000000 /* 256MB */
 #define GRATUITOUSLY_MUCH_MEMORY 0x7FFFFFFF /* >2GB NODE_DATA allocations are not supported */
@@ -313,85 +451,469 @@ static inline void byte_to_strW( wchar_t *& ps, unsigned int b )
 
 #define HASH_CONTAINS_AKEYS		0x01
 #define HASH_CONTAINS_WKEYS		0x02
+#define HASH_MIGRATING			0x04	/* children are still being moved from the old table */
+#define HASH_FROZEN				0x08	/* the table is a minimal perfect hash of the children (see node_hash_freeze) */
+#define HASH_SHARED				0x10	/* gets may run on other threads while it changes (see node_hash_share) */
 
+/* a node and its bag take 112 bytes on Win64 and 64 on Win32: multiples of MEMORY_ALLOCATION_ALIGNMENT,
+   since free nodes are pushed on SLists */
 #if _WIN64 
-#define NODE_SIZE		64		/* not sizeof(node_t), which is 64 */
+#ifdef _DEBUG
+#define NODE_SIZE		48		/* sizeof(node_t): psHashAllocated */
+#else
+#define NODE_SIZE		40		/* sizeof(node_t) */
+#endif
 #else 
-#define NODE_SIZE		48		/* not sizeof(node_t), which is 48 */
+#define NODE_SIZE		32		/* sizeof(node_t) */
 #endif
 
 
 #ifdef USE_BAGS
 #if _WIN64 
-#define BAG_SIZE		64
+#define BAG_SIZE		(112 - NODE_SIZE)
 #else 
 #define BAG_SIZE		32
 #endif
 
 #define GET_BAG( pn )		(((unsigned char *)pn) + NODE_SIZE)
 #define IS_BAG( pn, ps )	( (void*)(ps) == (void*)GET_BAG(pn) )
+/* anywhere in the bag: node_compact puts names behind the value */
+#define IN_BAG( pn, ps )	( (unsigned char *)(ps) >= GET_BAG(pn) && (unsigned char *)(ps) < GET_BAG(pn) + BAG_SIZE )
 #else
 #define BAG_SIZE		0
 #define GET_BAG( pn ) (assert(0))
 #pragma warning( disable: 4127 )
 #define IS_BAG( pn, ps ) 0
+#define IN_BAG( pn, ps ) 0
+#endif
+
+/* the intern table entry an interned name is the key of */
+#define NAME_DNODE( ps )	( (dnode_t *)( (unsigned char *)(ps) - offsetof( dnode_t, dict_key ) ) )
+
+/* a name in the bag keeps the bag in use after the value is cleaned up */
+#define NAME_IN_BAG( pn )	IN_BAG( pn, (pn)->psAName )
+
+/* a node has one name, in the encoding bNameW gives */
+#define NODE_NAMEA( pn )	( (pn)->bNameW ? NULL : (pn)->psAName )
+#define NODE_NAMEW( pn )	( (pn)->bNameW ? (pn)->psWName : NULL )
+
+/* what a scalar was last coerced to: few scalars are, so it lives beside the node */
+struct node_strings
+{
+	char * psAValue;
+	wchar_t * psWValue;
+};
+
+/* links between nodes: see node_link_t; a link is relative to the node that holds it */
+#ifdef NODE_COMPACT_LINKS
+#define LINK_UNIT			MEMORY_ALLOCATION_ALIGNMENT
+#define LINK_GET( pnHolder, ln )	( (ln) != 0 ? (node_t *)( (char *)(pnHolder) + (INT_PTR)(ln) * LINK_UNIT ) : (node_t *)NULL )
+#define LINK_TO( pnHolder, pn )		( (pn) != NULL ? (node_link_t)( ( (char *)(pn) - (char *)(pnHolder) ) / LINK_UNIT ) : 0 )
+#else
+#define LINK_GET( pnHolder, ln )	(ln)
+#define LINK_TO( pnHolder, pn )		(pn)
 #endif
 
+#define SET_NEXT( pn, pnTo )			( (pn)->pnNext = LINK_TO( (pn), (pnTo) ) )
+#define LIST_TAIL( pnList )				LINK_GET( (pnList), (pnList)->pnListTail )
+#define SET_LIST_HEAD( pnList, pn )		( (pnList)->pnListHead = LINK_TO( (pnList), (pn) ) )
+#define SET_LIST_TAIL( pnList, pn )		( (pnList)->pnListTail = LINK_TO( (pnList), (pn) ) )
+#define HASH_SLOT( pnHash, i )			LINK_GET( (pnHash), (pnHash)->ppnHashSlots[i] )
+#define SET_HASH_SLOT( pnHash, i, pn )	( (pnHash)->ppnHashSlots[i] = LINK_TO( (pnHash), (pn) ) )
+
+/* hash tables: open addressing over groups of slots, each slot with its child's full hash and key length
+   and a control byte holding HASH_CTRL_EMPTY, HASH_CTRL_DELETED or the top bits of the node's nHash */
+#define HASH_GROUP			16		/* control bytes probed at a time */
+#define HASH_MIN_SLOTS		4
+#define HASH_CTRL_EMPTY		0x80
+#define HASH_CTRL_DELETED	0xFE
+#define HASH_CTRL_CLAIMED	0xFF	/* a writer of a shared hash is filling the slot: gets pass it like a deleted one */
+#define HASH_TABLE_HASHES( ppnSlots, nSlots )	( (unsigned int *)( (ppnSlots) + (nSlots) ) )
+#define HASH_TABLE_LENGTHS( ppnSlots, nSlots )	( (unsigned short *)( HASH_TABLE_HASHES( ppnSlots, nSlots ) + (nSlots) ) )
+#define HASH_TABLE_CTRL( ppnSlots, nSlots )		( (unsigned char *)( HASH_TABLE_LENGTHS( ppnSlots, nSlots ) + (nSlots) ) )
+#define HASH_HASHES( pnHash )			HASH_TABLE_HASHES( (pnHash)->ppnHashSlots, (pnHash)->nHashSlots )
+#define HASH_LENGTHS( pnHash )			HASH_TABLE_LENGTHS( (pnHash)->ppnHashSlots, (pnHash)->nHashSlots )
+#define HASH_CTRL( pnHash )				HASH_TABLE_CTRL( (pnHash)->ppnHashSlots, (pnHash)->nHashSlots )
+#define HASH_SLOT_USED( pnHash, i )		( ( HASH_CTRL( pnHash )[i] & 0x80 ) == 0 )
+#define HASH_TAG( nHash )				( (unsigned char)( ( (nHash) >> (NODE_HASH_BITS - 7) ) & 0x7F ) )
+#define HASH_TABLE_SIZE( nSlots )		( (size_t)(nSlots) * ( sizeof(node_link_t) + sizeof(unsigned int) + sizeof(unsigned short) + 1 ) )
+#define HASH_LENGTH_LIMIT				0xFFFF	/* key lengths are kept up to this; longer ones are always compared */
+#define HASH_LENGTH( nLength )			( (unsigned short)__min( (nLength), (size_t)HASH_LENGTH_LIMIT ) )
+#define KEY_TERMINATED					( (size_t)-1 )	/* a key's length, when only its terminator says */
+#define HASH_MAX_FILL( nSlots )			( (nSlots) * 7 / 8 )	/* always leaves an empty slot to end probes */
+#define HASH_SLOTS_FOR( nElements )		( ( (nElements) * 8 + 6 ) / 7 )
+
+/* a table larger than a group grows incrementally: each add moves a few groups of the old table,
+   whose hash_migration record trails the control bytes of every allocated table */
+#define HASH_MIGRATE_GROUPS				4
+
+#define HASH_BATCH			16		/* keys a batched get hashes and prefetches before looking any up */
+
+/* a frozen table has exactly a slot per child, which a displacement per bucket of keys picks
+   (hash, displace and compress); its hash_frozen record trails the control bytes */
+#define HASH_FROZEN_BUCKET				2		/* keys per bucket, on average: more take far longer to place */
+#define HASH_FROZEN_SIZE( nSlots, nBuckets )	( HASH_TRAILER_OFFSET( nSlots ) + sizeof(hash_frozen) + ( (nBuckets) - 1 ) * sizeof(unsigned int) )
+#define HASH_FROZEN_RECORD( pnHash )	( (const hash_frozen *)( (char *)(pnHash)->ppnHashSlots + HASH_TRAILER_OFFSET( (pnHash)->nHashSlots ) ) )
+#define HASH_RANGE( n, nRange )			( (int)( ( (unsigned __int64)(n) * (unsigned int)(nRange) ) >> 32 ) )	/* n scaled to [0, nRange) */
+#define HASH_TRAILER_OFFSET( nSlots )	( ( HASH_TABLE_SIZE( nSlots ) + sizeof(void *) - 1 ) & ~( sizeof(void *) - 1 ) )
+#define HASH_ALLOC_SIZE( nSlots )		( HASH_TRAILER_OFFSET( nSlots ) + sizeof(hash_migration) )
+#define HASH_MIGRATION( pnHash )		( (hash_migration *)( (char *)(pnHash)->ppnHashSlots + HASH_TRAILER_OFFSET( (pnHash)->nHashSlots ) ) )
+
+/* a shared hash's tables are headed by a hash_shared_table record, padded so groups stay aligned;
+   a table is only ever replaced whole, and a slot once filled keeps its child until then */
+#define HASH_SHARED_HEADER				( ( sizeof(hash_shared_table) + 15 ) & ~(size_t)15 )
+#define HASH_SHARED_TABLE( ppnSlots )	( (hash_shared_table *)( (char *)(ppnSlots) - HASH_SHARED_HEADER ) )
+#define HASH_PUBLISHED( pnHash )		( *(node_link_t * const volatile *)&( (pnHash)->ppnHashSlots ) )	/* the table gets read */
+#define HASH_RETIRE_BATCH				64		/* children retired before a writer tries to free them */
+#define HASH_STRIPES					16		/* writer locks of a shared hash: a key's hash picks its stripe */
+#define HASH_STRIPE( nHash )			( (int)( (nHash) & ( HASH_STRIPES - 1 ) ) )
+
 #define NOT_IN_COLLECTION	0
 #define IN_COLLECTION		1
 
+/* node_hash_add*_valist flags */
+#define ADD_REPLACE			0		/* a child of the same name is freed for the new node */
+#define ADD_IN_PLACE		1		/* a child of the same name takes a plain value itself (see node_set_in_place) */
+
 /***********************
  Private Data Structures
  ***********************/
 
+/* bit i set for each of the nWidth control bytes at pb equal to b */
+static inline unsigned int hash_match( const unsigned char * pb, int nWidth, unsigned char b )
+{
+#ifdef HASH_USES_SSE2
+	if( nWidth == HASH_GROUP )
+		return (unsigned int)_mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)pb ), _mm_set1_epi8( (char)b ) ) );
+#endif
+	unsigned int nMatch = 0;
+	for( int i = 0; i < nWidth; i++ )
+		if( pb[i] == b )
+			nMatch |= 1u << i;
+	return nMatch;
+}
+
+/* bit i set for each empty or deleted control byte */
+static inline unsigned int hash_match_free( const unsigned char * pb, int nWidth )
+{
+#ifdef HASH_USES_SSE2
+	if( nWidth == HASH_GROUP )
+		return (unsigned int)_mm_movemask_epi8( _mm_loadu_si128( (const __m128i *)pb ) );
+#endif
+	unsigned int nMatch = 0;
+	for( int i = 0; i < nWidth; i++ )
+		if( pb[i] & 0x80 )
+			nMatch |= 1u << i;
+	return nMatch;
+}
+
+/* claim an empty slot of a shared hash for this writer: FALSE if another writer filled or claimed
+   it first. There is no exchange of a byte, so it exchanges the aligned word the byte is in; a table
+   has a multiple of four slots, so the word is all control bytes */
+static inline int hash_ctrl_claim( unsigned char * pbCtrl )
+{
+	volatile LONG * pnWord = (volatile LONG *)( (size_t)pbCtrl & ~(size_t)3 );
+	int nShift = (int)( (size_t)pbCtrl & 3 ) * 8;
+
+	unsigned long nOld = (unsigned long)*pnWord;
+	if( ( ( nOld >> nShift ) & 0xFF ) != HASH_CTRL_EMPTY )
+		return FALSE;
+
+	unsigned long nNew = ( nOld & ~( 0xFFul << nShift ) ) | ( (unsigned long)HASH_CTRL_CLAIMED << nShift );
+	return (unsigned long)InterlockedCompareExchange( pnWord, (LONG)nNew, (LONG)nOld ) == nOld;
+}
+
+/* the groups a hash probes, in order: triangular steps visit each group once */
+struct hash_probe
+{
+	const unsigned char * pbCtrl;
+	int nWidth;				/* slots per group: HASH_GROUP, or all of a smaller table */
+	int nMask;				/* groups - 1 */
+	int nGroup;
+	int nStep;
+
+	hash_probe( const node_t * pnHash, unsigned int nHash )
+	{
+		init( HASH_CTRL( pnHash ), pnHash->nHashSlots, nHash );
+	}
+
+	/* probe a table other than the hash's current one */
+	hash_probe( const node_link_t * ppnSlots, int nSlots, unsigned int nHash )
+	{
+		init( HASH_TABLE_CTRL( ppnSlots, nSlots ), nSlots, nHash );
+	}
+
+	void init( const unsigned char * pbTableCtrl, int nSlots, unsigned int nHash )
+	{
+		pbCtrl = pbTableCtrl;
+		nWidth = __min( nSlots, HASH_GROUP );
+		nMask = nSlots / nWidth - 1;
+		nGroup = (int)( nHash & nMask );
+		nStep = 1;
+	}
+
+	const unsigned char * group() const { return pbCtrl + nGroup * nWidth; }
+
+	/* the slot of the lowest bit in nMatch */
+	int slot( unsigned int nMatch ) const
+	{
+		unsigned long nBit;
+		_BitScanForward( &nBit, nMatch );
+		return nGroup * nWidth + (int)nBit;
+	}
+
+	bool next()
+	{
+		if( nStep > nMask )
+			return false;
+		nGroup = ( nGroup + nStep++ ) & nMask;
+		return true;
+	}
+};
+
+/* the displacements of a frozen table, one per bucket of keys */
+struct hash_frozen
+{
+	int nKeySlots;			/* slots the displacements pick from; past them, keys whose full hash another has */
+	int nBuckets;
+	unsigned int anDisplace[1];
+};
+
+/* one of a shared hash's writer locks and the counts its writers keep, padded to a cache line so
+   writers in other stripes do not contend for its line */
+struct hash_stripe
+{
+	CRITICAL_SECTION cs;
+	volatile LONG nElements;			/* children added less those deleted in this stripe: only the sum is a count */
+	LONG nGrowth;						/* slots this stripe's writers may fill before they must gather the others' */
+	char abPad[CACHE_LINE - ( sizeof(CRITICAL_SECTION) + 2 * sizeof(LONG) ) % CACHE_LINE];
+};
+
+/* a shared hash's writer locks and counts, and what it has taken out but readers may still hold.
+   Writers of keys in different stripes change the table at once: each claims its slot with an
+   interlocked exchange, and growing the table takes every stripe. The hash's nHashElements and
+   nHashGrowth are only up to date while every stripe is held; the stripes' counts always are */
+struct hash_shared
+{
+	hash_stripe aStripes[HASH_STRIPES];
+	void * pvBlock;						/* what node_malloc returned: the record starts at the next cache line */
+	CRITICAL_SECTION csRetired;			/* guards the rest */
+	node_t * pnRetired;					/* children retired since the last wait began, linked by pnNext */
+	struct hash_shared_table * ptRetired;	/* tables replaced since then */
+	int nRetired;
+	node_t * pnWaiting;					/* the ones retired before: freed once the epoch they wait on is over */
+	struct hash_shared_table * ptWaiting;
+	LONG nWaitEpoch;					/* 0 when nothing waits */
+};
+
+struct hash_shared_table
+{
+	hash_shared * pShared;				/* the same for every table of the hash */
+	hash_shared_table * ptNext;			/* retired tables */
+	int nSlots;							/* readers cannot take the hash's: it may be the next table's */
+};
+
+/* nHash mixed with a bucket's displacement: each displacement scatters the bucket afresh */
+static inline unsigned int hash_displace( unsigned int nHash, unsigned int nDisplace )
+{
+	return ( nHash ^ nDisplace ) * 0x85EBCA6Bu;
+}
+
+/* the one slot of a frozen table that can hold nHash */
+static inline int hash_frozen_slot( const node_t * pnHash, unsigned int nHash )
+{
+	const hash_frozen * pf = HASH_FROZEN_RECORD( pnHash );
+	return HASH_RANGE( hash_displace( nHash, pf->anDisplace[HASH_RANGE( nHash, pf->nBuckets )] ), pf->nKeySlots );
+}
+
+/* start fetching the slots nHash probes first, so a lookup that follows does not wait for them */
+static inline void hash_prefetch( const node_t * pnHash, unsigned int nHash )
+{
+#ifdef HASH_USES_SSE2
+	/* a frozen table's slot waits on the bucket's displacement */
+	if( pnHash->nHashFlags & HASH_FROZEN )
+	{
+		const hash_frozen * pf = HASH_FROZEN_RECORD( pnHash );
+		_mm_prefetch( (const char *)&pf->anDisplace[HASH_RANGE( nHash, pf->nBuckets )], _MM_HINT_T0 );
+		return;
+	}
+
+	hash_probe probe( pnHash, nHash );
+	int nFirst = probe.nGroup * probe.nWidth;
+	_mm_prefetch( (const char *)probe.group(), _MM_HINT_T0 );
+	_mm_prefetch( (const char *)( HASH_HASHES( pnHash ) + nFirst ), _MM_HINT_T0 );
+	_mm_prefetch( (const char *)( pnHash->ppnHashSlots + nFirst ), _MM_HINT_T0 );
+#else
+	(void)pnHash;
+	(void)nHash;
+#endif
+}
+
+/* once those slots are in, start fetching the child nHash most likely names */
+static inline void hash_prefetch_child( const node_t * pnHash, unsigned int nHash )
+{
+#ifdef HASH_USES_SSE2
+	if( pnHash->nHashFlags & HASH_FROZEN )
+	{
+		int nSlot = hash_frozen_slot( pnHash, nHash );
+		_mm_prefetch( (const char *)( HASH_HASHES( pnHash ) + nSlot ), _MM_HINT_T0 );
+		_mm_prefetch( (const char *)( pnHash->ppnHashSlots + nSlot ), _MM_HINT_T0 );
+		return;
+	}
+
+	hash_probe probe( pnHash, nHash );
+	const unsigned int * pnHashes = HASH_HASHES( pnHash );
+	for( unsigned int nMatch = hash_match( probe.group(), probe.nWidth, HASH_TAG( nHash ) ); nMatch != 0; nMatch &= nMatch - 1 )
+	{
+		int i = probe.slot( nMatch );
+		if( pnHashes[i] == nHash )
+		{
+			_mm_prefetch( (const char *)HASH_SLOT( pnHash, i ), _MM_HINT_T0 );
+			return;
+		}
+	}
+#else
+	(void)pnHash;
+	(void)nHash;
+#endif
+}
+
+/* the table a growing hash is moving its children out of */
+struct hash_migration
+{
+	node_link_t * ppnOld;	/* old slots; their control bytes follow them */
+	int nOldSlots;
+	int nNext;				/* first old slot not yet moved */
+	int nOldElements;		/* children still in the old table */
+};
+
+/* the children of a hash: those in its table, then any not yet moved from the old one */
+static inline void hash_iter_start( node_hash_iter_t * pIter, const node_t * pnHash )
+{
+	pIter->pnHash = pnHash;
+	pIter->pvSlots = pnHash->ppnHashSlots;
+	pIter->nSlots = pnHash->ppnHashSlots != NULL ? pnHash->nHashSlots : 0;
+	pIter->nNext = 0;
+	pIter->bOld = FALSE;
+}
+
+/* the next child, and its slot in pIter's table; NULL when there are no more */
+static inline node_t * hash_iter_step( node_hash_iter_t * pIter, int * pnSlot )
+{
+	for( ;; )
+	{
+		const node_link_t * ppnSlots = (const node_link_t *)pIter->pvSlots;
+		const unsigned char * pbCtrl = HASH_TABLE_CTRL( ppnSlots, pIter->nSlots );
+		while( pIter->nNext < pIter->nSlots )
+		{
+			int i = pIter->nNext++;
+			if( ( pbCtrl[i] & 0x80 ) == 0 )
+			{
+				*pnSlot = i;
+				return LINK_GET( pIter->pnHash, ppnSlots[i] );
+			}
+		}
+
+		if( pIter->bOld || !( pIter->pnHash->nHashFlags & HASH_MIGRATING ) )
+			return NULL;
+
+		hash_migration * pm = HASH_MIGRATION( pIter->pnHash );
+		pIter->pvSlots = pm->ppnOld;
+		pIter->nSlots = pm->nOldSlots;
+		pIter->nNext = 0;
+		pIter->bOld = TRUE;
+	}
+}
+
+struct hash_iter
+{
+	node_hash_iter_t cursor;
+	unsigned int nHash;		/* the full hash of the child next() last returned */
+	size_t nLength;			/* ...and the length of its name, up to HASH_LENGTH_LIMIT */
+
+	hash_iter( const node_t * pn )
+	{
+		hash_iter_start( &cursor, pn );
+		nHash = 0;
+		nLength = 0;
+	}
+
+	/* the next child, or NULL when there are no more */
+	node_t * next()
+	{
+		int nSlot;
+		node_t * pn = hash_iter_step( &cursor, &nSlot );
+		if( pn != NULL )
+		{
+			const node_link_t * ppnSlots = (const node_link_t *)cursor.pvSlots;
+			nHash = HASH_TABLE_HASHES( ppnSlots, cursor.nSlots )[nSlot];
+			nLength = HASH_TABLE_LENGTHS( ppnSlots, cursor.nSlots )[nSlot];
+		}
+		return pn;
+	}
+};
+
 struct node_dump
 {
 	FILE * pfOut;
 	int nOptions;
 	int nSpaces;
+	int nCodePage;
+	int bNoMem;						/* ran out of memory: the dump stopped after the last whole record */
 };
 
 /*****************************
  Private Function Declarations
  *****************************/
 
+static inline int node_set_in_place( int nType );
 /* set the node to a value using variable arguments. nType determines how 
 arguments are processed.*/
-static void NODE_INTERNAL_FUNC node_set_valist(node_t *pn, int nType, va_list valist);
-static node_t * NODE_INTERNAL_FUNC node_add_common( node_arena * pArena, int nType, va_list valist );
-
-static void NODE_INTERNAL_FUNC node_set_int( node_t * pn, int nValue );
-static void NODE_INTERNAL_FUNC node_set_int64( node_t * pn, __int64 nValue );
-static void NODE_INTERNAL_FUNC node_set_real( node_t * pn, double dfValue );
-static void NODE_INTERNAL_FUNC node_set_stringA( node_t * pn, const char * psAValue );
-static void NODE_INTERNAL_FUNC node_set_stringW( node_t * pn, const wchar_t * psWValue );
-static void NODE_INTERNAL_FUNC node_set_ptr( node_t * pn, void * pv );
+static int NODE_INTERNAL_FUNC node_set_valist( node_tls * ptls, node_t *pn, int nType, va_list valist);
+static node_t * NODE_INTERNAL_FUNC node_add_common( node_tls * ptls, node_arena * pArena, int nType, va_list valist );
+
+static void NODE_INTERNAL_FUNC node_set_int( node_tls * ptls, node_t * pn, int nValue );
+static void NODE_INTERNAL_FUNC node_set_int64( node_tls * ptls, node_t * pn, __int64 nValue );
+static void NODE_INTERNAL_FUNC node_set_real( node_tls * ptls, node_t * pn, double dfValue );
+static char * NODE_INTERNAL_FUNC node_scalar_stringA( node_t * pn, const char * psValue );
+static wchar_t * NODE_INTERNAL_FUNC node_scalar_stringW( node_t * pn, const wchar_t * psValue );
+static void * NODE_INTERNAL_FUNC node_scalar_detach( node_t * pn, const void * psValue );
+static int NODE_INTERNAL_FUNC node_set_stringA( node_tls * ptls, node_t * pn, const char * psAValue );
+static int NODE_INTERNAL_FUNC node_set_stringW( node_tls * ptls, node_t * pn, const wchar_t * psWValue );
+static void NODE_INTERNAL_FUNC node_set_ptr( node_tls * ptls, node_t * pn, void * pv );
 
 /* versions with less arg checking */
-static void NODE_INTERNAL_FUNC node_set_stringA_internal( node_t * pn, const char * psAValue );
-static void NODE_INTERNAL_FUNC node_set_stringA_internal( node_t * pn, const char * psAValue, const char * psEnd );
-static void NODE_INTERNAL_FUNC node_set_stringA_internal( node_t * pn, const char * psAValue, size_t nLength );
-
-static void NODE_INTERNAL_FUNC node_set_stringW_internal( node_t * pn, const wchar_t * psWValue );
-static void NODE_INTERNAL_FUNC node_set_stringW_internal( node_t * pn, const wchar_t * psWValue, const wchar_t * psEnd );
-static void NODE_INTERNAL_FUNC node_set_stringW_internal( node_t * pn, const wchar_t * psWValue, size_t cch );
-
-static void NODE_INTERNAL_FUNC node_set_data_internal( node_t * pn, int nLength, const data_t * pb );
+static int NODE_INTERNAL_FUNC node_set_stringA_internal( node_tls * ptls, node_t * pn, const char * psAValue );
+static int NODE_INTERNAL_FUNC node_set_stringA_internal( node_tls * ptls, node_t * pn, const char * psAValue, const char * psEnd );
+static int NODE_INTERNAL_FUNC node_set_stringA_internal( node_tls * ptls, node_t * pn, const char * psAValue, size_t nLength );
+
+static int NODE_INTERNAL_FUNC node_set_stringW_internal( node_tls * ptls, node_t * pn, const wchar_t * psWValue );
+static int NODE_INTERNAL_FUNC node_set_stringW_internal( node_tls * ptls, node_t * pn, const wchar_t * psWValue, const wchar_t * psEnd );
+static int NODE_INTERNAL_FUNC node_set_stringW_internal( node_tls * ptls, node_t * pn, const wchar_t * psWValue, size_t cch );
+
+static int NODE_INTERNAL_FUNC node_set_data_internal( node_tls * ptls, node_t * pn, int nLength, const data_t * pb );
+static int NODE_INTERNAL_FUNC node_value_alloc( node_t * pn, size_t cb, void ** ppv );
+static void * NODE_INTERNAL_FUNC node_value_place( node_tls * ptls, node_t * pn, void * pv );
+static void NODE_INTERNAL_FUNC node_value_stringA( node_tls * ptls, node_t * pn, const char * psAValue, size_t cch, void * pv );
+static void NODE_INTERNAL_FUNC node_value_stringW( node_tls * ptls, node_t * pn, const wchar_t * psWValue, size_t cch, void * pv );
+static void NODE_INTERNAL_FUNC node_value_data( node_tls * ptls, node_t * pn, int nLength, const data_t * pbValue, void * pv );
+static node_t * NODE_INTERNAL_FUNC node_set_data_common( node_tls * ptls, node_t * pn, int nLength, const void * pvValue );
 
 /* initialize a list node */
-static void NODE_INTERNAL_FUNC node_list_init(node_t * pn);	
+static void NODE_INTERNAL_FUNC node_list_init( node_tls * ptls, node_t * pn);	
 
 /* initialize a hash node */
-static void NODE_INTERNAL_FUNC node_hash_init( node_t * pn, int nHashBuckets );
+static int NODE_INTERNAL_FUNC node_hash_init( node_tls * ptls, node_t * pn, int nHashSlots );
 
 /* clean up overlaid structures in a node changing type */
-static void NODE_INTERNAL_FUNC node_cleanup( node_t * pn );
+static void NODE_INTERNAL_FUNC node_cleanup( node_tls * ptls, node_t * pn );
 
 /* internal analogs of external functions */
-static node_t * NODE_INTERNAL_FUNC node_alloc_internal( node_arena * pArena );
+static node_t * NODE_INTERNAL_FUNC node_alloc_internal( node_tls * ptls, node_arena * pArena );
+static inline node_t * NODE_INTERNAL_FUNC node_alloc_internal( node_arena * pArena );
 static void NODE_INTERNAL_FUNC node_free_internal( node_t * pn, unsigned int bInCollection );
 
-static node_t * NODE_INTERNAL_FUNC node_list_add_valist( node_t * pnList, int nType, va_list valist );
+static node_t * NODE_INTERNAL_FUNC node_list_add_valist( node_tls * ptls, node_t * pnList, int nType, va_list valist );
 static void NODE_INTERNAL_FUNC node_list_add_internal( node_t * pnList, node_t * pnNew );
 static void NODE_INTERNAL_FUNC node_list_delete_internal( node_t * pnList, node_t * pnToDelete );
 
@@ -399,25 +921,60 @@ static node_t * NODE_INTERNAL_FUNC node_push_valist( node_t * pnList, int nType,
 static node_t * NODE_INTERNAL_FUNC node_push_internal( node_t * pnList, node_t * pnNew );
 static node_t * NODE_INTERNAL_FUNC node_pop_internal( node_t * pnList );
 
-static node_t * NODE_INTERNAL_FUNC node_copy_internal( node_arena * pArena, const node_t * pnSource );
-
-static node_t * NODE_INTERNAL_FUNC node_hash_addA_valist( node_t * pnHash, const char * psKey, int nType, va_list valist );
-static node_t * NODE_INTERNAL_FUNC node_hash_addW_valist( node_t * pnHash, const wchar_t * psKey, int nType, va_list valist );
-static void NODE_INTERNAL_FUNC node_hash_add_internal( node_t * pnHash, node_t * pnNew );
+static node_t * NODE_INTERNAL_FUNC node_copy_internal( node_tls * ptls, node_arena * pArena, const node_t * pnSource );
+static int NODE_INTERNAL_FUNC node_copy_name_internal( node_tls * ptls, node_arena * pArena, node_t * pnCopy, const node_t * pnSource );
+
+/* short names share the bag with the value, packed in from its end */
+static size_t NODE_INTERNAL_FUNC node_bag_value_size( const node_t * pn );
+static size_t NODE_INTERNAL_FUNC node_bag_names_start( const node_t * pn );
+static void * NODE_INTERNAL_FUNC node_bag_name_slot( const node_t * pn, size_t cb, size_t cbAlign );
+
+static node_t * NODE_INTERNAL_FUNC node_hash_addA_valist( node_tls * ptls, node_t * pnHash, const node_key_t * pKey, int nType, va_list valist, int nAdd );
+static node_t * NODE_INTERNAL_FUNC node_hash_addW_valist( node_tls * ptls, node_t * pnHash, const node_key_t * pKey, int nType, va_list valist, int nAdd );
+static node_t * NODE_INTERNAL_FUNC node_hash_add_key_valist( node_tls * ptls, node_t * pnHash, const node_key_t * pKey, int nType, va_list valist, int nAdd );
+static inline node_key_t * key_makeA( node_key_t * pKey, const char * psKey, size_t cchKey );
+static inline node_key_t * key_makeW( node_key_t * pKey, const wchar_t * psKey, size_t cchKey );
+static int NODE_INTERNAL_FUNC key_check( const node_key_t * pKey );
+static int NODE_INTERNAL_FUNC node_hash_add_internal( node_t * pnHash, node_t * pnNew, unsigned int nHash, size_t nLength );
 static void NODE_INTERNAL_FUNC node_hash_delete_internal( node_t * pnHash, node_t * pnToDelete );
 
+static int NODE_INTERNAL_FUNC node_hash_check_getA( const node_t * pnHash, const char * psKey );
+static int NODE_INTERNAL_FUNC node_hash_check_getW( const node_t * pnHash, const wchar_t * psKey );
 static node_t * NODE_INTERNAL_FUNC node_hash_getA_internal( const node_t * pnHash, const char * psKey );
 static node_t * NODE_INTERNAL_FUNC node_hash_getW_internal( const node_t * pnHash, const wchar_t * psKey );
+static node_t * NODE_INTERNAL_FUNC hash_getA( const node_t * pnHash, unsigned int nHash, size_t nLength, const char * psKey );
+static node_t * NODE_INTERNAL_FUNC hash_getW( const node_t * pnHash, unsigned int nHash, size_t nLength, const wchar_t * psKey );
+static node_t * NODE_INTERNAL_FUNC hash_lookupA( const node_t * pnHash, const node_link_t * ppnSlots, int nSlots, unsigned int nHash, size_t nLength, const char * psKey );
+static node_t * NODE_INTERNAL_FUNC hash_lookup_frozenA( const node_t * pnHash, unsigned int nHash, size_t nLength, const char * psKey );
+static node_t * NODE_INTERNAL_FUNC hash_lookup_sharedA( const node_t * pnHash, unsigned int nHash, size_t nLength, const char * psKey );
+static int NODE_INTERNAL_FUNC node_hash_check_get_many( const node_t * pnHash, const void * pvKeys, int nKeys, node_t ** apnOut );
+static int NODE_INTERNAL_FUNC hash_get_batch( const node_t * pnHash, const node_key_t * aKeys, int nKeys, node_t ** apnOut );
+static node_t * NODE_INTERNAL_FUNC hash_lookupW( const node_t * pnHash, const node_link_t * ppnSlots, int nSlots, unsigned int nHash, size_t nLength, const wchar_t * psKey );
+static node_t * NODE_INTERNAL_FUNC hash_lookup_frozenW( const node_t * pnHash, unsigned int nHash, size_t nLength, const wchar_t * psKey );
+static node_t * NODE_INTERNAL_FUNC hash_lookup_sharedW( const node_t * pnHash, unsigned int nHash, size_t nLength, const wchar_t * psKey );
 
 static void NODE_INTERNAL_FUNC node_dumpA_internal( const node_t * pn, struct node_dump * pd );
 static void NODE_INTERNAL_FUNC node_dumpW_internal( const node_t * pn, struct node_dump * pd );
 
-static void NODE_INTERNAL_FUNC node_set_nameA_internal( node_t * pn, const char * psName );
-static void NODE_INTERNAL_FUNC node_set_nameW_internal( node_t * pn, const wchar_t * psName );
+static int NODE_INTERNAL_FUNC node_set_nameA_internal( node_tls * ptls, node_t * pn, const char * psName );
+static int NODE_INTERNAL_FUNC node_set_nameW_internal( node_tls * ptls, node_t * pn, const wchar_t * psName );
+static int NODE_INTERNAL_FUNC node_set_name_nA_internal( node_tls * ptls, node_t * pn, const char * psName, size_t cchName, unsigned int nHash );
+static int NODE_INTERNAL_FUNC node_set_name_nW_internal( node_tls * ptls, node_t * pn, const wchar_t * psName, size_t cchName, unsigned int nHash );
+static void NODE_INTERNAL_FUNC node_release_name( node_tls * ptls, node_t * pn );
+
+/* shared, refcounted copies of names */
+static char * NODE_INTERNAL_FUNC node_internA( const char * psName );
+static wchar_t * NODE_INTERNAL_FUNC node_internW( const wchar_t * psName );
+static char * NODE_INTERNAL_FUNC node_intern_nA( const char * psName, size_t cchName );
+static wchar_t * NODE_INTERNAL_FUNC node_intern_nW( const wchar_t * psName, size_t cchName );
+static void NODE_INTERNAL_FUNC node_intern_addref( void * psName );
+static void NODE_INTERNAL_FUNC node_intern_release( dict_t * pdict, void * psName );
 
 /* dlmalloc a new string */
 static char * NODE_INTERNAL_FUNC node_safe_copyA( node_arena * pArena, const char * ps );
 static wchar_t * NODE_INTERNAL_FUNC node_safe_copyW( node_arena * pArena, const wchar_t * ps );
+static char * NODE_INTERNAL_FUNC node_safe_copy_nA( node_arena * pArena, const char * ps, size_t cch );
+static wchar_t * NODE_INTERNAL_FUNC node_safe_copy_nW( node_arena * pArena, const wchar_t * ps, size_t cch );
 
 /* read a line from a file into malloc'ed storage */
 static char * NODE_INTERNAL_FUNC read_lineA( node_arena * pArena, FILE * pfIn, char ** ppsEnd );
@@ -432,11 +989,11 @@ static wchar_t * NODE_INTERNAL_FUNC node_unescapeW( node_arena * pArena, const w
 
 static char * NODE_INTERNAL_FUNC WToA( node_arena * pArena, const wchar_t * psW );
 static char * NODE_INTERNAL_FUNC WToA( node_arena * pArena, const wchar_t * psW, const wchar_t * psWEnd );
-static char * NODE_INTERNAL_FUNC WToA( node_arena * pArena, const wchar_t * psW, size_t cch );
+static char * NODE_INTERNAL_FUNC WToA( node_arena * pArena, const wchar_t * psW, size_t cch, int nCodePage );
 
 static wchar_t * NODE_INTERNAL_FUNC AToW( node_arena * pArena, const char * psA );
 static wchar_t * NODE_INTERNAL_FUNC AToW( node_arena * pArena, const char * psA, const char * psAEnd );
-static wchar_t * NODE_INTERNAL_FUNC AToW( node_arena * pArena, const char * psA, size_t nLength );
+static wchar_t * NODE_INTERNAL_FUNC AToW( node_arena * pArena, const char * psA, size_t nLength, int nCodePage );
 
 class NodeReader;
 static int NODE_INTERNAL_FUNC node_parse_internalA(NodeReader *pnr, node_t ** ppn, int nOutputStyle );
@@ -452,16 +1009,152 @@ static inline void NODE_INTERNAL_FUNC node_write_spacesA( FILE * pfOut, int nSpa
 static inline void NODE_INTERNAL_FUNC node_write_spacesW( FILE * pfOut, int nSpaces );
 
 static int NODE_INTERNAL_FUNC node_memory( size_t cb );
+static void NODE_INTERNAL_FUNC node_fail( int nError );
+static node_t * NODE_INTERNAL_FUNC node_hash_alloc_internal( node_tls * ptls, node_arena * pArena, int nHashSlots );
 static void NODE_INTERNAL_FUNC node_error( char * psError, ... );
 
 #define node_assert(exp) (void)( (exp) || (_node_assert(#exp, __FILE__, __LINE__), 0) )
 static void NODE_INTERNAL_FUNC _node_assert( void *, const char *, unsigned int );
 
-static int __inline hash_to_bucket( const node_t * pnHash, int nHash );
+static node_link_t * NODE_INTERNAL_FUNC hash_table_alloc( node_tls * ptls, node_t * pnHash, int nSlots );
+static void NODE_INTERNAL_FUNC hash_table_set( node_t * pnHash, node_link_t * ppnSlots, int nSlots );
+static void NODE_INTERNAL_FUNC hash_table_free( node_tls * ptls, node_t * pnHash, node_link_t * ppnSlots, int nSlots );
+static int NODE_INTERNAL_FUNC hash_reserve( node_t * pnHash );
+static void NODE_INTERNAL_FUNC hash_migrate( node_t * pnHash, int nGroups );
+static void NODE_INTERNAL_FUNC hash_place( node_t * pnHash, node_t * pn, unsigned int nHash, size_t nLength );
+static unsigned int NODE_INTERNAL_FUNC hash_keyA( const char * psKey, size_t * pnLength );
+static unsigned int NODE_INTERNAL_FUNC hash_keyW( const wchar_t * psKey, size_t * pnLength );
+static unsigned int NODE_INTERNAL_FUNC hash_key_nA( const char * psKey, size_t nLength );
+static unsigned int NODE_INTERNAL_FUNC hash_key_nW( const wchar_t * psKey, size_t nLength );
+static unsigned int NODE_INTERNAL_FUNC node_name_hash( const node_t * pn, size_t * pnLength );
+static inline int key_equalA( const char * ps1, const char * ps2, size_t cch );
+static inline int key_equalW( const wchar_t * ps1, const wchar_t * ps2, size_t cch );
+static int NODE_INTERNAL_FUNC key_equal_longA( const char * psName, const char * psKey, size_t cch );
+static int NODE_INTERNAL_FUNC key_equal_longW( const wchar_t * psName, const wchar_t * psKey, size_t cch );
+static int NODE_INTERNAL_FUNC hash_remove( const node_t * pnHash, node_link_t * ppnSlots, int nSlots, node_t * pn );
+static int NODE_INTERNAL_FUNC hash_freeze( node_t * pnHash );
+static int NODE_INTERNAL_FUNC hash_thaw( node_t * pnHash );
+static void NODE_INTERNAL_FUNC hash_frozen_free( node_t * pnHash, node_link_t * ppnSlots, int nSlots );
+static int NODE_INTERNAL_FUNC hash_table_place( const node_t * pnHash, node_link_t * ppnSlots, int nSlots, node_t * pn, unsigned int nHash, size_t nLength );
+static hash_shared * NODE_INTERNAL_FUNC hash_shared_of( const node_t * pnHash );
+static int NODE_INTERNAL_FUNC hash_shared_build( node_t * pnHash, hash_shared * pShared, int nSlots );
+static LONG NODE_INTERNAL_FUNC hash_shared_elements( const hash_shared * pShared );
+static void NODE_INTERNAL_FUNC hash_shared_spread( node_t * pnHash, hash_shared * pShared, int iStripe );
+static int NODE_INTERNAL_FUNC hash_shared_grow( node_t * pnHash, hash_shared * pShared, int iStripe );
+static void NODE_INTERNAL_FUNC hash_retire( node_t * pnHash, node_t * pn );
+static void NODE_INTERNAL_FUNC hash_retire_table( node_t * pnHash, node_link_t * ppnSlots );
+static void NODE_INTERNAL_FUNC hash_reclaim( node_t * pnHash, hash_shared * pShared, int bAll );
+static void NODE_INTERNAL_FUNC hash_unshare( node_t * pnHash );
+static void NODE_INTERNAL_FUNC hash_shared_free( node_t * pnHash, hash_shared * pShared );
+
+/* claim a reader record for this thread: a free one if some thread has exited, else a new one;
+   NULL if there is no memory for one */
+static node_reader * NODE_INTERNAL_FUNC node_reader_claim( node_tls * ptls )
+{
+	node_reader * pr;
+	for( pr = g_pReaders; pr != NULL; pr = pr->pNext )
+	{
+		if( pr->bInUse == FALSE && InterlockedCompareExchange( &(pr->bInUse), TRUE, FALSE ) == FALSE )
+			break;
+	}
+
+	if( pr == NULL )
+	{
+		/* malloc aligns only to 16; the record is never freed, so the block's start need not be kept */
+		char * pb = (char *)malloc( sizeof(node_reader) + CACHE_LINE - 1 );
+		if( pb == NULL )
+		{
+			node_fail( NODE_ERROR_MEMORY );
+			return NULL;
+		}
+		pr = reinterpret_cast<node_reader *>( CACHE_ALIGN( pb ) );
+
+		pr->nEpoch = 0;
+		pr->nDepth = 0;
+		pr->bInUse = TRUE;
+		do
+			pr->pNext = g_pReaders;
+		while( InterlockedCompareExchangePointer( (void * volatile *)&g_pReaders, pr, pr->pNext ) != pr->pNext );
+	}
 
-#ifdef HASH_AUTO_RESIZE
-static void NODE_INTERNAL_FUNC hash_rebalance( node_t * pnHash, int nNewBuckets );
-#endif
+	ptls->pReader = pr;
+	return pr;
+}
+
+/* begin a read section: from here on no writer frees what it retires, and the exchange orders
+   the announcement before every read of a shared hash that follows. NULL, with no section begun,
+   if the thread has no record and there is no memory for one */
+static inline node_reader * read_begin()
+{
+	node_tls * ptls = GetTLS();
+	node_reader * pr = ptls->pReader != NULL ? ptls->pReader : node_reader_claim( ptls );
+	if( pr == NULL )
+		return NULL;
+	if( pr->nDepth++ == 0 )
+		InterlockedExchange( &(pr->nEpoch), g_nReadEpoch );
+	return pr;
+}
+
+static inline void read_end( node_reader * pr )
+{
+	node_assert( pr->nDepth > 0 );
+	if( --pr->nDepth == 0 )
+		pr->nEpoch = 0;
+}
+
+/* holds the stripe of a shared hash's writer locks that the key hashing to nHash takes while it lives;
+   any other hash needs none */
+class hash_writer
+{
+	hash_shared * m_pShared;
+	int m_iStripe;
+	int m_bFailed;
+public:
+	hash_writer( const node_t * pnHash, unsigned int nHash ) : m_pShared( NULL ), m_iStripe( HASH_STRIPE( nHash ) ), m_bFailed( FALSE )
+	{
+		if( pnHash->nType != NODE_HASH || !( pnHash->nHashFlags & HASH_SHARED ) )
+			return;
+
+		m_pShared = hash_shared_of( pnHash );
+		if( m_pShared != NULL )
+			EnterCriticalSection( &( m_pShared->aStripes[m_iStripe].cs ) );
+		else
+			m_bFailed = TRUE;
+	}
+	~hash_writer()
+	{
+		if( m_pShared != NULL )
+			LeaveCriticalSection( &( m_pShared->aStripes[m_iStripe].cs ) );
+	}
+
+	/* TRUE if the hash is shared and there was no memory to find its locks: the change must not go ahead */
+	int failed() const
+	{
+		return m_bFailed;
+	}
+
+	/* make sure one more child can be placed (see hash_reserve): a shared hash's writer takes one of
+	   its stripe's slots left to fill, and steps out of its stripe while the others' are gathered or
+	   the table grows, since that takes every stripe. The slot is the writer's until it leaves its stripe */
+	int reserve( node_t * pnHash )
+	{
+		if( m_pShared == NULL )
+			return hash_reserve( pnHash );
+
+		hash_stripe * pStripe = &( m_pShared->aStripes[m_iStripe] );
+		while( pStripe->nGrowth <= 0 )
+		{
+			LeaveCriticalSection( &(pStripe->cs) );
+			int bGrown = hash_shared_grow( pnHash, m_pShared, m_iStripe );
+			EnterCriticalSection( &(pStripe->cs) );
+
+			if( !bGrown )
+				return FALSE;
+		}
+		pStripe->nGrowth--;
+		return TRUE;
+	}
+};
 
 /* debug checking functions */
 static void NODE_INTERNAL_FUNC node_check_ascii_string( const char * psValue, const char * psContext );
@@ -473,7 +1166,23 @@ static void NODE_INTERNAL_FUNC node_check_unicode_string( const wchar_t * psValu
 
 static int NODE_INTERNAL_FUNC node_string_type( const unsigned char * ps );
 
-static void * NODE_INTERNAL_FUNC node_valloc( node_arena * pArena, size_t nSize );
+#ifdef USE_DL_MALLOC
+static void * NODE_INTERNAL_FUNC node_valloc( node_arena * pArena, node_arena::va ** ppVA, size_t nSize );
+static void * NODE_INTERNAL_FUNC node_bump( node_arena * pArena, size_t cb );
+static size_t NODE_INTERNAL_FUNC node_vfree( node_arena::va * pVA );
+static node_cache * NODE_INTERNAL_FUNC node_cache_find( node_tls * ptls, node_arena * pArena );
+static char * NODE_INTERNAL_FUNC node_slab_carve( node_arena * pArena, size_t nNodeSize );
+static void NODE_INTERNAL_FUNC node_cache_refill( node_cache * pCache );
+static void NODE_INTERNAL_FUNC node_cache_drain( node_cache * pCache, int nKeep );
+static void NODE_INTERNAL_FUNC node_cache_retire( node_cache * pCache );
+static node_stat_slot * NODE_INTERNAL_FUNC node_stats_find( node_tls * ptls, node_arena * pArena );
+static void NODE_INTERNAL_FUNC node_stats_retire( node_stat_slot * pSlot );
+static void NODE_INTERNAL_FUNC node_remote_reclaim( node_arena * pArena );
+static bool NODE_INTERNAL_FUNC node_over_budget( node_arena * pArena, size_t cbMore );
+#ifdef NODE_COMPACT_LINKS
+static void * NODE_INTERNAL_FUNC node_span_commit( node_arena * pArena, size_t nSize );
+#endif
+#endif
 
 void * NODE_INTERNAL_FUNC node_malloc( struct node_arena * pArena, size_t cb );
 
@@ -486,8 +1195,10 @@ class NodeReader
 {
 public:
 	node_arena * m_pArena;
+	node_tls * m_ptls;	/* context for the nodes read */
+	int m_bNoMem;		/* a line could not be read for lack of memory */
 
-	NodeReader( node_arena * pArena ) : m_pArena(pArena) {}
+	NodeReader( node_arena * pArena, node_tls * ptls = NODE_CACHE_CTX ) : m_pArena(pArena), m_ptls(ptls), m_bNoMem(FALSE) {}
 	virtual void read_lineA( const char ** ppsStart, const char ** ppsEnd ) = 0;
 	virtual void read_lineW( const wchar_t ** ppsStart, const wchar_t ** ppsEnd ) = 0;
 	virtual void free_line( const void * psLine ) = 0;
@@ -517,7 +1228,7 @@ NODE_API node_t * node_first( const node_t * pnList )
 	/* half of a simple iterator: returns pnListHead */
 	if( pnList->nType == NODE_LIST )
 	{
-		return pnList->pnListHead;
+		return LINK_GET( pnList, pnList->pnListHead );
 	}
 	else	/* not currently a list, but may have been in the past... */
 	{
@@ -527,7 +1238,7 @@ NODE_API node_t * node_first( const node_t * pnList )
 
 }
 
-/* returns the next node in a list or hash bucket chain */
+/* returns the next node in a list */
 NODE_API node_t * node_next( const node_t * pn )
 {
 	if( pn == NULL )
@@ -536,16 +1247,34 @@ NODE_API node_t * node_next( const node_t * pn )
 		return NULL;
 	}
 
-	return pn->pnNext;
+	return LINK_GET( pn, pn->pnNext );
 }
 
 /*********************************************
  Local-to-node.dll Macro Versions of Iterators 
  *********************************************/
 
-#define node_first( pn )	((pn)->pnListHead)
-#define node_next( pn )		((pn)->pnNext)
+#define node_first( pn )	LINK_GET( (pn), (pn)->pnListHead )
+#define node_next( pn )		LINK_GET( (pn), (pn)->pnNext )
  
+/*****************
+ Context Functions
+ *****************/
+
+NODE_API node_ctx_t node_get_ctx()
+{
+	return (node_ctx_t)GetTLS();
+}
+
+/* a context from node_get_ctx is only good on the thread that got it */
+static inline node_tls * NODE_INTERNAL_FUNC node_ctx_tls( node_ctx_t ctx )
+{
+#ifdef _DEBUG
+	node_assert( ctx != NULL && (node_tls *)ctx == GetTLS() );
+#endif
+	return (node_tls *)ctx;
+}
+
 /****************
  Memory Functions 
  ****************/
@@ -556,57 +1285,49 @@ NODE_API node_t * node_alloc()
 	return node_alloc_internal( node_pArena );
 }
 
+NODE_API node_t * node_alloc_ctx( node_ctx_t ctx )
+{
+	node_tls * ptls = node_ctx_tls( ctx );
+	return node_alloc_internal( ptls, ptls->pArena );
+}
+
 NODE_API node_t * node_alloc_dbg( const char * psFile, int nLine )
 {
 	set_debug_allocator s( psFile, nLine );
 	return node_alloc_internal( node_pArena );
 }
 
-static node_t * NODE_INTERNAL_FUNC node_alloc_internal( node_arena * pArena )
+static inline node_t * NODE_INTERNAL_FUNC node_alloc_internal( node_arena * pArena )
 {
-	node_t * pnNew = NULL;
+	return node_alloc_internal( NODE_CACHE_CTX, pArena );
+}
 
 #ifdef USE_DL_MALLOC
-	{
-		node_lock l( &pArena->csFreeList );
-		if( pArena->pnFreeList != NULL )
-		{
-			pnNew = pArena->pnFreeList;
-			pArena->pnFreeList = pnNew->pnNext;
-		}
-
-		if( pnNew == NULL )
-		{
-			/* allocate some more space */
-
-#ifdef USE_BAGS
-			const size_t nNodeSize = NODE_SIZE + BAG_SIZE;
+static node_t * NODE_INTERNAL_FUNC node_alloc_internal( node_tls * ptls, node_arena * pArena )
 #else
-			const size_t nNodeSize = NODE_SIZE;
+static node_t * NODE_INTERNAL_FUNC node_alloc_internal( node_tls * , node_arena * pArena )
 #endif
-			/* reserve 16 bytes for dlmalloc page overhead */
-			const size_t nArenaSize = 65536;
-			const size_t nCount = (nArenaSize-sizeof(node_arena::va))/ nNodeSize;
-
-			char * pcArena = reinterpret_cast<char*>(node_valloc( pArena, nArenaSize ) );
-
-			/* build freelist */
-			node_t * pnLast = reinterpret_cast<node_t*>( pcArena + (nCount-1) * nNodeSize );
-			pnLast->pnNext = pArena->pnFreeList;
+{
+	node_t * pnNew = NULL;
 
-			
-			for( unsigned int i = nCount-2; i > 0; --i )
-			{
-				node_t * pn = reinterpret_cast<node_t*>( pcArena + i * nNodeSize );
-				pn->pnNext = pnLast;
-				pnLast = pn;
-			}
+#ifdef USE_DL_MALLOC
+	{
+		/* the owner takes back what other threads freed */
+		if( QueryDepthSList( &(pArena->slRemote) ) != 0 && pArena->dwOwner == GetCurrentThreadId() )
+			node_remote_reclaim( pArena );
 
-			pArena->pnFreeList = pnLast;
+		/* lock-free: the thread cache only touches the arena once per batch */
+		node_cache * pCache = node_cache_find( ptls, pArena );
+		if( pCache->pnHead == NULL )
+			node_cache_refill( pCache );
 
-			pnNew = reinterpret_cast<node_t*>(pcArena);
+		if( pCache->pnHead == NULL )
+			return NULL;	/* no slab to carve from */
 
-		}
+		pnNew = pCache->pnHead;
+		pCache->pnHead = node_next( pnNew );
+		pCache->nCount--;
+		pCache->nNodes++;
 	}
 #endif /* USE_DL_MALLOC */
 
@@ -614,8 +1335,10 @@ static node_t * NODE_INTERNAL_FUNC node_alloc_internal( node_arena * pArena )
 	if( pnNew == NULL )
 		pnNew = reinterpret_cast<node_t *>(node_malloc( pArena, NODE_SIZE + BAG_SIZE ));
 
+	if( pnNew == NULL )
+		return NULL;
+
 	memset( pnNew, 0, NODE_SIZE );
-	pnNew->pArena = pArena;
 
 	return pnNew;
 }
@@ -632,11 +1355,12 @@ NODE_API void node_free(node_t *pn)
 static void NODE_INTERNAL_FUNC node_free_internal( node_t * pn, unsigned int bInCollection )
 {
 	node_t * pnSaved = NULL;
+	node_tls * ptls = NODE_CACHE_CTX;
 
 	while( pn != NULL ) 
 	{
-		node_arena * pArena = pn->pArena;
-		pnSaved = pn->pnNext;
+		node_arena * pArena = GET_ARENA( pn );
+		pnSaved = node_next( pn );
 
 		if( pn->bInCollection != bInCollection )
 		{
@@ -644,26 +1368,35 @@ static void NODE_INTERNAL_FUNC node_free_internal( node_t * pn, unsigned int bIn
 			return;
 		}
 
-		if( pn->psAName != NULL ) 
-		{
-			nfree( pArena, pn->psAName );
-			pn->psAName = NULL;
-		}
-		
-		if( pn->psWName != NULL ) 
+#ifdef USE_DL_MALLOC
+		if( pArena->dwOwner != 0 && pArena->dwOwner != GetCurrentThreadId() )
 		{
-			nfree( pArena, pn->psWName );
-			pn->psWName = NULL;
+			/* the arena's mspace belongs to another thread: queue the node, children and all, for the owner */
+			InterlockedPushEntrySList( &(pArena->slRemote), reinterpret_cast<PSLIST_ENTRY>( pn ) );
+			pn = pnSaved;
+			continue;
 		}
 
+		/* an owner that only frees takes back what other threads freed too */
+		if( pArena->dwOwner != 0 && QueryDepthSList( &(pArena->slRemote) ) != 0 )
+			node_remote_reclaim( pArena );
+#endif
+
+		node_release_name( ptls, pn );
+
 		/* free and NULL all members of pn (type specific) */
-		node_cleanup( pn );
+		node_cleanup( ptls, pn );
 
 #ifdef USE_DL_MALLOC
 		{
-			node_lock l(&pArena->csFreeList );
-			pn->pnNext = pArena->pnFreeList;
-			pArena->pnFreeList = pn;
+			node_cache * pCache = node_cache_find( ptls, pArena );
+			SET_NEXT( pn, pCache->pnHead );
+			pCache->pnHead = pn;
+			pCache->nNodes--;
+
+			/* keep one batch for the next allocations, give the rest back */
+			if( ++pCache->nCount >= 2 * NODE_CACHE_BATCH )
+				node_cache_drain( pCache, NODE_CACHE_BATCH );
 		}
 #else
 		nfree( pArena, pn );
@@ -681,7 +1414,7 @@ static void NODE_INTERNAL_FUNC node_free_internal( node_t * pn, unsigned int bIn
  * and leaves list nodes untouched.
  * 
  */
-static void NODE_INTERNAL_FUNC node_list_init(node_t * pn)
+static void NODE_INTERNAL_FUNC node_list_init( node_tls * ptls, node_t * pn)
 {
 	/* if it's a list already */
 	if( pn->nType == NODE_LIST ) 
@@ -693,13 +1426,13 @@ static void NODE_INTERNAL_FUNC node_list_init(node_t * pn)
 	} 
 
 	/* free and null the previous occupants of the union */
-	node_cleanup( pn );
+	node_cleanup( ptls, pn );
 
 	/* set the type */
 	pn->nType = NODE_LIST;
 
-	/* do the tail magic */
-	pn->pnListTail = (node_t*)&(pn->pnListHead);
+	/* an empty list has no tail */
+	SET_LIST_TAIL( pn, NULL );
 
 	/* initialize the element count */
 	pn->nListElements = 0;
@@ -707,72 +1440,45 @@ static void NODE_INTERNAL_FUNC node_list_init(node_t * pn)
 	return;
 }
 
-/* initialize a hash node */
-static void NODE_INTERNAL_FUNC node_hash_init( node_t * pn, int nHashBuckets )
+/* initialize a hash node; FALSE if there was no memory for its table */
+static int NODE_INTERNAL_FUNC node_hash_init( node_tls * ptls, node_t * pn, int nHashSlots )
 {
 	/* if it's a hash, do nothing */
 	if(pn->nType == NODE_HASH)
 	{
-		return;
+		return TRUE;
 	}
 
 	/* otherwise, */
 	
 	/* free and null the previous occupants of the union */
-	node_cleanup( pn );
+	node_cleanup( ptls, pn );
 
 	/* again, make sure no-one is corrupting our information */
-	node_assert(pn->nHashBuckets == 0);
+	node_assert(pn->nHashSlots == 0);
 
-#ifdef HASH_USES_BITMASK
-	/* for bitmask - hash fails if nHashBuckets is not a power of 2 */
-	const int nNearbyPower2[33] = 
-		{ 2,  2,  2,  4,  4,  4,  4,  8,  8,  8,  8, 16, 16, 16, 16, 16,
-		 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 32, 32, 32, 32, 32, 32, 32 };
+	/* probing masks with nHashSlots, so it must be a power of 2 */
+	int nSlots = HASH_MIN_SLOTS;
+	while( nSlots < nHashSlots && nSlots < (1 << NODE_HASH_BITS) )
+		nSlots <<= 1;
 
-	if( nHashBuckets <= 32 )
-		pn->nHashBuckets = nNearbyPower2[nHashBuckets];
-	else
-	{
-		int v = nHashBuckets;
-
-		v--;
-		v |= v >> 1;
-		v |= v >> 2;
-		v |= v >> 4;
-		v |= v >> 8;
-		v |= v >> 16;
-		v++;
-
-		/* set nHashBuckets */
-		pn->nHashBuckets = v;
-	}
-
-#endif
-
-#ifdef HASH_USES_MOD
-	/* for mod - hash is less efficient if nHashBuckets is not prime */
-	
-	/* TODO: consider checking this */
-	pn->nHashBuckets = nHashBuckets;
-#endif
-
-	size_t nSize = sizeof(node_t*) * pn->nHashBuckets;
+	node_link_t * ppnSlots = hash_table_alloc( ptls, pn, nSlots );
 
 #ifdef USE_BAGS
-	if( !pn->bBagUsed && nSize <= BAG_SIZE )
+	if( ppnSlots == NULL && !pn->bBagUsed && HASH_TABLE_SIZE( HASH_MIN_SLOTS ) <= BAG_SIZE )
 	{
-		pn->ppnHashHeads = (node_t**)GET_BAG( pn );
+		/* out of memory: a small hash beats no hash */
+		for( nSlots = HASH_MIN_SLOTS; HASH_TABLE_SIZE( nSlots * 2 ) <= BAG_SIZE; nSlots *= 2 )
+			/* empty */;
+		ppnSlots = (node_link_t *)GET_BAG( pn );
 		pn->bBagUsed = TRUE;
 	}
-	else
 #endif
-	{
-		/* allocate ppnHashHeads */
-		pn->ppnHashHeads = ( node_t ** )node_malloc( pn->pArena, nSize );
-	}
-	
-	memset( pn->ppnHashHeads, 0, pn->nHashBuckets*sizeof(node_t*) );
+
+	if( ppnSlots == NULL )
+		return FALSE;
+
+	hash_table_set( pn, ppnSlots, nSlots );
 	
 	/* set nHashElements to 0 */
 	pn->nHashElements = 0;
@@ -780,7 +1486,7 @@ static void NODE_INTERNAL_FUNC node_hash_init( node_t * pn, int nHashBuckets )
 	/* set nType to NODE_HASH */
 	pn->nType = NODE_HASH;
 
-	return;
+	return TRUE;
 
 }
 
@@ -789,12 +1495,26 @@ NODE_API node_t * node_list_alloc()
 	node_t * pn = NULL;
 	
 	pn = node_alloc_internal( node_pArena );
+	if( pn == NULL )
+		return NULL;
 	
-	node_list_init( pn );
+	node_list_init( NODE_CACHE_CTX, pn );
 	
 	return pn;
 }
 
+NODE_API node_t * node_list_alloc_ctx( node_ctx_t ctx )
+{
+	node_tls * ptls = node_ctx_tls( ctx );
+	node_t * pn = node_alloc_internal( ptls, ptls->pArena );
+	if( pn == NULL )
+		return NULL;
+
+	node_list_init( ptls, pn );
+
+	return pn;
+}
+
 NODE_API node_t * node_list_alloc_dbg( const char * psFile, int nLine )
 {
 	set_debug_allocator s( psFile, nLine );
@@ -802,20 +1522,42 @@ NODE_API node_t * node_list_alloc_dbg( const char * psFile, int nLine )
 	return node_list_alloc();
 }
 
+/* a new hash, or NULL with the node given back if there's no memory for it */
+static node_t * NODE_INTERNAL_FUNC node_hash_alloc_internal( node_tls * ptls, node_arena * pArena, int nHashSlots )
+{
+	node_t * pn = node_alloc_internal( ptls, pArena );
+	if( pn == NULL )
+		return NULL;
+
+	if( !node_hash_init( ptls, pn, nHashSlots ) )
+	{
+		node_free_internal( pn, NOT_IN_COLLECTION );
+		return NULL;
+	}
+
+	return pn;
+}
+
 NODE_API node_t * node_hash_alloc()
 {
-	node_t * pn = node_alloc_internal( node_pArena );
-	
-	node_hash_init( pn, DEFAULT_HASHBUCKETS );
+	node_t * pn = node_hash_alloc_internal( NODE_CACHE_CTX, node_pArena, DEFAULT_HASHSLOTS );
+	if( pn == NULL )
+		return NULL;
 
 	return pn;
 }
 
-NODE_API node_t * node_hash_alloc2( int nHashBuckets )
+NODE_API node_t * node_hash_alloc_ctx( node_ctx_t ctx )
 {
-	node_t * pn = node_alloc_internal( node_pArena );
-	
-	node_hash_init( pn, nHashBuckets );
+	node_tls * ptls = node_ctx_tls( ctx );
+	return node_hash_alloc_internal( ptls, ptls->pArena, DEFAULT_HASHSLOTS );
+}
+
+NODE_API node_t * node_hash_alloc2( int nHashSlots )
+{
+	node_t * pn = node_hash_alloc_internal( NODE_CACHE_CTX, node_pArena, nHashSlots );
+	if( pn == NULL )
+		return NULL;
 	
 	return pn;
 }
@@ -826,16 +1568,16 @@ static void NODE_INTERNAL_FUNC node_hash_store_debug( node_t * pn, const char *
 	char acFile[1024];
 	_snprintf( acFile, sizeof(acFile), "%s(%d) :", psFile, nLine );
 	acFile[ sizeof(acFile)-1 ] = '\0';
-	pn->psHashAllocated = node_safe_copyA( pn->pArena, acFile );
+	pn->psHashAllocated = node_safe_copyA( GET_ARENA( pn ), acFile );
 }
 
 NODE_API node_t * node_hash_alloc_dbg( const char * psFile, int nLine )
 {
 	set_debug_allocator s( psFile, nLine );
 
-	node_t * pn = node_alloc_internal( node_pArena );
-	
-	node_hash_init( pn, DEFAULT_HASHBUCKETS );
+	node_t * pn = node_hash_alloc_internal( NODE_CACHE_CTX, node_pArena, DEFAULT_HASHSLOTS );
+	if( pn == NULL )
+		return NULL;
 
 	if( node_nDebugHashPerf )
 		node_hash_store_debug( pn, psFile, nLine );
@@ -843,13 +1585,13 @@ NODE_API node_t * node_hash_alloc_dbg( const char * psFile, int nLine )
 	return pn;
 }
 
-NODE_API node_t * node_hash_alloc2_dbg( int nHashBuckets, const char * psFile, int nLine )
+NODE_API node_t * node_hash_alloc2_dbg( int nHashSlots, const char * psFile, int nLine )
 {
 	set_debug_allocator s( psFile, nLine );
 
-	node_t * pn = node_alloc_internal( node_pArena );
-	
-	node_hash_init( pn, nHashBuckets );
+	node_t * pn = node_hash_alloc_internal( NODE_CACHE_CTX, node_pArena, nHashSlots );
+	if( pn == NULL )
+		return NULL;
 	
 	if( node_nDebugHashPerf )
 		node_hash_store_debug( pn, psFile, nLine );
@@ -885,12 +1627,12 @@ NODE_API node_t * node_set_dbg( const char * psFile, int nLine, node_t * pn, int
 	va_start(valist, nType);
 
 	/* pass the variable arguments to node_set_valist */
-	node_set_valist(pn, nType, valist);
+	int bSet = node_set_valist( NODE_CACHE_CTX, pn, nType, valist);
 
 	/* clean up */
 	va_end(valist);
 
-	return pn;
+	return bSet ? pn : NULL;
 }
 
 /* node_set is a wrapper for the private function node_set_valist */ 
@@ -902,12 +1644,12 @@ NODE_API node_t * node_set(node_t * pn, int nType, ...)
 	va_start(valist, nType);
 
 	/* pass the variable arguments to node_set_valist */
-	node_set_valist(pn, nType, valist);
+	int bSet = node_set_valist( NODE_CACHE_CTX, pn, nType, valist);
 
 	/* clean up */
 	va_end(valist);
 
-	return pn;
+	return bSet ? pn : NULL;
 }	
 
 /*****************
@@ -965,7 +1707,7 @@ NODE_API int node_get_int( const node_t *pn)
 		}
 		else	/* empty list */
 		{
-			node_assert( pn->pnListHead != NULL );	/* called node_get_int on empty list node */
+			node_assert( node_first( pn ) != NULL );	/* called node_get_int on empty list node */
 		}
 		break;
 		
@@ -1017,7 +1759,7 @@ NODE_API __int64 node_get_int64( const node_t *pn)
 		}
 		else	/* empty list */
 		{
-			node_assert( pn->pnListHead != NULL );	/* called node_get_int on empty list node */
+			node_assert( node_first( pn ) != NULL );	/* called node_get_int on empty list node */
 		}
 		break;
 		
@@ -1069,7 +1811,7 @@ NODE_API double node_get_real( const node_t *pn )
 		}
 		else	/* empty list */
 		{
-			node_assert(pn->pnListHead != NULL);	/* called node_get_real on empty list node */
+			node_assert( node_first( pn ) != NULL );	/* called node_get_real on empty list node */
 		}
 		break;
 		
@@ -1109,53 +1851,25 @@ NODE_API NODE_CONSTOUT char * node_get_stringA( node_t *pn )
 		/* convert W to A */
 		if( pn->psAValue == NULL )
 		{
-			pn->psAValue = WToA( pn->pArena, pn->psWValue );
+			pn->psAValue = WToA( GET_ARENA( pn ), pn->psWValue );
 		}
 
 		return pn->psAValue;
 
 	case NODE_INT:
-		/* free string value if set */
-		if( pn->psAValue != NULL ) 
-		{
-			nfree( pn->pArena, pn->psAValue );
-		}
-
 		/* convert nValue into psValue */
 		_itoa( pn->nValue, acBuffer, 10 );
-		pn->psAValue = node_safe_copyA( pn->pArena, acBuffer );
-
-		/* return psValue */
-		return pn->psAValue;
+		return node_scalar_stringA( pn, acBuffer );
 
 	case NODE_INT64:
-		/* free string value if set */
-		if( pn->psAValue != NULL ) 
-		{
-			nfree( pn->pArena, pn->psAValue );
-		}
-
 		/* convert nValue into psValue */
 		_i64toa( pn->n64Value, acBuffer, 10 );
-		pn->psAValue = node_safe_copyA( pn->pArena, acBuffer );
-
-		/* return psValue */
-		return pn->psAValue;
+		return node_scalar_stringA( pn, acBuffer );
 
 	case NODE_REAL:
-		/* free string value if set */
-		if( pn->psAValue != NULL ) 
-		{
-			nfree( pn->pArena, pn->psAValue );
-		}
-
 		/* convert nValue into psValue */
 		sprintf( acBuffer, "%-16.5f", pn->dfValue );
-
-		pn->psAValue = node_safe_copyA( pn->pArena, acBuffer );
-
-		/* return psValue */
-		return pn->psAValue;
+		return node_scalar_stringA( pn, acBuffer );
 
 	case NODE_LIST:
 		/* if has at least one element */
@@ -1166,7 +1880,7 @@ NODE_API NODE_CONSTOUT char * node_get_stringA( node_t *pn )
 		}
 		else	/* empty list */
 		{
-			node_assert(pn->pnListHead != NULL);	/* called node_get_stringA on empty list node */
+			node_assert( node_first( pn ) != NULL );	/* called node_get_stringA on empty list node */
 		}
 		break;
 
@@ -1199,7 +1913,7 @@ NODE_API NODE_CONSTOUT wchar_t * node_get_stringW(node_t *pn)
 	{
 	case NODE_STRINGA:
 		if( pn->psWValue == NULL )
-			pn->psWValue = AToW( pn->pArena, pn->psAValue );
+			pn->psWValue = AToW( GET_ARENA( pn ), pn->psAValue );
 
 		return pn->psWValue;
 
@@ -1207,46 +1921,19 @@ NODE_API NODE_CONSTOUT wchar_t * node_get_stringW(node_t *pn)
 		return pn->psWValue;
 
 	case NODE_INT:
-		/* free string value if set */
-		if( pn->psWValue != NULL ) 
-		{
-			nfree( pn->pArena, pn->psWValue );
-		}
-
 		/* convert nValue into psValue */
 		_itow( pn->nValue, acBuffer, 10 );
-		pn->psWValue = node_safe_copyW( pn->pArena, acBuffer );
-
-		/* return psValue */
-		return pn->psWValue;
+		return node_scalar_stringW( pn, acBuffer );
 
 	case NODE_INT64:
-		/* free string value if set */
-		if( pn->psWValue != NULL ) 
-		{
-			nfree( pn->pArena, pn->psWValue );
-		}
-
 		/* convert nValue into psValue */
 		_i64tow( pn->n64Value, acBuffer, 10 );
-		pn->psWValue = node_safe_copyW( pn->pArena, acBuffer );
-
-		/* return psValue */
-		return pn->psWValue;
+		return node_scalar_stringW( pn, acBuffer );
 
 	case NODE_REAL:
-		/* free string value if set */
-		if( pn->psWValue != NULL ) 
-		{
-			nfree( pn->pArena, pn->psWValue );
-		}
-
 		/* convert nValue into psValue */
 		swprintf( acBuffer, DIMENSION(acBuffer), L"%-16.5f", pn->dfValue );
-		pn->psWValue = node_safe_copyW( pn->pArena, acBuffer );
-
-		/* return psValue */
-		return pn->psWValue;
+		return node_scalar_stringW( pn, acBuffer );
 
 	case NODE_LIST:
 		/* if has at least one element */
@@ -1257,7 +1944,7 @@ NODE_API NODE_CONSTOUT wchar_t * node_get_stringW(node_t *pn)
 		}
 		else	/* empty list */
 		{
-			node_assert(pn->pnListHead != NULL);	/* called node_get_stringW on empty list node */
+			node_assert( node_first( pn ) != NULL );	/* called node_get_stringW on empty list node */
 		}
 		break;
 
@@ -1337,6 +2024,12 @@ NODE_API int node_get_elements( const node_t * pn )
 		break;
 
 	case NODE_HASH:
+		/* a shared hash's writers count in its stripes, since they may add at once */
+		if( pn->nHashFlags & HASH_SHARED )
+		{
+			const hash_shared * pShared = hash_shared_of( pn );
+			return pShared != NULL ? hash_shared_elements( pShared ) : 0;
+		}
 		return pn->nHashElements;
 		break;
 
@@ -1401,7 +2094,7 @@ NODE_API node_t * node_list_add_dbg( const char * psFile, int nLine, node_t * pn
 	/* grab the variable arguments */
 	va_start(valist, nType);
 
-	pnNew = node_list_add_valist( pnList, nType, valist );
+	pnNew = node_list_add_valist( NODE_CACHE_CTX, pnList, nType, valist );
 
 	/* clean up the variable arguments*/
 	va_end(valist);
@@ -1418,7 +2111,7 @@ NODE_API node_t * node_list_add(node_t * pnList, int nType, ...)
 	/* grab the variable arguments */
 	va_start(valist, nType);
 
-	pnNew = node_list_add_valist( pnList, nType, valist );
+	pnNew = node_list_add_valist( NODE_CACHE_CTX, pnList, nType, valist );
 
 	/* clean up the variable arguments*/
 	va_end(valist);
@@ -1426,7 +2119,21 @@ NODE_API node_t * node_list_add(node_t * pnList, int nType, ...)
 	return pnNew;
 }
 
-static node_t * NODE_INTERNAL_FUNC node_list_add_valist( node_t * pnList, int nType, va_list valist )
+NODE_API node_t * node_list_add_ctx( node_ctx_t ctx, node_t * pnList, int nType, ... )
+{
+	node_t * pnNew = NULL;
+	va_list valist;
+
+	va_start(valist, nType);
+
+	pnNew = node_list_add_valist( node_ctx_tls( ctx ), pnList, nType, valist );
+
+	va_end(valist);
+
+	return pnNew;
+}
+
+static node_t * NODE_INTERNAL_FUNC node_list_add_valist( node_tls * ptls, node_t * pnList, int nType, va_list valist )
 {
 	if( pnList == NULL )
 	{
@@ -1435,9 +2142,9 @@ static node_t * NODE_INTERNAL_FUNC node_list_add_valist( node_t * pnList, int nT
 	}
 
 	/* make sure list is initialized */
-	node_list_init( pnList );
+	node_list_init( ptls, pnList );
 
-	node_t * pnNew = node_add_common( pnList->pArena, nType, valist );
+	node_t * pnNew = node_add_common( ptls, GET_ARENA( pnList ), nType, valist );
 	if( pnNew == NULL )
 		return NULL;
 
@@ -1454,10 +2161,13 @@ static void NODE_INTERNAL_FUNC node_list_add_internal( node_t * pnList, node_t *
 	pnNew->bInCollection = IN_COLLECTION;
 
 	/* add the new node to the end of the list */
-	pnList->pnListTail->pnNext = pnNew;
+	if( LIST_TAIL( pnList ) == NULL )
+		SET_LIST_HEAD( pnList, pnNew );
+	else
+		SET_NEXT( LIST_TAIL( pnList ), pnNew );
 
 	/* advance the tail pointer */
-	pnList->pnListTail = pnList->pnListTail->pnNext;
+	SET_LIST_TAIL( pnList, pnNew );
 
 	/* increase the element count */
 	pnList->nListElements++;
@@ -1502,14 +2212,14 @@ static void NODE_INTERNAL_FUNC node_list_delete_internal( node_t * pnList, node_
 	if( pnToDelete == node_first( pnList ) )
 	{
 		/* cut the head off the list */
-		pnList->pnListHead = node_next( pnToDelete );
-		pnToDelete->pnNext = NULL;
+		SET_LIST_HEAD( pnList, node_next( pnToDelete ) );
+		SET_NEXT( pnToDelete, NULL );
 
 		/* if it's a one-membered list */
-		if( pnToDelete == pnList->pnListTail )
+		if( pnToDelete == LIST_TAIL( pnList ) )
 		{
 			/* fix the tail */
-			pnList->pnListTail = (node_t*)&(pnList->pnListHead);
+			SET_LIST_TAIL( pnList, NULL );
 		}
 
 		/* decrease the element count */
@@ -1529,14 +2239,14 @@ static void NODE_INTERNAL_FUNC node_list_delete_internal( node_t * pnList, node_
 		if( pnToDelete == pnScroll )
 		{
 			/* cut it out of the list */
-			pnPrevious->pnNext = node_next( pnToDelete );
-			pnToDelete->pnNext = NULL;
+			SET_NEXT( pnPrevious, node_next( pnToDelete ) );
+			SET_NEXT( pnToDelete, NULL );
 
 			/* if it was the end of the list */
-			if( pnToDelete == pnList->pnListTail )
+			if( pnToDelete == LIST_TAIL( pnList ) )
 			{
 				/* make the tail pointer point to the new tail */
-				pnList->pnListTail = pnPrevious;
+				SET_LIST_TAIL( pnList, pnPrevious );
 			}
 
 			/* decrease the element count */
@@ -1590,6 +2300,7 @@ NODE_API node_t * node_push( node_t * pnList, int nType, ... )
 static node_t * NODE_INTERNAL_FUNC node_push_valist( node_t * pnList, int nType, va_list valist )
 {
 	node_t * pnNew = NULL;
+	node_tls * ptls = NODE_CACHE_CTX;
 
 	if( pnList == NULL )
 	{
@@ -1598,9 +2309,9 @@ static node_t * NODE_INTERNAL_FUNC node_push_valist( node_t * pnList, int nType,
 	}
 
 	/* make sure list is initialized */
-	node_list_init( pnList );
+	node_list_init( ptls, pnList );
 
-	pnNew = node_add_common( pnList->pArena, nType, valist );
+	pnNew = node_add_common( ptls, GET_ARENA( pnList ), nType, valist );
 	if( pnNew == NULL )
 		return NULL;
 
@@ -1614,16 +2325,16 @@ node_t * NODE_INTERNAL_FUNC node_push_internal( node_t * pnList, node_t * pnNew
 	pnNew->bInCollection = IN_COLLECTION;
 
 	/* put the node at the head of the list */
-	pnNew->pnNext = pnList->pnListHead;
+	SET_NEXT( pnNew, node_first( pnList ) );
 
 	/* put the new list-chain in the list */
-	pnList->pnListHead = pnNew;
+	SET_LIST_HEAD( pnList, pnNew );
 
 	/* if the list was empty */
-	if( pnList->pnListHead->pnNext == NULL )
+	if( LIST_TAIL( pnList ) == NULL )
 	{
-		/* advance the tail pointer */
-		pnList->pnListTail = pnList->pnListTail->pnNext;
+		/* it is also the tail */
+		SET_LIST_TAIL( pnList, pnNew );
 	}
 
 	pnList->nListElements++;
@@ -1654,7 +2365,7 @@ node_t * NODE_INTERNAL_FUNC node_pop_internal( node_t * pnList )
 	node_t * pnPopped = NULL;
 
 	/* if the list is empty */
-	if( pnList->pnListHead == NULL )
+	if( node_first( pnList ) == NULL )
 	{
 		/* don't assert so pop() can be used to probe for elements */
 
@@ -1676,7 +2387,7 @@ node_t * NODE_INTERNAL_FUNC node_pop_internal( node_t * pnList )
  Hash Functions
  **************/
 
-static node_t * NODE_INTERNAL_FUNC node_add_common( node_arena * pArena, int nType, va_list valist )
+static node_t * NODE_INTERNAL_FUNC node_add_common( node_tls * ptls, node_arena * pArena, int nType, va_list valist )
 {
 	node_t * pnElement = NULL;
 	node_t * pnNew = NULL;
@@ -1702,7 +2413,7 @@ static node_t * NODE_INTERNAL_FUNC node_add_common( node_arena * pArena, int nTy
 		}
 
 		/* make a deep copy of the node to be added (without its neighbors) */
-		pnNew = node_copy_internal( pArena, pnElement );
+		pnNew = node_copy_internal( ptls, pArena, pnElement );
 		break;
 
 	/* if we're supposed to add _this_ node and not a copy */
@@ -1729,27 +2440,35 @@ static node_t * NODE_INTERNAL_FUNC node_add_common( node_arena * pArena, int nTy
 			if( pnElement->bInCollection != NOT_IN_COLLECTION )
 			{
 				node_error( "Attempted to add node with NODE_REF when node was in another list/hash - copying!\n" );
-				pnNew = node_copy_internal( pArena, pnElement );
+				pnNew = node_copy_internal( ptls, pArena, pnElement );
+				if( pnNew == NULL )
+					return NULL;
 			}
 		}
 
 		// if node_nDebugArena??
-		if( pnNew->pArena != pArena )
+		if( GET_ARENA( pnNew ) != pArena )
 		{
 			/* error only if heavyweight */
 			if( ( pnNew->nType == NODE_LIST || pnNew->nType == NODE_HASH ) && node_get_elements( pnNew ) > 1  )
 				node_error( "Attempting to add node with NODE_REF when nodes are from different arenas - copying!\n" );
-			pnNew = node_copy_internal( pArena, pnElement );
+			pnNew = node_copy_internal( ptls, pArena, pnElement );
 		}
 
 		break;
 
 	default: /* some scalar type *./
 		/* create a new node */
-		pnNew = node_alloc_internal( pArena );
+		pnNew = node_alloc_internal( ptls, pArena );
+		if( pnNew == NULL )
+			return NULL;
 
 		/* call node_set_valist on the input*/
-		node_set_valist(pnNew, nType, valist);
+		if( !node_set_valist( ptls, pnNew, nType, valist) )
+		{
+			node_free_internal( pnNew, NOT_IN_COLLECTION );
+			return NULL;
+		}
 
 		break;
 	}
@@ -1763,11 +2482,12 @@ NODE_API node_t * node_hash_add_dbgA( const char * psFile, int nLine, node_t * p
 	set_debug_allocator s(psFile, nLine);
 
 	va_list valist;
+	node_key_t key;
 
 	/* grab the variable arguments */
 	va_start( valist, nType );
 
-	node_t * pn = node_hash_addA_valist( pnHash, psKey, nType, valist );
+	node_t * pn = node_hash_addA_valist( NODE_CACHE_CTX, pnHash, key_makeA( &key, psKey, KEY_TERMINATED ), nType, valist, ADD_REPLACE );
 
 	/* clean up after variable argument processing*/
 	va_end( valist );
@@ -1778,11 +2498,12 @@ NODE_API node_t * node_hash_add_dbgA( const char * psFile, int nLine, node_t * p
 NODE_API node_t * node_hash_addA(node_t * pnHash, const char * psKey, int nType, ...)
 {
 	va_list valist;
+	node_key_t key;
 
 	/* grab the variable arguments */
 	va_start( valist, nType );
 
-	node_t * pn = node_hash_addA_valist( pnHash, psKey, nType, valist );
+	node_t * pn = node_hash_addA_valist( NODE_CACHE_CTX, pnHash, key_makeA( &key, psKey, KEY_TERMINATED ), nType, valist, ADD_REPLACE );
 
 	/* clean up after variable argument processing*/
 	va_end( valist );
@@ -1790,8 +2511,87 @@ NODE_API node_t * node_hash_addA(node_t * pnHash, const char * psKey, int nType,
 	return pn;
 }
 
-static node_t * NODE_INTERNAL_FUNC node_hash_addA_valist(node_t * pnHash, const char * psKey, int nType, va_list valist )
+NODE_API node_t * node_hash_add_ctxA( node_ctx_t ctx, node_t * pnHash, const char * psKey, int nType, ... )
+{
+	va_list valist;
+	node_key_t key;
+
+	va_start( valist, nType );
+
+	node_t * pn = node_hash_addA_valist( node_ctx_tls( ctx ), pnHash, key_makeA( &key, psKey, KEY_TERMINATED ), nType, valist, ADD_REPLACE );
+
+	va_end( valist );
+
+	return pn;
+}
+
+/* add a node to a hash under the first cchKey characters of psKey */
+NODE_API node_t * node_hash_add_n_dbgA( const char * psFile, int nLine, node_t * pnHash, const char * psKey, size_t cchKey, int nType, ... )
+{
+	set_debug_allocator s(psFile, nLine);
+
+	va_list valist;
+	node_key_t key;
+
+	va_start( valist, nType );
+
+	node_t * pn = node_hash_addA_valist( NODE_CACHE_CTX, pnHash, key_makeA( &key, psKey, cchKey ), nType, valist, ADD_REPLACE );
+
+	va_end( valist );
+
+	return pn;
+}
+
+NODE_API node_t * node_hash_add_nA( node_t * pnHash, const char * psKey, size_t cchKey, int nType, ... )
+{
+	va_list valist;
+	node_key_t key;
+
+	va_start( valist, nType );
+
+	node_t * pn = node_hash_addA_valist( NODE_CACHE_CTX, pnHash, key_makeA( &key, psKey, cchKey ), nType, valist, ADD_REPLACE );
+
+	va_end( valist );
+
+	return pn;
+}
+
+/* set a value on a hash's child in place, or add the child if there is none; a list, hash or node
+   (NODE_LIST, NODE_HASH, NODE_ADD_COPY, NODE_ADD_REF...) replaces the child as node_hash_addA does */
+NODE_API node_t * node_hash_set_dbgA( const char * psFile, int nLine, node_t * pnHash, const char * psKey, int nType, ... )
+{
+	set_debug_allocator s(psFile, nLine);
+
+	va_list valist;
+	node_key_t key;
+
+	va_start( valist, nType );
+
+	node_t * pn = node_hash_addA_valist( NODE_CACHE_CTX, pnHash, key_makeA( &key, psKey, KEY_TERMINATED ), nType, valist, ADD_IN_PLACE );
+
+	va_end( valist );
+
+	return pn;
+}
+
+NODE_API node_t * node_hash_setA( node_t * pnHash, const char * psKey, int nType, ... )
+{
+	va_list valist;
+	node_key_t key;
+
+	va_start( valist, nType );
+
+	node_t * pn = node_hash_addA_valist( NODE_CACHE_CTX, pnHash, key_makeA( &key, psKey, KEY_TERMINATED ), nType, valist, ADD_IN_PLACE );
+
+	va_end( valist );
+
+	return pn;
+}
+
+static node_t * NODE_INTERNAL_FUNC node_hash_addA_valist( node_tls * ptls, node_t * pnHash, const node_key_t * pKey, int nType, va_list valist, int nAdd )
 {
+	const char * psKey = (const char *)pKey->pvKey;
+
 	node_t * pnNew = NULL;
 
 	node_t * pnOld = NULL;
@@ -1804,7 +2604,12 @@ static node_t * NODE_INTERNAL_FUNC node_hash_addA_valist(node_t * pnHash, const
 	}
 
 	/* make sure hash is initialized */
-	node_hash_init( pnHash, DEFAULT_HASHBUCKETS );
+	if( !node_hash_init( ptls, pnHash, DEFAULT_HASHSLOTS ) )
+		return NULL;
+
+	hash_writer w( pnHash, pKey->nHash );
+	if( w.failed() )
+		return NULL;
 
 	if( node_nDebugUnicode )
 	{
@@ -1820,46 +2625,74 @@ static node_t * NODE_INTERNAL_FUNC node_hash_addA_valist(node_t * pnHash, const
 		pnHash->nHashFlags |= HASH_CONTAINS_AKEYS;
 	}
 
-	pnNew = node_add_common( pnHash->pArena, nType, valist );
+	/* a plain value is set on the child already there: no new node, and a miss is not looked up twice;
+	   a shared hash's readers may be reading the child, so it is replaced like any other */
+	int bLooked = FALSE;
+	if( ( nAdd & ADD_IN_PLACE ) && node_set_in_place( nType ) && !( pnHash->nHashFlags & HASH_SHARED ) )
+	{
+		pnOld = hash_getA( pnHash, pKey->nHash, pKey->cchKey, psKey );
+		if( pnOld != NULL )
+			return node_set_valist( ptls, pnOld, nType, valist ) ? pnOld : NULL;
+		bLooked = TRUE;
+	}
+
+	pnNew = node_add_common( ptls, GET_ARENA( pnHash ), nType, valist );
 	if( pnNew == NULL )
 		return NULL;
 
+	/* name the new node before touching the hash, so a failure leaves it as it was */
+	if( !node_set_name_nA_internal( ptls, pnNew, psKey, pKey->cchKey, pKey->nHash ) )
+	{
+		node_free_internal( pnNew, NOT_IN_COLLECTION );
+		return NULL;
+	}
+
+	/* make room first, so a failure leaves the hash as it was */
+	if( !w.reserve( pnHash ) )
+	{
+		node_free_internal( pnNew, NOT_IN_COLLECTION );
+		return NULL;
+	}
+
 	/* if the item already exists in the hash */
-	pnOld = node_hash_getA_internal( pnHash, psKey );
+	if( !bLooked )
+		pnOld = hash_getA( pnHash, pKey->nHash, pKey->cchKey, psKey );
+
+	/* the new node goes in before the old one comes out, so a concurrent get finds one or the other */
+	node_hash_add_internal( pnHash, pnNew, pKey->nHash, pKey->cchKey );
+
 	if( pnOld != NULL )
 	{
 		/* delete it */
 		node_hash_delete_internal( pnHash, pnOld );
 
-		/* free it */
-		node_free_internal( pnOld, NOT_IN_COLLECTION );
+		/* free it, once no reader can hold it */
+		hash_retire( pnHash, pnOld );
 	}
 
-	/* set the node name to psKey */
-	node_set_nameA_internal( pnNew, psKey );
-
-	node_hash_add_internal( pnHash, pnNew );
-
 	return pnNew;
 }
 
-static void NODE_INTERNAL_FUNC node_hash_add_internal( node_t * pnHash, node_t * pnNew )
+/* add pnNew, whose name is nLength long and hashes to nHash, without looking for a node of the same name;
+   FALSE if the table could not grow */
+static int NODE_INTERNAL_FUNC node_hash_add_internal( node_t * pnHash, node_t * pnNew, unsigned int nHash, size_t nLength )
 {
-	int nBucket;
+	/* a shared hash's writer has its slot already */
+	int bShared = ( pnHash->nHashFlags & HASH_SHARED ) != 0;
+	if( !bShared && !hash_reserve( pnHash ) )
+		return FALSE;
 
 	/* this node is now in a collection */
 	node_assert( pnNew->bInCollection == NOT_IN_COLLECTION );
 	pnNew->bInCollection = IN_COLLECTION;
 
-	/* get a bucket number */
-	nBucket = hash_to_bucket( pnHash, pnNew->nHash );
-
-	/* add the element to that bucket */
-	pnNew->pnNext = pnHash->ppnHashHeads[nBucket];
-	pnHash->ppnHashHeads[nBucket] = pnNew;
+	hash_place( pnHash, pnNew, nHash, nLength );
 
 	/* increment the number of hash elements */
-	pnHash->nHashElements++;
+	if( bShared )
+		HASH_SHARED_TABLE( pnHash->ppnHashSlots )->pShared->aStripes[HASH_STRIPE( nHash )].nElements++;
+	else
+		pnHash->nHashElements++;
 #ifdef _DEBUG
 	if( node_nDebugHashPerf )
 	{
@@ -1871,14 +2704,7 @@ static void NODE_INTERNAL_FUNC node_hash_add_internal( node_t * pnHash, node_t *
 	}
 #endif
 
-#ifdef HASH_AUTO_RESIZE
-	if( NEEDS_REBALANCE( pnHash ) )
-	{
-		hash_rebalance( pnHash );
-	}
-#endif
-
-	return;
+	return TRUE;
 }
 
 /* add a node to a hash{} similar variable arguments to node_set */
@@ -1887,10 +2713,11 @@ NODE_API node_t * node_hash_add_dbgW( const char * psFile, int nLine, node_t * p
 	set_debug_allocator s(psFile, nLine);
 
 	va_list valist;
+	node_key_t key;
 
 	va_start( valist, nType );
 
-	node_t * pnNew = node_hash_addW_valist( pnHash, psKey, nType, valist );
+	node_t * pnNew = node_hash_addW_valist( NODE_CACHE_CTX, pnHash, key_makeW( &key, psKey, KEY_TERMINATED ), nType, valist, ADD_REPLACE );
 
 	va_end( valist );
 
@@ -1900,142 +2727,229 @@ NODE_API node_t * node_hash_add_dbgW( const char * psFile, int nLine, node_t * p
 NODE_API node_t * node_hash_addW( node_t * pnHash, const wchar_t * psKey, int nType, ... )
 {
 	va_list valist;
+	node_key_t key;
 
 	va_start( valist, nType );
 
-	node_t * pnNew = node_hash_addW_valist( pnHash, psKey, nType, valist );
+	node_t * pnNew = node_hash_addW_valist( NODE_CACHE_CTX, pnHash, key_makeW( &key, psKey, KEY_TERMINATED ), nType, valist, ADD_REPLACE );
 
 	va_end( valist );
 
 	return pnNew;
 }
 
-static node_t * NODE_INTERNAL_FUNC node_hash_addW_valist( node_t * pnHash, const wchar_t * psKey, int nType, va_list valist )
+NODE_API node_t * node_hash_add_ctxW( node_ctx_t ctx, node_t * pnHash, const wchar_t * psKey, int nType, ... )
 {
-	node_t * pnNew = NULL;
-
-	node_t * pnOld = NULL;
+	va_list valist;
+	node_key_t key;
 
-	if( pnHash == NULL || psKey == NULL )
-	{
-		node_assert( pnHash != NULL );
-		node_assert( psKey != NULL );
-		return NULL;
-	}
+	va_start( valist, nType );
 
-	/* make sure hash is initialized */
-	node_hash_init( pnHash, DEFAULT_HASHBUCKETS );
+	node_t * pn = node_hash_addW_valist( node_ctx_tls( ctx ), pnHash, key_makeW( &key, psKey, KEY_TERMINATED ), nType, valist, ADD_REPLACE );
 
-	if( node_nDebugUnicode )
-	{
-		/* check that there are no A keys in this hash */
-		if( pnHash->nHashFlags & HASH_CONTAINS_AKEYS )
-		{
-			node_error( "Attempting to add W key to hash which contains A keys.\n" );
-			node_assert( (pnHash->nHashFlags & HASH_CONTAINS_AKEYS) == 0 );
-			return NULL;
-		}
+	va_end( valist );
 
-		/* set the W flag */
-		pnHash->nHashFlags |= HASH_CONTAINS_WKEYS;
-	}
+	return pn;
+}
 
-	pnNew = node_add_common( pnHash->pArena, nType, valist );
-	if( pnNew == NULL )
-		return NULL;
+/* add a node to a hash under the first cchKey characters of psKey */
+NODE_API node_t * node_hash_add_n_dbgW( const char * psFile, int nLine, node_t * pnHash, const wchar_t * psKey, size_t cchKey, int nType, ... )
+{
+	set_debug_allocator s(psFile, nLine);
 
-	/* if the item already exists in the hash */
-	pnOld = node_hash_getW_internal( pnHash, psKey );
-	if( pnOld != NULL )
-	{
-		/* delete it */
-		node_hash_delete_internal( pnHash, pnOld );
+	va_list valist;
+	node_key_t key;
 
-		/* free it */
-		node_free_internal( pnOld, NOT_IN_COLLECTION );
-	}
+	va_start( valist, nType );
 
-	/* set the node name to psKey */
-	node_set_nameW_internal( pnNew, psKey );
+	node_t * pn = node_hash_addW_valist( NODE_CACHE_CTX, pnHash, key_makeW( &key, psKey, cchKey ), nType, valist, ADD_REPLACE );
 
-	node_hash_add_internal( pnHash, pnNew );
+	va_end( valist );
 
-	return pnNew;
+	return pn;
 }
 
-#ifdef HASH_AUTO_RESIZE
-static void NODE_INTERNAL_FUNC hash_rebalance( node_t * pnHash )
+NODE_API node_t * node_hash_add_nW( node_t * pnHash, const wchar_t * psKey, size_t cchKey, int nType, ... )
 {
-	int nOldBuckets = pnHash->nHashBuckets;
-	int nNewBuckets = 0;
+	va_list valist;
+	node_key_t key;
 
-	node_t ** ppnOldHeads = pnHash->ppnHashHeads;
+	va_start( valist, nType );
 
-	node_t * pn = NULL;
+	node_t * pn = node_hash_addW_valist( NODE_CACHE_CTX, pnHash, key_makeW( &key, psKey, cchKey ), nType, valist, ADD_REPLACE );
 
-	int i = 0;
+	va_end( valist );
 
-	/* create new hash arrays */
-	for( pnHash->nHashBuckets*=2; NEEDS_REBALANCE( pnHash ); pnHash->nHashBuckets*=2 )
-		/* empty */;
+	return pn;
+}
 
-	nNewBuckets = pnHash->nHashBuckets;
+/* set a value on a hash's child in place, or add the child if there is none; a list, hash or node
+   (NODE_LIST, NODE_HASH, NODE_ADD_COPY, NODE_ADD_REF...) replaces the child as node_hash_addW does */
+NODE_API node_t * node_hash_set_dbgW( const char * psFile, int nLine, node_t * pnHash, const wchar_t * psKey, int nType, ... )
+{
+	set_debug_allocator s(psFile, nLine);
 
-	pnHash->ppnHashHeads = reinterpret_cast<node_t **>(node_malloc( pn->pArena, sizeof(node_t *) * nNewBuckets ));
-	
-	for( i=0; i < nNewBuckets; i++ )
-	{
-		/* null each element of ppnHashHeads */
-		pnHash->ppnHashHeads[i] = NULL;
-	}
+	va_list valist;
+	node_key_t key;
 
-	/* add all the old elements in */
-	for( i = 0; i < nOldBuckets; i++ )
-	{
-		node_t * pnNext = NULL;
-		int nBucket = 0;
+	va_start( valist, nType );
 
-		for( pn = ppnOldHeads[i]; pn != NULL; pn = pnNext )
-		{
-			/* save the next */
-			pnNext = pn->pnNext;
-			pn->pnNext = NULL;
+	node_t * pn = node_hash_addW_valist( NODE_CACHE_CTX, pnHash, key_makeW( &key, psKey, KEY_TERMINATED ), nType, valist, ADD_IN_PLACE );
 
-			/* get a bucket number */
-			nBucket = hash_to_bucket( pnHash, pn->nHash );
+	va_end( valist );
 
-			/* add the element to that bucket */
-			pn->pnNext = pnHash->ppnHashHeads[nBucket];
-			pnHash->ppnHashHeads[nBucket] = pn;
-		}
-	}
+	return pn;
+}
 
-#ifdef USE_BAGS
-	if( IS_BAG( pnHash, ppnOldHeads ) )
-		pnHash->bBagUsed = 0;
-	else
-#endif
+NODE_API node_t * node_hash_setW( node_t * pnHash, const wchar_t * psKey, int nType, ... )
+{
+	va_list valist;
+	node_key_t key;
+
+	va_start( valist, nType );
+
+	node_t * pn = node_hash_addW_valist( NODE_CACHE_CTX, pnHash, key_makeW( &key, psKey, KEY_TERMINATED ), nType, valist, ADD_IN_PLACE );
+
+	va_end( valist );
+
+	return pn;
+}
+
+static node_t * NODE_INTERNAL_FUNC node_hash_addW_valist( node_tls * ptls, node_t * pnHash, const node_key_t * pKey, int nType, va_list valist, int nAdd )
+{
+	const wchar_t * psKey = (const wchar_t *)pKey->pvKey;
+
+	node_t * pnNew = NULL;
+
+	node_t * pnOld = NULL;
+
+	if( pnHash == NULL || psKey == NULL )
+	{
+		node_assert( pnHash != NULL );
+		node_assert( psKey != NULL );
+		return NULL;
+	}
+
+	/* make sure hash is initialized */
+	if( !node_hash_init( ptls, pnHash, DEFAULT_HASHSLOTS ) )
+		return NULL;
+
+	hash_writer w( pnHash, pKey->nHash );
+	if( w.failed() )
+		return NULL;
+
+	if( node_nDebugUnicode )
+	{
+		/* check that there are no A keys in this hash */
+		if( pnHash->nHashFlags & HASH_CONTAINS_AKEYS )
+		{
+			node_error( "Attempting to add W key to hash which contains A keys.\n" );
+			node_assert( (pnHash->nHashFlags & HASH_CONTAINS_AKEYS) == 0 );
+			return NULL;
+		}
+
+		/* set the W flag */
+		pnHash->nHashFlags |= HASH_CONTAINS_WKEYS;
+	}
+
+	/* a plain value is set on the child already there: no new node, and a miss is not looked up twice;
+	   a shared hash's readers may be reading the child, so it is replaced like any other */
+	int bLooked = FALSE;
+	if( ( nAdd & ADD_IN_PLACE ) && node_set_in_place( nType ) && !( pnHash->nHashFlags & HASH_SHARED ) )
+	{
+		pnOld = hash_getW( pnHash, pKey->nHash, pKey->cchKey, psKey );
+		if( pnOld != NULL )
+			return node_set_valist( ptls, pnOld, nType, valist ) ? pnOld : NULL;
+		bLooked = TRUE;
+	}
+
+	pnNew = node_add_common( ptls, GET_ARENA( pnHash ), nType, valist );
+	if( pnNew == NULL )
+		return NULL;
+
+	/* name the new node before touching the hash, so a failure leaves it as it was */
+	if( !node_set_name_nW_internal( ptls, pnNew, psKey, pKey->cchKey, pKey->nHash ) )
+	{
+		node_free_internal( pnNew, NOT_IN_COLLECTION );
+		return NULL;
+	}
+
+	/* make room first, so a failure leaves the hash as it was */
+	if( !w.reserve( pnHash ) )
+	{
+		node_free_internal( pnNew, NOT_IN_COLLECTION );
+		return NULL;
+	}
+
+	/* if the item already exists in the hash */
+	if( !bLooked )
+		pnOld = hash_getW( pnHash, pKey->nHash, pKey->cchKey, psKey );
+
+	/* the new node goes in before the old one comes out, so a concurrent get finds one or the other */
+	node_hash_add_internal( pnHash, pnNew, pKey->nHash, pKey->cchKey );
+
+	if( pnOld != NULL )
 	{
-		nfree( pnHash->pArena, ppnOldHeads );
+		/* delete it */
+		node_hash_delete_internal( pnHash, pnOld );
+
+		/* free it, once no reader can hold it */
+		hash_retire( pnHash, pnOld );
 	}
+
+	return pnNew;
 }
-#endif
 
 /* get a node (by name) from a hash */
 NODE_API node_t * node_hash_getA( const node_t * pnHash, const char * psKey)
+{
+	if( !node_hash_check_getA( pnHash, psKey ) )
+		return NULL;
+
+	return node_hash_getA_internal( pnHash, psKey );
+}
+
+/* get a node from a hash by the first cchKey characters of psKey */
+NODE_API node_t * node_hash_get_nA( const node_t * pnHash, const char * psKey, size_t cchKey )
+{
+	if( !node_hash_check_getA( pnHash, psKey ) )
+		return NULL;
+
+	return hash_getA( pnHash, hash_key_nA( psKey, cchKey ), cchKey, psKey );
+}
+
+/* delete the node named by the first cchKey characters of psKey; the caller owns it afterwards */
+NODE_API node_t * node_hash_delete_nA( node_t * pnHash, const char * psKey, size_t cchKey )
+{
+	if( !node_hash_check_getA( pnHash, psKey ) )
+		return NULL;
+
+	unsigned int nHash = hash_key_nA( psKey, cchKey );
+	hash_writer w( pnHash, nHash );
+	if( w.failed() )
+		return NULL;
+	node_t * pn = hash_getA( pnHash, nHash, cchKey, psKey );
+	if( pn != NULL )
+		node_hash_delete_internal( pnHash, pn );
+
+	return pn;
+}
+
+/* FALSE if psKey cannot be looked for in pnHash */
+static int NODE_INTERNAL_FUNC node_hash_check_getA( const node_t * pnHash, const char * psKey )
 {
 	if( pnHash == NULL || psKey == NULL )
 	{
 		node_assert( pnHash != NULL );
 		node_assert( psKey != NULL );
-		return NULL;
+		return FALSE;
 	}
 
-	/* if nType is not NODE_HASH, assert and return NULL */
+	/* if nType is not NODE_HASH, assert and return FALSE */
 	if( pnHash->nType != NODE_HASH )
 	{
 		node_assert(pnHash->nType == NODE_HASH);	/* tried to get a hash out of a non-hash node! */
-		return NULL;
+		return FALSE;
 	}
 
 	if( node_nDebugUnicode )
@@ -2048,33 +2962,107 @@ NODE_API node_t * node_hash_getA( const node_t * pnHash, const char * psKey)
 		}
 	}
 
-	return node_hash_getA_internal( pnHash, psKey );
+	return TRUE;
 }
 
 static node_t * NODE_INTERNAL_FUNC node_hash_getA_internal( const node_t * pnHash, const char * psKey )
 {
-	unsigned long nHash;
-	int nBucket;
-	node_t * pnElement = NULL;
-
 	/* hash psKey */
-	nHash = node_hashA( psKey );
+	size_t nLength;
+	unsigned int nHash = hash_keyA( psKey, &nLength );
+	return hash_getA( pnHash, nHash, nLength, psKey );
+}
+
+/* get the node named psKey, which is nLength long and hashes to nHash */
+static node_t * NODE_INTERNAL_FUNC hash_getA( const node_t * pnHash, unsigned int nHash, size_t nLength, const char * psKey )
+{
+	if( pnHash->nHashFlags & HASH_FROZEN )
+		return hash_lookup_frozenA( pnHash, nHash, nLength, psKey );
+	if( pnHash->nHashFlags & HASH_SHARED )
+		return hash_lookup_sharedA( pnHash, nHash, nLength, psKey );
+
+	/* a growing hash may not have moved psKey's node out of its old table yet */
+	node_t * pn = hash_lookupA( pnHash, pnHash->ppnHashSlots, pnHash->nHashSlots, nHash, nLength, psKey );
+	if( pn == NULL && ( pnHash->nHashFlags & HASH_MIGRATING ) )
+	{
+		hash_migration * pm = HASH_MIGRATION( pnHash );
+		pn = hash_lookupA( pnHash, pm->ppnOld, pm->nOldSlots, nHash, nLength, psKey );
+	}
 
-	/* get a bucket number */
-	nBucket = hash_to_bucket( pnHash, nHash );
+	return pn;
+}
 
-	/* search the bucket for value associated with psKey */
-	pnElement = pnHash->ppnHashHeads[nBucket];
+/* the only child of a frozen hash that can be psKey: one slot, one comparison */
+static node_t * NODE_INTERNAL_FUNC hash_lookup_frozenA( const node_t * pnHash, unsigned int nHash, size_t nLength, const char * psKey )
+{
+	const unsigned int * pnHashes = HASH_HASHES( pnHash );
+	int nSlot = hash_frozen_slot( pnHash, nHash );
+	if( pnHashes[nSlot] != nHash )
+		return NULL;
 
-	while( pnElement != NULL)
+	/* keys with the full hash of another follow the slots of the rest: there is seldom one to look at */
+	for( int nNext = HASH_FROZEN_RECORD( pnHash )->nKeySlots; ; nSlot = nNext++ )
 	{
-		if( nHash == pnElement->nHash && _stricmp( pnElement->psAName, psKey ) == 0 )
-		{
-			/* if found, return a pointer to the found element */
+		node_t * pnElement = HASH_SLOT( pnHash, nSlot );
+		if( HASH_LENGTHS( pnHash )[nSlot] == HASH_LENGTH( nLength ) && ( pnElement->psAName == psKey || ( !pnElement->bNameW &&
+			( nLength < HASH_LENGTH_LIMIT ? key_equalA( pnElement->psAName, psKey, nLength ) : key_equal_longA( pnElement->psAName, psKey, nLength ) ) ) ) )
 			return pnElement;
-		}
-		pnElement = node_next( pnElement );
+
+		while( nNext < pnHash->nHashSlots && pnHashes[nNext] != nHash )
+			nNext++;
+		if( nNext >= pnHash->nHashSlots )
+			return NULL;
 	}
+}
+
+/* look in the table a shared hash last published: a writer may be replacing it meanwhile,
+   but not freeing it before the read section ends */
+static node_t * NODE_INTERNAL_FUNC hash_lookup_sharedA( const node_t * pnHash, unsigned int nHash, size_t nLength, const char * psKey )
+{
+	node_reader * pr = read_begin();
+	if( pr == NULL )
+		return NULL;
+	const node_link_t * ppnSlots = HASH_PUBLISHED( pnHash );
+	node_t * pn = hash_lookupA( pnHash, ppnSlots, HASH_SHARED_TABLE( ppnSlots )->nSlots, nHash, nLength, psKey );
+	read_end( pr );
+	return pn;
+}
+
+/* search one of pnHash's tables for psKey */
+static node_t * NODE_INTERNAL_FUNC hash_lookupA( const node_t * pnHash, const node_link_t * ppnSlots, int nSlots, unsigned int nHash, size_t nLength, const char * psKey )
+{
+	const unsigned int * pnHashes = HASH_TABLE_HASHES( ppnSlots, nSlots );
+	const unsigned short * pnLengths = HASH_TABLE_LENGTHS( ppnSlots, nSlots );
+
+	/* search the groups it probes for value associated with psKey */
+	hash_probe probe( ppnSlots, nSlots, nHash );
+	do
+	{
+		const unsigned char * pbGroup = probe.group();
+
+		for( unsigned int nMatch = hash_match( pbGroup, probe.nWidth, HASH_TAG( nHash ) ); nMatch != 0; nMatch &= nMatch - 1 )
+		{
+			/* the full hash and length are beside the slot: only a match costs a look at the node */
+			int nSlot = probe.slot( nMatch );
+			if( pnHashes[nSlot] != nHash || pnLengths[nSlot] != HASH_LENGTH( nLength ) )
+				continue;
+
+			node_t * pnElement = LINK_GET( pnHash, ppnSlots[nSlot] );
+
+			/* a key that is this element's (interned) name needs no comparison */
+			if( pnElement->psAName == psKey || ( !pnElement->bNameW &&
+				( nLength < HASH_LENGTH_LIMIT ? key_equalA( pnElement->psAName, psKey, nLength ) : key_equal_longA( pnElement->psAName, psKey, nLength ) ) ) )
+			{
+				/* if found, return a pointer to the found element */
+				return pnElement;
+			}
+		}
+
+		/* an insert would have stopped at the first empty slot */
+		if( hash_match( pbGroup, probe.nWidth, HASH_CTRL_EMPTY ) != 0 )
+			break;
+
+	} while( probe.next() );
 
 	/* if not found, return NULL */
 	return NULL;
@@ -2082,19 +3070,54 @@ static node_t * NODE_INTERNAL_FUNC node_hash_getA_internal( const node_t * pnHas
 
 /* get a node (by name) from a hash */
 NODE_API node_t * node_hash_getW( const node_t * pnHash, const wchar_t * psKey )
+{
+	if( !node_hash_check_getW( pnHash, psKey ) )
+		return NULL;
+
+	return node_hash_getW_internal( pnHash, psKey );
+}
+
+/* get a node from a hash by the first cchKey characters of psKey */
+NODE_API node_t * node_hash_get_nW( const node_t * pnHash, const wchar_t * psKey, size_t cchKey )
+{
+	if( !node_hash_check_getW( pnHash, psKey ) )
+		return NULL;
+
+	return hash_getW( pnHash, hash_key_nW( psKey, cchKey ), cchKey, psKey );
+}
+
+/* delete the node named by the first cchKey characters of psKey; the caller owns it afterwards */
+NODE_API node_t * node_hash_delete_nW( node_t * pnHash, const wchar_t * psKey, size_t cchKey )
+{
+	if( !node_hash_check_getW( pnHash, psKey ) )
+		return NULL;
+
+	unsigned int nHash = hash_key_nW( psKey, cchKey );
+	hash_writer w( pnHash, nHash );
+	if( w.failed() )
+		return NULL;
+	node_t * pn = hash_getW( pnHash, nHash, cchKey, psKey );
+	if( pn != NULL )
+		node_hash_delete_internal( pnHash, pn );
+
+	return pn;
+}
+
+/* FALSE if psKey cannot be looked for in pnHash */
+static int NODE_INTERNAL_FUNC node_hash_check_getW( const node_t * pnHash, const wchar_t * psKey )
 {
 	if( pnHash == NULL || psKey == NULL )
 	{
 		node_assert( pnHash != NULL );
 		node_assert( psKey != NULL );
-		return NULL;
+		return FALSE;
 	}
 
-	/* if nType is not NODE_HASH, assert and return NULL */
+	/* if nType is not NODE_HASH, assert and return FALSE */
 	if( pnHash->nType != NODE_HASH )
 	{
 		node_assert(pnHash->nType == NODE_HASH);	/* tried to get a hash out of a non-hash node! */
-		return NULL;
+		return FALSE;
 	}
 
 	if( node_nDebugUnicode )
@@ -2107,541 +3130,799 @@ NODE_API node_t * node_hash_getW( const node_t * pnHash, const wchar_t * psKey )
 		}
 	}
 
-	return node_hash_getW_internal( pnHash, psKey );
+	return TRUE;
 }
 
 static node_t * NODE_INTERNAL_FUNC node_hash_getW_internal( const node_t * pnHash, const wchar_t * psKey )
 {
-	unsigned long nHash;
-	int nBucket;
-	node_t * pnElement = NULL;
-
 	/* hash psKey */
-	nHash = node_hashW( psKey );
-
-	/* get a bucket number */
-	nBucket = hash_to_bucket( pnHash, nHash );
+	size_t nLength;
+	unsigned int nHash = hash_keyW( psKey, &nLength );
+	return hash_getW( pnHash, nHash, nLength, psKey );
+}
 
-	/* search the bucket for value associated with psKey */
-	pnElement = pnHash->ppnHashHeads[nBucket];
+/* get the node named psKey, which is nLength long and hashes to nHash */
+static node_t * NODE_INTERNAL_FUNC hash_getW( const node_t * pnHash, unsigned int nHash, size_t nLength, const wchar_t * psKey )
+{
+	if( pnHash->nHashFlags & HASH_FROZEN )
+		return hash_lookup_frozenW( pnHash, nHash, nLength, psKey );
+	if( pnHash->nHashFlags & HASH_SHARED )
+		return hash_lookup_sharedW( pnHash, nHash, nLength, psKey );
 
-	while( pnElement != NULL)
+	/* a growing hash may not have moved psKey's node out of its old table yet */
+	node_t * pn = hash_lookupW( pnHash, pnHash->ppnHashSlots, pnHash->nHashSlots, nHash, nLength, psKey );
+	if( pn == NULL && ( pnHash->nHashFlags & HASH_MIGRATING ) )
 	{
-		if( nHash == pnElement->nHash && _wcsicmp( pnElement->psWName, psKey ) == 0 )
-		{
-			/* if found, return a pointer to the found element */
-			return pnElement;
-		}
-		pnElement = node_next( pnElement );
+		hash_migration * pm = HASH_MIGRATION( pnHash );
+		pn = hash_lookupW( pnHash, pm->ppnOld, pm->nOldSlots, nHash, nLength, psKey );
 	}
 
-	/* if not found, return NULL */
-	return NULL;
+	return pn;
 }
 
-NODE_API void node_hash_delete( node_t * pnHash, node_t * pnToDelete )
+/* the only child of a frozen hash that can be psKey: one slot, one comparison */
+static node_t * NODE_INTERNAL_FUNC hash_lookup_frozenW( const node_t * pnHash, unsigned int nHash, size_t nLength, const wchar_t * psKey )
 {
-	if( pnHash == NULL || pnToDelete == NULL )
-	{
-		node_assert( pnHash != NULL );
-		node_assert( pnToDelete != NULL );
-		return;
-	}
+	const unsigned int * pnHashes = HASH_HASHES( pnHash );
+	int nSlot = hash_frozen_slot( pnHash, nHash );
+	if( pnHashes[nSlot] != nHash )
+		return NULL;
 
-	if( pnHash->nType != NODE_HASH )
+	/* keys with the full hash of another follow the slots of the rest: there is seldom one to look at */
+	for( int nNext = HASH_FROZEN_RECORD( pnHash )->nKeySlots; ; nSlot = nNext++ )
 	{
-		node_assert(pnHash->nType == NODE_HASH);
-		return;
+		node_t * pnElement = HASH_SLOT( pnHash, nSlot );
+		if( HASH_LENGTHS( pnHash )[nSlot] == HASH_LENGTH( nLength ) && ( pnElement->psWName == psKey || ( pnElement->bNameW &&
+			( nLength < HASH_LENGTH_LIMIT ? key_equalW( pnElement->psWName, psKey, nLength ) : key_equal_longW( pnElement->psWName, psKey, nLength ) ) ) ) )
+			return pnElement;
+
+		while( nNext < pnHash->nHashSlots && pnHashes[nNext] != nHash )
+			nNext++;
+		if( nNext >= pnHash->nHashSlots )
+			return NULL;
 	}
+}
 
-	node_hash_delete_internal( pnHash, pnToDelete );
+/* look in the table a shared hash last published: a writer may be replacing it meanwhile,
+   but not freeing it before the read section ends */
+static node_t * NODE_INTERNAL_FUNC hash_lookup_sharedW( const node_t * pnHash, unsigned int nHash, size_t nLength, const wchar_t * psKey )
+{
+	node_reader * pr = read_begin();
+	if( pr == NULL )
+		return NULL;
+	const node_link_t * ppnSlots = HASH_PUBLISHED( pnHash );
+	node_t * pn = hash_lookupW( pnHash, ppnSlots, HASH_SHARED_TABLE( ppnSlots )->nSlots, nHash, nLength, psKey );
+	read_end( pr );
+	return pn;
 }
 
-static void NODE_INTERNAL_FUNC node_hash_delete_internal( node_t * pnHash, node_t * pnToDelete )
+/* search one of pnHash's tables for psKey */
+static node_t * NODE_INTERNAL_FUNC hash_lookupW( const node_t * pnHash, const node_link_t * ppnSlots, int nSlots, unsigned int nHash, size_t nLength, const wchar_t * psKey )
 {
-	node_t * pnPrevious = NULL;
-	node_t * pnScroll = NULL;
-	
-	unsigned long nBucket = 0;
+	const unsigned int * pnHashes = HASH_TABLE_HASHES( ppnSlots, nSlots );
+	const unsigned short * pnLengths = HASH_TABLE_LENGTHS( ppnSlots, nSlots );
 
-	/* decrement the count of hash members */
-	if( pnHash->nHashElements <= 0 )
+	/* search the groups it probes for value associated with psKey */
+	hash_probe probe( ppnSlots, nSlots, nHash );
+	do
 	{
-		node_assert( pnHash->nHashElements > 0 );
-		return;
-	}
+		const unsigned char * pbGroup = probe.group();
 
-	node_assert( pnToDelete->bInCollection == IN_COLLECTION );
-
-	/* get the bucket it's in */
-	nBucket = hash_to_bucket( pnHash, pnToDelete->nHash );
-
-	/* if nonempty bucket */
-	if( pnHash->ppnHashHeads[nBucket] != NULL )
-	{
-		/* if the node to delete is the first in the bucket */
-		if( pnToDelete == pnHash->ppnHashHeads[nBucket] )
+		for( unsigned int nMatch = hash_match( pbGroup, probe.nWidth, HASH_TAG( nHash ) ); nMatch != 0; nMatch &= nMatch - 1 )
 		{
-			/* cut the head off the list in the bucket*/
-			pnHash->ppnHashHeads[nBucket] = node_next( pnToDelete );
-			pnToDelete->pnNext = NULL;
+			/* the full hash and length are beside the slot: only a match costs a look at the node */
+			int nSlot = probe.slot( nMatch );
+			if( pnHashes[nSlot] != nHash || pnLengths[nSlot] != HASH_LENGTH( nLength ) )
+				continue;
 
-			/* this node is no longer in a collection */
-			pnToDelete->bInCollection = NOT_IN_COLLECTION;
-			pnHash->nHashElements--;
-
-			return;
-		}
+			node_t * pnElement = LINK_GET( pnHash, ppnSlots[nSlot] );
 
-		for( pnPrevious = pnHash->ppnHashHeads[nBucket], pnScroll = node_next( pnPrevious );
-			 pnScroll != NULL; pnPrevious = pnScroll, pnScroll = node_next( pnPrevious ) )
-		{
-			/* if the current node is the node to delete */
-			if( pnToDelete == pnScroll )
+			/* a key that is this element's (interned) name needs no comparison */
+			if( pnElement->psWName == psKey || ( pnElement->bNameW &&
+				( nLength < HASH_LENGTH_LIMIT ? key_equalW( pnElement->psWName, psKey, nLength ) : key_equal_longW( pnElement->psWName, psKey, nLength ) ) ) )
 			{
-				/* cut it out of the list */
-				pnPrevious->pnNext = node_next( pnToDelete );
-				pnToDelete->pnNext = NULL;
-
-				/* this node is no longer in a collection */
-				pnToDelete->bInCollection = NOT_IN_COLLECTION;			
-				pnHash->nHashElements--;
-
-				return;
+				/* if found, return a pointer to the found element */
+				return pnElement;
 			}
 		}
-	}
 
-	/* if we got here, then the node was not found in the bucket */
-	node_assert(!"node_hash_delete: node to delete was not found in list");
-
-}
+		/* an insert would have stopped at the first empty slot */
+		if( hash_match( pbGroup, probe.nWidth, HASH_CTRL_EMPTY ) != 0 )
+			break;
 
-/**************
- Name Functions
- **************/
+	} while( probe.next() );
 
-/* set the name of a node */
-NODE_API void node_set_name_dbgA( const char * psFile, int nLine, node_t * pn, const char * psName)
-{
-	set_debug_allocator s(psFile, nLine);
-	node_set_nameA( pn, psName );
+	/* if not found, return NULL */
+	return NULL;
 }
 
-NODE_API void node_set_nameA(node_t * pn, const char * psName)
+/* make a prehashed key */
+NODE_API node_key_t * node_key_initA( node_key_t * pKey, const char * psKey )
 {
-	if( pn == NULL )
-	{
-		node_assert( pn != NULL );
-		return;
-	}
-
-	/* test psName for validity */
-	if(psName == NULL)
+	if( pKey == NULL || psKey == NULL )
 	{
-		node_assert( psName != NULL );
-		node_error("Internal error: attempt to set a node name to NULL.\n");
-		return;
+		node_assert( pKey != NULL );
+		node_assert( psKey != NULL );
+		return NULL;
 	}
 
-	node_set_nameA_internal( pn, psName );
+	return key_makeA( pKey, psKey, KEY_TERMINATED );
 }
 
-static void NODE_INTERNAL_FUNC node_set_nameA_internal( node_t * pn, const char * psName )
+NODE_API node_key_t * node_key_initW( node_key_t * pKey, const wchar_t * psKey )
 {
-	/* if pn->psName is the same as the passed-in name, we're done */
-	if( pn->psAName == psName )
-	{
-		return;
-	}
-	
-	/* if pn->psName is set, free it */
-	if( pn->psAName != NULL )
+	if( pKey == NULL || psKey == NULL )
 	{
-		nfree( pn->pArena, pn->psAName );
+		node_assert( pKey != NULL );
+		node_assert( psKey != NULL );
+		return NULL;
 	}
-	
-	/* copy psName onto pn->psName */
-	pn->psAName = node_safe_copyA( pn->pArena, psName );
-	
-	pn->nHash = node_hashA( psName );
-	
-	return;
+
+	return key_makeW( pKey, psKey, KEY_TERMINATED );
 }
 
-/* set the name of a node */
-NODE_API void node_set_name_dbgW( const char * psFile, int nLine, node_t * pn, const wchar_t * psName)
+/* add a node to a hash under a prehashed key */
+NODE_API node_t * node_hash_add_key_dbg( const char * psFile, int nLine, node_t * pnHash, const node_key_t * pKey, int nType, ... )
 {
 	set_debug_allocator s(psFile, nLine);
 
-	node_set_nameW( pn, psName );
+	va_list valist;
+
+	va_start( valist, nType );
+
+	node_t * pn = node_hash_add_key_valist( NODE_CACHE_CTX, pnHash, pKey, nType, valist, ADD_REPLACE );
+
+	va_end( valist );
+
+	return pn;
 }
 
-NODE_API void node_set_nameW(node_t * pn, const wchar_t * psName)
+NODE_API node_t * node_hash_add_key( node_t * pnHash, const node_key_t * pKey, int nType, ... )
 {
-	if( pn == NULL )
+	va_list valist;
+
+	va_start( valist, nType );
+
+	node_t * pn = node_hash_add_key_valist( NODE_CACHE_CTX, pnHash, pKey, nType, valist, ADD_REPLACE );
+
+	va_end( valist );
+
+	return pn;
+}
+
+static node_t * NODE_INTERNAL_FUNC node_hash_add_key_valist( node_tls * ptls, node_t * pnHash, const node_key_t * pKey, int nType, va_list valist, int nAdd )
+{
+	if( pKey == NULL || !key_check( pKey ) )
 	{
-		node_assert( pn != NULL );
-		return;
+		node_assert( pKey != NULL );
+		return NULL;
 	}
 
-	/* test psName for validity */
-	if(psName == NULL)
+	return pKey->bKeyW ? node_hash_addW_valist( ptls, pnHash, pKey, nType, valist, nAdd ) : node_hash_addA_valist( ptls, pnHash, pKey, nType, valist, nAdd );
+}
+
+/* get a node from a hash by a prehashed key */
+NODE_API node_t * node_hash_get_key( const node_t * pnHash, const node_key_t * pKey )
+{
+	if( pKey == NULL || !key_check( pKey ) )
 	{
-		node_assert( psName != NULL );
-		node_error("Internal error: attempt to set a node name to NULL.\n");
-		return;
+		node_assert( pKey != NULL );
+		return NULL;
+	}
+
+	if( pKey->bKeyW )
+	{
+		const wchar_t * psKey = (const wchar_t *)pKey->pvKey;
+		if( !node_hash_check_getW( pnHash, psKey ) )
+			return NULL;
+
+		return hash_getW( pnHash, pKey->nHash, pKey->cchKey, psKey );
 	}
 
-	node_set_nameW_internal( pn, psName );
+	const char * psKey = (const char *)pKey->pvKey;
+	if( !node_hash_check_getA( pnHash, psKey ) )
+		return NULL;
 
+	return hash_getA( pnHash, pKey->nHash, pKey->cchKey, psKey );
 }
 
-static void NODE_INTERNAL_FUNC node_set_nameW_internal( node_t * pn, const wchar_t * psName )
+/* get the nodes for nKeys keys at once; apnOut[i] is the node for apsKeys[i], or NULL */
+NODE_API int node_hash_get_manyA( const node_t * pnHash, const char * const * apsKeys, int nKeys, node_t ** apnOut )
 {
-	/* if pn->psName is the same as the passed-in name, we're done */
-	if( pn->psWName == psName )
+	if( !node_hash_check_get_many( pnHash, apsKeys, nKeys, apnOut ) )
+		return 0;
+
+	node_key_t aKeys[HASH_BATCH];
+	int nFound = 0;
+	for( int nFirst = 0; nFirst < nKeys; nFirst += HASH_BATCH )
 	{
-		return;
+		int nBatch = __min( nKeys - nFirst, HASH_BATCH );
+		for( int i = 0; i < nBatch; i++ )
+			key_makeA( &aKeys[i], apsKeys[nFirst + i], KEY_TERMINATED );
+
+		nFound += hash_get_batch( pnHash, aKeys, nBatch, apnOut + nFirst );
 	}
 
-	/* if pn->psName is set, free it */
-	if( pn->psWName != NULL )
+	return nFound;
+}
+
+NODE_API int node_hash_get_manyW( const node_t * pnHash, const wchar_t * const * apsKeys, int nKeys, node_t ** apnOut )
+{
+	if( !node_hash_check_get_many( pnHash, apsKeys, nKeys, apnOut ) )
+		return 0;
+
+	node_key_t aKeys[HASH_BATCH];
+	int nFound = 0;
+	for( int nFirst = 0; nFirst < nKeys; nFirst += HASH_BATCH )
 	{
-		nfree( pn->pArena, pn->psWName );
+		int nBatch = __min( nKeys - nFirst, HASH_BATCH );
+		for( int i = 0; i < nBatch; i++ )
+			key_makeW( &aKeys[i], apsKeys[nFirst + i], KEY_TERMINATED );
+
+		nFound += hash_get_batch( pnHash, aKeys, nBatch, apnOut + nFirst );
 	}
 
-	/* copy psName onto pn->psName */
-	pn->psWName = node_safe_copyW( pn->pArena, psName );
+	return nFound;
+}
+
+/* get the nodes for nKeys prehashed keys at once */
+NODE_API int node_hash_get_many_key( const node_t * pnHash, const node_key_t * aKeys, int nKeys, node_t ** apnOut )
+{
+	if( !node_hash_check_get_many( pnHash, aKeys, nKeys, apnOut ) )
+		return 0;
 
-	pn->nHash = node_hashW( psName );
+	int nFound = 0;
+	for( int nFirst = 0; nFirst < nKeys; nFirst += HASH_BATCH )
+		nFound += hash_get_batch( pnHash, aKeys + nFirst, __min( nKeys - nFirst, HASH_BATCH ), apnOut + nFirst );
 
-	return;
+	return nFound;
 }
 
-/* get the name of node */
-NODE_API NODE_CONSTOUT char * node_get_nameA( const node_t * pn )
+/* FALSE if a batched get cannot start; each of its keys is checked as it is looked up */
+static int NODE_INTERNAL_FUNC node_hash_check_get_many( const node_t * pnHash, const void * pvKeys, int nKeys, node_t ** apnOut )
 {
-	if( pn == NULL )
+	if( pnHash == NULL || nKeys < 0 || ( nKeys > 0 && ( pvKeys == NULL || apnOut == NULL ) ) )
 	{
-		node_assert( pn != NULL );
-		return NULL;
+		node_assert( pnHash != NULL );
+		node_assert( nKeys >= 0 );
+		node_assert( nKeys == 0 || pvKeys != NULL );
+		node_assert( nKeys == 0 || apnOut != NULL );
+		return FALSE;
+	}
+
+	if( pnHash->nType != NODE_HASH )
+	{
+		node_assert(pnHash->nType == NODE_HASH);	/* tried to get a hash out of a non-hash node! */
+		for( int i = 0; i < nKeys; i++ )
+			apnOut[i] = NULL;
+		return FALSE;
 	}
 
-	return pn->psAName;
+	return TRUE;
 }
 
-NODE_API NODE_CONSTOUT wchar_t * node_get_nameW( const node_t * pn)
+/* look up a batch of at most HASH_BATCH keys: prefetch every key's first group, then resolve them in
+   turn, so the cache misses of the whole batch overlap instead of each stalling its own lookup */
+static int NODE_INTERNAL_FUNC hash_get_batch( const node_t * pnHash, const node_key_t * aKeys, int nKeys, node_t ** apnOut )
 {
-	if( pn == NULL )
+	/* a writer may replace a shared hash's table between the prefetches and the gets: it is not prefetched */
+	if( !( pnHash->nHashFlags & HASH_SHARED ) )
 	{
-		node_assert( pn != NULL );
-		return NULL;
+		for( int i = 0; i < nKeys; i++ )
+		{
+			if( aKeys[i].pvKey != NULL )
+				hash_prefetch( pnHash, aKeys[i].nHash );
+		}
+
+		for( int i = 0; i < nKeys; i++ )
+		{
+			if( aKeys[i].pvKey != NULL )
+				hash_prefetch_child( pnHash, aKeys[i].nHash );
+		}
+	}
+
+	int nFound = 0;
+	for( int i = 0; i < nKeys; i++ )
+	{
+		const node_key_t * pKey = &aKeys[i];
+		node_t * pn = NULL;
+		if( pKey->bKeyW )
+		{
+			const wchar_t * psKey = (const wchar_t *)pKey->pvKey;
+			if( key_check( pKey ) && node_hash_check_getW( pnHash, psKey ) )
+				pn = hash_getW( pnHash, pKey->nHash, pKey->cchKey, psKey );
+		}
+		else
+		{
+			const char * psKey = (const char *)pKey->pvKey;
+			if( key_check( pKey ) && node_hash_check_getA( pnHash, psKey ) )
+				pn = hash_getA( pnHash, pKey->nHash, pKey->cchKey, psKey );
+		}
+
+		apnOut[i] = pn;
+		if( pn != NULL )
+			nFound++;
 	}
 
-	return pn->psWName;
+	return nFound;
 }
 
-/*****************************
- Dumping and Parsing Functions
- *****************************/
+/* a key built elsewhere (by NODE_KEYA at compile time, say) must hash as this library does */
+static int NODE_INTERNAL_FUNC key_check( const node_key_t * pKey )
+{
+#ifdef _DEBUG
+	if( pKey->pvKey != NULL )
+	{
+		unsigned int nHash = pKey->bKeyW ? hash_key_nW( (const wchar_t *)pKey->pvKey, pKey->cchKey ) : hash_key_nA( (const char *)pKey->pvKey, pKey->cchKey );
+		if( nHash != pKey->nHash )
+		{
+			node_error( "A prehashed key does not hash as this library does.\n" );
+			node_assert( nHash == pKey->nHash );
+			return FALSE;
+		}
+	}
+#endif
+	return TRUE;
+}
 
-/* dump the node to a file */
-NODE_API void node_dumpA( const node_t * pn, FILE * pfOut, int nOptions )
+/* fill in a key for psKey, of cchKey characters or terminated; a NULL key is left for the caller to reject */
+static inline node_key_t * key_makeA( node_key_t * pKey, const char * psKey, size_t cchKey )
 {
-	if( pn == NULL || pfOut == NULL )
+	pKey->pvKey = psKey;
+	pKey->cchKey = ( psKey == NULL ) ? 0 : ( cchKey == KEY_TERMINATED ) ? strlen( psKey ) : cchKey;
+	pKey->nHash = ( psKey == NULL ) ? 0 : hash_key_nA( psKey, pKey->cchKey );
+	pKey->bKeyW = FALSE;
+	return pKey;
+}
+
+static inline node_key_t * key_makeW( node_key_t * pKey, const wchar_t * psKey, size_t cchKey )
+{
+	pKey->pvKey = psKey;
+	pKey->cchKey = ( psKey == NULL ) ? 0 : ( cchKey == KEY_TERMINATED ) ? wcslen( psKey ) : cchKey;
+	pKey->nHash = ( psKey == NULL ) ? 0 : hash_key_nW( psKey, pKey->cchKey );
+	pKey->bKeyW = TRUE;
+	return pKey;
+}
+
+NODE_API void node_hash_delete( node_t * pnHash, node_t * pnToDelete )
+{
+	if( pnHash == NULL || pnToDelete == NULL )
 	{
-		node_assert( pn != NULL );
-		node_assert( pfOut != NULL );	
+		node_assert( pnHash != NULL );
+		node_assert( pnToDelete != NULL );
 		return;
 	}
 
-	struct node_dump d = {0};
-	d.pfOut = pfOut;
-	d.nOptions = nOptions;
-	d.nSpaces = 0;
-
-	node_dumpA_internal( pn, &d );
+	if( pnHash->nType != NODE_HASH )
+	{
+		node_assert(pnHash->nType == NODE_HASH);
+		return;
+	}
 
-	fflush( pfOut );
+	hash_writer w( pnHash, pnToDelete->nHash );
+	if( w.failed() )
+		return;
+	node_hash_delete_internal( pnHash, pnToDelete );
 }
 
-static void NODE_INTERNAL_FUNC node_dumpA_internal( const node_t * pn, struct node_dump * pd )
+static void NODE_INTERNAL_FUNC node_hash_delete_internal( node_t * pnHash, node_t * pnToDelete )
 {
-	node_t * pnElt;
-	float fTemp;
-	char * psEscaped = NULL;
+	/* decrement the count of hash members; a shared hash's writer holds its stripe, so the table stays */
+	hash_shared * pShared = ( pnHash->nHashFlags & HASH_SHARED ) ? HASH_SHARED_TABLE( pnHash->ppnHashSlots )->pShared : NULL;
+	hash_stripe * pStripe = pShared != NULL ? &( pShared->aStripes[HASH_STRIPE( pnToDelete->nHash )] ) : NULL;
+	if( ( pShared != NULL ? hash_shared_elements( pShared ) : pnHash->nHashElements ) <= 0 )
+	{
+		node_assert( !"node_hash_delete: hash is empty" );
+		return;
+	}
 
-	data_t * pbBase = NULL;
-	size_t nLength = 0;
+	node_assert( pnToDelete->bInCollection == IN_COLLECTION );
 
-	int nOptions = pd->nOptions;
-	int nSpaces = pd->nSpaces;
-	FILE * pfOut = pd->pfOut;
-	node_arena * pArena = pn->pArena;
+	/* deleting thaws a frozen hash, so the child stays if there is no memory to */
+	if( ( pnHash->nHashFlags & HASH_FROZEN ) && !hash_thaw( pnHash ) )
+		return;
 
-	/* write spaces */
-	node_write_spacesA( pfOut, nSpaces );
+	/* an emptied slot may be filled again */
+	int nLeft = hash_remove( pnHash, pnHash->ppnHashSlots, pnHash->nHashSlots, pnToDelete );
+	if( nLeft == HASH_CTRL_EMPTY )
+	{
+		if( pStripe != NULL )
+			pStripe->nGrowth++;
+		else
+			pnHash->nHashGrowth++;
+	}
 
-	/* write the name (if any) */
-	if( pn->psWName != NULL && pn->psAName == NULL )
+	/* a growing hash may not have moved it out of its old table yet */
+	if( nLeft == 0 && ( pnHash->nHashFlags & HASH_MIGRATING ) )
 	{
-		char *psA = WToA( pArena, pn->psWName );
-		psEscaped = node_escapeA( pArena, psA );
-		nfree( pArena, psA );
+		hash_migration * pm = HASH_MIGRATION( pnHash );
+		nLeft = hash_remove( pnHash, pm->ppnOld, pm->nOldSlots, pnToDelete );
+		if( nLeft != 0 )
+			pm->nOldElements--;
+	}
 
-		fputs( psEscaped, pfOut );
-		nfree( pArena, psEscaped );
-		psEscaped = NULL;
+	if( nLeft == 0 )
+	{
+		/* if we got here, then the node was not found in the table */
+		node_assert(!"node_hash_delete: node to delete was not found in hash");
+		return;
 	}
-	else if( pn->psAName != NULL )
+
+	/* this node is no longer in a collection */
+	pnToDelete->bInCollection = NOT_IN_COLLECTION;
+	if( pStripe != NULL )
+		pStripe->nElements--;
+	else
+		pnHash->nHashElements--;
+}
+
+/* lay a hash that is done changing out for lookups of one probe; adding or deleting thaws it */
+NODE_API int node_hash_freeze( node_t * pnHash )
+{
+	if( pnHash == NULL )
 	{
-		psEscaped = node_escapeA( pArena, pn->psAName );
-		fputs( psEscaped, pfOut );
-		nfree( pArena, psEscaped );
-		psEscaped = NULL;
+		node_assert( pnHash != NULL );
+		return FALSE;
 	}
 
-	/* write ':' */
-	fputs( ": ",  pfOut );
-	
-	switch( pn->nType )
+	if( pnHash->nType != NODE_HASH )
 	{
-	case NODE_INT:
-		fprintf( pfOut, "%d  (0x%08X)\r\n", pn->nValue, pn->nValue );
-		break;
+		node_assert( pnHash->nType == NODE_HASH );
+		return FALSE;
+	}
 
-	case NODE_INT64:
-		fprintf( pfOut, "%I64dL  (0x%016I64X)\r\n", pn->n64Value, pn->n64Value );
-		break;
+	if( pnHash->nHashFlags & HASH_FROZEN )
+		return TRUE;
 
-	case NODE_REAL:
-		fTemp = (float)pn->dfValue;
-		fprintf( pfOut, "%f  (0x%08X)\r\n", pn->dfValue, *((int*)&fTemp) );
-		break;
+	/* a shared hash's tables keep the layout its gets probe */
+	if( pnHash->nHashFlags & HASH_SHARED )
+		return FALSE;
 
-	case NODE_STRINGW:
-		/* TODO: maybe warn if data lost through conversion */
-		{
-			char * psA = NULL;
-			
-			if( pn->psAValue == NULL )
-			{	
-				psA = WToA( pArena, pn->psWValue );
-			}
-			else
-			{
-				psA = pn->psAValue;
-			}
+	return hash_freeze( pnHash );
+}
 
-			if( nOptions & DO_NOESCAPE )
-			{
-				fprintf( pfOut, "\"%s\"\r\n", psA );
-			}
-			else
-			{
-				psEscaped = node_escapeA( pArena, psA );
-				fprintf( pfOut, "'%s'\r\n", psEscaped );
-				nfree( pn->pArena, psEscaped );
-			}
-			
-			if( pn->psAValue == NULL )
-			{	
-				nfree( pArena, psA );
-			}
-		}
-		break;
+NODE_API int node_hash_frozen( const node_t * pnHash )
+{
+	return pnHash != NULL && pnHash->nType == NODE_HASH && ( pnHash->nHashFlags & HASH_FROZEN ) != 0;
+}
 
-	case NODE_STRINGA:
-		if( nOptions & DO_NOESCAPE )
-		{
-			fprintf( pfOut, "\"%s\"\r\n", pn->psAValue );
-		}
-		else
-		{
-			psEscaped = node_escapeA( pArena, pn->psAValue );
-			fprintf( pfOut, "'%s'\r\n", psEscaped );
-			nfree( pArena, psEscaped );
-		}
-		break;
+/* move a hash into tables that are only replaced whole, so gets on other threads need no lock */
+NODE_API int node_hash_share( node_t * pnHash )
+{
+	if( pnHash == NULL )
+	{
+		node_assert( pnHash != NULL );
+		return FALSE;
+	}
 
-	case NODE_PTR:
-		/* dump out the pointer value */
-		fprintf( pfOut, "PTR 0x%p\r\n", pn->pvValue );
-		break;
+	if( pnHash->nType != NODE_HASH )
+	{
+		node_assert( pnHash->nType == NODE_HASH );
+		return FALSE;
+	}
 
-	case NODE_DATA:
-		/* DATA: write 'DATA ', the data length, and a newline, 
-		   then write a hex dump of the data like this:
-		   $ 00 00 00 00 00 00 00 00  00 00 00 00 00 00 00 00 ................ */
-		fprintf(pfOut, "DATA %d\r\n", pn->nDataLength );
-		pbBase = pn->pbValue;
-		nLength = pn->nDataLength;
-		
-		/* 16 bytes per line AND remainder */
-		while( nLength > 0 )
-		{
-			char acBuffer[80];
-			char * ps = acBuffer;
-			size_t l;
-			data_t * pb;
-			
-			size_t nChunk = __min( 16, nLength );
+	if( pnHash->nHashFlags & HASH_SHARED )
+		return TRUE;
 
-			/* a dollar for every row... */
-			*ps++ = '$';
+#ifdef USE_DL_MALLOC
+	/* a thread's own arena takes no lock, so another thread's sets and deletes could not allocate from it */
+	if( GET_ARENA( pnHash )->dwOwner != 0 )
+	{
+		node_assert( !"node_hash_share: hash is not in the global arena" );
+		return FALSE;
+	}
+#endif
 
-			pb = pbBase;
-			size_t nSmallChunk = __min( 8, nChunk );
-			switch( nSmallChunk )
-			{
-			case  8: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  7: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  6: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  5: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  4: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  3: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  2: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  1: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			}
-			l = 3 * (8-nSmallChunk) + 1;
-			memset( ps, ' ', l );
-			ps += l;
+	/* every child in one ordinary table */
+	if( ( pnHash->nHashFlags & HASH_FROZEN ) && !hash_thaw( pnHash ) )
+		return FALSE;
+	if( pnHash->nHashFlags & HASH_MIGRATING )
+		hash_migrate( pnHash, pnHash->nHashSlots );
+
+	/* node_malloc aligns only to 16: the stripes go on cache lines of their own */
+	void * pvBlock = node_malloc( GET_ARENA( pnHash ), sizeof(hash_shared) + CACHE_LINE - 1 );
+	if( pvBlock == NULL )
+		return FALSE;
+	hash_shared * pShared = (hash_shared *)CACHE_ALIGN( pvBlock );
+	memset( pShared, 0, sizeof(hash_shared) );
+	pShared->pvBlock = pvBlock;
+	for( int i = 0; i < HASH_STRIPES; i++ )
+		InitializeCriticalSection( &(pShared->aStripes[i].cs) );
+	InitializeCriticalSection( &(pShared->csRetired) );
+	pShared->aStripes[0].nElements = pnHash->nHashElements;
+
+	node_link_t * ppnOld = pnHash->ppnHashSlots;
+	int nOldSlots = pnHash->nHashSlots;
+	if( !hash_shared_build( pnHash, pShared, nOldSlots ) )
+	{
+		hash_shared_free( pnHash, pShared );
+		return FALSE;
+	}
+
+	/* no other thread may get from a hash that is not shared yet */
+	hash_table_free( NODE_CACHE_CTX, pnHash, ppnOld, nOldSlots );
+	hash_shared_spread( pnHash, pShared, 0 );
+	pnHash->nHashFlags |= HASH_SHARED;
 
-			nSmallChunk = nChunk - nSmallChunk;
-			switch( nSmallChunk )
-			{
-			case  8: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  7: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  6: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  5: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  4: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  3: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  2: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			case  1: *ps++ = ' '; byte_to_strA( ps, *pb++ );
-			}
+	return TRUE;
+}
 
-			/* add the spaces */
-			l = 3 * (8-nSmallChunk);
-			memset( ps, ' ', l );
-			ps += l;
+NODE_API int node_hash_shared( const node_t * pnHash )
+{
+	return pnHash != NULL && pnHash->nType == NODE_HASH && ( pnHash->nHashFlags & HASH_SHARED ) != 0;
+}
 
-			/* add some spaces between the hex and character info */
-			*ps++ = ' '; *ps++ = ' '; *ps++ = ' ';
+NODE_API void node_hash_retire( node_t * pnHash, node_t * pn )
+{
+	if( pnHash == NULL || pn == NULL )
+	{
+		node_assert( pnHash != NULL );
+		node_assert( pn != NULL );
+		return;
+	}
 
-			/* now output the character values for the row */
-			pb = pbBase;
-			switch( nChunk )
-			{
-			case 16: *ps++ = (char)printable(*pb++);
-			case 15: *ps++ = (char)printable(*pb++);
-			case 14: *ps++ = (char)printable(*pb++);
-			case 13: *ps++ = (char)printable(*pb++);
-			case 12: *ps++ = (char)printable(*pb++);
-			case 11: *ps++ = (char)printable(*pb++);
-			case 10: *ps++ = (char)printable(*pb++);
-			case  9: *ps++ = (char)printable(*pb++);
-			case  8: *ps++ = (char)printable(*pb++);
-			case  7: *ps++ = (char)printable(*pb++);
-			case  6: *ps++ = (char)printable(*pb++);
-			case  5: *ps++ = (char)printable(*pb++);
-			case  4: *ps++ = (char)printable(*pb++);
-			case  3: *ps++ = (char)printable(*pb++);
-			case  2: *ps++ = (char)printable(*pb++);
-			case  1: *ps++ = (char)printable(*pb++);
-			}
+	if( pn->bInCollection != NOT_IN_COLLECTION )
+	{
+		node_assert( !"node_hash_retire: node is still in a collection" );
+		return;
+	}
 
-			l = 16-nChunk;
-			memset( ps, ' ', l );
-			ps += l;
-			
-			*ps++ = '\r'; 
-			*ps++ ='\n';
-			fwrite( acBuffer, ps-acBuffer, sizeof(*ps), pfOut );
+	hash_retire( pnHash, pn );
+}
 
-			nLength -= nChunk;
-			pbBase += nChunk;
-		}
+NODE_API void node_read_begin()
+{
+	read_begin();
+}
 
-		break;
+NODE_API void node_read_end()
+{
+	node_reader * pr = GetTLS()->pReader;
+	if( pr == NULL || pr->nDepth == 0 )
+	{
+		node_assert( !"node_read_end: no read section to end" );
+		return;
+	}
 
-	case NODE_LIST:
+	read_end( pr );
+}
 
-		fputs( "(\r\n", pfOut );
+/**************
+ Name Functions
+ **************/
 
-		/* increase the indentation */
-		pd->nSpaces += 2;
+/* set the name of a node */
+NODE_API void node_set_name_dbgA( const char * psFile, int nLine, node_t * pn, const char * psName)
+{
+	set_debug_allocator s(psFile, nLine);
+	node_set_nameA( pn, psName );
+}
 
-		/* for each element in the list, call node_dump */
-		for(pnElt = node_first(pn); pnElt != NULL; pnElt = node_next(pnElt))
-		{
-			node_dumpA_internal( pnElt, pd );
-		}
+NODE_API void node_set_nameA(node_t * pn, const char * psName)
+{
+	if( pn == NULL )
+	{
+		node_assert( pn != NULL );
+		return;
+	}
 
-		/* restore the previous level of indentation */
-		pd->nSpaces -= 2;
+	/* test psName for validity */
+	if(psName == NULL)
+	{
+		node_assert( psName != NULL );
+		node_error("Internal error: attempt to set a node name to NULL.\n");
+		return;
+	}
 
-		node_write_spacesA( pfOut, nSpaces );
+	node_set_nameA_internal( NODE_CACHE_CTX, pn, psName );
+}
 
-		fputs( ")\r\n", pfOut );
-		break;
+static int NODE_INTERNAL_FUNC node_set_nameA_internal( node_tls * ptls, node_t * pn, const char * psName )
+{
+	size_t cchName = strlen( psName );
+	return node_set_name_nA_internal( ptls, pn, psName, cchName, hash_key_nA( psName, cchName ) );
+}
 
-	case NODE_HASH:
+/* name pn after the first cchName characters of psName, which need not be terminated and hash to nHash */
+static int NODE_INTERNAL_FUNC node_set_name_nA_internal( node_tls * ptls, node_t * pn, const char * psName, size_t cchName, unsigned int nHash )
+{
+	/* if pn->psName is the same as the passed-in name, we're done */
+	if( NODE_NAMEA( pn ) == psName && strlen( psName ) == cchName )
+	{
+		return TRUE;
+	}
+	
+	int bIntern = node_bIntern;
 
-		/* HASH: write '{' and newline */
-		fputs( "{\r\n", pfOut );
+	/* copy psName first, so the old name survives a failure */
+	size_t cb = (cchName + 1) * sizeof(char);
+	char * psCopy = NULL;
+	if( bIntern )
+		psCopy = node_intern_nA( psName, cchName );
+	else if( (psCopy = (char *)node_bag_name_slot( pn, cb, sizeof(char) )) != NULL )
+	{
+		memcpy( psCopy, psName, cb - sizeof(char) );
+		psCopy[cchName] = 0;
+	}
+	else
+		psCopy = node_safe_copy_nA( GET_ARENA( pn ), psName, cchName );
+	if( psCopy == NULL )
+		return FALSE;
 
-		/* increase the indentation */
-		pd->nSpaces += 2;
-		
-		/* for each element in the hash, call node_dump */
-		if(pn->ppnHashHeads != NULL)
-		{
-			/* loop for 1..nHashBuckets */
-			for(int i=0; i < pn->nHashBuckets; i++)
-			{
-				for(pnElt = pn->ppnHashHeads[i];pnElt != NULL; pnElt = node_next(pnElt) )
-				{
-					/* call node_dump on each element of ppnHashHeads */
-					node_dumpA_internal( pnElt, pd );
-				}
+	/* if pn->psName is set, free it: an A name replaces a W one */
+	node_release_name( ptls, pn );
+	
+	pn->psAName = psCopy;
+	pn->bNameW = FALSE;
+	pn->bNameInterned = bIntern;
+	if( bIntern )
+	{
+		/* the table already hashed it */
+		pn->nHash = NAME_DNODE( psCopy )->dict_hash;
+		return TRUE;
+	}
 
-			}
-		} /* if pn->ppnHashHeads != NULL */
+	if( IN_BAG( pn, psCopy ) )
+	{
+		pn->bBagUsed = TRUE;
+		NODE_STAT_CTX( ptls, GET_ARENA( pn ), nBagHits++ );
+	}
+	else
+		NODE_STAT_CTX( ptls, GET_ARENA( pn ), cbStrings += cb );
+	pn->nHash = nHash;
+	
+	return TRUE;
+}
 
-		/* restore the previous level of indentation */
-		pd->nSpaces -= 2;
+/* set the name of a node */
+NODE_API void node_set_name_dbgW( const char * psFile, int nLine, node_t * pn, const wchar_t * psName)
+{
+	set_debug_allocator s(psFile, nLine);
 
-		node_write_spacesA( pfOut, nSpaces );
+	node_set_nameW( pn, psName );
+}
 
-		fputs( "}\r\n", pfOut );
-		break;
+NODE_API void node_set_nameW(node_t * pn, const wchar_t * psName)
+{
+	if( pn == NULL )
+	{
+		node_assert( pn != NULL );
+		return;
+	}
 
-	/* everything else */
-	default:
-		node_assert(!"Node type unknown in node_dump");	/* tried to dump node of unknown or invalid type */
+	/* test psName for validity */
+	if(psName == NULL)
+	{
+		node_assert( psName != NULL );
+		node_error("Internal error: attempt to set a node name to NULL.\n");
+		return;
 	}
-	
-	return;
+
+	node_set_nameW_internal( NODE_CACHE_CTX, pn, psName );
+
 }
 
-static inline void NODE_INTERNAL_FUNC node_write_spacesA( FILE * pfOut, int nSpaces )
+static int NODE_INTERNAL_FUNC node_set_nameW_internal( node_tls * ptls, node_t * pn, const wchar_t * psName )
 {
-	int nChunk = 0;
-	for( int n = nSpaces; n > 0; n -= nChunk )
+	size_t cchName = wcslen( psName );
+	return node_set_name_nW_internal( ptls, pn, psName, cchName, hash_key_nW( psName, cchName ) );
+}
+
+/* name pn after the first cchName characters of psName, which need not be terminated and hash to nHash */
+static int NODE_INTERNAL_FUNC node_set_name_nW_internal( node_tls * ptls, node_t * pn, const wchar_t * psName, size_t cchName, unsigned int nHash )
+{
+	/* if pn->psName is the same as the passed-in name, we're done */
+	if( NODE_NAMEW( pn ) == psName && wcslen( psName ) == cchName )
 	{
-		nChunk = __min( n, 16 );
-		fwrite( node_acSpaces, nChunk, 1, pfOut );
+		return TRUE;
+	}
+
+	int bIntern = node_bIntern;
+
+	/* copy psName first, so the old name survives a failure */
+	size_t cb = (cchName + 1) * sizeof(wchar_t);
+	wchar_t * psCopy = NULL;
+	if( bIntern )
+		psCopy = node_intern_nW( psName, cchName );
+	else if( (psCopy = (wchar_t *)node_bag_name_slot( pn, cb, sizeof(wchar_t) )) != NULL )
+	{
+		memcpy( psCopy, psName, cb - sizeof(wchar_t) );
+		psCopy[cchName] = 0;
+	}
+	else
+		psCopy = node_safe_copy_nW( GET_ARENA( pn ), psName, cchName );
+	if( psCopy == NULL )
+		return FALSE;
+
+	/* if pn->psName is set, free it: a W name replaces an A one */
+	node_release_name( ptls, pn );
+
+	pn->psWName = psCopy;
+	pn->bNameW = TRUE;
+	pn->bNameInterned = bIntern;
+	if( bIntern )
+	{
+		/* the table already hashed it */
+		pn->nHash = NAME_DNODE( psCopy )->dict_hash;
+		return TRUE;
+	}
+
+	if( IN_BAG( pn, psCopy ) )
+	{
+		pn->bBagUsed = TRUE;
+		NODE_STAT_CTX( ptls, GET_ARENA( pn ), nBagHits++ );
+	}
+	else
+		NODE_STAT_CTX( ptls, GET_ARENA( pn ), cbStrings += cb );
+	pn->nHash = nHash;
+
+	return TRUE;
+}
+
+/* free a node's name, or drop its reference to the interned one */
+static void NODE_INTERNAL_FUNC node_release_name( node_tls * ptls, node_t * pn )
+{
+	if( pn->psAName == NULL )
+		return;
+
+	if( pn->bNameInterned )
+	{
+		node_intern_release( pn->bNameW ? node_pdictNamesW : node_pdictNamesA, pn->psAName );
+	}
+	else if( !IN_BAG( pn, pn->psAName ) )
+	{
+		NODE_STAT_CTX( ptls, GET_ARENA( pn ), cbStrings -= pn->bNameW ? (wcslen( pn->psWName ) + 1) * sizeof(wchar_t) : strlen( pn->psAName ) + 1 );
+		nfree( GET_ARENA( pn ), pn->psAName );
+	}
+	else
+	{
+		pn->psAName = NULL;
+		pn->bBagUsed = ( node_bag_value_size( pn ) != 0 );
+	}
+	pn->psAName = NULL;
+	pn->bNameW = FALSE;
+	pn->bNameInterned = FALSE;
+}
+
+/* get the name of node */
+NODE_API NODE_CONSTOUT char * node_get_nameA( const node_t * pn )
+{
+	if( pn == NULL )
+	{
+		node_assert( pn != NULL );
+		return NULL;
+	}
+
+	return NODE_NAMEA( pn );
+}
+
+NODE_API NODE_CONSTOUT wchar_t * node_get_nameW( const node_t * pn)
+{
+	if( pn == NULL )
+	{
+		node_assert( pn != NULL );
+		return NULL;
 	}
+
+	return NODE_NAMEW( pn );
 }
 
+/*****************************
+ Dumping and Parsing Functions
+ *****************************/
+
 /* dump the node to a file */
-NODE_API void node_dumpW( const node_t * pn, FILE * pfOut, int nOptions )
+NODE_API void node_dumpA( const node_t * pn, FILE * pfOut, int nOptions )
+{
+	node_dump_ctxA( node_get_ctx(), pn, pfOut, nOptions );
+}
+
+NODE_API void node_dump_ctxA( node_ctx_t ctx, const node_t * pn, FILE * pfOut, int nOptions )
 {
 	if( pn == NULL || pfOut == NULL )
 	{
 		node_assert( pn != NULL );
-		node_assert( pfOut != NULL );
+		node_assert( pfOut != NULL );	
 		return;
 	}
 
@@ -2649,168 +3930,157 @@ NODE_API void node_dumpW( const node_t * pn, FILE * pfOut, int nOptions )
 	d.pfOut = pfOut;
 	d.nOptions = nOptions;
 	d.nSpaces = 0;
+	d.nCodePage = node_ctx_tls( ctx )->nCodePage;
 
-	node_dumpW_internal( pn, &d );
+	node_dumpA_internal( pn, &d );
 
 	fflush( pfOut );
 }
 
-
-static void NODE_INTERNAL_FUNC node_dumpW_internal( const node_t * pn, struct node_dump * pd )
+static void NODE_INTERNAL_FUNC node_dumpA_internal( const node_t * pn, struct node_dump * pd )
 {
-	int i;
 	node_t * pnElt;
 	float fTemp;
-	wchar_t * psEscaped = NULL;
+	char * psName = NULL;
+	char * psValue = NULL;
+	const char * psText = NULL;
 
-	data_t * pbBase;
-	int nLength;
+	data_t * pbBase = NULL;
+	size_t nLength = 0;
 
-	FILE * pfOut = pd->pfOut;
-	int nSpaces = pd->nSpaces;
 	int nOptions = pd->nOptions;
-	node_arena * pArena = pn->pArena;
-
-	/* write node_nSpaces spaces */
-	node_write_spacesW( pfOut, nSpaces );
+	int nSpaces = pd->nSpaces;
+	FILE * pfOut = pd->pfOut;
+	node_arena * pArena = GET_ARENA( pn );
 
-	/* write the name (if any) */
-	if( pn->psAName != NULL && pn->psWName == NULL )
+	/* convert and escape the name and a string value before writing anything, so that running
+	   out of memory stops the dump between records instead of writing a truncated one */
+	if( NODE_NAMEW( pn ) != NULL )
 	{
-		wchar_t * psW = AToW( pArena, pn->psAName );
-		psEscaped = node_escapeW( pArena, psW );
-		nfree( pArena, psW );
-
-		fputws( psEscaped, pfOut );
-		nfree( pArena, psEscaped );
-		psEscaped = NULL;
-
+		char *psA = WToA( pArena, pn->psWName, wcslen( pn->psWName ), pd->nCodePage );
+		psName = psA != NULL ? node_escapeA( pArena, psA ) : NULL;
+		nfree( pArena, psA );
+		if( psName == NULL )
+			goto NOMEM;
+	}
+	else if( pn->psAName != NULL )
+	{
+		psName = node_escapeA( pArena, pn->psAName );
+		if( psName == NULL )
+			goto NOMEM;
 	}
-	else if( pn->psWName != NULL)
+
+	if( pn->nType == NODE_STRINGA || pn->nType == NODE_STRINGW )
 	{
-		psEscaped = node_escapeW( pArena, pn->psWName );
-		fputws( psEscaped, pfOut );
-		nfree( pArena,  psEscaped );
-		psEscaped = NULL;
+		/* TODO: maybe warn if data lost through conversion */
+		psText = pn->psAValue;
+		if( psText == NULL )
+		{
+			psText = psValue = WToA( pArena, pn->psWValue, wcslen( pn->psWValue ), pd->nCodePage );
+			if( psValue == NULL )
+				goto NOMEM;
+		}
+
+		if( !( nOptions & DO_NOESCAPE ) )
+		{
+			char * psEscaped = node_escapeA( pArena, psText );
+			nfree( pArena, psValue );
+			psText = psValue = psEscaped;
+			if( psValue == NULL )
+				goto NOMEM;
+		}
 	}
 
+	/* write spaces */
+	node_write_spacesA( pfOut, nSpaces );
+
+	/* write the name (if any) */
+	if( psName != NULL )
+		fputs( psName, pfOut );
+
 	/* write ':' */
-	fputws( L": ", pfOut );
+	fputs( ": ",  pfOut );
 	
 	switch( pn->nType )
 	{
 	case NODE_INT:
-		fwprintf( pfOut, L"%d  (0x%08X)\r\n", pn->nValue, pn->nValue );
+		fprintf( pfOut, "%d  (0x%08X)\r\n", pn->nValue, pn->nValue );
 		break;
 
 	case NODE_INT64:
-		fwprintf( pfOut, L"%I64dL  (0x%016I64X)\r\n", pn->n64Value, pn->n64Value );
+		fprintf( pfOut, "%I64dL  (0x%016I64X)\r\n", pn->n64Value, pn->n64Value );
 		break;
 
 	case NODE_REAL:
 		fTemp = (float)pn->dfValue;
-		fwprintf( pfOut, L"%f  (0x%08X)\r\n", pn->dfValue, *((int*)&fTemp) );
-		break;
-
-	case NODE_STRINGA:
-		{
-			wchar_t * psW = NULL;
-
-			if( pn->psWValue == NULL )
-				psW = AToW( pArena, pn->psAValue );
-			else
-				psW = pn->psWValue;
-
-			if( nOptions & DO_NOESCAPE )
-			{
-				fwprintf( pfOut, L"\"%s\"\r\n", psW );
-			}
-			else
-			{
-				psEscaped = node_escapeW( pArena, psW );
-				fwprintf( pfOut, L"'%s'\r\n", psEscaped );
-				nfree( pArena, psEscaped );
-			}
-
-			if( pn->psWValue == NULL )
-				nfree( pArena, psW );
-		}
+		fprintf( pfOut, "%f  (0x%08X)\r\n", pn->dfValue, *((int*)&fTemp) );
 		break;
 
 	case NODE_STRINGW:
-		if( nOptions & DO_NOESCAPE )
-		{
-			fwprintf( pfOut, L"\"%s\"\r\n", pn->psWValue );
-		}
-		else
-		{
-			psEscaped = node_escapeW( pArena, pn->psWValue );
-			fwprintf( pfOut, L"'%s'\r\n", psEscaped );
-			nfree( pArena, psEscaped );
-		}
+	case NODE_STRINGA:
+		fprintf( pfOut, ( nOptions & DO_NOESCAPE ) ? "\"%s\"\r\n" : "'%s'\r\n", psText );
 		break;
 
 	case NODE_PTR:
 		/* dump out the pointer value */
-		fwprintf( pfOut, L"PTR 0x%p\r\n", pn->pvValue );
+		fprintf( pfOut, "PTR 0x%p\r\n", pn->pvValue );
 		break;
 
 	case NODE_DATA:
 		/* DATA: write 'DATA ', the data length, and a newline, 
 		   then write a hex dump of the data like this:
 		   $ 00 00 00 00 00 00 00 00  00 00 00 00 00 00 00 00 ................ */
-		fwprintf(pfOut, L"DATA %d\r\n", pn->nDataLength );
-		
+		fprintf(pfOut, "DATA %d\r\n", pn->nDataLength );
 		pbBase = pn->pbValue;
 		nLength = pn->nDataLength;
 		
 		/* 16 bytes per line AND remainder */
 		while( nLength > 0 )
 		{
-			wchar_t acBuffer[80];
-			wchar_t * ps = acBuffer;
-			int l, i;
+			char acBuffer[80];
+			char * ps = acBuffer;
+			size_t l;
 			data_t * pb;
 			
-			int nChunk = __min( 16, nLength );
+			size_t nChunk = __min( 16, nLength );
 
 			/* a dollar for every row... */
 			*ps++ = '$';
 
 			pb = pbBase;
-			int nSmallChunk = __min( 8, nChunk );
+			size_t nSmallChunk = __min( 8, nChunk );
 			switch( nSmallChunk )
 			{
-			case  8: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  7: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  6: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  5: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  4: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  3: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  2: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  1: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  8: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  7: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  6: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  5: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  4: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  3: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  2: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  1: *ps++ = ' '; byte_to_strA( ps, *pb++ );
 			}
 			l = 3 * (8-nSmallChunk) + 1;
-			for( i = 0; i <l; i++ )
-				*ps++ = L' ';
+			memset( ps, ' ', l );
+			ps += l;
 
 			nSmallChunk = nChunk - nSmallChunk;
 			switch( nSmallChunk )
 			{
-			case  8: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  7: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  6: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  5: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  4: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  3: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  2: *ps++ = ' '; byte_to_strW( ps, *pb++ );
-			case  1: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  8: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  7: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  6: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  5: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  4: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  3: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  2: *ps++ = ' '; byte_to_strA( ps, *pb++ );
+			case  1: *ps++ = ' '; byte_to_strA( ps, *pb++ );
 			}
 
 			/* add the spaces */
 			l = 3 * (8-nSmallChunk);
-			for( i = 0; i <l; i++ )
-				*ps++ = L' ';
+			memset( ps, ' ', l );
+			ps += l;
 
 			/* add some spaces between the hex and character info */
 			*ps++ = ' '; *ps++ = ' '; *ps++ = ' ';
@@ -2819,27 +4089,27 @@ static void NODE_INTERNAL_FUNC node_dumpW_internal( const node_t * pn, struct no
 			pb = pbBase;
 			switch( nChunk )
 			{
-			case 16: *ps++ = (wchar_t)printable(*pb++);
-			case 15: *ps++ = (wchar_t)printable(*pb++);
-			case 14: *ps++ = (wchar_t)printable(*pb++);
-			case 13: *ps++ = (wchar_t)printable(*pb++);
-			case 12: *ps++ = (wchar_t)printable(*pb++);
-			case 11: *ps++ = (wchar_t)printable(*pb++);
-			case 10: *ps++ = (wchar_t)printable(*pb++);
-			case  9: *ps++ = (wchar_t)printable(*pb++);
-			case  8: *ps++ = (wchar_t)printable(*pb++);
-			case  7: *ps++ = (wchar_t)printable(*pb++);
-			case  6: *ps++ = (wchar_t)printable(*pb++);
-			case  5: *ps++ = (wchar_t)printable(*pb++);
-			case  4: *ps++ = (wchar_t)printable(*pb++);
-			case  3: *ps++ = (wchar_t)printable(*pb++);
-			case  2: *ps++ = (wchar_t)printable(*pb++);
-			case  1: *ps++ = (wchar_t)printable(*pb++);
+			case 16: *ps++ = (char)printable(*pb++);
+			case 15: *ps++ = (char)printable(*pb++);
+			case 14: *ps++ = (char)printable(*pb++);
+			case 13: *ps++ = (char)printable(*pb++);
+			case 12: *ps++ = (char)printable(*pb++);
+			case 11: *ps++ = (char)printable(*pb++);
+			case 10: *ps++ = (char)printable(*pb++);
+			case  9: *ps++ = (char)printable(*pb++);
+			case  8: *ps++ = (char)printable(*pb++);
+			case  7: *ps++ = (char)printable(*pb++);
+			case  6: *ps++ = (char)printable(*pb++);
+			case  5: *ps++ = (char)printable(*pb++);
+			case  4: *ps++ = (char)printable(*pb++);
+			case  3: *ps++ = (char)printable(*pb++);
+			case  2: *ps++ = (char)printable(*pb++);
+			case  1: *ps++ = (char)printable(*pb++);
 			}
 
 			l = 16-nChunk;
-			for( i = 0; i <l; i++ )
-				*ps++ = L' ';
+			memset( ps, ' ', l );
+			ps += l;
 			
 			*ps++ = '\r'; 
 			*ps++ ='\n';
@@ -2853,2205 +4123,4593 @@ static void NODE_INTERNAL_FUNC node_dumpW_internal( const node_t * pn, struct no
 
 	case NODE_LIST:
 
-		fputws( L"(\r\n", pfOut );
+		fputs( "(\r\n", pfOut );
 
 		/* increase the indentation */
 		pd->nSpaces += 2;
 
 		/* for each element in the list, call node_dump */
-		for(pnElt = node_first(pn); pnElt != NULL; pnElt = node_next(pnElt))
+		for(pnElt = node_first(pn); pnElt != NULL && !pd->bNoMem; pnElt = node_next(pnElt))
 		{
-			node_dumpW_internal( pnElt, pd );
+			node_dumpA_internal( pnElt, pd );
 		}
 
 		/* restore the previous level of indentation */
 		pd->nSpaces -= 2;
+		if( pd->bNoMem )
+			break;
 
-		node_write_spacesW( pfOut, nSpaces );
+		node_write_spacesA( pfOut, nSpaces );
 
-		fputws( L")\r\n", pfOut );
+		fputs( ")\r\n", pfOut );
 		break;
 
 	case NODE_HASH:
 
 		/* HASH: write '{' and newline */
-		fputws( L"{\r\n", pfOut );
+		fputs( "{\r\n", pfOut );
 
 		/* increase the indentation */
 		pd->nSpaces += 2;
 		
 		/* for each element in the hash, call node_dump */
-		if(pn->ppnHashHeads != NULL)
 		{
-			/* loop for 1..nHashBuckets */
-			for(i=0; i < pn->nHashBuckets; i++)
+			hash_iter it( pn );
+			node_t * pnElement;
+			while( !pd->bNoMem && ( pnElement = it.next() ) != NULL )
 			{
-				for(pnElt = pn->ppnHashHeads[i];pnElt != NULL; pnElt = node_next(pnElt) )
-				{
-					/* call node_dump on each element of ppnHashHeads */
-					node_dumpW_internal( pnElt, pd );
-				}
-
+				/* call node_dump on each element */
+				node_dumpA_internal( pnElement, pd );
 			}
-		} /* if pn->ppnHashHeads != NULL */
+		}
 
 		/* restore the previous level of indentation */
 		pd->nSpaces -= 2;
+		if( pd->bNoMem )
+			break;
 
-		node_write_spacesW( pfOut, nSpaces );
+		node_write_spacesA( pfOut, nSpaces );
 
-		fputws( L"}\r\n", pfOut );
+		fputs( "}\r\n", pfOut );
 		break;
 
 	/* everything else */
 	default:
 		node_assert(!"Node type unknown in node_dump");	/* tried to dump node of unknown or invalid type */
 	}
-	
+
+	nfree( pArena, psName );
+	nfree( pArena, psValue );
+	return;
+
+NOMEM:
+	node_fail( NODE_ERROR_MEMORY );
+	pd->bNoMem = TRUE;
+	nfree( pArena, psName );
 	return;
 }
 
-static inline void NODE_INTERNAL_FUNC node_write_spacesW( FILE * pfOut, int nSpaces )
+static inline void NODE_INTERNAL_FUNC node_write_spacesA( FILE * pfOut, int nSpaces )
 {
 	int nChunk = 0;
 	for( int n = nSpaces; n > 0; n -= nChunk )
 	{
 		nChunk = __min( n, 16 );
-		fwrite( node_wcSpaces, nChunk, sizeof(wchar_t), pfOut );
+		fwrite( node_acSpaces, nChunk, 1, pfOut );
 	}
 }
 
+/* dump the node to a file */
+NODE_API void node_dumpW( const node_t * pn, FILE * pfOut, int nOptions )
+{
+	node_dump_ctxW( node_get_ctx(), pn, pfOut, nOptions );
+}
 
-/*********************************************
- Node Parsing Helper Classes - Implementations
- *********************************************/
-
-/* get A or W lines from a file */
-class NodeFileReader : public NodeReader
+NODE_API void node_dump_ctxW( node_ctx_t ctx, const node_t * pn, FILE * pfOut, int nOptions )
 {
-	FILE * m_pfIn;
-public:
-	NodeFileReader( FILE * pfIn, node_arena * pArena ) : NodeReader(pArena), m_pfIn(pfIn)  {}
-	void read_lineA( const char ** psStart, const char ** ppsEnd ) 
-	{ 
-		char * psEnd;
-		char * psLine = ::read_lineA( m_pArena, m_pfIn, &psEnd ); 
-		*psStart = psLine;
-		*ppsEnd = psEnd;
-	}
-	void read_lineW( const wchar_t ** psStart, const wchar_t ** ppsEnd ) 
-	{ 
-		wchar_t * psEnd;
-		wchar_t * psLine = ::read_lineW( m_pArena, m_pfIn, &psEnd ); 
-		*psStart = psLine; 
-		*ppsEnd = psEnd; 
+	if( pn == NULL || pfOut == NULL )
+	{
+		node_assert( pn != NULL );
+		node_assert( pfOut != NULL );
+		return;
 	}
-	void free_line( const void * psLine ) { nfree( m_pArena, (void*)psLine ); }
-};
 
-/* get A lines from an A string */
-class NodeStringAReader : public NodeReader
+	struct node_dump d = {0};
+	d.pfOut = pfOut;
+	d.nOptions = nOptions;
+	d.nSpaces = 0;
+	d.nCodePage = node_ctx_tls( ctx )->nCodePage;
+
+	node_dumpW_internal( pn, &d );
+
+	fflush( pfOut );
+}
+
+
+static void NODE_INTERNAL_FUNC node_dumpW_internal( const node_t * pn, struct node_dump * pd )
 {
-	const char * m_psAOrig;
-	const char * m_psA;
-	const char * m_psAEnd;
-public:
-	/* construct from zero-terminated string: copy */
-	NodeStringAReader( struct node_arena * p, const char * psA ) : ::NodeReader(p) { m_psAOrig = m_psA = psA; m_psAEnd = m_psAOrig + strlen(m_psAOrig); }
-	NodeStringAReader( struct node_arena * p, const char * psA, size_t nChars ) : ::NodeReader(p) 
+	node_t * pnElt;
+	float fTemp;
+	wchar_t * psName = NULL;
+	wchar_t * psValue = NULL;
+	const wchar_t * psText = NULL;
+
+	data_t * pbBase;
+	int nLength;
+
+	FILE * pfOut = pd->pfOut;
+	int nSpaces = pd->nSpaces;
+	int nOptions = pd->nOptions;
+	node_arena * pArena = GET_ARENA( pn );
+
+	/* everything that can run out of memory comes first, as in node_dumpA_internal */
+	if( NODE_NAMEA( pn ) != NULL )
 	{
-		m_psAOrig = m_psA = psA;
-		m_psAEnd = m_psA + nChars;
+		wchar_t * psW = AToW( pArena, pn->psAName, strlen( pn->psAName ), pd->nCodePage );
+		psName = psW != NULL ? node_escapeW( pArena, psW ) : NULL;
+		nfree( pArena, psW );
+		if( psName == NULL )
+			goto NOMEM;
+	}
+	else if( pn->psWName != NULL )
+	{
+		psName = node_escapeW( pArena, pn->psWName );
+		if( psName == NULL )
+			goto NOMEM;
 	}
-	~NodeStringAReader() { }
 
-	void read_lineA( const char ** ppsStart, const char ** ppsEnd ) 
-	{ 
-		const char * psStart = NULL;
-		const char * psEnd = NULL;
-		
-		if( m_psA < m_psAEnd )
+	if( pn->nType == NODE_STRINGA || pn->nType == NODE_STRINGW )
+	{
+		psText = pn->psWValue;
+		if( psText == NULL )
 		{
-			psStart = m_psA;
-
-			for( psEnd = psStart; psEnd < m_psAEnd; ++psEnd )
-				if( *psEnd == '\n' )
-					break;
-			m_psA = psEnd+1;
+			psText = psValue = AToW( pArena, pn->psAValue, strlen( pn->psAValue ), pd->nCodePage );
+			if( psValue == NULL )
+				goto NOMEM;
 		}
 
-		*ppsStart = psStart;
-		*ppsEnd = psEnd;
+		if( !( nOptions & DO_NOESCAPE ) )
+		{
+			wchar_t * psEscaped = node_escapeW( pArena, psText );
+			nfree( pArena, psValue );
+			psText = psValue = psEscaped;
+			if( psValue == NULL )
+				goto NOMEM;
+		}
 	}
-	void read_lineW( const wchar_t ** ppsStart, const wchar_t ** ppsEnd ) { node_assert(!"NodeStringAReader::read_lineW() is not defined."); *ppsStart = *ppsEnd = NULL; }
 
-	/* free_line is a no-op because the line was not independently allocated */
-	void free_line( const void * psLine ) { psLine = psLine; }
-};
+	/* write node_nSpaces spaces */
+	node_write_spacesW( pfOut, nSpaces );
 
-/* get W lines from a W string */
-class NodeStringWReader : public NodeReader
+	/* write the name (if any) */
+	if( psName != NULL )
+		fputws( psName, pfOut );
+
+	/* write ':' */
+	fputws( L": ", pfOut );
+	
+	switch( pn->nType )
+	{
+	case NODE_INT:
+		fwprintf( pfOut, L"%d  (0x%08X)\r\n", pn->nValue, pn->nValue );
+		break;
+
+	case NODE_INT64:
+		fwprintf( pfOut, L"%I64dL  (0x%016I64X)\r\n", pn->n64Value, pn->n64Value );
+		break;
+
+	case NODE_REAL:
+		fTemp = (float)pn->dfValue;
+		fwprintf( pfOut, L"%f  (0x%08X)\r\n", pn->dfValue, *((int*)&fTemp) );
+		break;
+
+	case NODE_STRINGA:
+	case NODE_STRINGW:
+		fwprintf( pfOut, ( nOptions & DO_NOESCAPE ) ? L"\"%s\"\r\n" : L"'%s'\r\n", psText );
+		break;
+
+	case NODE_PTR:
+		/* dump out the pointer value */
+		fwprintf( pfOut, L"PTR 0x%p\r\n", pn->pvValue );
+		break;
+
+	case NODE_DATA:
+		/* DATA: write 'DATA ', the data length, and a newline, 
+		   then write a hex dump of the data like this:
+		   $ 00 00 00 00 00 00 00 00  00 00 00 00 00 00 00 00 ................ */
+		fwprintf(pfOut, L"DATA %d\r\n", pn->nDataLength );
+		
+		pbBase = pn->pbValue;
+		nLength = pn->nDataLength;
+		
+		/* 16 bytes per line AND remainder */
+		while( nLength > 0 )
+		{
+			wchar_t acBuffer[80];
+			wchar_t * ps = acBuffer;
+			int l, i;
+			data_t * pb;
+			
+			int nChunk = __min( 16, nLength );
+
+			/* a dollar for every row... */
+			*ps++ = '$';
+
+			pb = pbBase;
+			int nSmallChunk = __min( 8, nChunk );
+			switch( nSmallChunk )
+			{
+			case  8: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  7: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  6: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  5: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  4: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  3: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  2: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  1: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			}
+			l = 3 * (8-nSmallChunk) + 1;
+			for( i = 0; i <l; i++ )
+				*ps++ = L' ';
+
+			nSmallChunk = nChunk - nSmallChunk;
+			switch( nSmallChunk )
+			{
+			case  8: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  7: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  6: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  5: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  4: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  3: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  2: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			case  1: *ps++ = ' '; byte_to_strW( ps, *pb++ );
+			}
+
+			/* add the spaces */
+			l = 3 * (8-nSmallChunk);
+			for( i = 0; i <l; i++ )
+				*ps++ = L' ';
+
+			/* add some spaces between the hex and character info */
+			*ps++ = ' '; *ps++ = ' '; *ps++ = ' ';
+
+			/* now output the character values for the row */
+			pb = pbBase;
+			switch( nChunk )
+			{
+			case 16: *ps++ = (wchar_t)printable(*pb++);
+			case 15: *ps++ = (wchar_t)printable(*pb++);
+			case 14: *ps++ = (wchar_t)printable(*pb++);
+			case 13: *ps++ = (wchar_t)printable(*pb++);
+			case 12: *ps++ = (wchar_t)printable(*pb++);
+			case 11: *ps++ = (wchar_t)printable(*pb++);
+			case 10: *ps++ = (wchar_t)printable(*pb++);
+			case  9: *ps++ = (wchar_t)printable(*pb++);
+			case  8: *ps++ = (wchar_t)printable(*pb++);
+			case  7: *ps++ = (wchar_t)printable(*pb++);
+			case  6: *ps++ = (wchar_t)printable(*pb++);
+			case  5: *ps++ = (wchar_t)printable(*pb++);
+			case  4: *ps++ = (wchar_t)printable(*pb++);
+			case  3: *ps++ = (wchar_t)printable(*pb++);
+			case  2: *ps++ = (wchar_t)printable(*pb++);
+			case  1: *ps++ = (wchar_t)printable(*pb++);
+			}
+
+			l = 16-nChunk;
+			for( i = 0; i <l; i++ )
+				*ps++ = L' ';
+			
+			*ps++ = '\r'; 
+			*ps++ ='\n';
+			fwrite( acBuffer, ps-acBuffer, sizeof(*ps), pfOut );
+
+			nLength -= nChunk;
+			pbBase += nChunk;
+		}
+
+		break;
+
+	case NODE_LIST:
+
+		fputws( L"(\r\n", pfOut );
+
+		/* increase the indentation */
+		pd->nSpaces += 2;
+
+		/* for each element in the list, call node_dump */
+		for(pnElt = node_first(pn); pnElt != NULL && !pd->bNoMem; pnElt = node_next(pnElt))
+		{
+			node_dumpW_internal( pnElt, pd );
+		}
+
+		/* restore the previous level of indentation */
+		pd->nSpaces -= 2;
+		if( pd->bNoMem )
+			break;
+
+		node_write_spacesW( pfOut, nSpaces );
+
+		fputws( L")\r\n", pfOut );
+		break;
+
+	case NODE_HASH:
+
+		/* HASH: write '{' and newline */
+		fputws( L"{\r\n", pfOut );
+
+		/* increase the indentation */
+		pd->nSpaces += 2;
+		
+		/* for each element in the hash, call node_dump */
+		{
+			hash_iter it( pn );
+			node_t * pnElement;
+			while( !pd->bNoMem && ( pnElement = it.next() ) != NULL )
+			{
+				/* call node_dump on each element */
+				node_dumpW_internal( pnElement, pd );
+			}
+		}
+
+		/* restore the previous level of indentation */
+		pd->nSpaces -= 2;
+		if( pd->bNoMem )
+			break;
+
+		node_write_spacesW( pfOut, nSpaces );
+
+		fputws( L"}\r\n", pfOut );
+		break;
+
+	/* everything else */
+	default:
+		node_assert(!"Node type unknown in node_dump");	/* tried to dump node of unknown or invalid type */
+	}
+
+	nfree( pArena, psName );
+	nfree( pArena, psValue );
+	return;
+
+NOMEM:
+	node_fail( NODE_ERROR_MEMORY );
+	pd->bNoMem = TRUE;
+	nfree( pArena, psName );
+	return;
+}
+
+static inline void NODE_INTERNAL_FUNC node_write_spacesW( FILE * pfOut, int nSpaces )
 {
-	const wchar_t * m_psWOrig;
-	const wchar_t * m_psW;
-	const wchar_t * m_psWEnd;
+	int nChunk = 0;
+	for( int n = nSpaces; n > 0; n -= nChunk )
+	{
+		nChunk = __min( n, 16 );
+		fwrite( node_wcSpaces, nChunk, sizeof(wchar_t), pfOut );
+	}
+}
+
+
+/*********************************************
+ Node Parsing Helper Classes - Implementations
+ *********************************************/
+
+/* get A or W lines from a file */
+class NodeFileReader : public NodeReader
+{
+	FILE * m_pfIn;
+public:
+	NodeFileReader( FILE * pfIn, node_arena * pArena ) : NodeReader(pArena), m_pfIn(pfIn)  {}
+	void read_lineA( const char ** psStart, const char ** ppsEnd ) 
+	{ 
+		char * psEnd;
+		char * psLine = ::read_lineA( m_pArena, m_pfIn, &psEnd ); 
+		if( psLine == NULL && !feof( m_pfIn ) )
+			m_bNoMem = TRUE;
+		*psStart = psLine;
+		*ppsEnd = psEnd;
+	}
+	void read_lineW( const wchar_t ** psStart, const wchar_t ** ppsEnd ) 
+	{ 
+		wchar_t * psEnd;
+		wchar_t * psLine = ::read_lineW( m_pArena, m_pfIn, &psEnd ); 
+		if( psLine == NULL && !feof( m_pfIn ) )
+			m_bNoMem = TRUE;
+		*psStart = psLine; 
+		*ppsEnd = psEnd; 
+	}
+	void free_line( const void * psLine ) { nfree( m_pArena, (void*)psLine ); }
+};
+
+/* get A lines from an A string */
+class NodeStringAReader : public NodeReader
+{
+	const char * m_psAOrig;
+	const char * m_psA;
+	const char * m_psAEnd;
 public:
 	/* construct from zero-terminated string: copy */
-	NodeStringWReader( struct node_arena * p, const wchar_t * psW ) : ::NodeReader(p) { m_psWOrig = m_psW = psW; m_psWEnd = m_psW + wcslen( m_psW ); }
-	NodeStringWReader( struct node_arena * p, const wchar_t * psW, size_t nChars ) : ::NodeReader(p)
+	NodeStringAReader( struct node_arena * p, const char * psA, node_tls * ptls = NODE_CACHE_CTX ) : ::NodeReader(p, ptls) { m_psAOrig = m_psA = psA; m_psAEnd = m_psAOrig + strlen(m_psAOrig); }
+	NodeStringAReader( struct node_arena * p, const char * psA, size_t nChars ) : ::NodeReader(p) 
+	{
+		m_psAOrig = m_psA = psA;
+		m_psAEnd = m_psA + nChars;
+	}
+	~NodeStringAReader() { }
+
+	void read_lineA( const char ** ppsStart, const char ** ppsEnd ) 
 	{ 
-		m_psWOrig = m_psW = psW;
-		m_psWEnd = m_psW + nChars;
+		const char * psStart = NULL;
+		const char * psEnd = NULL;
+		
+		if( m_psA < m_psAEnd )
+		{
+			psStart = m_psA;
+
+			for( psEnd = psStart; psEnd < m_psAEnd; ++psEnd )
+				if( *psEnd == '\n' )
+					break;
+			m_psA = psEnd+1;
+		}
+
+		*ppsStart = psStart;
+		*ppsEnd = psEnd;
+	}
+	void read_lineW( const wchar_t ** ppsStart, const wchar_t ** ppsEnd ) { node_assert(!"NodeStringAReader::read_lineW() is not defined."); *ppsStart = *ppsEnd = NULL; }
+
+	/* free_line is a no-op because the line was not independently allocated */
+	void free_line( const void * psLine ) { psLine = psLine; }
+};
+
+/* get W lines from a W string */
+class NodeStringWReader : public NodeReader
+{
+	const wchar_t * m_psWOrig;
+	const wchar_t * m_psW;
+	const wchar_t * m_psWEnd;
+public:
+	/* construct from zero-terminated string: copy */
+	NodeStringWReader( struct node_arena * p, const wchar_t * psW, node_tls * ptls = NODE_CACHE_CTX ) : ::NodeReader(p, ptls) { m_psWOrig = m_psW = psW; m_psWEnd = m_psW + wcslen( m_psW ); }
+	NodeStringWReader( struct node_arena * p, const wchar_t * psW, size_t nChars ) : ::NodeReader(p)
+	{ 
+		m_psWOrig = m_psW = psW;
+		m_psWEnd = m_psW + nChars;
 	}
 	~NodeStringWReader() {  }
 
-	void read_lineW( const wchar_t ** ppsStart, const wchar_t ** ppsEnd ) 
-	{ 
-		const wchar_t * psStart = NULL;
-		const wchar_t * psEnd = NULL;
-		
-		if( m_psW < m_psWEnd )
-		{
-			psStart = m_psW;
+	void read_lineW( const wchar_t ** ppsStart, const wchar_t ** ppsEnd ) 
+	{ 
+		const wchar_t * psStart = NULL;
+		const wchar_t * psEnd = NULL;
+		
+		if( m_psW < m_psWEnd )
+		{
+			psStart = m_psW;
+
+			for( psEnd = psStart; psEnd < m_psWEnd; ++psEnd )
+				if( *psEnd == '\n' )
+					break;
+				
+			m_psW = psEnd+1;
+		}
+
+		*ppsStart = psStart;
+		*ppsEnd = psEnd;
+	}
+	void read_lineA( const char **, const char ** ) { node_assert(!"NodeStringWReader:read_lineA() is not defined."); }
+
+	/* free_line is a no-op because the line was not independently allocated */
+	void free_line( const void * psLine ) { psLine = psLine; }
+};
+
+
+/***************************
+ Parsing Interface Functions
+ ***************************/
+
+NODE_API int node_parseA( FILE * pfIn, node_t ** ppn )
+{
+	if( pfIn == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	return node_parse_internal( pfIn, ppn, NODE_A );
+}
+
+NODE_API int node_parse_dbgA( const char * psFile, int nLine, FILE * pfIn, node_t ** ppn )
+{
+	set_debug_allocator s(psFile, nLine);
+
+	if( pfIn == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	return node_parse_internal( pfIn, ppn, NODE_A );
+}
+
+NODE_API int node_parseW( FILE * pfIn, node_t ** ppn )
+{
+	if( pfIn == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	return node_parse_internal( pfIn, ppn, NODE_W );
+}
+
+NODE_API int node_parse_dbgW( const char * psFile, int nLine, FILE * pfIn, node_t ** ppn )
+{
+	set_debug_allocator s(psFile, nLine);
+
+	if( pfIn == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	return node_parse_internal( pfIn, ppn, NODE_W );
+}
+
+NODE_API int node_parse_from_stringA( const char * ps, node_t ** ppn )
+{
+	return node_parse_from_string_ctxA( node_get_ctx(), ps, ppn );
+}
+
+NODE_API int node_parse_from_string_ctxA( node_ctx_t ctx, const char * ps, node_t ** ppn )
+{
+	if( ps == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	node_tls * ptls = node_ctx_tls( ctx );
+	NodeStringAReader nr( ptls->pArena, ps, ptls );
+	return node_parse_internalA( &nr, ppn, NODE_A );
+}
+
+NODE_API int node_parse_from_string_dbgA( const char * psFile, int nLine, const char * ps, node_t ** ppn )
+{
+	set_debug_allocator s(psFile, nLine);
+
+	if( ps == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	NodeStringAReader nr( node_pArena, ps );
+	return node_parse_internalA( &nr, ppn, NODE_A );
+}
+
+NODE_API int node_parse_from_stringW( const wchar_t * ps, node_t ** ppn )
+{
+	return node_parse_from_string_ctxW( node_get_ctx(), ps, ppn );
+}
+
+NODE_API int node_parse_from_string_ctxW( node_ctx_t ctx, const wchar_t * ps, node_t ** ppn )
+{
+	if( ps == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	node_tls * ptls = node_ctx_tls( ctx );
+	NodeStringWReader nr( ptls->pArena, ps, ptls );
+	return node_parse_internalW( &nr, ppn, NODE_W );
+}
+
+NODE_API int node_parse_from_string_dbgW( const char * psFile, int nLine, const wchar_t * ps, node_t ** ppn )
+{
+	set_debug_allocator s(psFile, nLine);
+
+	if( ps == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	NodeStringWReader nr( node_pArena, ps);
+	return node_parse_internalW( &nr, ppn, NODE_W );
+}
+
+static int NODE_INTERNAL_FUNC node_parse_from_data_internal( const void * pv, size_t nBytes, node_t ** ppn, int nType )
+{
+	int nLength = 128;
+	if( nBytes < 128 )
+		nLength = (int)nBytes;
+
+	int iFlags = 0xFFDD;
+	int bUnicode = IsTextUnicode( pv, nLength, &iFlags );
+
+	if( bUnicode )
+	{
+		NodeStringWReader nr( node_pArena, (wchar_t *)pv, nBytes/2 );
+		return node_parse_internalW( &nr, ppn, nType );
+	}
+	else
+	{
+		NodeStringAReader nr( node_pArena, (char *)pv, nBytes );
+		return node_parse_internalA( &nr, ppn, nType );
+	}
+}
+
+NODE_API int node_parse_from_dataA( const void * pv, size_t nBytes, node_t ** ppn )
+{
+	if( pv == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	return node_parse_from_data_internal( pv, nBytes, ppn, NODE_A );
+}
+
+NODE_API int node_parse_from_data_dbgA( const char * psFile, int nLine, const void * pv, size_t nBytes, node_t ** ppn )
+{
+	set_debug_allocator s(psFile, nLine);
+
+	if( pv == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	return node_parse_from_data_internal( pv, nBytes, ppn, NODE_A );
+}
+
+NODE_API int node_parse_from_dataW( const void * pv, size_t nBytes, node_t ** ppn )
+{
+	if( pv == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	return node_parse_from_data_internal( pv, nBytes, ppn, NODE_W );
+}
+
+NODE_API int node_parse_from_data_dbgW( const char * psFile, int nLine, const void * pv, size_t nBytes, node_t ** ppn )
+{
+	set_debug_allocator s(psFile, nLine);
+
+	if( pv == NULL || ppn == NULL )
+		return NP_INVALID;
+
+	return node_parse_from_data_internal( pv, nBytes, ppn, NODE_W );
+}
+
+static int NODE_INTERNAL_FUNC node_parse_internal( FILE * pfIn, node_t ** ppn, int nOutputStyle )
+{
+	/* save the file position */
+	fpos_t fpt = {0};
+	fgetpos( pfIn, &fpt );
+
+	/* read a block from pfIn */
+	data_t abData[512] = {0};
+	size_t nBytes = fread( abData, sizeof(data_t), sizeof(abData), pfIn );
+
+	/* evaluate its type */
+	int iFlags = 0xFFDD;
+	int nResult = IsTextUnicode( abData, (int)nBytes, &iFlags );
+
+	/* restore the file position */
+	fsetpos( pfIn, &fpt );
+
+	NodeFileReader nr( pfIn, node_pArena );
+
+	/* if the file is Unicode */
+	if( nResult > 0 )
+		return node_parse_internalW( &nr, ppn, nOutputStyle );
+	else
+		return node_parse_internalA( &nr, ppn, nOutputStyle );
+}
+
+template <class T> static const T * unterminated_strchr( const T * psStart, const T * psEnd, const int nChar )
+{
+	const T * psChar;
+
+	for( psChar = psStart; psChar < psEnd; ++psChar )
+		if( *psChar == nChar )
+			return psChar;
+
+	return NULL;
+}
+
+template <class T> static const T * unterminated_strrchr( const T * psStart, const T * psEnd, const int nChar )
+{
+	const T * psChar;
+
+	for( psChar = psEnd-1; psChar >= psStart; --psChar )
+		if( *psChar == nChar )
+			return psChar;
+
+	return NULL;
+}
+
+template <class T> class TempSZ
+{
+	node_arena * pArena;
+	T m_ac[32];
+	T* m_ps;
+	int m_bValid;
+
+public:
+	TempSZ( node_arena * p, const T * psStart, const T * psEnd ) : pArena(p), m_ps(0), m_bValid(TRUE)
+	{
+		size_t nLength = psEnd-psStart;
+		T* ps = NULL;
+		
+		if( nLength < sizeof( m_ac ) / sizeof(T) )
+		{
+			ps = m_ac;
+		}
+		else
+		{
+			ps = m_ps = (T*)node_malloc( pArena, (nLength + 1)*sizeof(T) );
+			if( ps == NULL )
+			{
+				/* read as an empty value; callers check valid() */
+				m_ac[0] = 0;
+				m_bValid = FALSE;
+				return;
+			}
+		}
+
+		memcpy( ps, psStart, nLength * sizeof(T) );
+		ps[ nLength ] = 0;
+	}
+	~TempSZ()
+	{
+		if( m_ps )
+			nfree( pArena, m_ps );
+	}
+
+	operator const T *()
+	{
+		return m_ps ? m_ps : m_ac;
+	}
+
+	int valid() const { return m_bValid; }
+};
+
+/********************************************************************** 
+ * read a node from a file 
+ * return values: 
+ *
+ *  NP_NODE   : succesful read of node element
+ *  NP_CPAREN : only thing on line is close paren
+ *  NP_CBRACE : only thing on line is close brace
+ *  NP_SERROR : syntax error reading line; skip this line
+ *  NP_EOF    : end of file
+ *  NP_NOMEM  : out of memory; whatever was read is freed
+ *
+ *	for a return of NP_NODE, ppn is set to the node read; otherwise, it is set
+ *	to NULL.
+ ***********************************************************************/
+static int NODE_INTERNAL_FUNC node_parse_internalA( NodeReader * pnr, node_t ** ppn, int nOutputStyle )
+{
+	const char * psLine = NULL;
+	const char * psEnd = NULL;
+
+	const char * psPos = NULL;
+
+	const char * psColon = NULL;
+	char * psName = NULL;
+	char * psUnescaped = NULL;
+
+	node_t * pn = NULL;
+	node_t * pnChild = NULL;
+	const char * psType = NULL;
+
+	const char * psTrailingQuote = NULL;
+
+	int nDataLength = 0;
+	data_t * pb = NULL;
+	int nRows = 0;
+	int i = 0;
+	int b = 0;
+
+	int nResult = 0;
+	node_arena * pArena = pnr->m_pArena;
+
+	/* initialize the returned node */
+	*ppn = NULL;
+
+	/* read a line */
+READ_LINE:
+	pnr->read_lineA( &psLine, &psEnd );
+
+	/* if it fails */
+	if( psLine == NULL )
+		return pnr->m_bNoMem ? NP_NOMEM : NP_EOF;
+
+	/* skip initial white-space */
+	for( psPos = psLine; psPos < psEnd; psPos++ )
+	{
+		if( !isspace( static_cast<unsigned char>( *psPos ) ) )
+			break;
+	}
+
+	/* what kind of line is this? */
+
+	/* if it's blank -- read another line */
+	if( psPos >= psEnd )
+	{
+		pnr->free_line( psLine );
+		goto READ_LINE;
+	}
+
+	/* if it's a close paren */
+	if( *psPos == ')' )
+	{
+		pnr->free_line( psLine );
+		return NP_CPAREN;
+	}
+
+	/* if it's a close brace */
+	if( *psPos == '}' )
+	{
+		pnr->free_line( psLine );
+		return NP_CBRACE;
+	}
+
+	/* it's a normal node */
+
+	/* unescape the name */
+	psColon = unterminated_strchr<char>( psPos, psEnd, ':' );
+
+	if( psColon == NULL )
+	{
+		node_error( "No colon on line.\n" );
+		goto PARSE_ERROR;
+	}
+
+	if( psColon != psPos )
+	{
+		psName = node_unescapeA( pArena, psPos, psColon );
+		if( psName == NULL )
+			goto NOMEM_ERROR;
+	}
+
+	/* figure out the node type */
+	for( psType = psColon+1; psType < psEnd; psType++ )
+		if( !isspace( *psType ) )
+			break;
+
+	/* allocate a new node */
+	pn = node_alloc_internal( pnr->m_ptls, pArena );
+	if( pn == NULL )
+	{
+		nfree( pArena, psName );
+		goto NOMEM_ERROR;
+	}
+	if( psName != NULL )
+	{
+		int bNamed = FALSE;
+
+		if( nOutputStyle == NODE_A )
+		{
+			bNamed = node_set_nameA_internal( pnr->m_ptls, pn, psName );
+		}
+		else
+		{
+			wchar_t * psW = AToW( pArena, psName );
+			if( psW != NULL )
+			{
+				bNamed = node_set_nameW_internal( pnr->m_ptls, pn, psW );
+				nfree( pArena, psW );
+			}
+		}
+
+		nfree( pArena, psName );
+		if( !bNamed )
+			goto NOMEM_ERROR;
+	}
+
+	/* switch the node type */
+	switch( *psType )
+	{
+	case '.': case '0': case '1': case '2': case '3': case '4':
+	case '-': case '5': case '6': case '7': case '8': case '9':
+		{
+			TempSZ<char> psValue( pArena, psType, psEnd );
+			if( !psValue.valid() )
+				goto NOMEM_ERROR;
+
+			if( strchr( psValue, '.' ) != NULL )
+				node_set_real( pnr->m_ptls, pn, strtod( psValue, NULL ) );
+			else if( strchr( psValue, 'L' ) != NULL )
+				node_set_int64( pnr->m_ptls, pn, _atoi64( psValue ) );
+			else
+				node_set_int( pnr->m_ptls, pn, atoi( psValue ) );
+		}
+		break;
+
+	case '"':
+		/* remove trailing quote */
+		psTrailingQuote = unterminated_strrchr<char>( psType, psEnd, '"' );
+		if( psTrailingQuote == NULL || psTrailingQuote <= psType )
+		{
+			node_error( "Unterminated string.\n" );
+			goto PARSE_ERROR;
+		}
+
+		if( nOutputStyle == NODE_A )
+		{
+			if( !node_set_stringA_internal( pnr->m_ptls, pn, psType+1, psTrailingQuote ) )
+				goto NOMEM_ERROR;
+		}
+		else
+		{
+			wchar_t * psW = AToW( pArena, psType+1, psTrailingQuote );
+			if( psW == NULL )
+				goto NOMEM_ERROR;
+			b = node_set_stringW_internal( pnr->m_ptls, pn, psW );
+			nfree( pArena, psW );
+			if( !b )
+				goto NOMEM_ERROR;
+		}
+
+		break;
+
+	case '\'':
+		/* remove trailing quote */
+		psTrailingQuote = unterminated_strrchr<char>( psType, psEnd, '\'' );
+		if( psTrailingQuote == NULL || psTrailingQuote <= psType )
+		{
+			node_error( "Unterminated string.\n" );
+			goto PARSE_ERROR;
+		}
+
+		psUnescaped = node_unescapeA( pArena, psType+1, psTrailingQuote );
+		if( psUnescaped == NULL )
+			goto NOMEM_ERROR;
+
+		if( nOutputStyle == NODE_A )
+			b = node_set_stringA_internal( pnr->m_ptls, pn, psUnescaped );
+		else
+		{
+			wchar_t * psW = AToW( pArena, psUnescaped );
+			b = ( psW != NULL ) && node_set_stringW_internal( pnr->m_ptls, pn, psW );
+			if( psW != NULL )
+				nfree( pArena, psW );
+		}
+
+		nfree( pArena, psUnescaped );
+		if( !b )
+			goto NOMEM_ERROR;
+		break;
+
+	case 'P':
+		/* handle reading in pointer value: use NULL */
+		node_set_ptr( pnr->m_ptls, pn, NULL );
+		break;
+	
+	case 'D':
+		nDataLength = atoi( psType + 4 );
+		pb = (data_t *)node_malloc( pArena, nDataLength );
+		if( pb == NULL )
+			goto NOMEM_ERROR;
+
+		/* loop over the rows of the binary data */
+		for( nRows = 0; nRows < (nDataLength+15)/16; nRows++ )
+		{
+			/* read a new line */
+			const char * psData = NULL;;
+			const char * psDataEnd = NULL;
+			
+			pnr->read_lineA( &psData, &psDataEnd );
+			if( psData == NULL )
+			{
+				nfree( pArena, pb );
+				if( pnr->m_bNoMem )
+					goto NOMEM_ERROR;
+				node_error( "Hex dump ended early.\n" );
+				goto PARSE_ERROR;
+			}
+			const char * psCursor = psData+1;
+
+			for( i = nRows*16; i < nDataLength && i < (nRows+1)*16; i++ )
+			{
+				/* skip whitespace */
+				psCursor += strspn( psCursor, " " );
+
+				/* convert the hex data to a byte */
+				b = strtoul( psCursor, NULL, 16 );
+				psCursor += 2;
+
+				/* set the data */
+				pb[i] = (data_t)b;
+			}
+			pnr->free_line( psData );
+		}
+
+		b = ( node_set_data_common( pnr->m_ptls, pn, nDataLength, pb ) != NULL );
+		nfree( pArena, pb );
+		if( !b )
+			goto NOMEM_ERROR;
+		break;
+
+	case '(':
+		node_list_init( pnr->m_ptls, pn );
+		while( (nResult = node_parse_internalA( pnr, &pnChild, nOutputStyle ) ) == NP_NODE )
+		{
+			node_list_add_internal( pn, pnChild );
+		}
+
+		if( nResult == NP_NOMEM )
+			goto NOMEM_ERROR;
+
+		if( nResult != NP_CPAREN )
+		{
+			node_error( "No close paren for list.\n" );
+			goto PARSE_ERROR;
+		}
+
+		break;
+	case '{':
+		{
+			/* gathers the children until the table size is known */
+			node_t * pnList = node_alloc_internal( pnr->m_ptls, pArena );
+			if( pnList == NULL )
+				goto NOMEM_ERROR;
+			node_list_init( pnr->m_ptls, pnList );
+			while( (nResult = node_parse_internalA( pnr, &pnChild, nOutputStyle ) ) == NP_NODE )
+			{
+				if( nOutputStyle == NODE_A )
+				{
+					if( NODE_NAMEA( pnChild ) != NULL )
+						node_push_internal( pnList, pnChild );
+					else
+					{
+						node_free( pnChild );
+						node_error( "Child of hash has no name -- skipping.\n" );
+					}
+				}
+				else
+				{
+					if( NODE_NAMEW( pnChild ) != NULL )
+						node_push_internal( pnList, pnChild );
+					else
+					{
+						node_free( pnChild );
+						node_error( "Child of hash has no name -- skipping.\n" );
+					}
+				}
+			}
+
+			if( nResult == NP_NOMEM || ( nResult == NP_CBRACE && 
+				!node_hash_init( pnr->m_ptls, pn, __max( DEFAULT_HASHSLOTS, HASH_SLOTS_FOR( pnList->nListElements ) ) ) ) )
+			{
+				node_free( pnList );
+				goto NOMEM_ERROR;
+			}
+
+			if( nResult != NP_CBRACE )
+			{
+				node_error( "No close brace for hash.\n" );
+				node_free( pnList );
+				goto PARSE_ERROR;
+			}
+
+			while( pnList->nListElements != 0 )
+			{
+				node_t * pnChild = node_pop_internal( pnList );
+				size_t nLength;
+				unsigned int nHash = node_name_hash( pnChild, &nLength );
+				if( !node_hash_add_internal( pn, pnChild, nHash, nLength ) )
+				{
+					node_free( pnChild );
+					node_free( pnList );
+					goto NOMEM_ERROR;
+				}
+			}
+
+			node_free( pnList );
+
+		}
+		break;
+	}
+
+	pnr->free_line( psLine );
+	*ppn = pn;
+	return NP_NODE;
+
+PARSE_ERROR:
+	if( pn != NULL )
+		node_free_internal( pn, NOT_IN_COLLECTION );
+	pnr->free_line( psLine );
+	
+	return NP_SERROR;
+
+NOMEM_ERROR:
+	if( pn != NULL )
+		node_free_internal( pn, NOT_IN_COLLECTION );
+	pnr->free_line( psLine );
+
+	return NP_NOMEM;
+}
+
+static int NODE_INTERNAL_FUNC node_parse_internalW( NodeReader *pnr, node_t ** ppn, int nOutputStyle )
+{
+	const wchar_t * psLine = NULL;
+	const wchar_t * psEnd = NULL;
+	const wchar_t * psPos = NULL;
+
+	const wchar_t * psColon = NULL;
+	wchar_t * psName = NULL;
+	wchar_t * psUnescaped = NULL;
+
+	node_t * pn = NULL;
+	node_t * pnChild = NULL;
+	const wchar_t * psType = NULL;
+
+	const wchar_t * psTrailingQuote = NULL;
+
+	int nDataLength = 0;
+	data_t * pb = NULL;
+	int nRows = 0;
+	int i = 0;
+	const wchar_t * psData = NULL;
+	const wchar_t * psCursor = NULL;
+	int b = 0;
+
+	node_arena * pArena = pnr->m_pArena;
+
+	int nResult = 0;
+
+	/* initialize the returned node */
+	*ppn = NULL;
+
+	/* read a line */
+READ_LINE:
+	pnr->read_lineW( &psLine, &psEnd );
+
+	/* if it fails */
+	if( psLine == NULL )
+		return pnr->m_bNoMem ? NP_NOMEM : NP_EOF;
+
+	/* skip initial white-space */
+	for( psPos = psLine; psPos < psEnd; ++psPos )
+		if( !iswspace( *psPos ) )
+			break;
+
+	/* what kind of line is this? */
+
+	/* if it's blank -- read another line */
+	if( psPos >= psEnd )
+	{
+		pnr->free_line( psLine );
+		goto READ_LINE;
+	}
+
+	/* if it's a close paren */
+	if( *psPos == ')' )
+	{
+		pnr->free_line( psLine );
+		return NP_CPAREN;
+	}
+
+	/* if it's a close brace */
+	if( *psPos == '}' )
+	{
+		pnr->free_line( psLine );
+		return NP_CBRACE;
+	}
+
+	/* it's a normal node */
+
+	/* unescape the name */
+	psColon = unterminated_strchr<wchar_t>( psPos, psEnd, ':' );
+	if( psColon == NULL )
+		goto PARSE_ERROR;
+
+	if( psColon != psPos )
+	{
+		psName = node_unescapeW( pArena, psPos, psColon );
+		if( psName == NULL )
+			goto NOMEM_ERROR;
+	}
+
+	/* figure out the node type */
+	for( psType = psColon+1; psType < psEnd; psType++ )
+		if( !iswspace( *psType ) )
+			break;
+
+	/* allocate a new node */
+	pn = node_alloc_internal( pnr->m_ptls, pArena );
+	if( pn == NULL )
+	{
+		nfree( pArena, psName );
+		goto NOMEM_ERROR;
+	}
+	if( psName != NULL )
+	{
+		int bNamed = FALSE;
+
+		if( nOutputStyle == NODE_W )
+		{
+			bNamed = node_set_nameW_internal( pnr->m_ptls, pn, psName );
+		}
+		else
+		{
+			/* TODO: warn possible loss of data */
+			char * psA = WToA( pArena, psName );
+			if( psA != NULL )
+			{
+				bNamed = node_set_nameA_internal( pnr->m_ptls, pn, psA );
+				nfree( pArena, psA );
+			}
+		}
+
+		nfree( pArena, psName );
+		if( !bNamed )
+			goto NOMEM_ERROR;
+	}
+
+	/* switch the node type */
+	switch( *psType )
+	{
+		/* TODO: possibly worry about localized numbers output */
+	case '.': case '0': case '1': case '2': case '3': case '4':
+	case '-': case '5': case '6': case '7': case '8': case '9':
+		{
+			TempSZ<wchar_t> psValue( pArena, psType, psEnd );
+			if( !psValue.valid() )
+				goto NOMEM_ERROR;
+
+			if( wcschr( psValue, '.' ) != NULL )
+				node_set_real( pnr->m_ptls, pn, wcstod( psValue, NULL ) );
+			else if( wcschr( psValue, 'L' ) != NULL )
+				node_set_int64( pnr->m_ptls, pn, _wtoi64( psValue ) );
+			else
+				node_set_int( pnr->m_ptls, pn, wcstol( psValue, NULL, 10 ) );
+		}
+		break;
+
+	case '"':
+		/* remove trailing quote */
+		psTrailingQuote = unterminated_strrchr<wchar_t>( psType, psEnd, '"' );
+		if( psTrailingQuote == NULL || psTrailingQuote <= psType )
+		{
+			node_error( "Unterminated string.\n" );
+			goto PARSE_ERROR;
+		}
+
+		if( nOutputStyle == NODE_W )
+		{
+			if( !node_set_stringW_internal( pnr->m_ptls, pn, psType+1, psTrailingQuote ) )
+				goto NOMEM_ERROR;
+		}
+		else
+		{
+			char * psA = WToA( pArena, psType+1, psTrailingQuote );
+			if( psA == NULL )
+				goto NOMEM_ERROR;
+			b = node_set_stringA_internal( pnr->m_ptls, pn, psA );
+			nfree( pArena, psA );
+			if( !b )
+				goto NOMEM_ERROR;
+		}
+
+		break;
+
+	case '\'':
+		/* remove trailing quote */
+		psTrailingQuote = unterminated_strrchr<wchar_t>( psType, psEnd, '\'' );
+		if( psTrailingQuote == NULL || psTrailingQuote <= psType )
+		{
+			node_error( "Unterminated string.\n" );
+			goto PARSE_ERROR;
+		}
+
+		psUnescaped = node_unescapeW( pArena, psType+1, psTrailingQuote );
+		if( psUnescaped == NULL )
+			goto NOMEM_ERROR;
+
+		if( nOutputStyle == NODE_W )
+			b = node_set_stringW_internal( pnr->m_ptls, pn, psUnescaped );
+		else
+		{
+			char * psA = WToA( pArena, psUnescaped );
+			b = ( psA != NULL ) && node_set_stringA_internal( pnr->m_ptls, pn, psA );
+			if( psA != NULL )
+				nfree( pArena, psA );
+		}
+
+		nfree( pArena, psUnescaped );
+		if( !b )
+			goto NOMEM_ERROR;
+		break;
+	
+	case 'D':
+		nDataLength = wcstol( psType + 4, NULL, 10 );
+		pb = (data_t *)node_malloc( pArena, nDataLength );
+		if( pb == NULL )
+			goto NOMEM_ERROR;
+		/* loop over the rows of the binary data */
+		for( nRows = 0; nRows < (nDataLength+15)/16; nRows++ )
+		{
+			const wchar_t * psDataEnd;
+
+			/* read a new line */
+			pnr->read_lineW( &psData, &psDataEnd );
+			if( psData == NULL )
+			{
+				nfree( pArena, pb );
+				if( pnr->m_bNoMem )
+					goto NOMEM_ERROR;
+				node_error( "Hex dump ended early.\n" );
+				goto PARSE_ERROR;
+			}
+			psCursor = psData+1;
+
+			for( i = nRows*16; i < nDataLength && i < (nRows+1)*16; i++ )
+			{
+				/* skip whitespace */
+				psCursor += wcsspn( psCursor, L" " );
+
+				/* convert the hex data to a byte */
+				b = wcstoul( psCursor, NULL, 16 );
+				psCursor += 2;
+
+				/* set the data */
+				pb[i] = (data_t)b;
+			}
+			pnr->free_line( psData );
+		}
+
+		b = ( node_set_data_common( pnr->m_ptls, pn, nDataLength, pb ) != NULL );
+		nfree( pArena, pb );
+		if( !b )
+			goto NOMEM_ERROR;
+		break;
+
+	case 'P':
+		/* handle reading in pointer value: use NULL */
+		node_set_ptr( pnr->m_ptls, pn, NULL );
+		break;
+
+	case '(':
+		node_list_init( pnr->m_ptls, pn );
+		while( (nResult = node_parse_internalW( pnr, &pnChild, nOutputStyle ) ) == NP_NODE )
+		{
+			node_list_add_internal( pn, pnChild );
+		}
+
+		if( nResult == NP_NOMEM )
+			goto NOMEM_ERROR;
+
+		if( nResult != NP_CPAREN )
+		{
+			node_error( "No close paren for list.\n" );
+			goto PARSE_ERROR;
+		}
+
+		break;
+	case '{':
+		{
+			/* gathers the children until the table size is known */
+			node_t * pnList = node_alloc_internal( pnr->m_ptls, pArena );
+			if( pnList == NULL )
+				goto NOMEM_ERROR;
+			node_list_init( pnr->m_ptls, pnList );
+
+			while( (nResult = node_parse_internalW( pnr, &pnChild, nOutputStyle ) ) == NP_NODE )
+			{
+				if( nOutputStyle == NODE_A )
+				{
+					if( NODE_NAMEA( pnChild ) != NULL )
+						node_push_internal( pnList, pnChild );
+					else
+					{
+						node_free( pnChild );
+						node_error( "Child of hash has no name -- skipping.\n" );
+					}
+				}
+				else
+				{
+					if( NODE_NAMEW( pnChild ) != NULL )
+						node_push_internal( pnList, pnChild );
+					else
+					{
+						node_free( pnChild );
+						node_error( "Child of hash has no name -- skipping.\n" );
+					}
+				}
+			}
+
+			if( nResult == NP_NOMEM || ( nResult == NP_CBRACE && 
+				!node_hash_init( pnr->m_ptls, pn, __max( DEFAULT_HASHSLOTS, HASH_SLOTS_FOR( pnList->nListElements ) ) ) ) )
+			{
+				node_free( pnList );
+				goto NOMEM_ERROR;
+			}
+
+			if( nResult != NP_CBRACE )
+			{
+				node_error( "No close brace for hash.\n" );
+				node_free( pnList );
+				goto PARSE_ERROR;
+			}
+
+			while( pnList->nListElements != 0 )
+			{
+				node_t * pnChild = node_pop_internal( pnList );
+				size_t nLength;
+				unsigned int nHash = node_name_hash( pnChild, &nLength );
+				if( !node_hash_add_internal( pn, pnChild, nHash, nLength ) )
+				{
+					node_free( pnChild );
+					node_free( pnList );
+					goto NOMEM_ERROR;
+				}
+			}
+
+			node_free( pnList );
+	
+		}
+		break;
+	}
+
+	pnr->free_line( psLine );
+	*ppn = pn;
+	return NP_NODE;
+
+PARSE_ERROR:
+	if( pn != NULL )
+		node_free_internal( pn, NOT_IN_COLLECTION );
+	pnr->free_line( psLine );
+	
+	return NP_SERROR;
+
+NOMEM_ERROR:
+	if( pn != NULL )
+		node_free_internal( pn, NOT_IN_COLLECTION );
+	pnr->free_line( psLine );
+
+	return NP_NOMEM;
+}
+
+
+/*****************
+ Utility Functions
+ *****************/
+
+/* deep copy a node */
+NODE_API node_t * node_copy_dbg( const char * psFile, int nLine, const node_t *pnSource )
+{
+	set_debug_allocator s( psFile, nLine );
+
+	return node_copy( pnSource );
+}
+
+NODE_API node_t * node_copy( const node_t *pnSource )
+{
+	return node_copy_ctx( node_get_ctx(), pnSource );
+}
+
+NODE_API node_t * node_copy_ctx( node_ctx_t ctx, const node_t *pnSource )
+{
+	/* if it's NULL, return NULL */
+	if( pnSource == NULL )
+	{
+		return NULL;
+	}
+
+	node_tls * ptls = node_ctx_tls( ctx );
+	return node_copy_internal( ptls, ptls->pArena, pnSource );
+}
+
+NODE_API node_t * node_compact_dbg( const char * psFile, int nLine, const node_t * pnSource, node_arena_t pArena )
+{
+	set_debug_allocator s( psFile, nLine );
+
+	return node_compact( pnSource, pArena );
+}
+
+NODE_API node_t * node_compact( const node_t * pnSource, node_arena_t pArena )
+{
+	if( pnSource == NULL )
+	{
+		node_assert( pnSource != NULL );
+		return NULL;
+	}
+
+	/* depth first, so each node's children and their strings follow it in the arena */
+	return node_copy_internal( NODE_CACHE_CTX, pArena != NULL ? (node_arena *)pArena : node_pArena, pnSource );
+}
+
+static node_t * NODE_INTERNAL_FUNC node_copy_internal( node_tls * ptls, node_arena * pArena, const node_t * pnSource )
+{
+	node_t * pnCopy = NULL;
+	node_t * pn = NULL;
+
+	int bCopied = TRUE;
+
+	/* allocate new node */
+	pnCopy = node_alloc_internal( ptls, pArena );
+	if( pnCopy == NULL )
+		return NULL;
+
+	if( pnSource->nType == NODE_HASH )
+	{
+		if( !node_hash_init( ptls, pnCopy, pnSource->nHashSlots ) )
+		{
+			node_free_internal( pnCopy, NOT_IN_COLLECTION );
+			return NULL;
+		}
+		pnCopy->nHashFlags = pnSource->nHashFlags & ( HASH_CONTAINS_AKEYS | HASH_CONTAINS_WKEYS );
+	}
+	else if( pnSource->nType == NODE_LIST )
+	{
+		node_list_init( ptls, pnCopy );
+	}
+
+	/* copy the type */
+	pnCopy->nType = pnSource->nType;
+	pnCopy->nHash = pnSource->nHash;
+
+	/* copy is not in a collection */
+	pnCopy->bInCollection = NOT_IN_COLLECTION;
+
+	/* if there's a pnNext, ignore it */
+	SET_NEXT( pnCopy, NULL );
+
+	/* copy the data */
+	switch( pnCopy->nType )
+	{
+	case NODE_INT:
+		pnCopy->nValue = pnSource->nValue;
+		break;
+
+	case NODE_INT64:
+		pnCopy->n64Value = pnSource->n64Value;
+		break;
+
+	case NODE_REAL:
+		pnCopy->dfValue = pnSource->dfValue;
+		break;
+
+	case NODE_STRINGA:
+		bCopied = node_set_stringA_internal( ptls, pnCopy, pnSource->psAValue );
+		break;
+
+	case NODE_STRINGW:
+		bCopied = node_set_stringW_internal( ptls, pnCopy, pnSource->psWValue );
+		break;
+
+	case NODE_PTR:
+		pnCopy->pvValue = pnSource->pvValue;
+		break;
+
+	case NODE_DATA:
+		bCopied = node_set_data_internal( ptls, pnCopy, pnSource->nDataLength, pnSource->pbValue );
+		break;
+
+	case NODE_LIST:
+	case NODE_HASH:
+		/* children are copied below, after the name */
+		break;
+
+	default:
+		node_error( "Attempted to copy illegal node type (value %d).\n", pnSource->nType );
+		node_assert( !"Attempted to copy illegal node type." );
+	}
+
+	/* copy the name: now that the value has taken its share of the bag */
+	if( bCopied )
+		bCopied = node_copy_name_internal( ptls, pArena, pnCopy, pnSource );
+
+	/* LIST : deep copy the list */
+	if( !bCopied )
+	{
+		/* out of memory: fall through to the cleanup below */
+	}
+	else if( pnCopy->nType == NODE_LIST )
+	{
+		for( pn = node_first( pnSource ); pn != NULL; pn = node_next( pn ) )
+		{
+			/* copy each element of list */
+			node_t * pnElement = node_copy_internal( ptls, pArena, pn );
+			if( pnElement == NULL )
+			{
+				bCopied = FALSE;
+				break;
+			}
+			node_list_add_internal( pnCopy, pnElement );
+		}
+	}
+
+	/* HASH: deep copy the hash */
+	else if( pnCopy->nType == NODE_HASH )
+	{
+		/* copy the elements in slot order, counting them as they land so a partial copy frees cleanly */
+		hash_iter it( pnSource );
+		node_t * pnSourceElement;
+		while( bCopied && ( pnSourceElement = it.next() ) != NULL )
+		{
+			node_t * pnElement = node_copy_internal( ptls, pArena, pnSourceElement );
+			if( pnElement == NULL || !node_hash_add_internal( pnCopy, pnElement, it.nHash, it.nLength ) )
+			{
+				if( pnElement != NULL )
+					node_free_internal( pnElement, NOT_IN_COLLECTION );
+				bCopied = FALSE;
+			}
+		}
+	}
+
+	if( !bCopied )
+	{
+		node_free_internal( pnCopy, NOT_IN_COLLECTION );
+		return NULL;
+	}
+
+	/* a copy of a frozen hash is frozen too, if it can be */
+	if( pnCopy->nType == NODE_HASH && ( pnSource->nHashFlags & HASH_FROZEN ) )
+		hash_freeze( pnCopy );
+
+	/* return the copied node */		
+	return pnCopy;
+
+}
+
+/* copy a node's names, behind the value in the bag when there is room */
+static int NODE_INTERNAL_FUNC node_copy_name_internal( node_tls * ptls, node_arena * pArena, node_t * pnCopy, const node_t * pnSource )
+{
+	if( pnSource->psAName == NULL )
+		return TRUE;
+
+	pnCopy->bNameW = pnSource->bNameW;
+
+	/* interned names are shared, even by node_compact copies */
+	if( pnSource->bNameInterned )
+	{
+		node_intern_addref( pnSource->psAName );
+		pnCopy->psAName = pnSource->psAName;
+		pnCopy->bNameInterned = TRUE;
+		return TRUE;
+	}
+
+	size_t cb;
+	if( pnSource->bNameW )
+		cb = (wcslen( pnSource->psWName ) + 1) * sizeof(wchar_t);
+	else
+		cb = (strlen( pnSource->psAName ) + 1) * sizeof(char);
+
+	pnCopy->psAName = (char *)node_bag_name_slot( pnCopy, cb, pnSource->bNameW ? sizeof(wchar_t) : sizeof(char) );
+	if( pnCopy->psAName != NULL )
+	{
+		memcpy( pnCopy->psAName, pnSource->psAName, cb );
+		pnCopy->bBagUsed = TRUE;
+		NODE_STAT_CTX( ptls, pArena, nBagHits++ );
+	}
+	else
+	{
+		if( pnSource->bNameW )
+			pnCopy->psWName = node_safe_copyW( pArena, pnSource->psWName );
+		else
+			pnCopy->psAName = node_safe_copyA( pArena, pnSource->psAName );
+		if( pnCopy->psAName == NULL )
+		{
+			pnCopy->bNameW = FALSE;
+			return FALSE;
+		}
+		NODE_STAT_CTX( ptls, pArena, cbStrings += cb );
+	}
+
+	return TRUE;
+}
+
+/* bytes at the front of the bag taken by pn's value */
+static size_t NODE_INTERNAL_FUNC node_bag_value_size( const node_t * pn )
+{
+#ifdef USE_BAGS
+	if( !pn->bBagUsed )
+		return 0;
+	if( pn->nType == NODE_STRINGA && IS_BAG( pn, pn->psAValue ) )
+		return (strlen( pn->psAValue ) + 1) * sizeof(char);
+	if( pn->nType == NODE_STRINGW && IS_BAG( pn, pn->psWValue ) )
+		return (wcslen( pn->psWValue ) + 1) * sizeof(wchar_t);
+	if( pn->nType == NODE_DATA && IS_BAG( pn, pn->pbValue ) )
+		return pn->nDataLength;
+	if( pn->nType == NODE_HASH && IS_BAG( pn, pn->ppnHashSlots ) )
+		return HASH_TABLE_SIZE( pn->nHashSlots );
+#endif
+	return 0;
+}
+
+/* offset in the bag of the names packed in from its end (BAG_SIZE if there are none):
+   a value may use the bytes in front of it */
+static size_t NODE_INTERNAL_FUNC node_bag_names_start( const node_t * pn )
+{
+	size_t cbStart = BAG_SIZE;
+
+#ifdef USE_BAGS
+	if( pn->bBagUsed )
+	{
+		if( IN_BAG( pn, pn->psAName ) )
+			cbStart = (size_t)( (unsigned char *)pn->psAName - GET_BAG( pn ) );
+	}
+#endif
+	return cbStart;
+}
+
+/* room for a cb byte name between the value and the names already in the bag, or NULL */
+static void * NODE_INTERNAL_FUNC node_bag_name_slot( const node_t * pn, size_t cb, size_t cbAlign )
+{
+#ifdef USE_BAGS
+	size_t cbBack = node_bag_names_start( pn );
+
+	if( cb <= cbBack )
+	{
+		cbBack = (cbBack - cb) & ~(cbAlign - 1);
+		if( cbBack >= node_bag_value_size( pn ) )
+			return GET_BAG( pn ) + cbBack;
+	}
+#endif
+	return NULL;
+}
+
+/* safely copy a string */
+static char * NODE_INTERNAL_FUNC node_safe_copyA( struct node_arena * pArena, const char * ps )
+{
+	return node_safe_copy_nA( pArena, ps, strlen( ps ) );
+}
+
+/* safely copy W string */
+static wchar_t * NODE_INTERNAL_FUNC node_safe_copyW( struct node_arena * pArena, const wchar_t * ps )
+{
+	return node_safe_copy_nW( pArena, ps, wcslen( ps ) );
+}
+
+/* safely copy the first cch characters of a string, terminating the copy */
+static char * NODE_INTERNAL_FUNC node_safe_copy_nA( struct node_arena * pArena, const char * ps, size_t cch )
+{
+	char * psCopy;
+
+	/* allocate memory */
+	psCopy = (char *)node_malloc( pArena, (cch + 1) * sizeof(char) );
+	if( psCopy == NULL )
+		return NULL;
+
+	/* copy the string */
+	memcpy( psCopy, ps, cch * sizeof(char) );
+	psCopy[cch] = 0;
+
+	return psCopy;
+}
+
+static wchar_t * NODE_INTERNAL_FUNC node_safe_copy_nW( struct node_arena * pArena, const wchar_t * ps, size_t cch )
+{
+	wchar_t * psCopy;
+
+	/* allocate memory */
+	psCopy = (wchar_t *)node_malloc( pArena, (cch + 1) * sizeof(wchar_t) );
+	if( psCopy == NULL )
+		return NULL;
+
+	/* copy the string */
+	memcpy( psCopy, ps, cch * sizeof(wchar_t) );
+	psCopy[cch] = 0;
+
+	return psCopy;
+}
+
+/* intern a name: find or add it in the table and take a reference */
+static char * NODE_INTERNAL_FUNC node_internA( const char * psName )
+{
+	node_lock l( &node_csNames );
+
+	if( node_pdictNamesA == NULL )
+		node_pdictNamesA = dict_create();
+
+	dnode_t * pdn = ( node_pdictNamesA != NULL ) ? dict_ensure_existsA( node_pdictNamesA, psName ) : NULL;
+	if( pdn == NULL )
+	{
+		node_fail( NODE_ERROR_MEMORY );
+		return NULL;
+	}
+
+	pdn->dict_refcount++;
+	return (char *)pdn->dict_key;
+}
+
+static wchar_t * NODE_INTERNAL_FUNC node_internW( const wchar_t * psName )
+{
+	node_lock l( &node_csNames );
+
+	if( node_pdictNamesW == NULL )
+		node_pdictNamesW = dict_create();
+
+	dnode_t * pdn = ( node_pdictNamesW != NULL ) ? dict_ensure_existsW( node_pdictNamesW, psName ) : NULL;
+	if( pdn == NULL )
+	{
+		node_fail( NODE_ERROR_MEMORY );
+		return NULL;
+	}
+
+	pdn->dict_refcount++;
+	return (wchar_t *)pdn->dict_key;
+}
+
+/* intern the first cchName characters of psName: the table takes terminated keys */
+static char * NODE_INTERNAL_FUNC node_intern_nA( const char * psName, size_t cchName )
+{
+	char acName[256];
+	char * psTerminated = ( cchName < sizeof(acName) / sizeof(char) ) ? acName : (char *)malloc( (cchName + 1) * sizeof(char) );
+	if( psTerminated == NULL )
+	{
+		node_fail( NODE_ERROR_MEMORY );
+		return NULL;
+	}
+
+	memcpy( psTerminated, psName, cchName * sizeof(char) );
+	psTerminated[cchName] = 0;
+
+	char * psInterned = node_internA( psTerminated );
+
+	if( psTerminated != acName )
+		free( psTerminated );
+	return psInterned;
+}
+
+static wchar_t * NODE_INTERNAL_FUNC node_intern_nW( const wchar_t * psName, size_t cchName )
+{
+	wchar_t acName[256];
+	wchar_t * psTerminated = ( cchName < sizeof(acName) / sizeof(wchar_t) ) ? acName : (wchar_t *)malloc( (cchName + 1) * sizeof(wchar_t) );
+	if( psTerminated == NULL )
+	{
+		node_fail( NODE_ERROR_MEMORY );
+		return NULL;
+	}
+
+	memcpy( psTerminated, psName, cchName * sizeof(wchar_t) );
+	psTerminated[cchName] = 0;
+
+	wchar_t * psInterned = node_internW( psTerminated );
+
+	if( psTerminated != acName )
+		free( psTerminated );
+	return psInterned;
+}
+
+static void NODE_INTERNAL_FUNC node_intern_addref( void * psName )
+{
+	node_lock l( &node_csNames );
+
+	NAME_DNODE( psName )->dict_refcount++;
+}
+
+/* drop a reference to an interned name; the last one removes it from the table */
+static void NODE_INTERNAL_FUNC node_intern_release( dict_t * pdict, void * psName )
+{
+	dnode_t * pdn = NAME_DNODE( psName );
+
+	node_lock l( &node_csNames );
+
+	if( node_nDebugIntern && pdn->dict_refcount <= 0 )
+	{
+		node_error( "Releasing an interned name that has no references.\n" );
+		node_assert( pdn->dict_refcount > 0 );
+		return;
+	}
+
+	if( --pdn->dict_refcount == 0 )
+	{
+		dict_delete( pdict, pdn );
+		free( pdn );
+	}
+}
+
+/* takes a byte and returns '.' if unprintable; else returns the byte */
+static __inline int printable(int c)
+{
+	return isprint( c ) ? c : '.';
+}
+
+/********************************
+ Private Function Implementations
+ ********************************/
+
+static void NODE_INTERNAL_FUNC node_set_int( node_tls * ptls, node_t * pn, int nValue )
+{
+	/* clean up */
+	node_cleanup( ptls, pn );
+
+	pn->nValue = nValue;
+
+	pn->nType = NODE_INT;
+}
+
+static void NODE_INTERNAL_FUNC node_set_int64( node_tls * ptls, node_t * pn, __int64 nValue )
+{
+	/* clean up */
+	node_cleanup( ptls, pn );
+
+	pn->n64Value = nValue;
+
+	pn->nType = NODE_INT64;
+}
+
+static void NODE_INTERNAL_FUNC node_set_real( node_tls * ptls, node_t * pn, double dfValue )
+{
+	/* clean up */
+	node_cleanup( ptls, pn );
+
+	pn->dfValue = dfValue;
+
+	pn->nType = NODE_REAL;
+}
+
+/* keep a scalar's string conversion in its side allocation, replacing the last one */
+static node_strings * NODE_INTERNAL_FUNC node_scalar_strings( node_t * pn )
+{
+	if( pn->pStrings == NULL )
+	{
+		pn->pStrings = (node_strings *)node_malloc( GET_ARENA( pn ), sizeof(node_strings) );
+		if( pn->pStrings != NULL )
+			memset( pn->pStrings, 0, sizeof(node_strings) );
+	}
+
+	return pn->pStrings;
+}
+
+static char * NODE_INTERNAL_FUNC node_scalar_stringA( node_t * pn, const char * psValue )
+{
+	node_strings * pStrings = node_scalar_strings( pn );
+	if( pStrings == NULL )
+		return NULL;
+
+	nfree( GET_ARENA( pn ), pStrings->psAValue );
+	pStrings->psAValue = node_safe_copyA( GET_ARENA( pn ), psValue );
+	return pStrings->psAValue;
+}
+
+static wchar_t * NODE_INTERNAL_FUNC node_scalar_stringW( node_t * pn, const wchar_t * psValue )
+{
+	node_strings * pStrings = node_scalar_strings( pn );
+	if( pStrings == NULL )
+		return NULL;
+
+	nfree( GET_ARENA( pn ), pStrings->psWValue );
+	pStrings->psWValue = node_safe_copyW( GET_ARENA( pn ), psValue );
+	return pStrings->psWValue;
+}
+
+/* if psValue is a scalar's own string conversion, takes it from the node so node_cleanup leaves it */
+static void * NODE_INTERNAL_FUNC node_scalar_detach( node_t * pn, const void * psValue )
+{
+	if( ( pn->nType != NODE_INT && pn->nType != NODE_INT64 && pn->nType != NODE_REAL ) || pn->pStrings == NULL )
+		return NULL;
+
+	if( psValue == pn->pStrings->psAValue )
+	{
+		pn->pStrings->psAValue = NULL;
+		return const_cast<void *>( psValue );
+	}
+
+	if( psValue == pn->pStrings->psWValue )
+	{
+		pn->pStrings->psWValue = NULL;
+		return const_cast<void *>( psValue );
+	}
+
+	return NULL;
+}
+
+static int NODE_INTERNAL_FUNC node_set_stringA( node_tls * ptls, node_t * pn, const char * psAValue )
+{
+	if(psAValue == NULL)
+	{
+		node_assert(psAValue != NULL);
+		node_error("Attempted to set node value to null string.\n");
+		return TRUE;
+	}
+
+	/* if setting to same as current, done */
+	if( psAValue == pn->psAValue && ( pn->nType == NODE_STRINGA || pn->nType == NODE_STRINGW ) )
+	{
+		return TRUE;
+	}
+
+	if( node_nDebugUnicode )
+	{
+		node_check_ascii_string( psAValue, "NODE_STRINGA" );
+	}
+
+	/* find room for the value first: running out of memory leaves the node as it was */
+	size_t cch = strlen( psAValue );
+	void * pv;
+	if( !node_value_alloc( pn, (cch+1)*sizeof(char), &pv ) )
+		return FALSE;
+
+	/* clean up, keeping the value if it is what this scalar was coerced to */
+	void * pvOwn = node_scalar_detach( pn, psAValue );
+	node_cleanup( ptls, pn );
+
+	node_value_stringA( ptls, pn, psAValue, cch, pv );
+	nfree( GET_ARENA( pn ), pvOwn );
+	return TRUE;
+}
+
+static int NODE_INTERNAL_FUNC node_set_stringA_internal( node_tls * ptls, node_t * pn, const char * psAValue )
+{
+	return node_set_stringA_internal( ptls, pn, psAValue, strlen( psAValue ) );
+}
+
+static int NODE_INTERNAL_FUNC node_set_stringA_internal( node_tls * ptls, node_t * pn, const char * psAValue, const char * psEnd )
+{
+	return node_set_stringA_internal( ptls, pn, psAValue, psEnd-psAValue );
+}
+
+static int NODE_INTERNAL_FUNC node_set_stringA_internal( node_tls * ptls, node_t * pn, const char * psAValue, size_t cch )
+{
+	void * pv;
+	if( !node_value_alloc( pn, (cch+1)*sizeof(char), &pv ) )
+	{
+		/* the node is left empty rather than half set */
+		pn->nType = NODE_UNKNOWN;
+		return FALSE;
+	}
+
+	node_value_stringA( ptls, pn, psAValue, cch, pv );
+	return TRUE;
+}
+
+/* gives a clean node the first cch characters of psAValue, in the room node_value_alloc found */
+static void NODE_INTERNAL_FUNC node_value_stringA( node_tls * ptls, node_t * pn, const char * psAValue, size_t cch, void * pv )
+{
+	pn->psAValue = (char *)node_value_place( ptls, pn, pv );
+	memmove( pn->psAValue, psAValue, cch*sizeof(char) );
+	pn->psAValue[cch] = '\0';
+	if( pv != NULL )
+		NODE_STAT_CTX( ptls, GET_ARENA( pn ), cbStrings += (cch+1)*sizeof(char) );
+
+	pn->nType = NODE_STRINGA;
+}
+
+static int NODE_INTERNAL_FUNC node_set_stringW( node_tls * ptls, node_t * pn, const wchar_t * psWValue )
+{
+	if(psWValue == NULL)
+	{
+		node_assert(psWValue != NULL);
+		node_error("Attempted to set node value to null string.\n");
+		return TRUE;
+	}
 
-			for( psEnd = psStart; psEnd < m_psWEnd; ++psEnd )
-				if( *psEnd == '\n' )
-					break;
-				
-			m_psW = psEnd+1;
-		}
+	/* if setting to same as current, done */
+	if( psWValue == pn->psWValue && ( pn->nType == NODE_STRINGA || pn->nType == NODE_STRINGW ) )
+	{
+		return TRUE;
+	}
 
-		*ppsStart = psStart;
-		*ppsEnd = psEnd;
+	if( node_nDebugUnicode )
+	{
+		node_check_unicode_string( psWValue, "NODE_STRINGW" );
 	}
-	void read_lineA( const char **, const char ** ) { node_assert(!"NodeStringWReader:read_lineA() is not defined."); }
 
-	/* free_line is a no-op because the line was not independently allocated */
-	void free_line( const void * psLine ) { psLine = psLine; }
-};
+	/* find room for the value first: running out of memory leaves the node as it was */
+	size_t cch = wcslen( psWValue );
+	void * pv;
+	if( !node_value_alloc( pn, (cch+1)*sizeof(wchar_t), &pv ) )
+		return FALSE;
 
+	/* clean up, keeping the value if it is what this scalar was coerced to */
+	void * pvOwn = node_scalar_detach( pn, psWValue );
+	node_cleanup( ptls, pn );
 
-/***************************
- Parsing Interface Functions
- ***************************/
+	node_value_stringW( ptls, pn, psWValue, cch, pv );
+	nfree( GET_ARENA( pn ), pvOwn );
+	return TRUE;
+}
 
-NODE_API int node_parseA( FILE * pfIn, node_t ** ppn )
+static int NODE_INTERNAL_FUNC node_set_stringW_internal( node_tls * ptls, node_t * pn, const wchar_t * psWValue )
 {
-	if( pfIn == NULL || ppn == NULL )
-		return NP_INVALID;
+	return node_set_stringW_internal( ptls, pn, psWValue, wcslen( psWValue ) );
+}
 
-	return node_parse_internal( pfIn, ppn, NODE_A );
+static int NODE_INTERNAL_FUNC node_set_stringW_internal( node_tls * ptls, node_t * pn, const wchar_t * psWValue, const wchar_t * psEnd )
+{
+	return node_set_stringW_internal( ptls, pn, psWValue, psEnd-psWValue );
 }
 
-NODE_API int node_parse_dbgA( const char * psFile, int nLine, FILE * pfIn, node_t ** ppn )
+static int NODE_INTERNAL_FUNC node_set_stringW_internal( node_tls * ptls, node_t * pn, const wchar_t * psWValue, size_t cch )
 {
-	set_debug_allocator s(psFile, nLine);
+	void * pv;
+	if( !node_value_alloc( pn, (cch+1)*sizeof(wchar_t), &pv ) )
+	{
+		pn->nType = NODE_UNKNOWN;
+		return FALSE;
+	}
 
-	if( pfIn == NULL || ppn == NULL )
-		return NP_INVALID;
+	node_value_stringW( ptls, pn, psWValue, cch, pv );
+	return TRUE;
+}
 
-	return node_parse_internal( pfIn, ppn, NODE_A );
+static void NODE_INTERNAL_FUNC node_value_stringW( node_tls * ptls, node_t * pn, const wchar_t * psWValue, size_t cch, void * pv )
+{
+	pn->psWValue = (wchar_t *)node_value_place( ptls, pn, pv );
+	memmove( pn->psWValue, psWValue, cch*sizeof(wchar_t) );
+	pn->psWValue[cch] = '\0';
+	if( pv != NULL )
+		NODE_STAT_CTX( ptls, GET_ARENA( pn ), cbStrings += (cch+1)*sizeof(wchar_t) );
+
+	pn->nType = NODE_STRINGW;
 }
 
-NODE_API int node_parseW( FILE * pfIn, node_t ** ppn )
+NODE_API node_t * node_set_data_dbg( const char * psFile, int nLine, node_t * pn, int nLength, const void * pbValue )
 {
-	if( pfIn == NULL || ppn == NULL )
-		return NP_INVALID;
+	set_debug_allocator s( psFile, nLine );
+	return node_set_data( pn, nLength, pbValue );
+}
 
-	return node_parse_internal( pfIn, ppn, NODE_W );
+NODE_API node_t * node_set_data( node_t * pn, int nLength, const void * pvValue )
+{
+	return node_set_data_common( NODE_CACHE_CTX, pn, nLength, pvValue );
 }
 
-NODE_API int node_parse_dbgW( const char * psFile, int nLine, FILE * pfIn, node_t ** ppn )
+static node_t * NODE_INTERNAL_FUNC node_set_data_common( node_tls * ptls, node_t * pn, int nLength, const void * pvValue )
 {
-	set_debug_allocator s(psFile, nLine);
+	const data_t * pbValue = reinterpret_cast<const data_t *>( pvValue );
+	if( nLength <= 0 )
+	{
+		node_assert( nLength > 0 );
+		return pn;
+	}
 
-	if( pfIn == NULL || ppn == NULL )
-		return NP_INVALID;
+	if( nLength > LOTS_OF_MEMORY ) 
+	{
+		if( nLength > GRATUITOUSLY_MUCH_MEMORY )
+		{
+			node_assert( nLength < GRATUITOUSLY_MUCH_MEMORY );
+			return pn;
+		}
+		else
+		{
+			node_error("Suspicious amount of memory (%d) allocated for data element\n", nLength );
+		}
+	}
 
-	return node_parse_internal( pfIn, ppn, NODE_W );
+	if( pbValue == NULL )
+	{
+		node_assert(pbValue != NULL);
+		node_error( "Attempted to set data with NULL pointer.\n");
+		return pn;
+	}
+	
+	/* if setting to same as current, return */
+	if( pn->nType == NODE_DATA && pbValue == pn->pbValue )
+	{
+		/* shortening the data in place is OK */
+		if( nLength <= pn->nDataLength )
+		{
+			if( !IS_BAG( pn, pn->pbValue ) )
+				NODE_STAT_CTX( ptls, GET_ARENA( pn ), cbData -= pn->nDataLength - nLength );
+			pn->nDataLength = nLength;
+		}
+		else
+			node_error( "Attempting to increase length of existing data from %d to %d.\n", pn->nDataLength, nLength );
+		
+		return pn;
+	}
+
+	/* find room for the data before cleaning up, so running out of memory leaves the node as it was */
+	void * pv;
+	if( !node_value_alloc( pn, nLength, &pv ) )
+		return NULL;
+
+	node_cleanup( ptls, pn );
+
+	node_value_data( ptls, pn, nLength, pbValue, pv );
+	return pn;
 }
 
-NODE_API int node_parse_from_stringA( const char * ps, node_t ** ppn )
+static int NODE_INTERNAL_FUNC node_set_data_internal( node_tls * ptls, node_t * pn, int nLength, const data_t * pbValue )
 {
-	if( ps == NULL || ppn == NULL )
-		return NP_INVALID;
+	void * pv;
+	if( !node_value_alloc( pn, nLength, &pv ) )
+	{
+		pn->nType = NODE_UNKNOWN;
+		return FALSE;
+	}
 
-	NodeStringAReader nr( node_pArena, ps );
-	return node_parse_internalA( &nr, ppn, NODE_A );
+	node_value_data( ptls, pn, nLength, pbValue, pv );
+	return TRUE;
 }
 
-NODE_API int node_parse_from_string_dbgA( const char * psFile, int nLine, const char * ps, node_t ** ppn )
+static void NODE_INTERNAL_FUNC node_value_data( node_tls * ptls, node_t * pn, int nLength, const data_t * pbValue, void * pv )
 {
-	set_debug_allocator s(psFile, nLine);
+	pn->nDataLength = nLength;
+	pn->pbValue = (data_t *)node_value_place( ptls, pn, pv );
+	memmove( pn->pbValue, pbValue, nLength );
+	if( pv != NULL )
+		NODE_STAT_CTX( ptls, GET_ARENA( pn ), cbData += nLength );
 
-	if( ps == NULL || ppn == NULL )
-		return NP_INVALID;
+	pn->nType = NODE_DATA;
+}
 
-	NodeStringAReader nr( node_pArena, ps );
-	return node_parse_internalA( &nr, ppn, NODE_A );
+/* room for a cb byte value of pn, found before node_cleanup takes the current value out so that
+   running out of memory (FALSE) leaves the node as it was. *ppv is a new buffer, or NULL when the
+   value will fit in the front of the bag: cleanup leaves only the names there, and they don't move */
+static int NODE_INTERNAL_FUNC node_value_alloc( node_t * pn, size_t cb, void ** ppv )
+{
+	*ppv = NULL;
+
+#ifdef USE_BAGS
+	if( cb <= node_bag_names_start( pn ) )
+		return TRUE;
+#endif
+
+	*ppv = node_malloc( GET_ARENA( pn ), cb );
+	return ( *ppv != NULL );
 }
 
-NODE_API int node_parse_from_stringW( const wchar_t * ps, node_t ** ppn )
+/* where the value node_value_alloc found room for goes, once pn is clean */
+static void * NODE_INTERNAL_FUNC node_value_place( node_tls * ptls, node_t * pn, void * pv )
 {
-	if( ps == NULL || ppn == NULL )
-		return NP_INVALID;
+	if( pv != NULL )
+	{
+		NODE_STAT_CTX( ptls, GET_ARENA( pn ), nBagMisses++ );
+		return pv;
+	}
 
-	NodeStringWReader nr( node_pArena, ps );
-	return node_parse_internalW( &nr, ppn, NODE_W );
+#ifdef USE_BAGS
+	pn->bBagUsed = true;
+	NODE_STAT_CTX( ptls, GET_ARENA( pn ), nBagHits++ );
+	return GET_BAG( pn );
+#else
+	node_assert( pv != NULL );
+	return NULL;
+#endif
 }
 
-NODE_API int node_parse_from_string_dbgW( const char * psFile, int nLine, const wchar_t * ps, node_t ** ppn )
+static void NODE_INTERNAL_FUNC node_set_ptr( node_tls * ptls, node_t * pn, void * pv )
 {
-	set_debug_allocator s(psFile, nLine);
+	/* clean up */
+	node_cleanup( ptls, pn );
 
-	if( ps == NULL || ppn == NULL )
-		return NP_INVALID;
+	/* store the pointer */
+	pn->pvValue = pv;
 
-	NodeStringWReader nr( node_pArena, ps);
-	return node_parse_internalW( &nr, ppn, NODE_W );
+	pn->nType = NODE_PTR;
 }
 
-static int NODE_INTERNAL_FUNC node_parse_from_data_internal( const void * pv, size_t nBytes, node_t ** ppn, int nType )
+/* TRUE if node_set_valist can give an existing node a value of nType; otherwise node_add_common
+   makes (or takes) a whole node, which cannot be set on another in place */
+static inline int node_set_in_place( int nType )
 {
-	int nLength = 128;
-	if( nBytes < 128 )
-		nLength = (int)nBytes;
+	switch( nType )
+	{
+	case NODE_LIST:
+	case NODE_HASH:
+	case NODE_OLD_COPY:
+	case NODE_ADD_COPY:
+	case NODE_OLD_REF:
+	case NODE_ADD_REF:
+		return FALSE;
+	}
 
-	int iFlags = 0xFFDD;
-	int bUnicode = IsTextUnicode( pv, nLength, &iFlags );
+	return TRUE;
+}
 
-	if( bUnicode )
+/* set the node to a value using variable arguments. nType determines how 
+arguments are processed. FALSE if out of memory, with the node left as it was */
+static int NODE_INTERNAL_FUNC node_set_valist( node_tls * ptls, node_t * pn, int nType, va_list valist)
+{
+	unsigned int nDataLength = 0;
+	data_t * pbValue = NULL;
+
+	if( pn == NULL )
 	{
-		NodeStringWReader nr( node_pArena, (wchar_t *)pv, nBytes/2 );
-		return node_parse_internalW( &nr, ppn, nType );
+		node_assert( pn != NULL );
+		pn = node_alloc_internal( node_pArena );
+		if( pn == NULL )
+			return FALSE;
 	}
-	else
+
+	switch (nType)
 	{
-		NodeStringAReader nr( node_pArena, (char *)pv, nBytes );
-		return node_parse_internalA( &nr, ppn, nType );
+	case NODE_INT:
+		node_set_int( ptls, pn, va_arg(valist, int) );
+		break;
+
+	case NODE_INT64:
+		node_set_int64( ptls, pn, va_arg(valist, __int64) );
+		break;
+
+	case NODE_REAL:
+		node_set_real( ptls, pn, va_arg(valist, double) );
+		break;
+
+	case NODE_STRINGA:
+		if( !node_set_stringA( ptls, pn, va_arg(valist, char *) ) )
+			return FALSE;
+		break;
+
+	case NODE_STRINGW:
+		if( !node_set_stringW( ptls, pn, va_arg(valist, wchar_t *) ) )
+			return FALSE;
+		break;
+
+	case NODE_DATA:
+		nDataLength = va_arg( valist, unsigned int );
+		pbValue = va_arg( valist, data_t * );
+
+		if( node_set_data_common( ptls, pn, nDataLength, pbValue ) == NULL )
+			return FALSE;
+		break;
+
+	case NODE_PTR:
+		node_set_ptr( ptls, pn, va_arg( valist, void * ) );
+		break;
+
+	case NODE_REF_DATA:
+		{
+			node_t * pnSource = va_arg( valist, node_t * );
+			int bSet = TRUE;
+
+#ifdef USE_BAGS
+			if( IS_BAG( pnSource, pnSource->pbValue ) )
+			{
+				/* data in the source's bag has to be copied; the reference is consumed either way */
+				bSet = ( node_set_data_common( ptls, pn, pnSource->nDataLength, pnSource->pbValue ) != NULL );
+			}
+			else
+#endif
+			{
+				node_cleanup( ptls, pn );
+				pn->nType = NODE_DATA;
+				pn->nDataLength = pnSource->nDataLength;
+				pn->pbValue = pnSource->pbValue;
+				pnSource->nDataLength = 0;
+				pnSource->pbValue = NULL;
+			}
+
+			node_free_internal( pnSource, FALSE );
+
+			return bSet;
+		}
+		break;
+
+	case NODE_COPY_DATA:
+		{
+			node_t * pnSource = va_arg( valist, node_t * );
+
+			if( node_set_data_common( ptls, pn, pnSource->nDataLength, pnSource->pbValue ) == NULL )
+				return FALSE;
+
+			pn->nType = NODE_DATA;
+			return TRUE;
+		}
+		break;
+
+	default:
+	/* otherwise */
+		node_assert(!"Invalid node type");
+		node_error( "Tried to set node with invalid type (%d).\n", nType );
 	}
-}
 
-NODE_API int node_parse_from_dataA( const void * pv, size_t nBytes, node_t ** ppn )
-{
-	if( pv == NULL || ppn == NULL )
-		return NP_INVALID;
+	/* copy the type */
+	pn->nType = nType;
+	return TRUE;
+}	
 
-	return node_parse_from_data_internal( pv, nBytes, ppn, NODE_A );
-}
+/* key hashing: eight bytes at a time, folding ASCII case exactly. Characters past ASCII keep
+   the old 'lower case' bit, so names a code page's _stricmp calls equal still hash together */
+#define HASH_ONES		0x0101010101010101ULL
+#define HASH_ONES16		0x0001000100010001ULL
+#define HASH_MUL		0x9E3779B97F4A7C15ULL
 
-NODE_API int node_parse_from_data_dbgA( const char * psFile, int nLine, const void * pv, size_t nBytes, node_t ** ppn )
+/* set the 'lower case' bit in each byte of w that is 'A'..'Z' */
+static inline unsigned __int64 hash_fold_ascii( unsigned __int64 w )
 {
-	set_debug_allocator s(psFile, nLine);
-
-	if( pv == NULL || ppn == NULL )
-		return NP_INVALID;
+	unsigned __int64 nLow = w & ( HASH_ONES * 0x7F );
+	unsigned __int64 nUpper = ( nLow + HASH_ONES * ( 0x80 - 'A' ) ) ^ ( nLow + HASH_ONES * ( 0x80 - 'Z' - 1 ) );
 
-	return node_parse_from_data_internal( pv, nBytes, ppn, NODE_A );
+	return w | ( nUpper & ~w & ( HASH_ONES * 0x80 ) ) >> 2;
 }
 
-NODE_API int node_parse_from_dataW( const void * pv, size_t nBytes, node_t ** ppn )
+/* ...or not ASCII */
+static inline unsigned __int64 hash_fold( unsigned __int64 w )
 {
-	if( pv == NULL || ppn == NULL )
-		return NP_INVALID;
-
-	return node_parse_from_data_internal( pv, nBytes, ppn, NODE_W );
+	return hash_fold_ascii( w ) | ( w & ( HASH_ONES * 0x80 ) ) >> 2;
 }
 
-NODE_API int node_parse_from_data_dbgW( const char * psFile, int nLine, const void * pv, size_t nBytes, node_t ** ppn )
+/* ...a UTF-16 character at a time: past ASCII, the bit is set regardless */
+static inline unsigned __int64 hash_fold_chars( unsigned __int64 w )
 {
-	set_debug_allocator s(psFile, nLine);
-
-	if( pv == NULL || ppn == NULL )
-		return NP_INVALID;
+	unsigned __int64 nLow = w & ( HASH_ONES16 * 0x7FFF );
+	unsigned __int64 nUpper = ( nLow + HASH_ONES16 * ( 0x8000 - 'A' ) ) ^ ( nLow + HASH_ONES16 * ( 0x8000 - 'Z' - 1 ) );
+	unsigned __int64 nWide = ( nLow + HASH_ONES16 * ( 0x8000 - 0x80 ) ) | w;
 
-	return node_parse_from_data_internal( pv, nBytes, ppn, NODE_W );
+	return w | ( ( ( nUpper & ~w ) | nWide ) & ( HASH_ONES16 * 0x8000 ) ) >> 10;
 }
 
-static int NODE_INTERNAL_FUNC node_parse_internal( FILE * pfIn, node_t ** ppn, int nOutputStyle )
+/* up to 8 bytes of ps as a word, without reading past them: a short key is two loads that may overlap */
+static inline unsigned __int64 hash_word( const char * ps, size_t cb )
 {
-	/* save the file position */
-	fpos_t fpt = {0};
-	fgetpos( pfIn, &fpt );
-
-	/* read a block from pfIn */
-	data_t abData[512] = {0};
-	size_t nBytes = fread( abData, sizeof(data_t), sizeof(abData), pfIn );
-
-	/* evaluate its type */
-	int iFlags = 0xFFDD;
-	int nResult = IsTextUnicode( abData, (int)nBytes, &iFlags );
+	if( cb >= sizeof(unsigned __int64) )
+	{
+		unsigned __int64 w;
+		memcpy( &w, ps, sizeof(w) );
+		return w;
+	}
 
-	/* restore the file position */
-	fsetpos( pfIn, &fpt );
+	if( cb >= sizeof(unsigned int) )
+	{
+		unsigned int nLo, nHi;
+		memcpy( &nLo, ps, sizeof(nLo) );
+		memcpy( &nHi, ps + cb - sizeof(nHi), sizeof(nHi) );
+		return nLo | (unsigned __int64)nHi << ( ( cb - sizeof(nHi) ) * 8 );
+	}
 
-	NodeFileReader nr( pfIn, node_pArena );
+	if( cb >= sizeof(unsigned short) )
+	{
+		unsigned short nLo, nHi;
+		memcpy( &nLo, ps, sizeof(nLo) );
+		memcpy( &nHi, ps + cb - sizeof(nHi), sizeof(nHi) );
+		return nLo | (unsigned __int64)nHi << ( ( cb - sizeof(nHi) ) * 8 );
+	}
 
-	/* if the file is Unicode */
-	if( nResult > 0 )
-		return node_parse_internalW( &nr, ppn, nOutputStyle );
-	else
-		return node_parse_internalA( &nr, ppn, nOutputStyle );
+	return cb != 0 ? (unsigned char)ps[0] : 0;
 }
 
-template <class T> static const T * unterminated_strchr( const T * psStart, const T * psEnd, const int nChar )
+/* the last cb (less than 8) bytes before psEnd of a key at least 8 long: one load, overlapping the word before */
+static inline unsigned __int64 hash_tail( const char * psEnd, size_t cb )
 {
-	const T * psChar;
-
-	for( psChar = psStart; psChar < psEnd; ++psChar )
-		if( *psChar == nChar )
-			return psChar;
-
-	return NULL;
+	unsigned __int64 w;
+	memcpy( &w, psEnd - sizeof(w), sizeof(w) );
+	return w >> ( ( sizeof(w) - cb ) * 8 );
 }
 
-template <class T> static const T * unterminated_strrchr( const T * psStart, const T * psEnd, const int nChar )
+static inline unsigned __int64 hash_mix( unsigned __int64 nHash, unsigned __int64 w )
 {
-	const T * psChar;
+	nHash = ( nHash ^ w ) * HASH_MUL;
+	return nHash ^ ( nHash >> 32 );
+}
 
-	for( psChar = psEnd-1; psChar >= psStart; --psChar )
-		if( *psChar == nChar )
-			return psChar;
+/* every bit of the result depends on every bit of the key: probing uses the low bits */
+static inline unsigned int hash_finish( unsigned __int64 nHash, size_t nLength )
+{
+	nHash ^= nLength;
+	nHash ^= nHash >> 33;
+	nHash *= 0xFF51AFD7ED558CCDULL;
+	nHash ^= nHash >> 33;
+	nHash *= 0xC4CEB9FE1A85EC53ULL;
+	nHash ^= nHash >> 33;
+	return (unsigned int)nHash;
+}
 
-	return NULL;
+/* a key of one word needs less: the fold lets the second multiply's high half depend on every bit */
+static inline unsigned int hash_finish_word( unsigned __int64 w, size_t nLength )
+{
+	unsigned __int64 nHash = w * HASH_MUL;
+	nHash ^= ( nHash >> 32 ) ^ nLength;
+	nHash *= 0xFF51AFD7ED558CCDULL;
+	return (unsigned int)( nHash >> 32 );
 }
 
-template <class T> class TempSZ
+/* hash a string: the full 32 bits, of which a node keeps NODE_HASH_BITS */
+unsigned int NODE_INTERNAL_FUNC node_hashA( const char * psKey )
 {
-	node_arena * pArena;
-	T m_ac[32];
-	T* m_ps;
+	size_t nLength;
+	return hash_keyA( psKey, &nLength );
+}
 
-public:
-	TempSZ( node_arena * p, const T * psStart, const T * psEnd ) : pArena(p), m_ps(0)
-	{
-		size_t nLength = psEnd-psStart;
-		T* ps = NULL;
-		
-		if( nLength < sizeof( m_ac ) / sizeof(T) )
-		{
-			ps = m_ac;
-		}
-		else
-		{
-			ps = m_ps = (T*)node_malloc( pArena, (nLength + 1)*sizeof(T) );
-		}
+unsigned int NODE_INTERNAL_FUNC node_hashW( const wchar_t * psKey )
+{
+	size_t nLength;
+	return hash_keyW( psKey, &nLength );
+}
 
-		memcpy( ps, psStart, nLength * sizeof(T) );
-		ps[ nLength ] = 0;
-	}
-	~TempSZ()
-	{
-		if( m_ps )
-			nfree( pArena, m_ps );
-	}
+/* hash a key, and measure it */
+static unsigned int NODE_INTERNAL_FUNC hash_keyA( const char * psKey, size_t * pnLength )
+{
+	*pnLength = strlen( psKey );
+	return hash_key_nA( psKey, *pnLength );
+}
 
-	operator const T *()
-	{
-		return m_ps ? m_ps : m_ac;
-	}
-};
+static unsigned int NODE_INTERNAL_FUNC hash_keyW( const wchar_t * psKey, size_t * pnLength )
+{
+	*pnLength = wcslen( psKey );
+	return hash_key_nW( psKey, *pnLength );
+}
 
-/********************************************************************** 
- * read a node from a file 
- * return values: 
- *
- *  NP_NODE   : succesful read of node element
- *  NP_CPAREN : only thing on line is close paren
- *  NP_CBRACE : only thing on line is close brace
- *  NP_SERROR : syntax error reading line; skip this line
- *  NP_EOF    : end of file
- *
- *	for a return of NP_NODE, ppn is set to the node read; otherwise, it is set
- *	to NULL.
- ***********************************************************************/
-static int NODE_INTERNAL_FUNC node_parse_internalA( NodeReader * pnr, node_t ** ppn, int nOutputStyle )
+/* hash the first nLength characters of psKey, which need not be terminated */
+static unsigned int NODE_INTERNAL_FUNC hash_key_nA( const char * psKey, size_t nLength )
 {
-	const char * psLine = NULL;
-	const char * psEnd = NULL;
+	if( nLength <= sizeof(unsigned __int64) )
+		return hash_finish_word( 0x53378008 ^ hash_fold( hash_word( psKey, nLength ) ), nLength );
 
-	const char * psPos = NULL;
+	unsigned __int64 nHash = 0x53378008;
+	const char * pc = psKey;
+	size_t cb;
 
-	const char * psColon = NULL;
-	char * psName = NULL;
-	char * psUnescaped = NULL;
+	for( cb = nLength; cb >= sizeof(unsigned __int64); cb -= sizeof(unsigned __int64), pc += sizeof(unsigned __int64) )
+		nHash = hash_mix( nHash, hash_fold( hash_word( pc, cb ) ) );
 
-	node_t * pn = NULL;
-	node_t * pnChild = NULL;
-	const char * psType = NULL;
+	if( cb != 0 )
+		nHash = hash_mix( nHash, hash_fold( hash_tail( pc + cb, cb ) ) );
 
-	const char * psTrailingQuote = NULL;
+	return hash_finish( nHash, nLength );
+}
 
-	int nDataLength = 0;
-	data_t * pb = NULL;
-	int nRows = 0;
-	int i = 0;
-	int b = 0;
+/* four characters to a word, laid out as they are in memory */
+static unsigned int NODE_INTERNAL_FUNC hash_key_nW( const wchar_t * psKey, size_t nLength )
+{
+	const size_t cchWord = sizeof(unsigned __int64) / sizeof(unsigned short);
 
-	int nResult = 0;
-	node_arena * pArena = pnr->m_pArena;
+	if( sizeof(wchar_t) == sizeof(unsigned short) )
+	{
+		const char * pc = reinterpret_cast<const char *>( psKey );
+		size_t cb = nLength * sizeof(wchar_t);
 
-	/* initialize the returned node */
-	*ppn = NULL;
+		if( cb <= sizeof(unsigned __int64) )
+			return hash_finish_word( 0x55378008 ^ hash_fold_chars( hash_word( pc, cb ) ), nLength );
 
-	/* read a line */
-READ_LINE:
-	pnr->read_lineA( &psLine, &psEnd );
+		unsigned __int64 nHash = 0x55378008;
+		for( ; cb >= sizeof(unsigned __int64); cb -= sizeof(unsigned __int64), pc += sizeof(unsigned __int64) )
+			nHash = hash_mix( nHash, hash_fold_chars( hash_word( pc, cb ) ) );
 
-	/* if it fails */
-	if( psLine == NULL )
-		return NP_EOF;
+		if( cb != 0 )
+			nHash = hash_mix( nHash, hash_fold_chars( hash_tail( pc + cb, cb ) ) );
 
-	/* skip initial white-space */
-	for( psPos = psLine; psPos < psEnd; psPos++ )
-	{
-		if( !isspace( static_cast<unsigned char>( *psPos ) ) )
-			break;
+		return hash_finish( nHash, nLength );
 	}
 
-	/* what kind of line is this? */
+	/* a wider wchar_t makes the same words a character at a time */
+	unsigned __int64 nHash = 0x55378008;
+	unsigned __int64 w = 0;
 
-	/* if it's blank -- read another line */
-	if( psPos >= psEnd )
+	for( size_t i = 0; i < nLength; i++ )
 	{
-		pnr->free_line( psLine );
-		goto READ_LINE;
-	}
+		unsigned int c = (unsigned short)psKey[i];
+		if( c - 'A' <= 'Z' - 'A' || c >= 0x80 )
+			c |= 0x20;
 
-	/* if it's a close paren */
-	if( *psPos == ')' )
-	{
-		pnr->free_line( psLine );
-		return NP_CPAREN;
-	}
+		w |= (unsigned __int64)c << ( ( i % cchWord ) * 16 );
+		if( nLength <= cchWord )
+			continue;
 
-	/* if it's a close brace */
-	if( *psPos == '}' )
-	{
-		pnr->free_line( psLine );
-		return NP_CBRACE;
+		if( ( i + 1 ) % cchWord == 0 || i + 1 == nLength )
+		{
+			nHash = hash_mix( nHash, w );
+			w = 0;
+		}
 	}
 
-	/* it's a normal node */
+	if( nLength <= cchWord )
+		return hash_finish_word( nHash ^ w, nLength );
 
-	/* unescape the name */
-	psColon = unterminated_strchr<char>( psPos, psEnd, ':' );
+	return hash_finish( nHash, nLength );
+}
 
-	if( psColon == NULL )
-	{
-		node_error( "No colon on line.\n" );
-		goto PARSE_ERROR;
-	}
+/* the full hash of a node's name, and its length */
+static unsigned int NODE_INTERNAL_FUNC node_name_hash( const node_t * pn, size_t * pnLength )
+{
+	return pn->bNameW ? hash_keyW( pn->psWName, pnLength ) : hash_keyA( pn->psAName, pnLength );
+}
 
-	if( psColon != psPos )
+#ifdef HASH_USES_SSE2
+/* set the 'lower case' bit in each byte (A) or character (W) that is 'A'..'Z': shifted so 'A' is the
+   smallest signed value, one signed compare finds the range */
+static inline __m128i key_fold_bytes( __m128i v )
+{
+	__m128i vUpper = _mm_cmplt_epi8( _mm_add_epi8( v, _mm_set1_epi8( (char)( 0x80 - 'A' ) ) ), _mm_set1_epi8( (char)( 0x80 + 'Z' - 'A' + 1 ) ) );
+	return _mm_or_si128( v, _mm_and_si128( vUpper, _mm_set1_epi8( 0x20 ) ) );
+}
+
+static inline __m128i key_fold_chars( __m128i v )
+{
+	__m128i vUpper = _mm_cmplt_epi16( _mm_add_epi16( v, _mm_set1_epi16( (short)( 0x8000 - 'A' ) ) ), _mm_set1_epi16( (short)( 0x8000 + 'Z' - 'A' + 1 ) ) );
+	return _mm_or_si128( v, _mm_and_si128( vUpper, _mm_set1_epi16( 0x20 ) ) );
+}
+#endif
+
+/* two keys of cch characters are equal ignoring case: ASCII is folded a block at a time, and only
+   a block that differs past ASCII is left to the locale, from that block on. The last block of a
+   key overlaps the one before it rather than reading past the key, so neither need be terminated */
+static inline int key_equalA( const char * ps1, const char * ps2, size_t cch )
+{
+	size_t i, n;
+
+#ifdef HASH_USES_SSE2
+	if( cch >= sizeof(__m128i) )
 	{
-		psName = node_unescapeA( pArena, psPos, psColon );
+		for( i = 0; i < cch; i += sizeof(__m128i) )
+		{
+			n = __min( i, cch - sizeof(__m128i) );
+			__m128i v1 = _mm_loadu_si128( (const __m128i *)( ps1 + n ) );
+			__m128i v2 = _mm_loadu_si128( (const __m128i *)( ps2 + n ) );
+			if( _mm_movemask_epi8( _mm_cmpeq_epi8( key_fold_bytes( v1 ), key_fold_bytes( v2 ) ) ) != 0xFFFF )
+				return _mm_movemask_epi8( _mm_or_si128( v1, v2 ) ) != 0 && _strnicmp( ps1 + n, ps2 + n, cch - n ) == 0;
+		}
+		return TRUE;
 	}
+#endif
 
-	/* figure out the node type */
-	for( psType = psColon+1; psType < psEnd; psType++ )
-		if( !isspace( *psType ) )
-			break;
-
-	/* allocate a new node */
-	pn = node_alloc_internal( pArena );
-	if( psName != NULL )
+	for( i = 0; i < cch; i += sizeof(unsigned __int64) )
 	{
-		if( nOutputStyle == NODE_A )
+		unsigned __int64 w1, w2;
+		if( cch >= sizeof(unsigned __int64) )
 		{
-			node_set_nameA_internal( pn, psName );
+			n = __min( i, cch - sizeof(unsigned __int64) );
+			memcpy( &w1, ps1 + n, sizeof(w1) );
+			memcpy( &w2, ps2 + n, sizeof(w2) );
 		}
 		else
 		{
-			wchar_t * psW = AToW( pArena, psName );
-			node_set_nameW_internal( pn, psW );
-			nfree( pArena, psW );
+			n = 0;
+			w1 = hash_word( ps1, cch );
+			w2 = hash_word( ps2, cch );
 		}
 
-		nfree( pArena, psName );
+		if( hash_fold_ascii( w1 ) != hash_fold_ascii( w2 ) )
+			return ( ( w1 | w2 ) & ( HASH_ONES * 0x80 ) ) != 0 && _strnicmp( ps1 + n, ps2 + n, cch - n ) == 0;
 	}
 
-	/* switch the node type */
-	switch( *psType )
-	{
-	case '.': case '0': case '1': case '2': case '3': case '4':
-	case '-': case '5': case '6': case '7': case '8': case '9':
-		{
-			TempSZ<char> psValue( pArena, psType, psEnd );
+	return TRUE;
+}
 
-			if( strchr( psValue, '.' ) != NULL )
-				node_set_real( pn, strtod( psValue, NULL ) );
-			else if( strchr( psValue, 'L' ) != NULL )
-				node_set_int64( pn, _atoi64( psValue ) );
-			else
-				node_set_int( pn, atoi( psValue ) );
-		}
-		break;
+static inline int key_equalW( const wchar_t * ps1, const wchar_t * ps2, size_t cch )
+{
+	size_t i, n;
 
-	case '"':
-		/* remove trailing quote */
-		psTrailingQuote = unterminated_strrchr<char>( psType, psEnd, '"' );
-		if( psTrailingQuote == NULL || psTrailingQuote <= psType )
+#ifdef HASH_USES_SSE2
+	/* eight UTF-16 characters at a time */
+	if( sizeof(wchar_t) == 2 && cch >= sizeof(__m128i) / sizeof(wchar_t) )
+	{
+		for( i = 0; i < cch; i += sizeof(__m128i) / sizeof(wchar_t) )
 		{
-			node_error( "Unterminated string.\n" );
-			goto PARSE_ERROR;
+			n = __min( i, cch - sizeof(__m128i) / sizeof(wchar_t) );
+			__m128i v1 = _mm_loadu_si128( (const __m128i *)( ps1 + n ) );
+			__m128i v2 = _mm_loadu_si128( (const __m128i *)( ps2 + n ) );
+			if( _mm_movemask_epi8( _mm_cmpeq_epi16( key_fold_chars( v1 ), key_fold_chars( v2 ) ) ) != 0xFFFF )
+			{
+				__m128i vWide = _mm_and_si128( _mm_or_si128( v1, v2 ), _mm_set1_epi16( (short)0xFF80 ) );
+				return _mm_movemask_epi8( _mm_cmpeq_epi16( vWide, _mm_setzero_si128() ) ) != 0xFFFF && _wcsnicmp( ps1 + n, ps2 + n, cch - n ) == 0;
+			}
 		}
+		return TRUE;
+	}
+#endif
 
-		if( nOutputStyle == NODE_A )
-			node_set_stringA_internal( pn, psType+1, psTrailingQuote );
-		else
-		{
-			wchar_t * psW = AToW( pArena, psType+1, psTrailingQuote );
-			node_set_stringW_internal( pn, psW );
-			nfree( pArena, psW );
-		}
+	for( i = 0; i < cch; i++ )
+	{
+		unsigned int c1 = ps1[i], c2 = ps2[i];
+		if( c1 - 'A' <= 'Z' - 'A' )
+			c1 |= 0x20;
+		if( c2 - 'A' <= 'Z' - 'A' )
+			c2 |= 0x20;
+		if( c1 != c2 )
+			return ( c1 >= 0x80 || c2 >= 0x80 ) && _wcsnicmp( ps1 + i, ps2 + i, cch - i ) == 0;
+	}
 
-		break;
+	return TRUE;
+}
 
-	case '\'':
-		/* remove trailing quote */
-		psTrailingQuote = unterminated_strrchr<char>( psType, psEnd, '\'' );
-		if( psTrailingQuote == NULL || psTrailingQuote <= psType )
+/* a name longer than the table keeps the length of must still be exactly cch long */
+static int NODE_INTERNAL_FUNC key_equal_longA( const char * psName, const char * psKey, size_t cch )
+{
+	return strlen( psName ) == cch && _strnicmp( psName, psKey, cch ) == 0;
+}
+
+static int NODE_INTERNAL_FUNC key_equal_longW( const wchar_t * psName, const wchar_t * psKey, size_t cch )
+{
+	return wcslen( psName ) == cch && _wcsnicmp( psName, psKey, cch ) == 0;
+}
+
+static void NODE_INTERNAL_FUNC node_cleanup( node_tls * ptls, node_t * pn )
+{
+	/* on node_cleanup, make sure all members are freed and zeroed */
+	switch( pn->nType )
+	{
+	case NODE_STRINGA:
+	case NODE_STRINGW:
+		/* because of implicit conversion, must clear both strings together */
+		if( pn->psAValue != NULL && !IS_BAG( pn, pn->psAValue ) )
 		{
-			node_error( "Unterminated string.\n" );
-			goto PARSE_ERROR;
+			/* conversion caches are not counted, only the value itself */
+			if( pn->nType == NODE_STRINGA )
+				NODE_STAT_CTX( ptls, GET_ARENA( pn ), cbStrings -= strlen( pn->psAValue ) + 1 );
+			nfree( GET_ARENA( pn ), pn->psAValue );
 		}
 
-		psUnescaped = node_unescapeA( pArena, psType+1, psTrailingQuote );
-
-		if( nOutputStyle == NODE_A )
-			node_set_stringA_internal( pn, psUnescaped );
-		else
+		if( pn->psWValue != NULL && !IS_BAG( pn, pn->psWValue ) )
 		{
-			wchar_t * psW = AToW( pArena, psUnescaped );
-			node_set_stringW_internal( pn, psW );
-			nfree( pArena, psW );
+			if( pn->nType == NODE_STRINGW )
+				NODE_STAT_CTX( ptls, GET_ARENA( pn ), cbStrings -= (wcslen( pn->psWValue ) + 1) * sizeof(wchar_t) );
+			nfree( GET_ARENA( pn ), pn->psWValue );
 		}
 
-		nfree( pArena, psUnescaped );
-		break;
-
-	case 'P':
-		/* handle reading in pointer value: use NULL */
-		node_set_ptr( pn, NULL );
+		pn->psAValue = NULL;
+		pn->psWValue = NULL;
 		break;
-	
-	case 'D':
-		nDataLength = atoi( psType + 4 );
-		pb = (data_t *)node_malloc( pArena, nDataLength );
 
-		/* loop over the rows of the binary data */
-		for( nRows = 0; nRows < (nDataLength+15)/16; nRows++ )
+	case NODE_INT:
+	case NODE_INT64:
+	case NODE_REAL:
+		if( pn->pStrings != NULL )
 		{
-			/* read a new line */
-			const char * psData = NULL;;
-			const char * psDataEnd = NULL;
-			
-			pnr->read_lineA( &psData, &psDataEnd );
-			const char * psCursor = psData+1;
-
-			for( i = nRows*16; i < nDataLength && i < (nRows+1)*16; i++ )
-			{
-				/* skip whitespace */
-				psCursor += strspn( psCursor, " " );
-
-				/* convert the hex data to a byte */
-				b = strtoul( psCursor, NULL, 16 );
-				psCursor += 2;
-
-				/* set the data */
-				pb[i] = (data_t)b;
-			}
-			pnr->free_line( psData );
+			nfree( GET_ARENA( pn ), pn->pStrings->psAValue );
+			nfree( GET_ARENA( pn ), pn->pStrings->psWValue );
+			nfree( GET_ARENA( pn ), pn->pStrings );
 		}
 
-		node_set_data( pn, nDataLength, pb );
-		nfree( pArena, pb );
+		pn->pStrings = NULL;
+		pn->dfValue = 0.0;
 		break;
 
-	case '(':
-		node_list_init( pn );
-		while( (nResult = node_parse_internalA( pnr, &pnChild, nOutputStyle ) ) == NP_NODE )
-		{
-			node_list_add_internal( pn, pnChild );
-		}
+	case NODE_PTR:
+		pn->pvValue = 0;
+		break;
 
-		if( nResult != NP_CPAREN )
+	case NODE_DATA:
+		if( pn->pbValue != NULL && !IS_BAG( pn, pn->pbValue ) )
 		{
-			node_error( "No close paren for list.\n" );
-			goto PARSE_ERROR;
+			NODE_STAT_CTX( ptls, GET_ARENA( pn ), cbData -= pn->nDataLength );
+			nfree( GET_ARENA( pn ), pn->pbValue );
 		}
-
+		pn->pbValue = NULL;
+		pn->nDataLength = 0;
 		break;
-	case '{':
+	case NODE_LIST:
+		node_free_internal( node_first( pn ), IN_COLLECTION );
+		SET_LIST_HEAD( pn, NULL );
+		SET_LIST_TAIL( pn, NULL );
+		pn->nListElements = 0;
+		break;
+	case NODE_HASH:
+#ifdef _DEBUG
+		if( node_nDebugHashPerf )
 		{
-			node_t * pnList = node_list_alloc();
-			while( (nResult = node_parse_internalA( pnr, &pnChild, nOutputStyle ) ) == NP_NODE )
+			if( pn->psHashAllocated != NULL )
 			{
-				if( nOutputStyle == NODE_A )
-				{
-					if( pnChild->psAName != NULL )
-						node_push_internal( pnList, pnChild );
-					else
-					{
-						node_free( pnChild );
-						node_error( "Child of hash has no name -- skipping.\n" );
-					}
-				}
-				else
+				int nMaxElts = pn->nHashFlags>>8;
+				/* check and report load factor */
+				double dfLoad = (double)nMaxElts/pn->nHashSlots;
+				
+				if( dfLoad > node_dfLoadLimit || ( pn->nHashSlots > 128 && dfLoad < 0.001 ) )
 				{
-					if( pnChild->psWName != NULL )
-						node_push_internal( pnList, pnChild );
-					else
-					{
-						node_free( pnChild );
-						node_error( "Child of hash has no name -- skipping.\n" );
-					}
+					char acBuffer[1024];
+					sprintf( acBuffer, "%s Node hash debugging: hash has load factor %.2f (%d/%d)\n",
+						pn->psHashAllocated, dfLoad, nMaxElts, pn->nHashSlots );
+//					fputs( acBuffer, stderr );
+					OutputDebugStringA( acBuffer );
 				}
-			}
 
-			if( nResult != NP_CBRACE )
-			{
-				node_error( "No close brace for hash.\n" );
-				node_free( pnList );
-				goto PARSE_ERROR;
+				nfree( GET_ARENA( pn ), pn->psHashAllocated );
 			}
+		}
+#endif
 
-			node_hash_init( pn, __max( DEFAULT_HASHBUCKETS, pnList->nListElements>>3 )  );
-
-			while( pnList->nListElements != 0 )
-				node_hash_add_internal( pn, node_pop_internal( pnList ) );
+		{
+			hash_iter it( pn );
+			node_t * pnElement;
+			while( ( pnElement = it.next() ) != NULL )
+				node_free_internal( pnElement, IN_COLLECTION );
+		}
+		if( pn->nHashFlags & HASH_MIGRATING )
+		{
+			hash_migration * pm = HASH_MIGRATION( pn );
+			hash_table_free( ptls, pn, pm->ppnOld, pm->nOldSlots );
+			pn->nHashFlags &= ~HASH_MIGRATING;
+		}
+		if( pn->nHashFlags & HASH_FROZEN )
+		{
+			hash_frozen_free( pn, pn->ppnHashSlots, pn->nHashSlots );
+			pn->nHashFlags &= ~HASH_FROZEN;
+		}
+		else if( pn->nHashFlags & HASH_SHARED )
+			hash_unshare( pn );
+		else if( pn->ppnHashSlots != NULL )
+			hash_table_free( ptls, pn, pn->ppnHashSlots, pn->nHashSlots );
 
-			node_free( pnList );
+		pn->ppnHashSlots = NULL;
 
-		}
+		pn->nHashSlots = 0;
+		pn->nHashGrowth = 0;
+		pn->nHashElements = 0;
 		break;
 	}
-
-	pnr->free_line( psLine );
-	*ppn = pn;
-	return NP_NODE;
-
-PARSE_ERROR:
-	if( pn != NULL )
-		node_free_internal( pn, NOT_IN_COLLECTION );
-	pnr->free_line( psLine );
-	
-	return NP_SERROR;
+	pn->nType = NODE_UNKNOWN;
+	pn->bBagUsed = NAME_IN_BAG( pn );
 }
 
-static int NODE_INTERNAL_FUNC node_parse_internalW( NodeReader *pnr, node_t ** ppn, int nOutputStyle )
+/* walk the children of a hash without allocating */
+NODE_API node_t * node_hash_iter_begin( const node_t * pnHash, node_hash_iter_t * pIter )
 {
-	const wchar_t * psLine = NULL;
-	const wchar_t * psEnd = NULL;
-	const wchar_t * psPos = NULL;
-
-	const wchar_t * psColon = NULL;
-	wchar_t * psName = NULL;
-	wchar_t * psUnescaped = NULL;
-
-	node_t * pn = NULL;
-	node_t * pnChild = NULL;
-	const wchar_t * psType = NULL;
+	if( pnHash == NULL || pIter == NULL )
+	{
+		node_assert( pnHash != NULL );
+		node_assert( pIter != NULL );
+		return NULL;
+	}
 
-	const wchar_t * psTrailingQuote = NULL;
+	/* if pnHash is not a hash node */
+	if( pnHash->nType != NODE_HASH )
+	{
+		node_assert( pnHash->nType == NODE_HASH );
+		pIter->pnHash = NULL;
+		return NULL;
+	}
 
-	int nDataLength = 0;
-	data_t * pb = NULL;
-	int nRows = 0;
-	int i = 0;
-	const wchar_t * psData = NULL;
-	const wchar_t * psCursor = NULL;
-	int b = 0;
+	hash_iter_start( pIter, pnHash );
+	return node_hash_iter_next( pIter );
+}
 
-	node_arena * pArena = pnr->m_pArena;
+NODE_API node_t * node_hash_iter_next( node_hash_iter_t * pIter )
+{
+	if( pIter == NULL )
+	{
+		node_assert( pIter != NULL );
+		return NULL;
+	}
 
-	int nResult = 0;
+	/* a walk of something that was not a hash is already over */
+	if( pIter->pnHash == NULL )
+		return NULL;
 
-	/* initialize the returned node */
-	*ppn = NULL;
+	int nSlot;
+	return hash_iter_step( pIter, &nSlot );
+}
 
-	/* read a line */
-READ_LINE:
-	pnr->read_lineW( &psLine, &psEnd );
+/* node_hash_keys 
+ * This function returns a newly-allocated list node containing 
+ * a list of the key strings for hash pnHash. 
+ */
+NODE_API node_t * node_hash_keys_dbgA( const char * psFile, int nLine, const node_t * pnHash ) 
+{
+	set_debug_allocator s( psFile, nLine );
+	return node_hash_keysA( pnHash );
+}
 
-	/* if it fails */
-	if( psLine == NULL )
-		return NP_EOF;
 
-	/* skip initial white-space */
-	for( psPos = psLine; psPos < psEnd; ++psPos )
-		if( !iswspace( *psPos ) )
-			break;
+NODE_API node_t * node_hash_keysA( const node_t * pnHash ) 
+{
+	node_t * pnList = NULL;
+	node_t * pn = NULL;
+	node_tls * ptls = NODE_CACHE_CTX;
 
-	/* what kind of line is this? */
+	if( pnHash == NULL )
+	{
+		node_assert( pnHash != NULL );
+		return NULL;
+	}
 
-	/* if it's blank -- read another line */
-	if( psPos >= psEnd )
+	/* if pnHash is not a hash node */
+	if( pnHash->nType != NODE_HASH )
 	{
-		pnr->free_line( psLine );
-		goto READ_LINE;
+		node_assert( pnHash->nType == NODE_HASH );
+		/* return the list */
+		return node_list_alloc();
 	}
 
-	/* if it's a close paren */
-	if( *psPos == ')' )
+	if( node_nDebugUnicode )
 	{
-		pnr->free_line( psLine );
-		return NP_CPAREN;
+		/* check that there are no W keys in this hash */
+		if( pnHash->nHashFlags & HASH_CONTAINS_WKEYS )
+		{
+			node_error( "Attempting to get A keys from hash which contains W keys.\n" );
+			node_assert( (pnHash->nHashFlags & HASH_CONTAINS_WKEYS) == 0 );
+			return node_list_alloc();
+		}
 	}
 
-	/* if it's a close brace */
-	if( *psPos == '}' )
+	/* allocate a list node */
+	pnList = node_alloc_internal( node_pArena );
+	if( pnList == NULL )
+		return NULL;
+	node_list_init( ptls, pnList );
+
+	/* for each child, including any not yet moved out of an old table */
+	hash_iter it( pnHash );
+	while( ( pn = it.next() ) != NULL )
 	{
-		pnr->free_line( psLine );
-		return NP_CBRACE;
+		node_t * pnName = node_alloc_internal( GET_ARENA( pnList ) );
+		if( pnName == NULL || !node_set_stringA_internal( ptls, pnName, NODE_NAMEA( pn ) ) )
+		{
+			if( pnName != NULL )
+				node_free_internal( pnName, NOT_IN_COLLECTION );
+			node_free_internal( pnList, NOT_IN_COLLECTION );
+			return NULL;
+		}
+
+		node_list_add_internal( pnList, pnName );
 	}
 
-	/* it's a normal node */
+	/* return the list */
+	return pnList;
+}
 
-	/* unescape the name */
-	psColon = unterminated_strchr<wchar_t>( psPos, psEnd, ':' );
-	if( psColon == NULL )
-		goto PARSE_ERROR;
+NODE_API node_t * node_hash_keys_dbgW( const char * psFile, int nLine, const node_t * pnHash ) 
+{
+	set_debug_allocator s(psFile, nLine);
+	return node_hash_keysW( pnHash );
+}
+
+NODE_API node_t * node_hash_keysW( const node_t * pnHash ) 
+{
+	node_t * pnList = NULL;
+	node_t * pn = NULL;
+	node_tls * ptls = NODE_CACHE_CTX;
+
+	if( pnHash == NULL )
+	{
+		node_assert( pnHash != NULL );
+		return NULL;
+	}
 
-	if( psColon != psPos )
+	/* if pnHash is not a hash node */
+	if( pnHash->nType != NODE_HASH )
 	{
-		psName = node_unescapeW( pArena, psPos, psColon );
+		node_assert( pnHash->nType == NODE_HASH );
+		/* return the list */
+		return node_list_alloc();
 	}
 
-	/* figure out the node type */
-	for( psType = psColon+1; psType < psEnd; psType++ )
-		if( !iswspace( *psType ) )
-			break;
-
-	/* allocate a new node */
-	pn = node_alloc_internal( pArena );
-	if( psName != NULL )
+	if( node_nDebugUnicode )
 	{
-		if( nOutputStyle == NODE_W )
+		/* check that there are no W keys in this hash */
+		if( pnHash->nHashFlags & HASH_CONTAINS_AKEYS )
 		{
-			node_set_nameW_internal( pn, psName );
+			node_error( "Attempting to get W keys from hash which contains A keys.\n" );
+			node_assert( (pnHash->nHashFlags & HASH_CONTAINS_AKEYS) == 0 );
+			return node_list_alloc();
 		}
-		else
+	}
+
+	/* allocate a list node */
+	pnList = node_alloc_internal( node_pArena );
+	if( pnList == NULL )
+		return NULL;
+	node_list_init( ptls, pnList );
+
+	/* for each child, including any not yet moved out of an old table */
+	hash_iter it( pnHash );
+	while( ( pn = it.next() ) != NULL )
+	{
+		node_t * pnName = node_alloc_internal( GET_ARENA( pnList ) );
+		if( pnName == NULL || !node_set_stringW_internal( ptls, pnName, NODE_NAMEW( pn ) ) )
 		{
-			/* TODO: warn possible loss of data */
-			char * psA = WToA( pArena, psName );
-			node_set_nameA_internal( pn, psA );
-			nfree( pArena, psA );
+			if( pnName != NULL )
+				node_free_internal( pnName, NOT_IN_COLLECTION );
+			node_free_internal( pnList, NOT_IN_COLLECTION );
+			return NULL;
 		}
 
-		nfree( pArena, psName );
+		node_list_add_internal( pnList, pnName );
 	}
 
-	/* switch the node type */
-	switch( *psType )
-	{
-		/* TODO: possibly worry about localized numbers output */
-	case '.': case '0': case '1': case '2': case '3': case '4':
-	case '-': case '5': case '6': case '7': case '8': case '9':
-		{
-			TempSZ<wchar_t> psValue( pArena, psType, psEnd );
+	/* return the list */
+	return pnList;
+}
 
-			if( wcschr( psValue, '.' ) != NULL )
-				node_set_real( pn, wcstod( psValue, NULL ) );
-			else if( wcschr( psValue, 'L' ) != NULL )
-				node_set_int64( pn, _wtoi64( psValue ) );
-			else
-				node_set_int( pn, wcstol( psValue, NULL, 10 ) );
-		}
-		break;
+static char * NODE_INTERNAL_FUNC read_lineA( node_arena * pArena, FILE * pfIn, char ** ppsEnd )
+{
+	int nBufferSize = 40;
+	char * psBuffer = NULL;
+	int nBytesRead = 0;
+	int nChar = 0;
 
-	case '"':
-		/* remove trailing quote */
-		psTrailingQuote = unterminated_strrchr<wchar_t>( psType, psEnd, '"' );
-		if( psTrailingQuote == NULL || psTrailingQuote <= psType )
-		{
-			node_error( "Unterminated string.\n" );
-			goto PARSE_ERROR;
-		}
+	/* initialize output arg */
+	*ppsEnd = NULL;
 
-		if( nOutputStyle == NODE_W )
-			node_set_stringW_internal( pn, psType+1, psTrailingQuote );
-		else
-		{
-			char * psA = WToA( pArena, psType+1, psTrailingQuote );
-			node_set_stringA_internal( pn, psA );
-			nfree( pArena, psA );
-		}
+	/* check for end-of-file */
+	nChar = fgetc( pfIn );
+	if( feof( pfIn ) )
+		return NULL;
+	else
+		ungetc( nChar, pfIn );
 
-		break;
+	/* allocate initial buffer */
+	psBuffer = (char *)node_malloc( pArena, nBufferSize );
+	if( psBuffer == NULL )
+		return NULL;
 
-	case '\'':
-		/* remove trailing quote */
-		psTrailingQuote = unterminated_strrchr<wchar_t>( psType, psEnd, '\'' );
-		if( psTrailingQuote == NULL || psTrailingQuote <= psType )
-		{
-			node_error( "Unterminated string.\n" );
-			goto PARSE_ERROR;
-		}
+	for(;;)
+	{
+		/* read a character */
+		nChar = fgetc( pfIn );
 
-		psUnescaped = node_unescapeW( pArena, psType+1, psTrailingQuote );
+		/* if the character was EOF */
+		if( nChar == EOF )
+			break;
 
-		if( nOutputStyle == NODE_W )
-			node_set_stringW_internal( pn, psUnescaped );
-		else
-		{
-			char * psA = WToA( pArena, psUnescaped );
-			node_set_stringA_internal( pn, psA );
-			nfree( pArena, psA );
-		}
+		/* increment the read count */
+		nBytesRead++;
 
-		nfree( pArena, psUnescaped );
-		break;
-	
-	case 'D':
-		nDataLength = wcstol( psType + 4, NULL, 10 );
-		pb = (data_t *)node_malloc( pArena, nDataLength );
-		/* loop over the rows of the binary data */
-		for( nRows = 0; nRows < (nDataLength+15)/16; nRows++ )
+		/* if we're past the length of the buffer */
+		if( nBytesRead >= nBufferSize )
 		{
-			const wchar_t * psDataEnd;
+			char * psNewBuffer = NULL;
 
-			/* read a new line */
-			pnr->read_lineW( &psData, &psDataEnd );
-			psCursor = psData+1;
+			/* increase the buffer size */
+			nBufferSize *= 2;
 
-			for( i = nRows*16; i < nDataLength && i < (nRows+1)*16; i++ )
+			/* reallocate the buffer */
+			psNewBuffer = (char*)node_malloc( pArena, nBufferSize );
+			if( psNewBuffer == NULL )
 			{
-				/* skip whitespace */
-				psCursor += wcsspn( psCursor, L" " );
+				nfree( pArena, psBuffer );
+				return NULL;
+			}
 
-				/* convert the hex data to a byte */
-				b = wcstoul( psCursor, NULL, 16 );
-				psCursor += 2;
+			/* copy the old buffer onto the new one */
+			memcpy( psNewBuffer, psBuffer, nBufferSize/2 );
 
-				/* set the data */
-				pb[i] = (data_t)b;
-			}
-			pnr->free_line( psData );
+			nfree( pArena, psBuffer );
+			psBuffer = psNewBuffer;
 		}
 
-		node_set_data( pn, nDataLength, pb );
-		nfree( pArena, pb );
-		break;
+		/* store the character in the buffer */
+		psBuffer[ nBytesRead-1 ] = (char)nChar;
 
-	case 'P':
-		/* handle reading in pointer value: use NULL */
-		node_set_ptr( pn, NULL );
-		break;
+		/* if the character was a newline */
+		if( nChar == '\n' )
+			break;
+	}
 
-	case '(':
-		node_list_init( pn );
-		while( (nResult = node_parse_internalW( pnr, &pnChild, nOutputStyle ) ) == NP_NODE )
-		{
-			node_list_add_internal( pn, pnChild );
-		}
+	/* terminate the buffer */
+	int nEnd = nBytesRead;
 
-		if( nResult != NP_CPAREN )
-		{
-			node_error( "No close paren for list.\n" );
-			goto PARSE_ERROR;
-		}
+	if( nBytesRead >= 1 && psBuffer[ nBytesRead-1 ] == '\n' )
+		nEnd = nBytesRead - 1;
 
-		break;
-	case '{':
+	if( nBytesRead >= 2 &&psBuffer[ nBytesRead-2 ] == '\r' )
+		nEnd = nBytesRead - 2;
+
+	psBuffer[ nEnd ] = '\0';
+	*ppsEnd = psBuffer + nEnd;
+
+	/* return the read string */
+	return psBuffer;
+}
+
+static wchar_t * NODE_INTERNAL_FUNC read_lineW( node_arena * pArena, FILE * pfIn, wchar_t ** ppsEnd )
+{
+	int nBufferSize = 40;
+	wchar_t * psBuffer = NULL;
+	int nCharsRead = 0;
+	wchar_t nChar = 0;
+
+	/* check for end-of-file */
+	nChar = fgetwc( pfIn );
+	if( feof( pfIn ) )
+		return NULL;
+	else
+		ungetwc( nChar, pfIn );
+
+	/* allocate initial buffer */
+	psBuffer = (wchar_t *)node_malloc( pArena, nBufferSize * sizeof(wchar_t) );
+	if( psBuffer == NULL )
+		return NULL;
+
+	for(;;)
+	{
+READ_CHAR:
+		/* read a character */
+		nChar = fgetwc( pfIn );
+
+		/* if the character was EOF */
+		if( nChar == WEOF )
+			break;
+
+		/* if byte-order marker, skip */
+		/* TODO: handle other-endian unicode files */
+		if( nChar == NODE_BOM )
+			goto READ_CHAR;
+
+		/* increment the read count */
+		nCharsRead++;
+
+		/* if we're past the length of the buffer */
+		if( nCharsRead >= nBufferSize )
 		{
-			node_t * pnList = node_list_alloc();
+			wchar_t * psNewBuffer = NULL;
 
-			while( (nResult = node_parse_internalW( pnr, &pnChild, nOutputStyle ) ) == NP_NODE )
-			{
-				if( nOutputStyle == NODE_A )
-				{
-					if( pnChild->psAName != NULL )
-						node_push_internal( pnList, pnChild );
-					else
-					{
-						node_free( pnChild );
-						node_error( "Child of hash has no name -- skipping.\n" );
-					}
-				}
-				else
-				{
-					if( pnChild->psWName != NULL )
-						node_push_internal( pnList, pnChild );
-					else
-					{
-						node_free( pnChild );
-						node_error( "Child of hash has no name -- skipping.\n" );
-					}
-				}
-			}
+			/* increase the buffer size */
+			nBufferSize *= 2;
 
-			if( nResult != NP_CBRACE )
+			/* reallocate the buffer */
+			psNewBuffer = (wchar_t*)node_malloc( pArena, nBufferSize * sizeof(wchar_t) );
+			if( psNewBuffer == NULL )
 			{
-				node_error( "No close brace for hash.\n" );
-				node_free( pnList );
-				goto PARSE_ERROR;
+				nfree( pArena, psBuffer );
+				return NULL;
 			}
 
-			node_hash_init( pn, __max( DEFAULT_HASHBUCKETS, pnList->nListElements>>3 )  );
-
-			while( pnList->nListElements != 0 )
-				node_hash_add_internal( pn, node_pop_internal( pnList ) );
-
-			node_free( pnList );
-	
-		}
-		break;
-	}
+			/* copy the old buffer onto the new one */
+			memcpy( psNewBuffer, psBuffer, (nBufferSize/2) * sizeof(wchar_t) );
 
-	pnr->free_line( psLine );
-	*ppn = pn;
-	return NP_NODE;
+			nfree( pArena, psBuffer );
+			psBuffer = psNewBuffer;
+		}
 
-PARSE_ERROR:
-	if( pn != NULL )
-		node_free_internal( pn, NOT_IN_COLLECTION );
-	pnr->free_line( psLine );
-	
-	return NP_SERROR;
-}
+		/* store the character in the buffer */
+		psBuffer[ nCharsRead-1 ] = (wchar_t)nChar;
 
+		/* if the character was a newline */
+		if( nChar == '\n' )
+			break;
+	}
 
-/*****************
- Utility Functions
- *****************/
+	int nEnd = nCharsRead;
 
-/* deep copy a node */
-NODE_API node_t * node_copy_dbg( const char * psFile, int nLine, const node_t *pnSource )
-{
-	set_debug_allocator s( psFile, nLine );
+	if( nCharsRead >= 1 && psBuffer[ nCharsRead-1 ] == '\n' )
+		nEnd = nCharsRead - 1;
 
-	return node_copy( pnSource );
-}
+	if( nCharsRead >= 2 &&psBuffer[ nCharsRead-2 ] == '\r' )
+		nEnd = nCharsRead - 2;
 
-NODE_API node_t * node_copy( const node_t *pnSource )
-{
-	/* if it's NULL, return NULL */
-	if( pnSource == NULL )
-	{
-		return NULL;
-	}
+	psBuffer[ nEnd ] = '\0';
+	*ppsEnd = psBuffer + nEnd;
 
-	return node_copy_internal( node_pArena, pnSource );
+	/* return the read string */
+	return psBuffer;
 }
 
-static node_t * NODE_INTERNAL_FUNC node_copy_internal( node_arena * pArena, const node_t * pnSource )
+static char * NODE_INTERNAL_FUNC node_escapeA( struct node_arena * pArena, const char * psUnescaped )
 {
-	int i;
-
-	node_t * pnCopy = NULL;
-	node_t * pn = NULL;
+	char * psEscaped = NULL;
+	char * psE = NULL;
+	const char * psU = NULL;
 
-	/* allocate new node */
-	pnCopy = node_alloc_internal( pArena );
+	psEscaped = (char *)node_malloc( pArena, 3*strlen(psUnescaped) + 1 );
+	if( psEscaped == NULL )
+		return NULL;
 
-	if( pnSource->nType == NODE_HASH )
-	{
-		node_hash_init( pnCopy, pnSource->nHashBuckets );
-		pnCopy->nHashFlags = pnSource->nHashFlags;
-	}
-	else if( pnSource->nType == NODE_LIST )
+	psE = psEscaped;
+	psU = psUnescaped;
+	while( *psU != '\0' )
 	{
-		node_list_init( pnCopy );
-	}
+		if( ( psU == psUnescaped && ( *psU == '}' || *psU == ')' || *psU == '$' ) ) ||
+			*psU == '%' || *psU == ':' || *psU == '\r' || *psU == '\n' )
+		{
+			/* write out a percent */
+			*psE++ = '%';
 
-	/* copy the type */
-	pnCopy->nType = pnSource->nType;
-	pnCopy->nHash = pnSource->nHash;
+			/* write out the hex code */
+			sprintf( psE, "%02X", *psU );
+			psU++;
+			psE += 2;
+		}
+		else
+		{
+			*psE++ = *psU++;
+		}
+	}
+	*psE = '\0';
 
-	/* copy is not in a collection */
-	pnCopy->bInCollection = NOT_IN_COLLECTION;
+	return psEscaped;
+}
 
-	/* copy the name */
-	if( pnSource->psAName != NULL )
-		pnCopy->psAName = node_safe_copyA( pArena, pnSource->psAName );
-	if( pnSource->psWName != NULL )
-		pnCopy->psWName = node_safe_copyW( pArena, pnSource->psWName );
+static wchar_t * NODE_INTERNAL_FUNC node_escapeW( struct node_arena * pArena, const wchar_t * psUnescaped )
+{
+	wchar_t * psEscaped = NULL;
+	wchar_t * psE = NULL;
+	const wchar_t * psU = NULL;
 
-	/* if there's a pnNext, ignore it */
-	pnCopy->pnNext = NULL;
+	const size_t nEscapedLen = (3*wcslen(psUnescaped) + 1);
+	psEscaped = (wchar_t *)node_malloc( pArena, nEscapedLen*sizeof(wchar_t) );
+	if( psEscaped == NULL )
+		return NULL;
 
-	/* copy the data */
-	switch( pnCopy->nType )
+	psE = psEscaped;
+	psU = psUnescaped;
+	while( *psU != '\0' )
 	{
-	case NODE_INT:
-		pnCopy->nValue = pnSource->nValue;
-		break;
-
-	case NODE_INT64:
-		pnCopy->n64Value = pnSource->n64Value;
-		break;
-
-	case NODE_REAL:
-		pnCopy->dfValue = pnSource->dfValue;
-		break;
+		if( ( psU == psUnescaped && ( *psU == '}' || *psU == ')' || *psU == '$' ) ) ||
+			*psU == '%' || *psU == ':' || *psU == '\r' || *psU == '\n' )
+		{
+			/* write out a percent */
+			*psE++ = '%';
 
-	case NODE_STRINGA:
-		node_set_stringA_internal( pnCopy, pnSource->psAValue );
-		break;
+			/* write out the hex code */
+			swprintf( psE, nEscapedLen-(psE - psEscaped), L"%02X", *psU );
+			psU++;
+			psE += 2;
+		}
+		else
+		{
+			*psE++ = *psU++;
+		}
+	}
+	*psE = '\0';
 
-	case NODE_STRINGW:
-		node_set_stringW_internal( pnCopy, pnSource->psWValue );
-		break;
+	return psEscaped;
+}
 
-	case NODE_PTR:
-		pnCopy->pvValue = pnSource->pvValue;
-		break;
+static char * NODE_INTERNAL_FUNC node_unescapeA( struct node_arena * pArena, const char * psEscaped, const char * psEnd )
+{
+	char * psUnescaped = (char *)node_malloc( pArena, psEnd-psEscaped+1 );
+	const char * psE = psEscaped;
+	char * psU = psUnescaped;
 
-	case NODE_DATA:
-		node_set_data_internal( pnCopy, pnSource->nDataLength, pnSource->pbValue );
-		break;
+	int n = 0;
 
-		/* LIST : deep copy the list */
-	case NODE_LIST:
+	if( psUnescaped == NULL )
+		return NULL;
 
-		for( pn = node_first( pnSource ); pn != NULL; pn = node_next( pn ) )
+	while( psE < psEnd )
+	{
+		switch( *psE )
 		{
-			/* copy each element of list */
-			node_list_add_internal( pnCopy, node_copy_internal( pArena, pn ) );
+		case '%':
+			{
+				/* step over the percent */
+				psE++;
+
+				/* convert the hex code */
+				TempSZ<char> t( pArena, psE, psE+2 );
+				n = strtoul( t, NULL, 16 );
+				*psU++ = (char)n;
+				psE += 2;
+			}
+			break;
+		default:
+			*psU++ = *psE++;
 		}
+	}
+	*psU = '\0';
 
-		break;
+	return psUnescaped;
+}
 
-		/* HASH: deep copy the hash */
-	case NODE_HASH:
+static wchar_t * NODE_INTERNAL_FUNC node_unescapeW( struct node_arena * pArena, const wchar_t * psEscaped, const wchar_t * psEnd )
+{
+	wchar_t * psUnescaped = (wchar_t *)node_malloc( pArena, (psEnd-psEscaped+1)*sizeof(wchar_t) );
+	const wchar_t * psE = psEscaped;
+	wchar_t * psU = psUnescaped;
+
+	int n = 0;
 
-		/* copy the number of elements */
-		pnCopy->nHashElements = pnSource->nHashElements;
+	if( psUnescaped == NULL )
+		return NULL;
 
-		/* copy the elements */
-		for( i = 0; i < pnCopy->nHashBuckets; i++ )
+	while( psE < psEnd )
+	{
+		switch( *psE )
 		{
-			for( pn = pnSource->ppnHashHeads[i]; pn != NULL; pn = node_next( pn ) )
+		case '%':
 			{
-				node_t * pnElement = node_copy_internal( pArena, pn );
-
-				pnElement->bInCollection = IN_COLLECTION;
+				/* step over the percent */
+				psE++;
 
-				/* add the element to that bucket */
-				pnElement->pnNext = pnCopy->ppnHashHeads[i];
-				pnCopy->ppnHashHeads[i] = pnElement;
+				/* convert the hex code */
+				TempSZ<wchar_t> t( pArena, psE, psE+2 );
+				n = wcstoul( t, NULL, 16 );
+				*psU++ = (wchar_t)n;
+				psE += 2;
 			}
-
+			break;
+		default:
+			*psU++ = *psE++;
 		}
-	
-		break;
-
-	default:
-		node_error( "Attempted to copy illegal node type (value %d).\n", pnSource->nType );
-		node_assert( !"Attempted to copy illegal node type." );
 	}
+	*psU = '\0';
 
-	/* return the copied node */		
-	return pnCopy;
-
+	return psUnescaped;
 }
 
-/* safely copy a string */
-static char * NODE_INTERNAL_FUNC node_safe_copyA( struct node_arena * pArena, const char * ps )
+static char * NODE_INTERNAL_FUNC WToA( node_arena * pArena, const wchar_t * psW )
 {
-	char * psCopy;
-	size_t length;
-
-	/* allocate memory */
-	length = (strlen(ps) + 1) * sizeof(char);
-
-	psCopy = (char *)node_malloc( pArena, length );
-
-	/* copy the string */
-	strcpy( psCopy, ps );
-
-	return psCopy;
+	return WToA( pArena, psW, wcslen(psW), node_nCodePage );
 }
 
-/* safely copy W string */
-static wchar_t * NODE_INTERNAL_FUNC node_safe_copyW( struct node_arena * pArena, const wchar_t * ps )
+static char * NODE_INTERNAL_FUNC WToA( node_arena * pArena, const wchar_t * psW, const wchar_t * psWEnd )
 {
-	wchar_t * psCopy;
+	return WToA( pArena, psW, psWEnd - psW, node_nCodePage );
+}
 
-	size_t length;
+static char * NODE_INTERNAL_FUNC WToA( node_arena * pArena, const wchar_t * psW, size_t cch, int nCodePage )
+{
+	char * psA = NULL;
 
-	length = (wcslen(ps) + 1) * sizeof(wchar_t);
+	DWORD dwLength = WideCharToMultiByte( nCodePage, 0, psW, (int)cch, NULL, 0, NULL, NULL ) + 1;
 
-	/* allocate memory */
-	psCopy = (wchar_t *)node_malloc( pArena, length );
+	psA = (char *)node_malloc( pArena, dwLength );
+	if( psA == NULL )
+		return NULL;
 
-	/* copy the string */
-	wcscpy( psCopy, ps );
+	WideCharToMultiByte( nCodePage, 0, psW, (int)cch, psA, dwLength, NULL, NULL );
+	psA[dwLength-1] = '\0';
 
-	return psCopy;
+	return psA;
 }
 
-/* takes a byte and returns '.' if unprintable; else returns the byte */
-static __inline int printable(int c)
+static wchar_t * NODE_INTERNAL_FUNC AToW( node_arena * pArena, const char * psA )
 {
-	return isprint( c ) ? c : '.';
+	return AToW( pArena, psA, strlen(psA), node_nCodePage );
 }
 
-/********************************
- Private Function Implementations
- ********************************/
+static wchar_t * NODE_INTERNAL_FUNC AToW( node_arena * pArena, const char * psA, const char * psAEnd )
+{
+	return AToW( pArena, psA, psAEnd-psA, node_nCodePage );
+}
 
-static void NODE_INTERNAL_FUNC node_set_int( node_t * pn, int nValue )
+static wchar_t * NODE_INTERNAL_FUNC AToW( node_arena * pArena, const char * psA, size_t nLength, int nCodePage )
 {
-	/* clean up */
-	node_cleanup( pn );
+	wchar_t * psW = NULL;
 
-	pn->nValue = nValue;
+	DWORD dwLength = MultiByteToWideChar( nCodePage, 0, psA, (int)nLength, NULL, 0 ) + 1;
 
-	pn->nType = NODE_INT;
+	psW = (wchar_t *)node_malloc( pArena, dwLength * sizeof(wchar_t) );
+	if( psW == NULL )
+		return NULL;
+
+	MultiByteToWideChar( nCodePage, 0, psA, (int)nLength, psW, dwLength );
+	psW[dwLength-1] = '\0';
+
+	return psW;
 }
 
-static void NODE_INTERNAL_FUNC node_set_int64( node_t * pn, __int64 nValue )
+NODE_API void node_set_codepage( int nCodePage )
 {
-	/* clean up */
-	node_cleanup( pn );
-
-	pn->n64Value = nValue;
-
-	pn->nType = NODE_INT64;
+	node_nCodePage = nCodePage;
 }
 
-static void NODE_INTERNAL_FUNC node_set_real( node_t * pn, double dfValue )
+NODE_API int node_get_codepage()
 {
-	/* clean up */
-	node_cleanup( pn );
-
-	pn->dfValue = dfValue;
-
-	pn->nType = NODE_REAL;
+	return node_nCodePage;
 }
 
-static void NODE_INTERNAL_FUNC node_set_stringA( node_t * pn, const char * psAValue )
+NODE_API void node_set_debug( int nDebug )
 {
-	if(psAValue == NULL)
-	{
-		node_assert(psAValue != NULL);
-		node_error("Attempted to set node value to null string.\n");
-		return;
-	}
-
-	/* if setting to same as current, done */
-	if( psAValue == pn->psAValue )
-	{
-		return;
-	}
-
-	/* clean up */
-	node_cleanup( pn );
-
-	if( node_nDebugUnicode )
-	{
-		node_check_ascii_string( psAValue, "NODE_STRINGA" );
-	}
+	node_nDebug = nDebug;
 
-	node_set_stringA_internal( pn, psAValue );
+	node_nDebugIntern = (node_nDebug & NODE_DEBUG_INTERN);
+	node_nDebugUnicode = (node_nDebug & NODE_DEBUG_UNICODE);
+	node_nDebugRef = (node_nDebug & NODE_DEBUG_REF);
+	node_nDebugHashPerf = (node_nDebug & NODE_DEBUG_HASHPERF);
 }
 
-static void NODE_INTERNAL_FUNC node_set_stringA_internal( node_t * pn, const char * psAValue )
+NODE_API int node_get_debug()
 {
-	node_set_stringA_internal( pn, psAValue, strlen( psAValue ) );
+	return node_nDebug;
 }
 
-static void NODE_INTERNAL_FUNC node_set_stringA_internal( node_t * pn, const char * psAValue, const char * psEnd )
+NODE_API void node_set_intern( int bIntern )
 {
-	node_set_stringA_internal( pn, psAValue, psEnd-psAValue );
+	node_bIntern = bIntern;
 }
 
-static void NODE_INTERNAL_FUNC node_set_stringA_internal( node_t * pn, const char * psAValue, size_t cch )
+NODE_API int node_get_intern()
 {
-#ifdef USE_BAGS
-	if( !pn->bBagUsed && cch < BAG_SIZE )
-	{
-		pn->psAValue = (char *)GET_BAG( pn );
-		memcpy( pn->psAValue, psAValue, cch );
-		pn->psAValue[cch] = '\0';
-		pn->bBagUsed = true;
-	}
-	else
-#endif
-	{
-		/* node_safe_copy psValue */
-		pn->psAValue = (char *)node_malloc( pn->pArena, (cch+1)*sizeof(char) );
-		memcpy( pn->psAValue, psAValue, cch*sizeof(char) );	 
-		pn->psAValue[cch] = '\0';
-	}
+	return node_bIntern;
+}
 
 
-	pn->nType = NODE_STRINGA;
+NODE_API void node_set_error_funcs( node_error_func_t pErrFunc, node_memory_func_t pMemFunc, 
+								    node_assert_func_t pAssertFunc )
+{
+	node_pfError = pErrFunc;
+	node_pfMemory = pMemFunc;
+	node_pfAssert = reinterpret_cast<node_assert_func_internal_t>(pAssertFunc);
 }
 
-static void NODE_INTERNAL_FUNC node_set_stringW( node_t * pn, const wchar_t * psWValue )
+static void NODE_INTERNAL_FUNC _node_assert( void * psExpr, const char * psFile, unsigned int nLine )
 {
-	if(psWValue == NULL)
-	{
-		node_assert(psWValue != NULL);
-		node_error("Attempted to set node value to null string.\n");
-		return;
-	}
-
-	/* if setting to same as current, done */
-	if( psWValue == pn->psWValue )
+	if( node_pfAssert != NULL )
 	{
-		return;
+		if( node_source_file != NULL )
+			node_pfAssert( psExpr, node_source_file, node_source_line );
+		else
+			node_pfAssert( psExpr, psFile, nLine );
 	}
+}
 
-	/* clean up */
-	node_cleanup( pn );
+static void NODE_INTERNAL_FUNC node_error( char * psError, ... )
+{
+	char acBuffer[1024] = {0};
+	va_list ap;
 
-	if( node_nDebugUnicode )
+	if( node_pfError != NULL )
 	{
-		node_check_unicode_string( psWValue, "NODE_STRINGW" );
+		va_start( ap, psError );
+		_vsnprintf_s( acBuffer, sizeof(acBuffer)-1, psError, ap );
+		va_end( ap );
+
+		node_pfError( acBuffer );
 	}
-	
-	node_set_stringW_internal( pn, psWValue );
 }
 
-static void NODE_INTERNAL_FUNC node_set_stringW_internal( node_t * pn, const wchar_t * psWValue )
+static int NODE_INTERNAL_FUNC node_memory( size_t cb )
 {
-	node_set_stringW_internal( pn, psWValue, wcslen( psWValue ) );
+	if( node_pfMemory == NULL )
+		return NODE_MEMORY_FAIL;
+	else
+		return node_pfMemory( cb );
 }
 
-static void NODE_INTERNAL_FUNC node_set_stringW_internal( node_t * pn, const wchar_t * psWValue, const wchar_t * psEnd )
+/* record an allocation failure; the first one since node_clear_error is kept */
+static void NODE_INTERNAL_FUNC node_fail( int nError )
 {
-	node_set_stringW_internal( pn, psWValue, psEnd-psWValue );
+	if( node_nError == NODE_ERROR_NONE )
+		node_nError = nError;
 }
 
-static void NODE_INTERNAL_FUNC node_set_stringW_internal( node_t * pn, const wchar_t * psWValue, size_t cch )
+NODE_API int node_get_error()
 {
-#ifdef USE_BAGS
-	if( !pn->bBagUsed && (sizeof(wchar_t)*cch) < BAG_SIZE )
-	{
-		pn->psWValue = (wchar_t *)GET_BAG( pn );
-		memcpy( pn->psWValue, psWValue, cch*sizeof(wchar_t) );
-		pn->psWValue[cch] = '\0';
-		pn->bBagUsed = true;
-	}
-	else
-#endif
-	{
-		pn->psWValue = (wchar_t *)node_malloc( pn->pArena, (cch+1)*sizeof(wchar_t) );
-		memcpy( pn->psWValue, psWValue, cch*sizeof(wchar_t) );	 
-		pn->psWValue[cch] = '\0';
-	}
-
-	pn->nType = NODE_STRINGW;
+	return node_nError;
 }
 
-NODE_API node_t * node_set_data_dbg( const char * psFile, int nLine, node_t * pn, int nLength, const void * pbValue )
+NODE_API void node_clear_error()
 {
-	set_debug_allocator s( psFile, nLine );
-	return node_set_data( pn, nLength, pbValue );
+	node_nError = NODE_ERROR_NONE;
 }
 
-NODE_API node_t * node_set_data( node_t * pn, int nLength, const void * pvValue )
+#ifdef USE_DL_MALLOC
+void * NODE_INTERNAL_FUNC node_malloc( struct node_arena * pArena, size_t cb )
+#else
+void * NODE_INTERNAL_FUNC node_malloc( struct node_arena * , size_t cb )
+#endif
 {
-	const data_t * pbValue = reinterpret_cast<const data_t *>( pvValue );
-	if( nLength <= 0 )
+	int nRetry = 0;
+
+RETRY:
+	void * pv = NULL;
+
+#if defined(USE_DL_MALLOC) || defined(DEBUG_DL_MALLOC)
+	/* round up to multiple of 4 */
+	cb = (cb + 3) & (~3);
+
+	if( pArena->nFlags & NODE_ARENA_MONOTONIC )
 	{
-		node_assert( nLength > 0 );
-		return pn;
+		/* node_valloc checks the budget and reports failure */
+		return node_bump( pArena, cb );
 	}
 
-	if( nLength > LOTS_OF_MEMORY ) 
+	if( pArena->cbBudget != 0 )
 	{
-		if( nLength > GRATUITOUSLY_MUCH_MEMORY )
-		{
-			node_assert( nLength < GRATUITOUSLY_MUCH_MEMORY );
-			return pn;
-		}
-		else
+		/* whatever the slabs have not used is what the mspace may grow to */
+		size_t cbSlabs = pArena->cbSlabs;
+		mspace_set_footprint_limit( pArena->pSpace, cbSlabs < pArena->cbBudget ? pArena->cbBudget - cbSlabs : 1 );
+
+		pv = mspace_malloc( pArena->pSpace, cb );
+		if( pv == NULL )
 		{
-			node_error("Suspicious amount of memory (%d) allocated for data element\n", nLength );
+			node_fail( NODE_ERROR_BUDGET );
+			return NULL;
 		}
 	}
+	else
+		pv = mspace_malloc( pArena->pSpace, cb );
+#else
 
-	if( pbValue == NULL )
-	{
-		node_assert(pbValue != NULL);
-		node_error( "Attempted to set data with NULL pointer.\n");
-		return pn;
-	}
-	
-	/* if setting to same as current, return */
-	if( pn->nType == NODE_DATA && pbValue == pn->pbValue )
-	{
-		/* shortening the data in place is OK */
-		if( nLength <= pn->nDataLength )
-			pn->nDataLength = nLength;
-		else
-			node_error( "Attempting to increase length of existing data from %d to %d.\n", pn->nDataLength, nLength );
-		
-		return pn;
-	}
-
-	/* clean up */
-	node_cleanup( pn );
-
-	node_set_data_internal( pn, nLength, pbValue );
-
-	return pn;
-}
-
-static void NODE_INTERNAL_FUNC node_set_data_internal( node_t * pn, int nLength, const data_t * pbValue )
-{
-	/* store the length */
-	pn->nDataLength = nLength;
-
-#ifdef USE_BAGS
-	if( !pn->bBagUsed && nLength <= BAG_SIZE )
-	{
-		pn->pbValue = (data_t *)GET_BAG( pn );
-		pn->bBagUsed = true;
-	}
+#if defined(_DEBUG)
+	if( node_source_file == NULL )
+		pv = malloc( cb );
 	else
+		pv = _malloc_dbg( cb, _NORMAL_BLOCK, node_source_file, node_source_line );
+#else
+	pv = malloc( cb );
+#endif
+
 #endif
+
+	if( pv == NULL ) 
 	{
-		/* allocate the buffer */
-		pn->pbValue = (data_t *)node_malloc( pn->pArena, pn->nDataLength );
-	}
+		if( node_memory( cb ) == NODE_MEMORY_RETRY && nRetry++ < 10 )
+			goto RETRY;
 
-	/* copy the data into the buffer */
-	memcpy( pn->pbValue, pbValue, pn->nDataLength );
+		node_fail( NODE_ERROR_MEMORY );
+	}
 
-	pn->nType = NODE_DATA;
+	return pv;
 }
 
-static void NODE_INTERNAL_FUNC node_set_ptr( node_t * pn, void * pv )
+#if defined(USE_DL_MALLOC)
+/* would cbMore more bytes from the system put the arena over its budget? */
+static bool NODE_INTERNAL_FUNC node_over_budget( node_arena * pArena, size_t cbMore )
 {
-	/* clean up */
-	node_cleanup( pn );
+	if( pArena->cbBudget == 0 )
+		return false;
 
-	/* store the pointer */
-	pn->pvValue = pv;
+	size_t cbHeld = pArena->cbSlabs;
+	if( pArena->pSpace != NULL )
+		cbHeld += mspace_footprint( pArena->pSpace );
 
-	pn->nType = NODE_PTR;
+	return cbHeld + cbMore > pArena->cbBudget;
 }
 
-/* set the node to a value using variable arguments. nType determines how 
-arguments are processed.*/
-static void NODE_INTERNAL_FUNC node_set_valist(node_t * pn, int nType, va_list valist)
+static void * NODE_INTERNAL_FUNC node_valloc( node_arena * pArena, node_arena::va ** ppVA, size_t nSize )
 {
-	unsigned int nDataLength = 0;
-	data_t * pbValue = NULL;
+	int nRetry = 0;
+	int nFlags = pArena->nFlags;
 
-	if( pn == NULL )
+	if( node_over_budget( pArena, nSize ) )
 	{
-		node_assert( pn != NULL );
-		pn = node_alloc_internal( node_pArena );
+		node_fail( NODE_ERROR_BUDGET );
+		return NULL;
 	}
 
-	switch (nType)
-	{
-	case NODE_INT:
-		node_set_int( pn, va_arg(valist, int) );
-		break;
-
-	case NODE_INT64:
-		node_set_int64( pn, va_arg(valist, __int64) );
-		break;
-
-	case NODE_REAL:
-		node_set_real( pn, va_arg(valist, double) );
-		break;
-
-	case NODE_STRINGA:
-		node_set_stringA( pn, va_arg(valist, char *) );
-		break;
-
-	case NODE_STRINGW:
-		node_set_stringW( pn, va_arg(valist, wchar_t *) );
-		break;
-
-	case NODE_DATA:
-		nDataLength = va_arg( valist, unsigned int );
-		pbValue = va_arg( valist, data_t * );
-
-		node_set_data( pn, nDataLength, pbValue );
-		break;
-
-	case NODE_PTR:
-		node_set_ptr( pn, va_arg( valist, void * ) );
-		break;
+RETRY:
+	void * pv = NULL;
 
-	case NODE_REF_DATA:
+#ifdef NODE_COMPACT_LINKS
+	if( ppVA == &(pArena->pVA) )
+	{
+		/* node slabs must stay in the span; it is reserved with small pages */
+		pv = node_span_commit( pArena, nSize );
+	}
+	else
+#endif
+	{
+		if( (nFlags & NODE_ARENA_HUGEPAGES) && GetLargePageMinimum() != 0 && nSize % GetLargePageMinimum() == 0 )
 		{
-			node_t * pnSource = va_arg( valist, node_t * );
-
-			pn->nType = NODE_DATA;
-			nDataLength = pn->nDataLength = pnSource->nDataLength;
+			/* needs SeLockMemoryPrivilege; large pages are never paged out, so no prefault either */
+			pv = VirtualAlloc( NULL, nSize, MEM_COMMIT|MEM_RESERVE|MEM_LARGE_PAGES, PAGE_READWRITE );
+			nFlags &= ~NODE_ARENA_PREFAULT;
+		}
 
-#ifdef USE_BAGS
-			if( IS_BAG( pnSource, pnSource->pbValue ) )
-			{
-				if( !pn->bBagUsed )
-				{
-					pn->bBagUsed = TRUE;
-					pn->pbValue = GET_BAG( pn );
-					memcpy( pn->pbValue, pnSource->pbValue, nDataLength );
-				}
-				else
-					node_set_data( pn, nDataLength, pnSource->pbValue );
-			}
-			else
-#endif
-			{
-				pn->pbValue = pnSource->pbValue;
-				pnSource->nDataLength = 0;
-				pnSource->pbValue = NULL;
-			}
+		if( pv == NULL )
+			pv = VirtualAlloc( NULL, nSize, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE );
+	}
 
-			node_free_internal( pnSource, FALSE );
+	if( pv == NULL ) 
+	{
+		if( node_memory( nSize ) == NODE_MEMORY_RETRY && nRetry++ < 10 )
+			goto RETRY;
 
-			return;
-		}
-		break;
+		node_fail( NODE_ERROR_MEMORY );
+		return NULL;
+	}
 
-	case NODE_COPY_DATA:
-		{
-			node_t * pnSource = va_arg( valist, node_t * );
+	if( nFlags & NODE_ARENA_PREFAULT )
+	{
+		/* take the demand-zero faults now rather than during traversal */
+		for( size_t i = 0; i < nSize; i += NODE_PAGE_SIZE )
+			reinterpret_cast<volatile char *>( pv )[i] = 0;
+	}
 
-			node_set_data( pn, pnSource->nDataLength, pnSource->pbValue );
+	// stash a pointer on the arena so we can clean it later
+	node_arena::va * pVA = (node_arena::va *)pv;
+	pVA->pArena = pArena;
+	pVA->next = *ppVA;
+	pVA->nSize = nSize;
+	*ppVA = pVA;
 
-			pn->nType = NODE_DATA;
-			return;
-		}
-		break;
+	pArena->nSlabs++;
+	pArena->cbSlabs += nSize;
 
-	default:
-	/* otherwise */
-		node_assert(!"Invalid node type");
-		node_error( "Tried to set node with invalid type (%d).\n", nType );
-	}
+	return (char * )pv + sizeof(node_arena::va);
 
-	/* copy the type */
-	pn->nType = nType;
-	return;
-}	
+}
 
-/* hash a string */
-unsigned int NODE_INTERNAL_FUNC node_hashA( const char * psKey )
+/* NODE_ARENA_MONOTONIC allocation: bump a pointer through the arena's bump slabs */
+static void * NODE_INTERNAL_FUNC node_bump( struct node_arena * pArena, size_t cb )
 {
-	unsigned int nHash = 0x53378008;
-	const char * pc = NULL;
+	cb = (__max( cb, 1 ) + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~(size_t)(MEMORY_ALLOCATION_ALIGNMENT - 1);
 
-	for( pc = psKey; *pc != 0; pc++ )
+	if( (size_t)(pArena->pcBumpEnd - pArena->pcBumpNext) < cb )
 	{
-		unsigned int c = *pc | 0x20;
+		const size_t nSlabSize = pArena->nBumpSize;
+		node_arena::va * pVA = NULL;
+
+		if( cb > nSlabSize / 4 )
+		{
+			/* big blocks get a slab of their own rather than wasting the rest of the current one */
+			node_lock l( &(pArena->csSlabs) );
+			return node_valloc( pArena, &(pArena->pVABump), cb + sizeof(node_arena::va) );
+		}
+
+		if( pArena->pVABumpSpare != NULL )
+		{
+			/* reuse a slab emptied by a reset */
+			pVA = pArena->pVABumpSpare;
+			pArena->pVABumpSpare = pVA->next;
+			pVA->next = pArena->pVABump;
+			pArena->pVABump = pVA;
+		}
+		else
+		{
+			node_lock l( &(pArena->csSlabs) );
+			if( node_valloc( pArena, &(pArena->pVABump), nSlabSize ) == NULL )
+				return NULL;
+			pVA = pArena->pVABump;
+		}
 
-		nHash = (nHash * 0x1F) + ( (c << 16) + c );
+		pArena->pcBumpNext = reinterpret_cast<char *>( pVA ) + sizeof(node_arena::va);
+		pArena->pcBumpEnd = reinterpret_cast<char *>( pVA ) + pVA->nSize;
 	}
 
-	return (nHash & NODE_HASH_MASK);
+	void * pv = pArena->pcBumpNext;
+	pArena->pcBumpNext += cb;
+	return pv;
 }
 
-unsigned int NODE_INTERNAL_FUNC node_hashW( const wchar_t * psKey )
+/* releases a list of slabs, returning the bytes freed */
+#ifdef NODE_COMPACT_LINKS
+/* commit the next nSize bytes of the arena's span, reserving the span first if need be */
+static void * NODE_INTERNAL_FUNC node_span_commit( node_arena * pArena, size_t nSize )
 {
-    unsigned int nHash = 0x55378008;
-    const wchar_t * pc = NULL;
+	if( pArena->pcSpan == NULL )
+	{
+		pArena->pcSpan = reinterpret_cast<char *>( VirtualAlloc( NULL, NODE_LINK_SPAN, MEM_RESERVE, PAGE_NOACCESS ) );
+		if( pArena->pcSpan == NULL )
+			return NULL;
 
-    for( pc = psKey; *pc != 0; pc++ )
-    {
-		/* set the 'lower case' bit */
-		unsigned int c = *pc | 0x20;
+		pArena->pcSpanNext = pArena->pcSpan;
+	}
 
-		nHash = (nHash * 0x1F) + ( (c << 16) + c );
-    }
+	/* past the span, links would no longer fit */
+	if( nSize > (size_t)( pArena->pcSpan + NODE_LINK_SPAN - pArena->pcSpanNext ) )
+		return NULL;
 
-    return (nHash & NODE_HASH_MASK);
+	void * pv = VirtualAlloc( pArena->pcSpanNext, nSize, MEM_COMMIT, PAGE_READWRITE );
+	if( pv != NULL )
+		pArena->pcSpanNext += nSize;
+
+	return pv;
 }
+#endif
 
-static void NODE_INTERNAL_FUNC node_cleanup( node_t * pn )
+static size_t NODE_INTERNAL_FUNC node_vfree( node_arena::va * pVA )
 {
-	int i = 0;
+	size_t nFreed = 0;
+	node_arena::va * pVANext;
 
-	/* on node_cleanup, make sure all members are freed and zeroed */
-	switch( pn->nType )
+	for( ; pVA != NULL; pVA = pVANext )
 	{
-	case NODE_STRINGA:
-	case NODE_STRINGW:
-	case NODE_INT:
-	case NODE_INT64:
-	case NODE_REAL:
-		/* because of implicit conversion, must clear all scalar values together */
-		if( pn->psAValue != NULL && !IS_BAG( pn, pn->psAValue ) )
-			nfree( pn->pArena, pn->psAValue );
+		pVANext = pVA->next;
+		nFreed += pVA->nSize;
+		VirtualFree( pVA, 0, MEM_RELEASE );
+	}
 
-		if( pn->psWValue != NULL && !IS_BAG( pn, pn->psWValue ) )
-			nfree( pn->pArena, pn->psWValue );
+	return nFreed;
+}
+#endif
 
-		pn->psAValue = NULL;
-		pn->psWValue = NULL;
-		pn->nValue = 0;
-		pn->dfValue = 0.0;
-		break;
+/* a table of nSlots for pnHash: in its bag when that is free, else allocated */
+static node_link_t * NODE_INTERNAL_FUNC hash_table_alloc( node_tls * ptls, node_t * pnHash, int nSlots )
+{
+	size_t nSize = HASH_TABLE_SIZE( nSlots );
 
-	case NODE_PTR:
-		pn->pvValue = 0;
-		break;
+#ifdef USE_BAGS
+	if( nSize <= node_bag_names_start( pnHash ) && node_bag_value_size( pnHash ) == 0 )
+	{
+		pnHash->bBagUsed = TRUE;
+		NODE_STAT_CTX( ptls, GET_ARENA( pnHash ), nBagHits++ );
+		return (node_link_t *)GET_BAG( pnHash );
+	}
+#endif
 
-	case NODE_DATA:
-		if( pn->pbValue != NULL && !IS_BAG( pn, pn->pbValue ) )
-			nfree( pn->pArena, pn->pbValue );
-		pn->pbValue = NULL;
-		pn->nDataLength = 0;
-		break;
-	case NODE_LIST:
-		node_free_internal( pn->pnListHead, IN_COLLECTION );
-		pn->pnListHead = NULL;
-		pn->pnListTail = NULL;
-		pn->nListElements = 0;
-		break;
-	case NODE_HASH:
-#ifdef _DEBUG
-		if( node_nDebugHashPerf )
-		{
-			if( pn->psHashAllocated != NULL )
-			{
-				int nMaxElts = pn->nHashFlags>>8;
-				/* check and report load factor */
-				double dfLoad = (double)nMaxElts/pn->nHashBuckets;
-				
-				if( dfLoad > node_dfLoadLimit || ( pn->nHashBuckets > 128 && dfLoad < 0.001 ) )
-				{
-					char acBuffer[1024];
-					sprintf( acBuffer, "%s Node hash debugging: hash has load factor %.2f (%d/%d)\n",
-						pn->psHashAllocated, dfLoad, nMaxElts, pn->nHashBuckets );
-//					fputs( acBuffer, stderr );
-					OutputDebugStringA( acBuffer );
-				}
+	/* an allocated table has room for the record of a migration out of it */
+	nSize = HASH_ALLOC_SIZE( nSlots );
+	node_link_t * ppnSlots = (node_link_t *)node_malloc( GET_ARENA( pnHash ), nSize );
+	if( ppnSlots != NULL )
+	{
+		NODE_STAT_CTX( ptls, GET_ARENA( pnHash ), nBagMisses++ );
+		NODE_STAT_CTX( ptls, GET_ARENA( pnHash ), cbBuckets += nSize );
+	}
 
-				nfree( pn->pArena, pn->psHashAllocated );
-			}
-		}
-#endif
+	return ppnSlots;
+}
 
-		for( i = 0; i < pn->nHashBuckets; i ++ )
-		{
-			node_free_internal( pn->ppnHashHeads[i], IN_COLLECTION );
-		}
-		if( !IS_BAG( pn, pn->ppnHashHeads ) )
-			nfree( pn->pArena, pn->ppnHashHeads );
+/* make ppnSlots pnHash's (empty) table */
+static void NODE_INTERNAL_FUNC hash_table_set( node_t * pnHash, node_link_t * ppnSlots, int nSlots )
+{
+	pnHash->ppnHashSlots = ppnSlots;
+	pnHash->nHashSlots = nSlots;
+	pnHash->nHashGrowth = HASH_MAX_FILL( nSlots );
 
-		pn->ppnHashHeads = NULL;
+	memset( HASH_CTRL( pnHash ), HASH_CTRL_EMPTY, nSlots );
+}
 
-		pn->nHashBuckets = 0;
-		pn->nHashElements = 0;
-		break;
+static void NODE_INTERNAL_FUNC hash_table_free( node_tls * ptls, node_t * pnHash, node_link_t * ppnSlots, int nSlots )
+{
+#ifdef USE_BAGS
+	if( IS_BAG( pnHash, ppnSlots ) )
+	{
+		pnHash->bBagUsed = NAME_IN_BAG( pnHash );
+		return;
 	}
-	pn->nType = NODE_UNKNOWN;
-	pn->bBagUsed = 0;
+#endif
+
+	NODE_STAT_CTX( ptls, GET_ARENA( pnHash ), cbBuckets -= HASH_ALLOC_SIZE( nSlots ) );
+	nfree( GET_ARENA( pnHash ), ppnSlots );
 }
 
-/* node_hash_keys 
- * This function returns a newly-allocated list node containing 
- * a list of the key strings for hash pnHash. 
- */
-NODE_API node_t * node_hash_keys_dbgA( const char * psFile, int nLine, const node_t * pnHash ) 
+/* make sure one more child can be placed without growing; FALSE if there was no memory to grow */
+static int NODE_INTERNAL_FUNC hash_reserve( node_t * pnHash )
 {
-	set_debug_allocator s( psFile, nLine );
-	return node_hash_keysA( pnHash );
-}
+	/* a frozen table has no room: adding thaws it */
+	if( ( pnHash->nHashFlags & HASH_FROZEN ) && !hash_thaw( pnHash ) )
+		return FALSE;
 
+	/* a growing hash moves a few more of its old children with each add */
+	if( pnHash->nHashFlags & HASH_MIGRATING )
+		hash_migrate( pnHash, HASH_MIGRATE_GROUPS );
 
-NODE_API node_t * node_hash_keysA( const node_t * pnHash ) 
-{
-	node_t * pnList = NULL;
-	node_t * pn = NULL;
+	if( pnHash->nHashGrowth > 0 )
+		return TRUE;
 
-	int i = 0;
+	/* the new table filled before the old one emptied: finish with the old one before growing again */
+	if( pnHash->nHashFlags & HASH_MIGRATING )
+		hash_migrate( pnHash, pnHash->nHashSlots );
 
-	if( pnHash == NULL )
+	/* full of children: double; full of deleted slots: just clear them out */
+	int nSlots = pnHash->nHashSlots;
+	if( pnHash->nHashElements >= HASH_MAX_FILL( nSlots ) / 2 )
 	{
-		node_assert( pnHash != NULL );
-		return NULL;
+		if( nSlots >= (1 << NODE_HASH_BITS) )
+		{
+			node_fail( NODE_ERROR_MEMORY );
+			return FALSE;
+		}
+		nSlots *= 2;
 	}
 
-	/* if pnHash is not a hash node */
-	if( pnHash->nType != NODE_HASH )
+	/* gets may be in a shared hash's table: a new one is filled before it replaces it */
+	if( pnHash->nHashFlags & HASH_SHARED )
 	{
-		node_assert( pnHash->nType == NODE_HASH );
-		/* return the list */
-		return node_list_alloc();
+		node_link_t * ppnShared = pnHash->ppnHashSlots;
+		if( !hash_shared_build( pnHash, HASH_SHARED_TABLE( ppnShared )->pShared, nSlots ) )
+			return FALSE;
+
+		hash_retire_table( pnHash, ppnShared );
+		return TRUE;
 	}
 
-	if( node_nDebugUnicode )
+	node_link_t * ppnOld = pnHash->ppnHashSlots;
+	int nOldSlots = pnHash->nHashSlots;
+
+	node_link_t * ppnNew = hash_table_alloc( NODE_CACHE_CTX, pnHash, nSlots );
+	if( ppnNew == NULL )
+		return FALSE;
+
+	/* the old hashes and control bytes outlive the switch: they follow the old slots */
+	const unsigned int * pnOldHashes = HASH_TABLE_HASHES( ppnOld, nOldSlots );
+	const unsigned short * pnOldLengths = HASH_TABLE_LENGTHS( ppnOld, nOldSlots );
+	const unsigned char * pbOldCtrl = HASH_TABLE_CTRL( ppnOld, nOldSlots );
+	hash_table_set( pnHash, ppnNew, nSlots );
+
+	/* a table of one group is moved at once */
+	if( nOldSlots <= HASH_GROUP )
 	{
-		/* check that there are no W keys in this hash */
-		if( pnHash->nHashFlags & HASH_CONTAINS_WKEYS )
+		for( int i = 0; i < nOldSlots; i++ )
 		{
-			node_error( "Attempting to get A keys from hash which contains W keys.\n" );
-			node_assert( (pnHash->nHashFlags & HASH_CONTAINS_WKEYS) == 0 );
-			return node_list_alloc();
+			if( ( pbOldCtrl[i] & 0x80 ) == 0 )
+				hash_place( pnHash, LINK_GET( pnHash, ppnOld[i] ), pnOldHashes[i], pnOldLengths[i] );
 		}
+
+		hash_table_free( NODE_CACHE_CTX, pnHash, ppnOld, nOldSlots );
+		return TRUE;
 	}
 
-	/* allocate a list node */
-	pnList = node_alloc_internal( node_pArena );
-	node_list_init( pnList );
+	/* a larger one is moved a few groups per add, so no one add pays for all of it;
+	   the new table is larger than the bag, so it has a trailer to record the old one in */
+	node_assert( !IS_BAG( pnHash, ppnNew ) );
+	hash_migration * pm = HASH_MIGRATION( pnHash );
+	pm->ppnOld = ppnOld;
+	pm->nOldSlots = nOldSlots;
+	pm->nNext = 0;
+	pm->nOldElements = pnHash->nHashElements;
+	pnHash->nHashFlags |= HASH_MIGRATING;
+
+	hash_migrate( pnHash, HASH_MIGRATE_GROUPS );
 
-	/* for each hash bucket */
-	for( i = 0; i < pnHash->nHashBuckets; i++ )
+	return TRUE;
+}
+
+/* move the children in the next nGroups groups of the old table into the current one,
+   freeing the old table once it is empty */
+static void NODE_INTERNAL_FUNC hash_migrate( node_t * pnHash, int nGroups )
+{
+	hash_migration * pm = HASH_MIGRATION( pnHash );
+	const unsigned int * pnOldHashes = HASH_TABLE_HASHES( pm->ppnOld, pm->nOldSlots );
+	const unsigned short * pnOldLengths = HASH_TABLE_LENGTHS( pm->ppnOld, pm->nOldSlots );
+	unsigned char * pbOldCtrl = HASH_TABLE_CTRL( pm->ppnOld, pm->nOldSlots );
+
+	for( ; nGroups > 0 && pm->nNext < pm->nOldSlots && pm->nOldElements > 0; nGroups-- )
 	{
-		/* for each node in the bucket */
-		for( pn = pnHash->ppnHashHeads[i]; pn != NULL; pn = node_next( pn ) )
+		for( int i = pm->nNext; i < pm->nNext + HASH_GROUP; i++ )
 		{
-			node_t * pnName = node_alloc_internal( pnList->pArena );
+			if( ( pbOldCtrl[i] & 0x80 ) != 0 )
+				continue;
 
-			node_set_stringA_internal( pnName, pn->psAName );
+			hash_place( pnHash, LINK_GET( pnHash, pm->ppnOld[i] ), pnOldHashes[i], pnOldLengths[i] );
 
-			node_list_add_internal( pnList, pnName );
+			/* deleted, not empty: lookups still in the old table probe past it */
+			pbOldCtrl[i] = HASH_CTRL_DELETED;
+			pm->nOldElements--;
 		}
+		pm->nNext += HASH_GROUP;
 	}
 
-	/* return the list */
-	return pnList;
+	if( pm->nNext >= pm->nOldSlots || pm->nOldElements == 0 )
+	{
+		pnHash->nHashFlags &= ~HASH_MIGRATING;
+		hash_table_free( NODE_CACHE_CTX, pnHash, pm->ppnOld, pm->nOldSlots );
+	}
 }
 
-NODE_API node_t * node_hash_keys_dbgW( const char * psFile, int nLine, const node_t * pnHash ) 
+/* put pn, whose name is nLength long and hashes to nHash, in the first free slot its hash probes;
+   the caller has made room */
+static void NODE_INTERNAL_FUNC hash_place( node_t * pnHash, node_t * pn, unsigned int nHash, size_t nLength )
 {
-	set_debug_allocator s(psFile, nLine);
-	return node_hash_keysW( pnHash );
+	/* a deleted slot was already counted against the growth, and a shared hash's writer took its slot
+	   from the growth when it reserved it */
+	if( hash_table_place( pnHash, pnHash->ppnHashSlots, pnHash->nHashSlots, pn, nHash, nLength ) && !( pnHash->nHashFlags & HASH_SHARED ) )
+		pnHash->nHashGrowth--;
 }
 
-NODE_API node_t * node_hash_keysW( const node_t * pnHash ) 
+/* put pn in the first free slot its hash probes in one of pnHash's tables: TRUE if the slot was empty,
+   FALSE if it was deleted. A shared hash's deleted slots are never filled again, writers of other
+   stripes may be claiming its empty ones, and a get that sees the control byte of a slot filled
+   meanwhile sees the rest of it */
+static int NODE_INTERNAL_FUNC hash_table_place( const node_t * pnHash, node_link_t * ppnSlots, int nSlots, node_t * pn, unsigned int nHash, size_t nLength )
 {
-	node_t * pnList = NULL;
-	node_t * pn = NULL;
-
-	int i = 0;
-
-	if( pnHash == NULL )
-	{
-		node_assert( pnHash != NULL );
-		return NULL;
-	}
+	/* deletes find the slot from the node's own bits of the hash */
+	node_assert( ( nHash & NODE_HASH_MASK ) == pn->nHash );
 
-	/* if pnHash is not a hash node */
-	if( pnHash->nType != NODE_HASH )
-	{
-		node_assert( pnHash->nType == NODE_HASH );
-		/* return the list */
-		return node_list_alloc();
-	}
+	int bShared = ( pnHash->nHashFlags & HASH_SHARED ) != 0;
+	hash_probe probe( ppnSlots, nSlots, nHash );
+	unsigned char * pbCtrl = HASH_TABLE_CTRL( ppnSlots, nSlots );
+	int nSlot;
 
-	if( node_nDebugUnicode )
+	for( ;; )
 	{
-		/* check that there are no W keys in this hash */
-		if( pnHash->nHashFlags & HASH_CONTAINS_AKEYS )
+		unsigned int nFree = bShared ? hash_match( probe.group(), probe.nWidth, HASH_CTRL_EMPTY ) : hash_match_free( probe.group(), probe.nWidth );
+		if( nFree == 0 )
 		{
-			node_error( "Attempting to get W keys from hash which contains A keys.\n" );
-			node_assert( (pnHash->nHashFlags & HASH_CONTAINS_AKEYS) == 0 );
-			return node_list_alloc();
+			if( !probe.next() )
+			{
+				node_assert( !"hash_place: table is full" );
+				return FALSE;
+			}
+			continue;
 		}
-	}
-
-	/* allocate a list node */
-	pnList = node_alloc_internal( node_pArena );
-	node_list_init( pnList );
 
-	/* for each hash bucket */
-	for( i = 0; i < pnHash->nHashBuckets; i++ )
-	{
-		/* for each node in the bucket */
-		for( pn = pnHash->ppnHashHeads[i]; pn != NULL; pn = node_next( pn ) )
-		{
-			node_t * pnName = node_alloc_internal( pnList->pArena );
+		/* a writer that loses a slot to another looks through the group again */
+		nSlot = probe.slot( nFree );
+		if( !bShared || hash_ctrl_claim( pbCtrl + nSlot ) )
+			break;
+	}
 
-			node_set_stringW_internal( pnName, pn->psWName );
+	int bEmpty = bShared || pbCtrl[nSlot] == HASH_CTRL_EMPTY;
 
-			node_list_add_internal( pnList, pnName );
-		}
-	}
+	HASH_TABLE_HASHES( ppnSlots, nSlots )[nSlot] = nHash;
+	HASH_TABLE_LENGTHS( ppnSlots, nSlots )[nSlot] = HASH_LENGTH( nLength );
+	ppnSlots[nSlot] = LINK_TO( pnHash, pn );
+	SET_NEXT( pn, NULL );
+	if( bShared )
+		MemoryBarrier();
+	pbCtrl[nSlot] = HASH_TAG( nHash );
 
-	/* return the list */
-	return pnList;
+	return bEmpty;
 }
 
-static char * NODE_INTERNAL_FUNC read_lineA( node_arena * pArena, FILE * pfIn, char ** ppsEnd )
+/* take pn out of one of pnHash's tables: the control byte it leaves, or 0 if it is not there */
+static int NODE_INTERNAL_FUNC hash_remove( const node_t * pnHash, node_link_t * ppnSlots, int nSlots, node_t * pn )
 {
-	int nBufferSize = 40;
-	char * psBuffer = NULL;
-	int nBytesRead = 0;
-	int nChar = 0;
+	unsigned char * pbCtrl = HASH_TABLE_CTRL( ppnSlots, nSlots );
 
-	/* initialize output arg */
-	*ppsEnd = NULL;
+	/* look for its slot where its hash probes */
+	hash_probe probe( ppnSlots, nSlots, pn->nHash );
+	do
+	{
+		unsigned char * pbGroup = pbCtrl + probe.nGroup * probe.nWidth;
 
-	/* check for end-of-file */
-	nChar = fgetc( pfIn );
-	if( feof( pfIn ) )
-		return NULL;
-	else
-		ungetc( nChar, pfIn );
+		for( unsigned int nMatch = hash_match( pbGroup, probe.nWidth, HASH_TAG( pn->nHash ) ); nMatch != 0; nMatch &= nMatch - 1 )
+		{
+			int nSlot = probe.slot( nMatch );
+			if( LINK_GET( pnHash, ppnSlots[nSlot] ) != pn )
+				continue;
 
-	/* allocate initial buffer */
-	psBuffer = (char *)node_malloc( pArena, nBufferSize );
+			/* a get may have matched it already: a shared hash's slot keeps its child until the table is replaced */
+			if( pnHash->nHashFlags & HASH_SHARED )
+			{
+				pbCtrl[nSlot] = HASH_CTRL_DELETED;
+				return HASH_CTRL_DELETED;
+			}
 
-	for(;;)
-	{
-		/* read a character */
-		nChar = fgetc( pfIn );
+			/* no probe passes a group with an empty slot, so the slot may be empty too */
+			if( hash_match( pbGroup, probe.nWidth, HASH_CTRL_EMPTY ) != 0 )
+				pbCtrl[nSlot] = HASH_CTRL_EMPTY;
+			else
+				pbCtrl[nSlot] = HASH_CTRL_DELETED;
+			ppnSlots[nSlot] = 0;
 
-		/* if the character was EOF */
-		if( nChar == EOF )
+			return pbCtrl[nSlot];
+		}
+
+		if( hash_match( pbGroup, probe.nWidth, HASH_CTRL_EMPTY ) != 0 )
 			break;
 
-		/* increment the read count */
-		nBytesRead++;
+	} while( probe.next() );
 
-		/* if we're past the length of the buffer */
-		if( nBytesRead >= nBufferSize )
-		{
-			char * psNewBuffer = NULL;
+	return 0;
+}
 
-			/* increase the buffer size */
-			nBufferSize *= 2;
+/* replace pnHash's table by a frozen one with a slot per child; FALSE (leaving the table as it was)
+   if there is no memory */
+static int NODE_INTERNAL_FUNC hash_freeze( node_t * pnHash )
+{
+	int n = pnHash->nHashElements;
+	if( n == 0 )
+		return FALSE;
+
+	/* every child in one table */
+	if( pnHash->nHashFlags & HASH_MIGRATING )
+		hash_migrate( pnHash, pnHash->nHashSlots );
+
+	node_link_t * ppnOld = pnHash->ppnHashSlots;
+	int nOldSlots = pnHash->nHashSlots;
+	const unsigned int * pnOldHashes = HASH_TABLE_HASHES( ppnOld, nOldSlots );
+	const unsigned short * pnOldLengths = HASH_TABLE_LENGTHS( ppnOld, nOldSlots );
+	const unsigned char * pbOldCtrl = HASH_TABLE_CTRL( ppnOld, nOldSlots );
+	int nBuckets = ( n + HASH_FROZEN_BUCKET - 1 ) / HASH_FROZEN_BUCKET;
+
+	/* scratch: each child's old slot and new slot, the children by bucket and their hashes, buckets by size, taken slots */
+	int * pnScratch = (int *)malloc( ( 4 * (size_t)n + 3 * ( (size_t)nBuckets + 1 ) + (size_t)n + 1 ) * sizeof(int) + n );
+	node_link_t * ppnNew = (node_link_t *)node_malloc( GET_ARENA( pnHash ), HASH_FROZEN_SIZE( n, nBuckets ) );
+	if( pnScratch == NULL || ppnNew == NULL )
+	{
+		if( pnScratch == NULL )
+			node_fail( NODE_ERROR_MEMORY );
+		free( pnScratch );
+		if( ppnNew != NULL )
+			nfree( GET_ARENA( pnHash ), ppnNew );
+		return FALSE;
+	}
+	int * pnFrom = pnScratch;
+	int * pnTo = pnFrom + n;
+	int * pnByBucket = pnTo + n;
+	unsigned int * pnKeyHashes = (unsigned int *)( pnByBucket + n );
+	int * pnBucketStart = (int *)( pnKeyHashes + n );
+	int * pnBySize = pnBucketStart + nBuckets + 1;
+	int * pnBucketKeys = pnBySize + nBuckets + 1;
+	int * pnSizeStart = pnBucketKeys + nBuckets + 1;
+	unsigned char * pbTaken = (unsigned char *)( pnSizeStart + n + 1 );
+	hash_frozen * pf = (hash_frozen *)( (char *)ppnNew + HASH_TRAILER_OFFSET( n ) );
+	pf->nBuckets = nBuckets;
+
+	/* the children, grouped by bucket */
+	int i, j = 0;
+	memset( pnBucketStart, 0, ( nBuckets + 1 ) * sizeof(int) );
+	for( i = 0; i < nOldSlots; i++ )
+	{
+		if( ( pbOldCtrl[i] & 0x80 ) == 0 )
+		{
+			pnFrom[j++] = i;
+			pnBucketStart[HASH_RANGE( pnOldHashes[i], nBuckets ) + 1]++;
+		}
+	}
+	node_assert( j == n );
+	for( i = 0; i < nBuckets; i++ )
+		pnBucketStart[i + 1] += pnBucketStart[i];
+	for( j = 0; j < n; j++ )
+	{
+		/* the hashes are kept in bucket order, as the displacements are tried */
+		int nAt = pnBucketStart[HASH_RANGE( pnOldHashes[pnFrom[j]], nBuckets )]++;
+		pnByBucket[nAt] = j;
+		pnKeyHashes[nAt] = pnOldHashes[pnFrom[j]];
+	}
+	for( i = nBuckets; i > 0; i-- )
+		pnBucketStart[i] = pnBucketStart[i - 1];
+	pnBucketStart[0] = 0;
+
+	/* the buckets, largest first: they are the hardest to place, so they go while the table is emptiest */
+	memset( pnSizeStart, 0, ( n + 1 ) * sizeof(int) );
+	for( i = 0; i < nBuckets; i++ )
+		pnSizeStart[n - ( pnBucketStart[i + 1] - pnBucketStart[i] )]++;
+	for( i = 0, j = 0; i <= n; i++ )
+	{
+		int nCount = pnSizeStart[i];
+		pnSizeStart[i] = j;
+		j += nCount;
+	}
+	for( i = 0; i < nBuckets; i++ )
+		pnBySize[pnSizeStart[n - ( pnBucketStart[i + 1] - pnBucketStart[i] )]++] = i;
+
+	/* keys of the same full hash would go to the same slot whatever the displacement:
+	   all but the first of them move to the end of their bucket, and later to the end of the table */
+	int nKeySlots = n;
+	for( int nBucket = 0; nBucket < nBuckets; nBucket++ )
+	{
+		int * pnKeys = pnByBucket + pnBucketStart[nBucket];
+		unsigned int * pnHashes = pnKeyHashes + pnBucketStart[nBucket];
+		int nKeys = pnBucketStart[nBucket + 1] - pnBucketStart[nBucket];
+		for( i = 1; i < nKeys; i++ )
+		{
+			for( j = 0; j < i && pnHashes[i] != pnHashes[j]; j++ )
+				/* empty */;
+			if( j < i )
+			{
+				int nKey = pnKeys[i];
+				unsigned int nHash = pnHashes[i];
+				memmove( pnKeys + i, pnKeys + i + 1, ( nKeys - i - 1 ) * sizeof(int) );
+				memmove( pnHashes + i, pnHashes + i + 1, ( nKeys - i - 1 ) * sizeof(unsigned int) );
+				pnKeys[--nKeys] = nKey;
+				pnHashes[nKeys] = nHash;
+				pnTo[nKey] = --nKeySlots;
+				i--;
+			}
+		}
+		pnBucketKeys[nBucket] = nKeys;
+	}
+	pf->nKeySlots = nKeySlots;
 
-			/* reallocate the buffer */
-			psNewBuffer = (char*)node_malloc( pArena, nBufferSize );
+	/* give each bucket the first displacement that puts all its keys in free slots */
+	int bFrozen = TRUE;
+	unsigned int nMaxTries = 16u * (unsigned int)n + 256;
+	memset( pbTaken, 0, n );
+	for( int b = 0; b < nBuckets && bFrozen; b++ )
+	{
+		int nBucket = pnBySize[b];
+		const int * pnKeys = pnByBucket + pnBucketStart[nBucket];
+		const unsigned int * pnHashes = pnKeyHashes + pnBucketStart[nBucket];
+		int nKeys = pnBucketKeys[nBucket];
 
-			/* copy the old buffer onto the new one */
-			memcpy( psNewBuffer, psBuffer, nBufferSize/2 );
+		unsigned int nTry;
+		for( nTry = 0; nKeys > 0 && nTry < nMaxTries; nTry++ )
+		{
+			/* the tries differ in all their bits, not just the low ones */
+			unsigned int nDisplace = nTry * 0x9E3779B9u;
+			for( i = 0; i < nKeys; i++ )
+			{
+				int nSlot = HASH_RANGE( hash_displace( pnHashes[i], nDisplace ), nKeySlots );
+				if( pbTaken[nSlot] )
+					break;
+				pbTaken[nSlot] = TRUE;
+				pnTo[pnKeys[i]] = nSlot;
+			}
+			if( i == nKeys )
+				break;
 
-			nfree( pArena, psBuffer );
-			psBuffer = psNewBuffer;
+			while( i-- > 0 )
+				pbTaken[pnTo[pnKeys[i]]] = FALSE;
 		}
 
-		/* store the character in the buffer */
-		psBuffer[ nBytesRead-1 ] = (char)nChar;
+		if( nTry >= nMaxTries )
+			bFrozen = FALSE;
+		pf->anDisplace[nBucket] = ( nKeys > 0 ) ? nTry * 0x9E3779B9u : 0;
+	}
 
-		/* if the character was a newline */
-		if( nChar == '\n' )
-			break;
+	if( !bFrozen )
+	{
+		free( pnScratch );
+		nfree( GET_ARENA( pnHash ), ppnNew );
+		return FALSE;
 	}
 
-	/* terminate the buffer */
-	int nEnd = nBytesRead;
+	/* move the children to their slots */
+	unsigned int * pnHashes = HASH_TABLE_HASHES( ppnNew, n );
+	unsigned short * pnLengths = HASH_TABLE_LENGTHS( ppnNew, n );
+	unsigned char * pbCtrl = HASH_TABLE_CTRL( ppnNew, n );
+	for( j = 0; j < n; j++ )
+	{
+		int nFrom = pnFrom[j], nTo = pnTo[j];
+		ppnNew[nTo] = ppnOld[nFrom];
+		pnHashes[nTo] = pnOldHashes[nFrom];
+		pnLengths[nTo] = pnOldLengths[nFrom];
+		pbCtrl[nTo] = pbOldCtrl[nFrom];
+	}
+	free( pnScratch );
 
-	if( nBytesRead >= 1 && psBuffer[ nBytesRead-1 ] == '\n' )
-		nEnd = nBytesRead - 1;
+	hash_table_free( NODE_CACHE_CTX, pnHash, ppnOld, nOldSlots );
+	NODE_STAT_CTX( NODE_CACHE_CTX, GET_ARENA( pnHash ), cbBuckets += HASH_FROZEN_SIZE( n, nBuckets ) );
+	pnHash->ppnHashSlots = ppnNew;
+	pnHash->nHashSlots = n;
+	pnHash->nHashGrowth = 0;
+	pnHash->nHashFlags |= HASH_FROZEN;
 
-	if( nBytesRead >= 2 &&psBuffer[ nBytesRead-2 ] == '\r' )
-		nEnd = nBytesRead - 2;
+	return TRUE;
+}
 
-	psBuffer[ nEnd ] = '\0';
-	*ppsEnd = psBuffer + nEnd;
+/* give a frozen hash an ordinary table again; FALSE (still frozen) if there is no memory for one */
+static int NODE_INTERNAL_FUNC hash_thaw( node_t * pnHash )
+{
+	int nSlots = HASH_MIN_SLOTS;
+	while( HASH_MAX_FILL( nSlots ) <= pnHash->nHashElements )
+		nSlots <<= 1;
 
-	/* return the read string */
-	return psBuffer;
+	node_link_t * ppnNew = hash_table_alloc( NODE_CACHE_CTX, pnHash, nSlots );
+	if( ppnNew == NULL )
+		return FALSE;
+
+	/* every slot of a frozen table is used */
+	node_link_t * ppnFrozen = pnHash->ppnHashSlots;
+	int nFrozenSlots = pnHash->nHashSlots;
+	const unsigned int * pnHashes = HASH_TABLE_HASHES( ppnFrozen, nFrozenSlots );
+	const unsigned short * pnLengths = HASH_TABLE_LENGTHS( ppnFrozen, nFrozenSlots );
+	hash_table_set( pnHash, ppnNew, nSlots );
+	pnHash->nHashFlags &= ~HASH_FROZEN;
+
+	for( int i = 0; i < nFrozenSlots; i++ )
+		hash_place( pnHash, LINK_GET( pnHash, ppnFrozen[i] ), pnHashes[i], pnLengths[i] );
+
+	hash_frozen_free( pnHash, ppnFrozen, nFrozenSlots );
+	return TRUE;
 }
 
-static wchar_t * NODE_INTERNAL_FUNC read_lineW( node_arena * pArena, FILE * pfIn, wchar_t ** ppsEnd )
+static void NODE_INTERNAL_FUNC hash_frozen_free( node_t * pnHash, node_link_t * ppnSlots, int nSlots )
 {
-	int nBufferSize = 40;
-	wchar_t * psBuffer = NULL;
-	int nCharsRead = 0;
-	wchar_t nChar = 0;
+	const hash_frozen * pf = (const hash_frozen *)( (char *)ppnSlots + HASH_TRAILER_OFFSET( nSlots ) );
+	NODE_STAT_CTX( NODE_CACHE_CTX, GET_ARENA( pnHash ), cbBuckets -= HASH_FROZEN_SIZE( nSlots, pf->nBuckets ) );
+	nfree( GET_ARENA( pnHash ), ppnSlots );
+}
 
-	/* check for end-of-file */
-	nChar = fgetwc( pfIn );
-	if( feof( pfIn ) )
+/* the record every table of a shared hash is headed by: found as a get finds the table, since
+   another writer may be replacing it. NULL if there is no memory for the read section */
+static hash_shared * NODE_INTERNAL_FUNC hash_shared_of( const node_t * pnHash )
+{
+	node_reader * pr = read_begin();
+	if( pr == NULL )
 		return NULL;
-	else
-		ungetwc( nChar, pfIn );
-
-	/* allocate initial buffer */
-	psBuffer = (wchar_t *)node_malloc( pArena, nBufferSize * sizeof(wchar_t) );
-
-	for(;;)
-	{
-READ_CHAR:
-		/* read a character */
-		nChar = fgetwc( pfIn );
+	hash_shared * pShared = HASH_SHARED_TABLE( HASH_PUBLISHED( pnHash ) )->pShared;
+	read_end( pr );
+	return pShared;
+}
 
-		/* if the character was EOF */
-		if( nChar == WEOF )
-			break;
+/* fill a new table of nSlots with a shared hash's children, then make it the one gets read;
+   the caller disposes of the old one. FALSE (the old one still current) if there is no memory */
+static int NODE_INTERNAL_FUNC hash_shared_build( node_t * pnHash, hash_shared * pShared, int nSlots )
+{
+	size_t nSize = HASH_SHARED_HEADER + HASH_TABLE_SIZE( nSlots );
+	hash_shared_table * pt = (hash_shared_table *)node_malloc( GET_ARENA( pnHash ), nSize );
+	if( pt == NULL )
+		return FALSE;
+	NODE_STAT_CTX( NODE_CACHE_CTX, GET_ARENA( pnHash ), cbBuckets += nSize );
 
-		/* if byte-order marker, skip */
-		/* TODO: handle other-endian unicode files */
-		if( nChar == NODE_BOM )
-			goto READ_CHAR;
+	pt->pShared = pShared;
+	pt->ptNext = NULL;
+	pt->nSlots = nSlots;
 
-		/* increment the read count */
-		nCharsRead++;
+	node_link_t * ppnNew = (node_link_t *)( (char *)pt + HASH_SHARED_HEADER );
+	memset( HASH_TABLE_CTRL( ppnNew, nSlots ), HASH_CTRL_EMPTY, nSlots );
 
-		/* if we're past the length of the buffer */
-		if( nCharsRead >= nBufferSize )
-		{
-			wchar_t * psNewBuffer = NULL;
+	hash_iter it( pnHash );
+	node_t * pnElement;
+	while( ( pnElement = it.next() ) != NULL )
+		hash_table_place( pnHash, ppnNew, nSlots, pnElement, it.nHash, it.nLength );
 
-			/* increase the buffer size */
-			nBufferSize *= 2;
+	/* the exchange orders the filling before the table's publication */
+	InterlockedExchangePointer( (void * volatile *)&( pnHash->ppnHashSlots ), ppnNew );
+	pnHash->nHashSlots = nSlots;
+	pnHash->nHashGrowth = HASH_MAX_FILL( nSlots ) - pnHash->nHashElements;
 
-			/* reallocate the buffer */
-			psNewBuffer = (wchar_t*)node_malloc( pArena, nBufferSize * sizeof(wchar_t) );
+	return TRUE;
+}
 
-			/* copy the old buffer onto the new one */
-			memcpy( psNewBuffer, psBuffer, (nBufferSize/2) * sizeof(wchar_t) );
+/* the children of a shared hash, counted by every stripe */
+static LONG NODE_INTERNAL_FUNC hash_shared_elements( const hash_shared * pShared )
+{
+	LONG nElements = 0;
+	for( int i = 0; i < HASH_STRIPES; i++ )
+		nElements += pShared->aStripes[i].nElements;
+	return nElements;
+}
 
-			nfree( pArena, psBuffer );
-			psBuffer = psNewBuffer;
-		}
+/* share the hash's nHashGrowth out among the stripes, holding every one; iStripe's writer, who ran
+   out, gets what does not divide, so it has a slot whenever there is any */
+static void NODE_INTERNAL_FUNC hash_shared_spread( node_t * pnHash, hash_shared * pShared, int iStripe )
+{
+	int nGrowth = pnHash->nHashGrowth > 0 ? pnHash->nHashGrowth : 0;
+	for( int i = 0; i < HASH_STRIPES; i++ )
+		pShared->aStripes[i].nGrowth = nGrowth / HASH_STRIPES;
+	pShared->aStripes[iStripe].nGrowth += nGrowth % HASH_STRIPES;
+}
 
-		/* store the character in the buffer */
-		psBuffer[ nCharsRead-1 ] = (wchar_t)nChar;
+/* gather the stripes' slots for the writer of iStripe, which found none left in its own, and grow the
+   table if they are all gone; holding every stripe so no other writer is in the table. The writer holds
+   none, or two growing at once could each wait on the other's stripe. FALSE if there was no memory to grow */
+static int NODE_INTERNAL_FUNC hash_shared_grow( node_t * pnHash, hash_shared * pShared, int iStripe )
+{
+	int i;
+	for( i = 0; i < HASH_STRIPES; i++ )
+		EnterCriticalSection( &(pShared->aStripes[i].cs) );
 
-		/* if the character was a newline */
-		if( nChar == '\n' )
-			break;
-	}
+	/* no writer holds a slot it reserved, so the counts are exact; another writer may have grown it already */
+	pnHash->nHashElements = hash_shared_elements( pShared );
+	pnHash->nHashGrowth = 0;
+	for( i = 0; i < HASH_STRIPES; i++ )
+		pnHash->nHashGrowth += pShared->aStripes[i].nGrowth;
+	int bRoom = hash_reserve( pnHash );
+	hash_shared_spread( pnHash, pShared, iStripe );
 
-	int nEnd = nCharsRead;
+	for( i = HASH_STRIPES - 1; i >= 0; i-- )
+		LeaveCriticalSection( &(pShared->aStripes[i].cs) );
 
-	if( nCharsRead >= 1 && psBuffer[ nCharsRead-1 ] == '\n' )
-		nEnd = nCharsRead - 1;
+	return bRoom;
+}
 
-	if( nCharsRead >= 2 &&psBuffer[ nCharsRead-2 ] == '\r' )
-		nEnd = nCharsRead - 2;
+/* free a child taken out of pnHash: at once, unless it is shared and a get may still hold it */
+static void NODE_INTERNAL_FUNC hash_retire( node_t * pnHash, node_t * pn )
+{
+	if( pnHash->nType != NODE_HASH || !( pnHash->nHashFlags & HASH_SHARED ) )
+	{
+		node_free_internal( pn, NOT_IN_COLLECTION );
+		return;
+	}
 
-	psBuffer[ nEnd ] = '\0';
-	*ppsEnd = psBuffer + nEnd;
+	/* without its record, a get may still hold the child: it is left, not freed */
+	hash_shared * pShared = hash_shared_of( pnHash );
+	if( pShared == NULL )
+		return;
+	node_lock lock( &(pShared->csRetired) );
+	SET_NEXT( pn, pShared->pnRetired );
+	pShared->pnRetired = pn;
 
-	/* return the read string */
-	return psBuffer;
+	if( ++pShared->nRetired >= HASH_RETIRE_BATCH )
+		hash_reclaim( pnHash, pShared, FALSE );
 }
 
-static char * NODE_INTERNAL_FUNC node_escapeA( struct node_arena * pArena, const char * psUnescaped )
+/* a table replaced in a shared hash waits with its retired children */
+static void NODE_INTERNAL_FUNC hash_retire_table( node_t * pnHash, node_link_t * ppnSlots )
 {
-	char * psEscaped = NULL;
-	char * psE = NULL;
-	const char * psU = NULL;
+	hash_shared_table * pt = HASH_SHARED_TABLE( ppnSlots );
+	hash_shared * pShared = pt->pShared;
+	node_lock lock( &(pShared->csRetired) );
+	pt->ptNext = pShared->ptRetired;
+	pShared->ptRetired = pt;
 
-	psEscaped = (char *)node_malloc( pArena, 3*strlen(psUnescaped) + 1 );
+	/* tables are large: no batch is waited for */
+	hash_reclaim( pnHash, pShared, FALSE );
+}
 
-	psE = psEscaped;
-	psU = psUnescaped;
-	while( *psU != '\0' )
+static void NODE_INTERNAL_FUNC hash_shared_tables_free( node_t * pnHash, hash_shared_table * pt )
+{
+	while( pt != NULL )
 	{
-		if( ( psU == psUnescaped && ( *psU == '}' || *psU == ')' || *psU == '$' ) ) ||
-			*psU == '%' || *psU == ':' || *psU == '\r' || *psU == '\n' )
-		{
-			/* write out a percent */
-			*psE++ = '%';
+		hash_shared_table * ptNext = pt->ptNext;
+		NODE_STAT_CTX( NODE_CACHE_CTX, GET_ARENA( pnHash ), cbBuckets -= HASH_SHARED_HEADER + HASH_TABLE_SIZE( pt->nSlots ) );
+		nfree( GET_ARENA( pnHash ), pt );
+		pt = ptNext;
+	}
+}
 
-			/* write out the hex code */
-			sprintf( psE, "%02X", *psU );
-			psU++;
-			psE += 2;
-		}
-		else
+/* free what waits once no read section begun before it was set aside is still going, then set aside
+   what was retired since in its place: every section that could hold that begins before the epoch moves
+   on. With bAll, no other thread is using the hash, and everything goes */
+static void NODE_INTERNAL_FUNC hash_reclaim( node_t * pnHash, hash_shared * pShared, int bAll )
+{
+	if( pShared->nWaitEpoch != 0 && !bAll )
+	{
+		for( node_reader * pr = g_pReaders; pr != NULL; pr = pr->pNext )
 		{
-			*psE++ = *psU++;
+			LONG nEpoch = pr->nEpoch;
+			if( nEpoch != 0 && nEpoch <= pShared->nWaitEpoch )
+				return;
 		}
 	}
-	*psE = '\0';
 
-	return psEscaped;
+	/* retired children are linked by pnNext, so they are freed as neighbours */
+	node_free_internal( pShared->pnWaiting, NOT_IN_COLLECTION );
+	hash_shared_tables_free( pnHash, pShared->ptWaiting );
+	pShared->pnWaiting = pShared->pnRetired;
+	pShared->ptWaiting = pShared->ptRetired;
+	pShared->pnRetired = NULL;
+	pShared->ptRetired = NULL;
+	pShared->nRetired = 0;
+	pShared->nWaitEpoch = 0;
+
+	if( pShared->pnWaiting == NULL && pShared->ptWaiting == NULL )
+		return;
+
+	if( bAll )
+	{
+		node_free_internal( pShared->pnWaiting, NOT_IN_COLLECTION );
+		hash_shared_tables_free( pnHash, pShared->ptWaiting );
+		pShared->pnWaiting = NULL;
+		pShared->ptWaiting = NULL;
+		return;
+	}
+
+	pShared->nWaitEpoch = InterlockedIncrement( &g_nReadEpoch ) - 1;
 }
 
-static wchar_t * NODE_INTERNAL_FUNC node_escapeW( struct node_arena * pArena, const wchar_t * psUnescaped )
+/* free a shared hash's last table and its record: no other thread may be using it any more */
+static void NODE_INTERNAL_FUNC hash_unshare( node_t * pnHash )
 {
-	wchar_t * psEscaped = NULL;
-	wchar_t * psE = NULL;
-	const wchar_t * psU = NULL;
+	hash_shared_table * pt = HASH_SHARED_TABLE( pnHash->ppnHashSlots );
+	hash_shared * pShared = pt->pShared;
 
-	const size_t nEscapedLen = (3*wcslen(psUnescaped) + 1);
-	psEscaped = (wchar_t *)node_malloc( pArena, nEscapedLen*sizeof(wchar_t) );
+	hash_reclaim( pnHash, pShared, TRUE );
+	hash_shared_tables_free( pnHash, pt );
 
-	psE = psEscaped;
-	psU = psUnescaped;
-	while( *psU != '\0' )
-	{
-		if( ( psU == psUnescaped && ( *psU == '}' || *psU == ')' || *psU == '$' ) ) ||
-			*psU == '%' || *psU == ':' || *psU == '\r' || *psU == '\n' )
-		{
-			/* write out a percent */
-			*psE++ = '%';
+	hash_shared_free( pnHash, pShared );
+	pnHash->nHashFlags &= ~HASH_SHARED;
+}
 
-			/* write out the hex code */
-			swprintf( psE, nEscapedLen-(psE - psEscaped), L"%02X", *psU );
-			psU++;
-			psE += 2;
-		}
-		else
-		{
-			*psE++ = *psU++;
-		}
-	}
-	*psE = '\0';
+static void NODE_INTERNAL_FUNC hash_shared_free( node_t * pnHash, hash_shared * pShared )
+{
+	for( int i = 0; i < HASH_STRIPES; i++ )
+		DeleteCriticalSection( &(pShared->aStripes[i].cs) );
+	DeleteCriticalSection( &(pShared->csRetired) );
+	nfree( GET_ARENA( pnHash ), pShared->pvBlock );
+}
 
-	return psEscaped;
+/******************
+ Freelist Functions
+ ******************/
+void freelist_cleanup()
+{
 }
 
-static char * NODE_INTERNAL_FUNC node_unescapeA( struct node_arena * pArena, const char * psEscaped, const char * psEnd )
+#ifdef USE_DL_MALLOC
+/* a run of free nodes as kept on node_arena::slBatches; overlays the first node of the run */
+struct node_batch
 {
-	char * psUnescaped = (char *)node_malloc( pArena, psEnd-psEscaped+1 );
-	const char * psE = psEscaped;
-	char * psU = psUnescaped;
+	SLIST_ENTRY sle;
+	node_t * pnRest;		/* remaining nodes of the batch, linked by pnNext */
+	int nCount;				/* nodes in the batch, including this one */
+};
 
-	int n = 0;
+/* returns this thread's cache for pArena, claiming (and if need be evicting) a slot */
+static node_cache * NODE_INTERNAL_FUNC node_cache_find( node_tls * ptls, node_arena * pArena )
+{
+	node_cache * pCacheFree = NULL;
 
-	while( psE < psEnd )
+	for( int i = 0; i < NODE_CACHE_ARENAS; i++ )
 	{
-		switch( *psE )
+		node_cache * pCache = &(ptls->aCache[i]);
+		if( pCache->pArena == pArena )
 		{
-		case '%':
+			if( pCache->nSerial != pArena->nSerial )
 			{
-				/* step over the percent */
-				psE++;
-
-				/* convert the hex code */
-				TempSZ<char> t( pArena, psE, psE+2 );
-				n = strtoul( t, NULL, 16 );
-				*psU++ = (char)n;
-				psE += 2;
+				/* arena was reset or recreated since we cached: those nodes went with it */
+				pCache->nSerial = pArena->nSerial;
+				pCache->pnHead = NULL;
+				pCache->nCount = 0;
+				pCache->nNodes = 0;
 			}
-			break;
-		default:
-			*psU++ = *psE++;
+			return pCache;
 		}
+
+		if( pCache->pArena == NULL && pCacheFree == NULL )
+			pCacheFree = pCache;
 	}
-	*psU = '\0';
 
-	return psUnescaped;
+	if( pCacheFree == NULL )
+	{
+		/* all slots busy: give one cache back to its arena */
+		pCacheFree = &(ptls->aCache[ ptls->iCacheVictim++ % NODE_CACHE_ARENAS ]);
+		node_cache_drain( pCacheFree, 0 );
+		node_cache_retire( pCacheFree );
+	}
+
+	pCacheFree->pArena = pArena;
+	pCacheFree->nSerial = pArena->nSerial;
+	pCacheFree->pnHead = NULL;
+	pCacheFree->nCount = 0;
+	pCacheFree->nNodes = 0;
+
+	return pCacheFree;
 }
 
-static wchar_t * NODE_INTERNAL_FUNC node_unescapeW( struct node_arena * pArena, const wchar_t * psEscaped, const wchar_t * psEnd )
+/* returns this thread's statistics slot for pArena, folding another slot into its arena if none is free */
+static node_stat_slot * NODE_INTERNAL_FUNC node_stats_find( node_tls * ptls, node_arena * pArena )
 {
-	wchar_t * psUnescaped = (wchar_t *)node_malloc( pArena, (psEnd-psEscaped+1)*sizeof(wchar_t) );
-	const wchar_t * psE = psEscaped;
-	wchar_t * psU = psUnescaped;
+	node_stat_slot * pSlotFree = NULL;
 
-	int n = 0;
-
-	while( psE < psEnd )
+	for( int i = 0; i < NODE_STAT_ARENAS; i++ )
 	{
-		switch( *psE )
+		node_stat_slot * pSlot = &(ptls->aStats[i]);
+		if( pSlot->pArena == pArena )
 		{
-		case '%':
+			if( pSlot->nSerial != pArena->nSerial )
 			{
-				/* step over the percent */
-				psE++;
-
-				/* convert the hex code */
-				TempSZ<wchar_t> t( pArena, psE, psE+2 );
-				n = wcstoul( t, NULL, 16 );
-				*psU++ = (wchar_t)n;
-				psE += 2;
+				/* arena was reset or recreated: its counts started again */
+				pSlot->nSerial = pArena->nSerial;
+				memset( &(pSlot->stats), 0, sizeof(pSlot->stats) );
 			}
-			break;
-		default:
-			*psU++ = *psE++;
+			return pSlot;
 		}
+
+		if( pSlot->pArena == NULL && pSlotFree == NULL )
+			pSlotFree = pSlot;
 	}
-	*psU = '\0';
 
-	return psUnescaped;
-}
+	if( pSlotFree == NULL )
+	{
+		pSlotFree = &(ptls->aStats[ ptls->iStatVictim++ % NODE_STAT_ARENAS ]);
+		node_stats_retire( pSlotFree );
+	}
 
-static char * NODE_INTERNAL_FUNC WToA( node_arena * pArena, const wchar_t * psW )
-{
-	return WToA( pArena, psW, wcslen(psW) );
-}
+	pSlotFree->pArena = pArena;
+	pSlotFree->nSerial = pArena->nSerial;
+	memset( &(pSlotFree->stats), 0, sizeof(pSlotFree->stats) );
 
-static char * NODE_INTERNAL_FUNC WToA( node_arena * pArena, const wchar_t * psW, const wchar_t * psWEnd )
-{
-	return WToA( pArena, psW, psWEnd - psW );
+	return pSlotFree;
 }
 
-static char * NODE_INTERNAL_FUNC WToA( node_arena * pArena, const wchar_t * psW, size_t cch )
+/* the next node of the newest slab, or NULL when it is used up; nodes are kept inside a chunk,
+   and a chunk after the slab's first gets the arena pointer GET_ARENA reads. Holds csSlabs. */
+static char * NODE_INTERNAL_FUNC node_slab_carve( node_arena * pArena, size_t nNodeSize )
 {
-	char * psA = NULL;
-
-	int nCodePage = node_nCodePage;
-	DWORD dwLength = WideCharToMultiByte( nCodePage, 0, psW, (int)cch, NULL, 0, NULL, NULL ) + 1;
-
-	psA = (char *)node_malloc( pArena, dwLength );
+	char * pc = pArena->pcSlabNext;
+	if( pc == NULL )
+		return NULL;
 
-	WideCharToMultiByte( nCodePage, 0, psW, (int)cch, psA, dwLength, NULL, NULL );
-	psA[dwLength-1] = '\0';
+	size_t nOffset = (uintptr_t)pc & (NODE_CHUNK_SIZE - 1);
+	if( nOffset + nNodeSize > NODE_CHUNK_SIZE )
+	{
+		pc += NODE_CHUNK_SIZE - nOffset;
+		nOffset = 0;
+	}
 
-	return psA;
-}
+	if( nOffset == 0 )
+	{
+		if( pArena->pcSlabEnd - pc < (ptrdiff_t)( NODE_CHUNK_HEADER + nNodeSize ) )
+			return NULL;
 
-static wchar_t * NODE_INTERNAL_FUNC AToW( node_arena * pArena, const char * psA )
-{
-	return AToW( pArena, psA, strlen(psA) );
-}
+		*reinterpret_cast<node_arena **>( pc ) = pArena;
+		pc += NODE_CHUNK_HEADER;
+	}
+	else if( pArena->pcSlabEnd - pc < (ptrdiff_t)nNodeSize )
+		return NULL;
 
-static wchar_t * NODE_INTERNAL_FUNC AToW( node_arena * pArena, const char * psA, const char * psAEnd )
-{
-	return AToW( pArena, psA, psAEnd-psA );
+	pArena->pcSlabNext = pc + nNodeSize;
+	return pc;
 }
 
-static wchar_t * NODE_INTERNAL_FUNC AToW( node_arena * pArena, const char * psA, size_t nLength )
+/* fills an empty cache with one batch: a shared batch if there is one, else fresh slab memory */
+static void NODE_INTERNAL_FUNC node_cache_refill( node_cache * pCache )
 {
-	wchar_t * psW = NULL;
+	node_arena * pArena = pCache->pArena;
 
-	int nCodePage = node_nCodePage;
-	DWORD dwLength = MultiByteToWideChar( nCodePage, 0, psA, (int)nLength, NULL, 0 ) + 1;
+	node_batch * pBatch = reinterpret_cast<node_batch *>( InterlockedPopEntrySList( &(pArena->slBatches) ) );
+	if( pBatch != NULL )
+	{
+		node_t * pnRest = pBatch->pnRest;
+		pCache->nCount = pBatch->nCount;
+		pCache->pnHead = reinterpret_cast<node_t *>( pBatch );
+		SET_NEXT( pCache->pnHead, pnRest );
+		InterlockedExchangeAdd( &(pArena->nBatchedNodes), -pCache->nCount );
+		return;
+	}
 
-	psW = (wchar_t *)node_malloc( pArena, dwLength * sizeof(wchar_t) );
+#ifdef USE_BAGS
+	const size_t nNodeSize = NODE_SIZE + BAG_SIZE;
+#else
+	const size_t nNodeSize = NODE_SIZE;
+#endif
 
-	MultiByteToWideChar( nCodePage, 0, psA, (int)nLength, psW, dwLength );
-	psW[dwLength-1] = '\0';
+	node_lock l( &(pArena->csSlabs) );
 
-	return psW;
-}
+	char * pcNode = node_slab_carve( pArena, nNodeSize );
+	if( pcNode == NULL )
+	{
+		if( pArena->pVASpare != NULL )
+		{
+			/* reuse a slab emptied by a reset */
+			node_arena::va * pVA = pArena->pVASpare;
+			pArena->pVASpare = pVA->next;
+			pVA->next = pArena->pVA;
+			pArena->pVA = pVA;
+
+			pArena->pcSlabNext = reinterpret_cast<char *>( pVA ) + sizeof(node_arena::va);
+			pArena->pcSlabEnd = reinterpret_cast<char *>( pVA ) + pVA->nSize;
+		}
+		else
+		{
+			/* allocate some more space */
+			const size_t nSlabSize = pArena->nSlabSize;
+			char * pcSlab = reinterpret_cast<char *>( node_valloc( pArena, &(pArena->pVA), nSlabSize ) );
+			if( pcSlab == NULL )
+				return;		/* cache stays empty; node_alloc_internal reports the failure */
 
-NODE_API void node_set_codepage( int nCodePage )
-{
-	node_nCodePage = nCodePage;
-}
+			pArena->pcSlabNext = pcSlab;
+			pArena->pcSlabEnd = pcSlab + nSlabSize - sizeof(node_arena::va);
+		}
 
-NODE_API int node_get_codepage()
-{
-	return node_nCodePage;
-}
+		pcNode = node_slab_carve( pArena, nNodeSize );
+		if( pcNode == NULL )
+			return;
+	}
 
-NODE_API void node_set_debug( int nDebug )
-{
-	node_nDebug = nDebug;
+	/* carve in address order so neighbouring allocations stay neighbours */
+	node_t * pnHead = reinterpret_cast<node_t *>( pcNode );
+	node_t * pnLast = pnHead;
+	int nCount = 1;
 
-	node_nDebugIntern = (node_nDebug & NODE_DEBUG_INTERN);
-	node_nDebugUnicode = (node_nDebug & NODE_DEBUG_UNICODE);
-	node_nDebugRef = (node_nDebug & NODE_DEBUG_REF);
-	node_nDebugHashPerf = (node_nDebug & NODE_DEBUG_HASHPERF);
+	while( nCount < NODE_CACHE_BATCH && ( pcNode = node_slab_carve( pArena, nNodeSize ) ) != NULL )
+	{
+		SET_NEXT( pnLast, reinterpret_cast<node_t *>( pcNode ) );
+		pnLast = node_next( pnLast );
+		nCount++;
+	}
+	SET_NEXT( pnLast, NULL );
+
+	pCache->pnHead = pnHead;
+	pCache->nCount = nCount;
 }
 
-NODE_API int node_get_debug()
+/* gives all but nKeep cached nodes back to the arena, one lock-free push per batch */
+static void NODE_INTERNAL_FUNC node_cache_drain( node_cache * pCache, int nKeep )
 {
-	return node_nDebug;
-}
+	node_arena * pArena = pCache->pArena;
 
+	if( pArena == NULL )
+		return;
 
-NODE_API void node_set_error_funcs( node_error_func_t pErrFunc, node_memory_func_t pMemFunc, 
-								    node_assert_func_t pAssertFunc )
-{
-	node_pfError = pErrFunc;
-	node_pfMemory = pMemFunc;
-	node_pfAssert = reinterpret_cast<node_assert_func_internal_t>(pAssertFunc);
-}
+	if( pCache->nSerial != pArena->nSerial )
+	{
+		/* arena deleted: its slabs are gone */
+		pCache->pnHead = NULL;
+		pCache->nCount = 0;
+		return;
+	}
 
-static void NODE_INTERNAL_FUNC _node_assert( void * psExpr, const char * psFile, unsigned int nLine )
-{
-	if( node_pfAssert != NULL )
+	while( pCache->nCount > nKeep )
 	{
-		if( node_source_file != NULL )
-			node_pfAssert( psExpr, node_source_file, node_source_line );
-		else
-			node_pfAssert( psExpr, psFile, nLine );
+		int nCount = __min( pCache->nCount - nKeep, NODE_CACHE_BATCH );
+
+		node_t * pnFirst = pCache->pnHead;
+		node_t * pnLast = pnFirst;
+		for( int i = 1; i < nCount; i++ )
+			pnLast = node_next( pnLast );
+
+		pCache->pnHead = node_next( pnLast );
+		pCache->nCount -= nCount;
+		SET_NEXT( pnLast, NULL );
+
+		node_t * pnRest = node_next( pnFirst );
+		node_batch * pBatch = reinterpret_cast<node_batch *>( pnFirst );
+		pBatch->pnRest = pnRest;
+		pBatch->nCount = nCount;
+		InterlockedExchangeAdd( &(pArena->nBatchedNodes), nCount );
+		InterlockedPushEntrySList( &(pArena->slBatches), &(pBatch->sle) );
 	}
 }
 
-static void NODE_INTERNAL_FUNC node_error( char * psError, ... )
+/* on the owning thread: frees the nodes other threads queued with node_free */
+static void NODE_INTERNAL_FUNC node_remote_reclaim( node_arena * pArena )
 {
-	char acBuffer[1024] = {0};
-	va_list ap;
+	PSLIST_ENTRY pEntry = InterlockedFlushSList( &(pArena->slRemote) );
 
-	if( node_pfError != NULL )
+	while( pEntry != NULL )
 	{
-		va_start( ap, psError );
-		_vsnprintf_s( acBuffer, sizeof(acBuffer)-1, psError, ap );
-		va_end( ap );
+		node_t * pn = reinterpret_cast<node_t *>( pEntry );
+		pEntry = pEntry->Next;
 
-		node_pfError( acBuffer );
+		/* the list entry overlaid pnNext; the node's neighbours were queued separately */
+		SET_NEXT( pn, NULL );
+		node_free_internal( pn, pn->bInCollection );
 	}
 }
 
-static int NODE_INTERNAL_FUNC node_memory( size_t cb )
+static inline void node_stats_add( node_stat_counts * pTo, const node_stat_counts * pFrom )
 {
-	if( node_pfMemory == NULL )
-		return NODE_MEMORY_FAIL;
-	else
-		return node_pfMemory( cb );
+	pTo->nNodes += pFrom->nNodes;
+	pTo->cbStrings += pFrom->cbStrings;
+	pTo->cbData += pFrom->cbData;
+	pTo->cbBuckets += pFrom->cbBuckets;
+	pTo->nBagHits += pFrom->nBagHits;
+	pTo->nBagMisses += pFrom->nBagMisses;
 }
 
-#ifdef USE_DL_MALLOC
-void * NODE_INTERNAL_FUNC node_malloc( struct node_arena * pArena, size_t cb )
-#else
-void * NODE_INTERNAL_FUNC node_malloc( struct node_arena * , size_t cb )
-#endif
+/* folds a cache's node count into its arena before the cache goes away */
+static void NODE_INTERNAL_FUNC node_cache_retire( node_cache * pCache )
 {
-	int nRetry = 0;
-
-RETRY:
-	void * pv = NULL;
-
-#if defined(USE_DL_MALLOC) || defined(DEBUG_DL_MALLOC)
-	/* round up to multiple of 4 */
-	cb = (cb + 3) & (~3);
-
-	pv = mspace_malloc( pArena->pSpace, cb );
-#else
-
-#if defined(_DEBUG)
-	if( node_source_file == NULL )
-		pv = malloc( cb );
-	else
-		pv = _malloc_dbg( cb, _NORMAL_BLOCK, node_source_file, node_source_line );
-#else
-	pv = malloc( cb );
-#endif
-
-#endif
+	node_arena * pArena = pCache->pArena;
 
-	if( pv == NULL ) 
+	if( pArena != NULL && pCache->nSerial == pArena->nSerial )
 	{
-		if( node_memory( cb ) == NODE_MEMORY_RETRY && nRetry++ < 10 )
-			goto RETRY;
-		else
-			exit(1);
+		node_lock l( &g_csArenas );
+		pArena->statsRetired.nNodes += pCache->nNodes;
 	}
 
-	return pv;
+	pCache->nNodes = 0;
 }
 
-#if defined(USE_DL_MALLOC)
-static void * NODE_INTERNAL_FUNC node_valloc( struct node_arena * pArena, size_t nSize )
+/* folds a slot's statistics into its arena before the slot is reused or its thread exits */
+static void NODE_INTERNAL_FUNC node_stats_retire( node_stat_slot * pSlot )
 {
-	int nRetry = 0;
-
-RETRY:
-	void * pv = VirtualAlloc( NULL, nSize, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE );
+	node_arena * pArena = pSlot->pArena;
 
-	if( pv == NULL ) 
+	if( pArena != NULL && pSlot->nSerial == pArena->nSerial )
 	{
-		if( node_memory( nSize ) == NODE_MEMORY_RETRY && nRetry++ < 10 )
-			goto RETRY;
-		else
-			exit(1);
+		node_lock l( &g_csArenas );
+		node_stats_add( &(pArena->statsRetired), &(pSlot->stats) );
 	}
 
-	// stash a pointer on the arena so we can clean it later
-	node_arena::va * pVA = (node_arena::va *)pv;
-	pVA->next = pArena->pVA;
-	pArena->pVA = pVA;
-
-	return (char * )pv + sizeof(node_arena::va);
-
+	memset( &(pSlot->stats), 0, sizeof(pSlot->stats) );
 }
-#endif
 
-static int __inline hash_to_bucket( const node_t * pnHash, int nHash )
+node_tls::~node_tls()
 {
-#ifdef HASH_USES_BITMASK
-	return nHash & (pnHash->nHashBuckets-1);
-#endif
-#ifdef HASH_USES_MOD
-	return nHash % pnHash->nHashBuckets;
-#endif
-}
+	if( pReader != NULL )
+	{
+		pReader->nDepth = 0;
+		pReader->nEpoch = 0;
+		InterlockedExchange( &(pReader->bInUse), FALSE );
+	}
 
-/******************
- Freelist Functions
- ******************/
-void freelist_cleanup()
-{
+	for( int i = 0; i < NODE_CACHE_ARENAS; i++ )
+	{
+		node_cache_drain( &(aCache[i]), 0 );
+		node_cache_retire( &(aCache[i]) );
+	}
+
+	for( int i = 0; i < NODE_STAT_ARENAS; i++ )
+		node_stats_retire( &(aStats[i]) );
+
+	node_lock l( &g_csArenas );
+	if( ptlsPrev != NULL )
+		ptlsPrev->ptlsNext = ptlsNext;
+	else
+		g_ptlsThreads = ptlsNext;
+	if( ptlsNext != NULL )
+		ptlsNext->ptlsPrev = ptlsPrev;
 }
+#endif /* USE_DL_MALLOC */
 
 
 /*******************
@@ -5108,16 +8766,75 @@ static int NODE_INTERNAL_FUNC node_string_type( const unsigned char * psValue )
 
 #ifdef USE_DL_MALLOC
 NODE_API node_arena_t node_create_arena( size_t size )
+{
+	return node_create_arena2( size, 0, 0 );
+}
+
+NODE_API node_arena_t node_create_arena2( size_t size, int nFlags, size_t cbSlab )
 {
 	/* create a new arena and don't select it */
 	
+	/* reuse a deleted arena if there is one, since thread caches may still look at it */
+	node_arena * pNewArena = NULL;
+	{
+		node_lock l( &g_csArenas );
+		pNewArena = g_pnaDeadArenas;
+		if( pNewArena != NULL )
+			g_pnaDeadArenas = pNewArena->pnaNextDead;
+	}
+
 	/* alloc from global arena so we can't be F'ed up by being destroyed along with some other arena... */
-	node_arena * pNewArena = (node_arena *)node_malloc( &g_GlobalArena, sizeof(node_arena) );
+	if( pNewArena == NULL )
+		pNewArena = (node_arena *)node_malloc( &g_GlobalArena, sizeof(node_arena) );
+	if( pNewArena == NULL )
+		return NULL;
+
+	InitializeSListHead( &(pNewArena->slBatches) );
+	pNewArena->pSpace = (nFlags & NODE_ARENA_MONOTONIC) ? NULL : create_mspace( size, 0 );
+	if( pNewArena->pSpace == NULL && !(nFlags & NODE_ARENA_MONOTONIC) )
+	{
+		node_fail( NODE_ERROR_MEMORY );
 
-	pNewArena->pSpace = create_mspace( size, 0 );
-	pNewArena->pnFreeList = NULL;
-	InitializeCriticalSection( &(pNewArena->csFreeList) );
+		/* back on the dead list, where an old cache can still safely look at it */
+		pNewArena->nSerial = 0;
+		node_lock l( &g_csArenas );
+		pNewArena->pnaNextDead = g_pnaDeadArenas;
+		g_pnaDeadArenas = pNewArena;
+		return NULL;
+	}
+	pNewArena->nSpaceSize = size;
+	InitializeCriticalSection( &(pNewArena->csSlabs) );
 	pNewArena->pVA = NULL;
+	pNewArena->pVASpare = NULL;
+#ifdef NODE_COMPACT_LINKS
+	pNewArena->pcSpan = NULL;
+	pNewArena->pcSpanNext = NULL;
+#endif
+	pNewArena->pcSlabNext = NULL;
+	pNewArena->pcSlabEnd = NULL;
+	pNewArena->nFlags = nFlags;
+
+	/* whole allocation-granularity units, and whole large pages if we want those */
+	size_t nGranularity = NODE_SLAB_SIZE;
+	if( (nFlags & NODE_ARENA_HUGEPAGES) && GetLargePageMinimum() > nGranularity )
+		nGranularity = GetLargePageMinimum();
+	if( cbSlab == 0 )
+		cbSlab = NODE_SLAB_SIZE;
+	pNewArena->nSlabSize = (cbSlab + nGranularity - 1) / nGranularity * nGranularity;
+	pNewArena->nBumpSize = __max( pNewArena->nSlabSize, NODE_BUMP_SIZE );
+	pNewArena->pVABump = NULL;
+	pNewArena->pVABumpSpare = NULL;
+	pNewArena->pcBumpNext = NULL;
+	pNewArena->pcBumpEnd = NULL;
+	pNewArena->pnaNextDead = NULL;
+	pNewArena->nBatchedNodes = 0;
+	pNewArena->nSlabs = 0;
+	pNewArena->cbSlabs = 0;
+	memset( &(pNewArena->statsRetired), 0, sizeof(pNewArena->statsRetired) );
+	InitializeSListHead( &(pNewArena->slRemote) );
+	pNewArena->dwOwner = GetCurrentThreadId();
+	pNewArena->cbBudget = 0;
+	pNewArena->nSerial = InterlockedIncrement( &g_nArenaSerial );
 
 	return (node_arena_t)pNewArena;
 }
@@ -5127,12 +8844,94 @@ NODE_API node_arena_t node_get_arena()
 	return (node_arena_t)node_pArena;
 }
 
+NODE_API void node_arena_stats( node_arena_t pArenaStats, node_arena_stats_t * pStats )
+{
+	node_arena * pArena = (node_arena *)pArenaStats;
+	if( pArena == NULL || pStats == NULL )
+	{
+		node_assert( pArena != NULL && pStats != NULL );
+		return;
+	}
+
+	/* the arena's own counts plus every live thread's share; other threads keep running, so this is a snapshot */
+	node_stat_counts counts;
+	size_t nCached = 0;
+	{
+		node_lock l( &g_csArenas );
+		counts = pArena->statsRetired;
+
+		for( node_tls * ptls = g_ptlsThreads; ptls != NULL; ptls = ptls->ptlsNext )
+		{
+			for( int i = 0; i < NODE_CACHE_ARENAS; i++ )
+			{
+				const node_cache * pCache = &(ptls->aCache[i]);
+				if( pCache->pArena != pArena || pCache->nSerial != pArena->nSerial )
+					continue;
+
+				counts.nNodes += pCache->nNodes;
+				nCached += pCache->nCount;
+			}
+
+			for( int i = 0; i < NODE_STAT_ARENAS; i++ )
+			{
+				const node_stat_slot * pSlot = &(ptls->aStats[i]);
+				if( pSlot->pArena == pArena && pSlot->nSerial == pArena->nSerial )
+					node_stats_add( &counts, &(pSlot->stats) );
+			}
+		}
+	}
+
+	pStats->nLiveNodes = (size_t)__max( counts.nNodes, 0 );
+	pStats->nFreeNodes = nCached + (size_t)__max( pArena->nBatchedNodes, 0 );
+	{
+		node_lock l( &(pArena->csSlabs) );
+		pStats->nSlabs = pArena->nSlabs;
+		pStats->cbSlabs = pArena->cbSlabs;
+	}
+	pStats->cbFootprint = pArena->pSpace != NULL ? mspace_footprint( pArena->pSpace ) : 0;
+	pStats->cbStrings = (size_t)__max( counts.cbStrings, 0 );
+	pStats->cbData = (size_t)__max( counts.cbData, 0 );
+	pStats->cbBuckets = (size_t)__max( counts.cbBuckets, 0 );
+	pStats->nBagHits = (size_t)counts.nBagHits;
+	pStats->nBagMisses = (size_t)counts.nBagMisses;
+	pStats->nRemoteNodes = QueryDepthSList( &(pArena->slRemote) );
+}
+
+NODE_API void node_arena_set_budget( node_arena_t pToLimit, size_t cbBudget )
+{
+	node_arena * pArena = (node_arena *)pToLimit;
+	if( pArena == NULL )
+	{
+		node_assert( pArena != NULL );
+		return;
+	}
+
+	/* a budget below what the arena already holds just stops it growing */
+	pArena->cbBudget = cbBudget;
+
+	/* node_malloc keeps the mspace limit in step while there is a budget */
+	if( cbBudget == 0 && pArena->pSpace != NULL )
+		mspace_set_footprint_limit( pArena->pSpace, 0 );
+}
+
 NODE_API node_arena_t node_set_arena( node_arena_t pNewArena )
 {
 	node_arena * pOld = node_pArena;
 
+	/* the arena may go idle: take back what other threads freed while this thread still owns it */
+	if( pOld != NULL && pOld != &g_GlobalArena && pOld->dwOwner == GetCurrentThreadId() )
+		node_remote_reclaim( pOld );
+
 	node_pArena = (node_arena *)pNewArena;
 
+	/* the thread that makes an arena current is the one that allocates from it, and frees for it,
+	   including what other threads freed for the owner before */
+	if( node_pArena != NULL && node_pArena != &g_GlobalArena )
+	{
+		node_pArena->dwOwner = GetCurrentThreadId();
+		node_remote_reclaim( node_pArena );
+	}
+
 	return (node_arena_t)pOld;
 }
 
@@ -5148,24 +8947,140 @@ NODE_API size_t node_delete_arena( node_arena_t pToDelete )
 	if( pArena == node_pArena )
 	{
 		/* deleting current arena - set current to global */
-		pArena = &g_GlobalArena;
+		node_pArena = &g_GlobalArena;
 		/* other threads might have as current the arena we are about to delete.  If so, too bad! */
 	}
 
+	/* nodes other threads freed still hold interned names: no other thread may use the arena now,
+	   so this one frees them as the owner */
+	pArena->dwOwner = GetCurrentThreadId();
+	node_remote_reclaim( pArena );
+
+	/* invalidate every thread's cached nodes for this arena */
+	pArena->nSerial = 0;
+
 	/* free the vas */
-	node_arena::va * pVANext;
-	for( node_arena::va * pVA = pArena->pVA; pVA != NULL; pVA = pVANext )
+#ifdef NODE_COMPACT_LINKS
+	/* the node slabs are all committed from the span */
+	if( pArena->pcSpan != NULL )
+		VirtualFree( pArena->pcSpan, 0, MEM_RELEASE );
+	pArena->pcSpan = NULL;
+	pArena->pcSpanNext = NULL;
+#else
+	node_vfree( pArena->pVA );
+	node_vfree( pArena->pVASpare );
+#endif
+
+	/* monotonic arenas have no mspace; report their bump slabs instead */
+	size_t result = node_vfree( pArena->pVABump ) + node_vfree( pArena->pVABumpSpare );
+	if( pArena->pSpace != NULL )
+		result = destroy_mspace( pArena->pSpace );
+
+	InitializeSListHead( &(pArena->slBatches) );
+	InitializeSListHead( &(pArena->slRemote) );
+	pArena->dwOwner = 0;
+	pArena->pVA = NULL;
+	pArena->pVASpare = NULL;
+	pArena->pSpace = NULL;
+	pArena->pVABump = NULL;
+	pArena->pVABumpSpare = NULL;
+	pArena->pcBumpNext = NULL;
+	pArena->pcBumpEnd = NULL;
+	pArena->pcSlabNext = NULL;
+	pArena->pcSlabEnd = NULL;
+	pArena->nSlabs = 0;
+	pArena->cbSlabs = 0;
+	DeleteCriticalSection( &(pArena->csSlabs) );
+
+	{
+		node_lock l( &g_csArenas );
+		pArena->pnaNextDead = g_pnaDeadArenas;
+		g_pnaDeadArenas = pArena;
+	}
+
+	return result;
+}
+NODE_API void node_arena_reset( node_arena_t pToReset )
+{
+	node_arena * pArena = (node_arena *)pToReset;
+	if( pArena == &g_GlobalArena )
 	{
-		pVANext = pVA->next;
-		VirtualFree( pVA, 0, MEM_RELEASE );
+		node_error( "Error! Attempting to reset global arena!\n" );
+		return;
 	}
 
-	size_t result = destroy_mspace( pArena->pSpace );
-	pArena->pnFreeList = NULL;
-	DeleteCriticalSection( &(pArena->csFreeList) );
-	nfree( &g_GlobalArena, pArena );
+	/* the new mspace comes first: without the memory for one, the arena is left as it was */
+	mspace pSpace = NULL;
+	if( pArena->pSpace != NULL )
+	{
+		pSpace = create_mspace( pArena->nSpaceSize, 0 );
+		if( pSpace == NULL )
+		{
+			node_fail( NODE_ERROR_MEMORY );
+			return;
+		}
+	}
 
-	return result;
+	/* nodes other threads freed still hold interned names, so they are freed first, as by the owner */
+	DWORD dwOwner = pArena->dwOwner;
+	pArena->dwOwner = GetCurrentThreadId();
+	node_remote_reclaim( pArena );
+	pArena->dwOwner = dwOwner;
+
+	/* every node cached by any thread is now garbage */
+	pArena->nSerial = InterlockedIncrement( &g_nArenaSerial );
+	InitializeSListHead( &(pArena->slBatches) );
+	InitializeSListHead( &(pArena->slRemote) );
+	pArena->nBatchedNodes = 0;
+	{
+		node_lock l( &g_csArenas );
+		memset( &(pArena->statsRetired), 0, sizeof(pArena->statsRetired) );
+	}
+
+	/* keep the slabs, but carve them again from the start */
+	{
+		node_lock l( &(pArena->csSlabs) );
+
+		node_arena::va * pVANext;
+		for( node_arena::va * pVA = pArena->pVA; pVA != NULL; pVA = pVANext )
+		{
+			pVANext = pVA->next;
+			pVA->next = pArena->pVASpare;
+			pArena->pVASpare = pVA;
+		}
+		pArena->pVA = NULL;
+		pArena->pcSlabNext = NULL;
+		pArena->pcSlabEnd = NULL;
+	}
+
+	/* strings, data and hash tables all live in the mspace or the bump slabs */
+	if( pSpace != NULL )
+	{
+		destroy_mspace( pArena->pSpace );
+		pArena->pSpace = pSpace;
+	}
+
+	node_arena::va * pVANext;
+	for( node_arena::va * pVA = pArena->pVABump; pVA != NULL; pVA = pVANext )
+	{
+		pVANext = pVA->next;
+		if( pVA->nSize == pArena->nBumpSize )
+		{
+			pVA->next = pArena->pVABumpSpare;
+			pArena->pVABumpSpare = pVA;
+		}
+		else
+		{
+			/* a block that had a slab of its own */
+			node_lock l( &(pArena->csSlabs) );
+			pArena->nSlabs--;
+			pArena->cbSlabs -= pVA->nSize;
+			VirtualFree( pVA, 0, MEM_RELEASE );
+		}
+	}
+	pArena->pVABump = NULL;
+	pArena->pcBumpNext = NULL;
+	pArena->pcBumpEnd = NULL;
 }
 #else
 NODE_API node_arena_t node_create_arena( size_t )
@@ -5173,11 +9088,26 @@ NODE_API node_arena_t node_create_arena( size_t )
 	return NULL;
 }
 
+NODE_API node_arena_t node_create_arena2( size_t , int , size_t )
+{
+	return NULL;
+}
+
 NODE_API node_arena_t node_get_arena()
 {
 	return NULL;
 }
 
+NODE_API void node_arena_stats( node_arena_t , node_arena_stats_t * pStats )
+{
+	if( pStats != NULL )
+		memset( pStats, 0, sizeof(*pStats) );
+}
+
+NODE_API void node_arena_set_budget( node_arena_t , size_t )
+{
+}
+
 NODE_API node_arena_t node_set_arena( node_arena_t  )
 {
 	return NULL;
@@ -5187,15 +9117,33 @@ NODE_API size_t node_delete_arena( node_arena_t  )
 {
 	return 0;
 }
+
+NODE_API void node_arena_reset( node_arena_t )
+{
+}
 #endif
 
 
+/* give back what the calling thread holds: its cached nodes and statistics go to their arenas and
+   its read record to the next thread. A DLL does this as each thread detaches; a static library's
+   threads call it themselves before they exit */
+NODE_API void node_thread_exit()
+{
+	if( m_dwTLSIndex < 0 )
+		return;
+
+	node_tls * ptls = reinterpret_cast<node_tls *>( TlsGetValue( m_dwTLSIndex ) );
+	if( ptls == NULL )
+		return;
+
+	TlsSetValue( m_dwTLSIndex, NULL );
+	delete ptls;
+}
+
 #ifdef NODE_DLL
 static void NODE_INTERNAL_FUNC TLSThreadCleanup()
 {
-	node_tls * ptls = GetTLS();
-	if( ptls != NULL )
-		delete ptls;
+	node_thread_exit();
 }
 
 BOOL WINAPI DllMain( HINSTANCE /*hInstance*/, DWORD fdwReason, LPVOID /*lpvReserved*/ )
@@ -5235,8 +9183,12 @@ public:
 //		FreeLibrary( hKernel );
 
 #ifdef USE_DL_MALLOC
-		InitializeCriticalSection( &(g_GlobalArena.csFreeList) );
+		InitializeSListHead( &(g_GlobalArena.slBatches) );
+		InitializeSListHead( &(g_GlobalArena.slRemote) );
+		InitializeCriticalSection( &(g_GlobalArena.csSlabs) );
+		InitializeCriticalSection( &g_csArenas );
 #endif
+		InitializeCriticalSection( &node_csNames );
 //		_CrtSetBreakAlloc( 1380 );
 
 		m_dwTLSIndex = TlsAlloc();
@@ -5245,9 +9197,11 @@ public:
 	~LibSetup()
 	{
 #ifdef USE_DL_MALLOC
-		DeleteCriticalSection( &(g_GlobalArena.csFreeList) );
-		memset( &(g_GlobalArena.csFreeList), 0, sizeof(g_GlobalArena.csFreeList) );
+		DeleteCriticalSection( &(g_GlobalArena.csSlabs) );
+		memset( &(g_GlobalArena.csSlabs), 0, sizeof(g_GlobalArena.csSlabs) );
+		DeleteCriticalSection( &g_csArenas );
 #endif
+		DeleteCriticalSection( &node_csNames );
 
 		TlsFree( m_dwTLSIndex );
 		m_dwTLSIndex = -1;
@@ -5258,4 +9212,20 @@ static class LibSetup m_l;
 
 NODE_API void node_finalize()
 {
+	node_lock l( &node_csNames );
+
+	/* free the intern tables once no node holds a name from them */
+	if( node_pdictNamesA != NULL && dict_first( node_pdictNamesA ) == NULL )
+	{
+		free( node_pdictNamesA );
+		node_pdictNamesA = NULL;
+	}
+	if( node_pdictNamesW != NULL && dict_first( node_pdictNamesW ) == NULL )
+	{
+		free( node_pdictNamesW );
+		node_pdictNamesW = NULL;
+	}
+
+	if( node_nDebugIntern && ( node_pdictNamesA != NULL || node_pdictNamesW != NULL ) )
+		node_error( "Interned names are still in use at node_finalize.\n" );
 }
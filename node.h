@@ -110,6 +110,7 @@ NODE_API const char * node_version_3_0();
 #define NP_SERROR	4	/* syntax error reading line; skip this line */
 #define NP_EOF		5	/* end of file */
 #define NP_INVALID	6	/* invalid file stream or node pointer */
+#define NP_NOMEM	7	/* ran out of memory or arena budget; see node_get_error */
 
 /* Node Debugging Options */
 #define NODE_DEBUG_INTERN		0x01	/* check for problems with intern table */
@@ -119,6 +120,11 @@ NODE_API const char * node_version_3_0();
 
 #define NODE_DEBUG_ALL			0x0F	/* convenience macro to turn on common debugging options */
 
+/* Arena Options for node_create_arena2 */
+#define NODE_ARENA_MONOTONIC	0x01	/* allocations bump a pointer and frees do nothing; memory comes back on reset/delete */
+#define NODE_ARENA_HUGEPAGES	0x02	/* back slabs with large pages when the process may lock memory */
+#define NODE_ARENA_PREFAULT		0x04	/* touch every page of a slab when it is allocated */
+
 /********
  TYPEDEFS
  ********/
@@ -126,15 +132,38 @@ NODE_API const char * node_version_3_0();
 typedef unsigned char data_t;
 typedef struct __node node_t;
 typedef void * node_arena_t; 
+typedef void * node_ctx_t;
+
+/* a prehashed hash key: the characters are not copied, and must outlive the key */
+typedef struct node_key_t
+{
+	const void * pvKey;			/* the key's characters: char, or wchar_t if bKeyW */
+	size_t cchKey;				/* how many */
+	unsigned int nHash;			/* hashed as node_hash_get does */
+	int bKeyW;
+} node_key_t;
+
+/* a cursor over the children of a hash, kept by the caller: its members are private */
+typedef struct node_hash_iter_t
+{
+	const node_t * pnHash;
+	const void * pvSlots;
+	int nSlots;
+	int nNext;
+	int bOld;
+} node_hash_iter_t;
 
 /* most client apps should not define NODE_TRANSPARENT */
 #ifdef NODE_TRANSPARENT
 
-#define NODE_TYPE_BITS				5							/* number of bits for nType - up to 32 nodes */
+#define NODE_TYPE_BITS				4							/* number of bits for nType - up to 16 nodes */
 #define NODE_COLLECTIONFLAG_BITS	1							/* am I in a list/hash? */
 #define NODE_BAG_BITS				1							/* is the bag in use? */
+#define NODE_INTERN_BITS			1							/* are the names in the intern table? */
 #define NODE_HASH_BITS				25							/* how many hash bits we keep */
 #define NODE_HASH_MASK				((1<<NODE_HASH_BITS)-1)
+#define NODE_NAMEW_BITS				1							/* is the name wide? */
+#define NODE_COUNT_BITS				(32-NODE_NAMEW_BITS)		/* data length or list elements */
 
 #ifdef _MSC_VER
 #pragma warning( push )
@@ -142,27 +171,65 @@ typedef void * node_arena_t;
 #endif
 
 struct node_arena;
+struct node_strings;
+
+/* a link from one node to another in the same list or hash */
+#ifdef NODE_COMPACT_LINKS
+/* 16-byte units relative to the node holding the link, 0 for none: opt-in, defined by the user with USE_DL_MALLOC on x64 */
+typedef __int32 node_link_t;
+#else
+typedef node_t * node_link_t;
+#endif
 
+/* the arena is not here: it heads the slab chunk the node was carved from */
 struct __node
 {
 	/* overhead */
-	node_t * pnNext;			/* pointer to next node -- only used in lists/hashes */
+	node_link_t pnNext;			/* link to next node -- only used in lists/hashes */
+#ifdef NODE_COMPACT_LINKS
+	int nLinkPad;				/* a remote free's SLIST_ENTRY overlays the first 8 bytes */
+#endif
 	
-	/* name */
+	/* name: one pointer, bNameW says which */
+	union
+	{
 	char * psAName; 			/* name of this node (may be NULL) */
 	wchar_t * psWName;			/* name of this node (may be NULL) */
-
-	struct node_arena * pArena;
-	/* Win32 - 16 bytes */
-	/* Win64 - 32 bytes */
+	};
+	/* Win32 - 8 bytes */
+	/* Win64 - 16 bytes */
 	
 	/* data */
 	unsigned int nType:NODE_TYPE_BITS;		/* type of this node: NODE_xxx */
 	unsigned int bInCollection:NODE_COLLECTIONFLAG_BITS;
 	unsigned int bBagUsed:NODE_BAG_BITS;
+	unsigned int bNameInterned:NODE_INTERN_BITS;
 	unsigned int nHash:NODE_HASH_BITS;
-	/* Win32 - 20 bytes */
-	/* Win64 - 36 bytes, padded to 40 */
+
+	/* the name's encoding shares a word with the value's count */
+	union
+	{
+		struct
+		{
+			unsigned int bNameW:NODE_NAMEW_BITS;		/* psWName rather than psAName */
+			unsigned int nDataLength:NODE_COUNT_BITS;	/* length of data */
+		};
+
+		struct
+		{
+			unsigned int :NODE_NAMEW_BITS;
+			unsigned int nListElements:NODE_COUNT_BITS;	/* number of elements in list */
+		};
+
+		struct
+		{
+			unsigned int :NODE_NAMEW_BITS;
+			unsigned int nHashFlags:5; 					/* debugging/data flags */
+			unsigned int nHashElements:NODE_COUNT_BITS-5;	/* number of elements in hash */
+		};
+	};
+	/* Win32 - 16 bytes */
+	/* Win64 - 24 bytes */
 	
 	union
 	{
@@ -171,7 +238,10 @@ struct __node
 			/* string data */
 			char * psAValue;			/* string value if string type or coerced to string type */
 			wchar_t * psWValue; 		/* string value if string type or coerced to string type */
+		};
 
+		struct
+		{
 			/* numeric data */
 			union
 			{
@@ -183,16 +253,17 @@ struct __node
 			int nValue; 				/* int value if int type or coerced */
 			};
 
-			/* Win32 - 16 bytes */
-			/* Win64 - 24 bytes */
+			struct node_strings * pStrings;	/* the value coerced to strings: allocated when asked for */
+
+			/* Win32 - 12 bytes, padded to 16 */
+			/* Win64 - 16 bytes */
 		};
 		
 		struct
 		{
 			data_t * pbValue;			/* binary data */
-			int nDataLength;			/* length of data */
-			/* Win32 - 8 bytes */
-			/* Win64 - 12 bytes, padded to 16 */
+			/* Win32 - 4 bytes */
+			/* Win64 - 8 bytes */
 		};
 		
 		struct
@@ -206,29 +277,28 @@ struct __node
 		struct
 		{
 			/* list data */
-			node_t* pnListHead; 		/* head of list if list type */
-			node_t* pnListTail; 		/* tail of list if list type */
-
-			int nListElements;			/* number of elements in list */
-			/* Win32 - 12 bytes */
-			/* Win64 - 20 bytes, padded to 24 */
+			node_link_t pnListHead; 	/* head of list if list type */
+			node_link_t pnListTail; 	/* tail of list if list type, none if empty */
+			/* Win32 - 8 bytes */
+			/* Win64 - 16 bytes */
 		};
 		
 		struct
 		{
-			/* hash data */
-			node_t** ppnHashHeads;		/* array of buckets if hash type */
+			/* hash data: open addressing; after the slots, a full hash, key length and control byte per slot */
+			node_link_t * ppnHashSlots;	/* array of slots if hash type */
 #ifdef _DEBUG
 			char * psHashAllocated;		/* where hash allocated from: debug only */
 #endif
-			int nHashBuckets;			/* number of buckets if hash type */
-			int nHashFlags:2; 			/* debugging/data flags */
-			int nHashElements:29;		/* number of elements in hash */
+			int nHashSlots;				/* number of slots if hash type: a power of two */
+			int nHashGrowth;			/* empty slots that may be filled before the table grows */
 
-			/* Win32 - 16 bytes(D), 12 bytes padded to 16 (R) */
-			/* Win64 - 16 bytes(D), 24 bytes (R) */
+			/* Win32 - 16 bytes(D), 12 bytes (R) */
+			/* Win64 - 24 bytes(D), 16 bytes (R) */
 		};
 	};
+	/* Win32 - 32 bytes */
+	/* Win64 - 40 bytes, 48 (D) */
 };
 
 #ifdef _MSC_VER
@@ -258,8 +328,8 @@ NODE_API node_t * node_list_alloc();
 /** allocate an empty hash node */
 NODE_API node_t * node_hash_alloc();
 
-/** allocate an empty hash node with a user-specified number of buckets */
-NODE_API node_t * node_hash_alloc2( int nHashBuckets );
+/** allocate an empty hash node with a user-specified number of slots (rounded up to a power of two) */
+NODE_API node_t * node_hash_alloc2( int nHashSlots );
 
 /*****************
  Setting Functions
@@ -315,7 +385,7 @@ NODE_API void node_list_delete( node_t * pnList, node_t * pnToDelete );
 /** returns the first node of a list */
 NODE_API node_t * node_first( const node_t * pnList );
 
-/** returns the next node in a list or hash bucket chain */
+/** returns the next node in a list */
 NODE_API node_t * node_next( const node_t * pn );
 
 /* Stack functions: treating the list as a stack */
@@ -334,6 +404,11 @@ NODE_API node_t * node_hash_addA( node_t * pnHash, const char * psKey, int nType
 /** add a node to a hash; similar variable arguments to node_set */
 NODE_API node_t * node_hash_addW( node_t * pnHash, const wchar_t * psKey, int nType, ... );
 
+/** set a hash's child to a value in place, adding it if there is none; similar variable arguments to node_set */
+NODE_API node_t * node_hash_setA( node_t * pnHash, const char * psKey, int nType, ... );
+/** set a hash's child to a value in place, adding it if there is none; similar variable arguments to node_set */
+NODE_API node_t * node_hash_setW( node_t * pnHash, const wchar_t * psKey, int nType, ... );
+
 /** delete a node from within a hash */
 NODE_API void node_hash_delete( node_t * pnHash, node_t * pnToDelete );
 
@@ -342,6 +417,78 @@ NODE_API node_t * node_hash_getA( const node_t * pnHash, const char * psKey );
 /** get a node (by name) from a hash */
 NODE_API node_t * node_hash_getW( const node_t * pnHash, const wchar_t * psKey );
 
+/* Length-delimited keys: the first cchKey characters of psKey are the key, which need not
+   be terminated (a key sliced out of a larger buffer) but must not contain a NUL */
+/** add a node to a hash under a key of cchKey characters */
+NODE_API node_t * node_hash_add_nA( node_t * pnHash, const char * psKey, size_t cchKey, int nType, ... );
+/** add a node to a hash under a key of cchKey characters */
+NODE_API node_t * node_hash_add_nW( node_t * pnHash, const wchar_t * psKey, size_t cchKey, int nType, ... );
+
+/** get a node from a hash by a key of cchKey characters */
+NODE_API node_t * node_hash_get_nA( const node_t * pnHash, const char * psKey, size_t cchKey );
+/** get a node from a hash by a key of cchKey characters */
+NODE_API node_t * node_hash_get_nW( const node_t * pnHash, const wchar_t * psKey, size_t cchKey );
+
+/** delete the node with a key of cchKey characters from a hash, and return it (NULL if none) */
+NODE_API node_t * node_hash_delete_nA( node_t * pnHash, const char * psKey, size_t cchKey );
+/** delete the node with a key of cchKey characters from a hash, and return it (NULL if none) */
+NODE_API node_t * node_hash_delete_nW( node_t * pnHash, const wchar_t * psKey, size_t cchKey );
+
+/* Frozen hashes: a hash built once and then only read can be frozen, giving each child exactly one
+   slot that a lookup computes from the key's hash (a minimal perfect hash). Reading works as before;
+   adding or deleting thaws it first */
+/** freeze a hash; FALSE if it is empty, shared or there is no memory */
+NODE_API int node_hash_freeze( node_t * pnHash );
+/** TRUE if a hash is frozen */
+NODE_API int node_hash_frozen( const node_t * pnHash );
+
+/* Shared hashes: threads may get from a shared hash while others add to, set in or delete from it.
+   Gets take no lock and never wait; changes take one of the hash's locks, picked by the key's hash,
+   so changes to different keys mostly go ahead at once and only growing the table waits for all.
+   A child got from a shared hash stays valid until the read section it was got in ends, and children
+   that are replaced or retired are only freed once every read section that might hold them has. Sets
+   replace rather than change the child. Only gets and changes are safe while another thread changes
+   the hash: walk, copy or free it when none does. Only a hash in the global arena, whose allocations
+   are locked, may be shared */
+/** make a hash safe to get from while it changes; FALSE if it is in a thread's own arena or there is no memory */
+NODE_API int node_hash_share( node_t * pnHash );
+/** TRUE if a hash is shared */
+NODE_API int node_hash_shared( const node_t * pnHash );
+/** free a child deleted from a shared hash once no read section can still hold it */
+NODE_API void node_hash_retire( node_t * pnHash, node_t * pn );
+
+/** begin a read section on this thread; sections nest. If there is no memory for the thread's
+   record none begins, node_get_error says so, and gets from shared hashes return NULL */
+NODE_API void node_read_begin();
+/** end a read section: children got from shared hashes since it began may be freed */
+NODE_API void node_read_end();
+
+/* Prehashed keys: hash a key once, then look it up in any number of hashes. In C++, NODE_KEYA
+   and NODE_KEYW build one from a literal at compile time */
+/** make a prehashed key from psKey, which must outlive it */
+NODE_API node_key_t * node_key_initA( node_key_t * pKey, const char * psKey );
+/** make a prehashed key from psKey, which must outlive it */
+NODE_API node_key_t * node_key_initW( node_key_t * pKey, const wchar_t * psKey );
+
+/** add a node to a hash under a prehashed key; similar variable arguments to node_set */
+NODE_API node_t * node_hash_add_key( node_t * pnHash, const node_key_t * pKey, int nType, ... );
+
+/** get a node from a hash by a prehashed key */
+NODE_API node_t * node_hash_get_key( const node_t * pnHash, const node_key_t * pKey );
+
+/* Batched gets: every key is hashed and its slots fetched before any is looked up, so the
+   cache misses overlap. apnOut[i] is the node for key i, or NULL; returns how many were found */
+NODE_API int node_hash_get_manyA( const node_t * pnHash, const char * const * apsKeys, int nKeys, node_t ** apnOut );
+NODE_API int node_hash_get_manyW( const node_t * pnHash, const wchar_t * const * apsKeys, int nKeys, node_t ** apnOut );
+NODE_API int node_hash_get_many_key( const node_t * pnHash, const node_key_t * aKeys, int nKeys, node_t ** apnOut );
+
+/* Iteration: walk the children of a hash in no particular order, allocating nothing; each
+   child's key is its name. The child just returned may be deleted, but an add ends the walk */
+/** start walking a hash: its first child, or NULL if it has none */
+NODE_API node_t * node_hash_iter_begin( const node_t * pnHash, node_hash_iter_t * pIter );
+/** the next child of the hash, or NULL when there are no more */
+NODE_API node_t * node_hash_iter_next( node_hash_iter_t * pIter );
+
 /**************
  Name Functions
  **************/
@@ -360,10 +507,10 @@ NODE_API NODE_CONSTOUT wchar_t * node_get_nameW( const node_t * pn);
  Dumping and Parsing Functions
  *****************************/
 
-/** dump the node to a file */
+/** dump the node to a file; running out of memory stops it after the last whole record (see node_get_error) */
 NODE_API void node_dumpA( const node_t * pn, FILE * pfOut, int nOptions);
 
-/** dump the node to a file */
+/** dump the node to a file; running out of memory stops it after the last whole record (see node_get_error) */
 NODE_API void node_dumpW( const node_t * pn, FILE * pfOut, int nOptions);
 
 /** read a node from a file */
@@ -391,6 +538,10 @@ NODE_API int node_parse_from_dataW( const void * pv, size_t nBytes, node_t ** pp
 /** deep copy a node */
 NODE_API node_t * node_copy( const node_t * pn );
 
+/** deep copy a node into pArena (the current arena if NULL), laid out in traversal
+   order with names packed into node bags; free the original to defragment */
+NODE_API node_t * node_compact( const node_t * pn, node_arena_t pArena );
+
 /** returns true if the node has a valid type and is suitable for adding
    to a list, etc. */
 NODE_API int node_is_valid( const node_t * pn );
@@ -413,6 +564,15 @@ NODE_API void node_set_debug( int nDebug );
 /** get debug state */
 NODE_API int node_get_debug();
 
+/** turn name interning on or off for the whole process. Names set while it is on
+ *  are shared, refcounted copies: copying a node shares its names and looking
+ *  a key up with another node's name compares pointers. Interned names are not
+ *  charged to any arena, and node_arena_reset leaves the references it discards */
+NODE_API void node_set_intern( int bIntern );
+
+/** get name interning state */
+NODE_API int node_get_intern();
+
 #ifdef _DEBUG
 /** set hash load factor limit */
 NODE_API void node_set_loadlimit( double dfLoadLimit );
@@ -429,13 +589,74 @@ NODE_API double node_get_loadlimit();
 /** clean up all module storage */
 NODE_API void node_finalize();
 
+/** give back the calling thread's cached nodes, statistics and read record. A static
+ *  library's threads must call it before they exit; a DLL calls it as threads detach */
+NODE_API void node_thread_exit();
+
 NODE_API node_arena_t node_create_arena( size_t size );
 
+/** create an arena with NODE_ARENA_* options; cbSlab is the size of each node slab (0 for the default 64KB) */
+NODE_API node_arena_t node_create_arena2( size_t size, int nFlags, size_t cbSlab );
+
 NODE_API node_arena_t node_get_arena();
 
 NODE_API node_arena_t node_set_arena( node_arena_t pNewArena );
 
 NODE_API size_t node_delete_arena( node_arena_t pToDelete );
+
+/** arena statistics; a snapshot when other threads are using the arena */
+typedef struct node_arena_stats
+{
+	size_t nLiveNodes;		/* nodes allocated and not yet freed */
+	size_t nFreeNodes;		/* nodes carved from slabs and waiting on a freelist */
+	size_t nSlabs;			/* node and bump slabs obtained with VirtualAlloc */
+	size_t cbSlabs;
+	size_t cbFootprint;		/* bytes the arena's mspace holds from the system */
+	size_t cbStrings;		/* string values and names stored outside node bags */
+	size_t cbData;			/* data values stored outside node bags */
+	size_t cbBuckets;		/* hash tables stored outside node bags */
+	size_t nBagHits;		/* values and hash tables that fit in their node's bag */
+	size_t nBagMisses;		/* values and hash tables that needed an allocation */
+	size_t nRemoteNodes;	/* trees freed by other threads, waiting for the owning thread's next allocation */
+} node_arena_stats_t;
+
+/** fill *pStats for an arena; cheap enough to poll */
+NODE_API void node_arena_stats( node_arena_t pArena, node_arena_stats_t * pStats );
+
+/** cap the bytes an arena may take from the system (0 for no limit); once reached,
+ *  allocating functions return NULL and node_get_error reports NODE_ERROR_BUDGET */
+NODE_API void node_arena_set_budget( node_arena_t pArena, size_t cbBudget );
+
+/** discard every node and string in an arena at once, keeping its memory for reuse;
+ *  no node from the arena may be used (or freed) afterwards. Without the memory to
+ *  start its heap again the arena is left as it was (see node_get_error) */
+NODE_API void node_arena_reset( node_arena_t pToReset );
+
+/*****************
+ Context Functions
+ *****************/
+
+/** the calling thread's context: its arena, codepage, error functions and node cache.
+ *  The _ctx functions take it instead of looking it up on every call; a context may
+ *  only be used on the thread that got it */
+NODE_API node_ctx_t node_get_ctx();
+
+NODE_API node_t * node_alloc_ctx( node_ctx_t ctx );
+NODE_API node_t * node_list_alloc_ctx( node_ctx_t ctx );
+NODE_API node_t * node_hash_alloc_ctx( node_ctx_t ctx );
+
+NODE_API node_t * node_list_add_ctx( node_ctx_t ctx, node_t * pnList, int nType, ... );
+NODE_API node_t * node_hash_add_ctxA( node_ctx_t ctx, node_t * pnHash, const char * psKey, int nType, ... );
+NODE_API node_t * node_hash_add_ctxW( node_ctx_t ctx, node_t * pnHash, const wchar_t * psKey, int nType, ... );
+
+NODE_API node_t * node_copy_ctx( node_ctx_t ctx, const node_t * pn );
+
+NODE_API void node_dump_ctxA( node_ctx_t ctx, const node_t * pn, FILE * pfOut, int nOptions );
+NODE_API void node_dump_ctxW( node_ctx_t ctx, const node_t * pn, FILE * pfOut, int nOptions );
+
+NODE_API int node_parse_from_string_ctxA( node_ctx_t ctx, const char * ps, node_t ** ppn );
+NODE_API int node_parse_from_string_ctxW( node_ctx_t ctx, const wchar_t * ps, node_t ** ppn );
+
 /**************************************
  Debugging analogues of above functions
  **************************************/
@@ -447,7 +668,7 @@ NODE_API node_t * node_alloc_dbg( const char *psFile, int nLine );
 NODE_API node_t * node_list_alloc_dbg( const char * psFile, int nLine );
 
 NODE_API node_t * node_hash_alloc_dbg( const char * psFile, int nLine );
-NODE_API node_t * node_hash_alloc2_dbg( int nHashBuckets, const char * psFile, int nLine );
+NODE_API node_t * node_hash_alloc2_dbg( int nHashSlots, const char * psFile, int nLine );
 
 NODE_API node_t * node_set_dbg( const char *psFile, int nLine, node_t * pn, int nType, ... );
 NODE_API node_t * node_set_data_dbg( const char *psFile, int nLine, node_t * pn, int nLength, const void * pb );
@@ -460,6 +681,11 @@ NODE_API node_t * node_push_dbg( const char *psFile, int nLine, node_t * pnList,
 
 NODE_API node_t * node_hash_add_dbgA( const char *psFile, int nLine, node_t * pnHash, const char * psKey, int nType, ... );
 NODE_API node_t * node_hash_add_dbgW( const char *psFile, int nLine, node_t * pnHash, const wchar_t * psKey, int nType, ... );
+NODE_API node_t * node_hash_add_n_dbgA( const char *psFile, int nLine, node_t * pnHash, const char * psKey, size_t cchKey, int nType, ... );
+NODE_API node_t * node_hash_add_n_dbgW( const char *psFile, int nLine, node_t * pnHash, const wchar_t * psKey, size_t cchKey, int nType, ... );
+NODE_API node_t * node_hash_add_key_dbg( const char *psFile, int nLine, node_t * pnHash, const node_key_t * pKey, int nType, ... );
+NODE_API node_t * node_hash_set_dbgA( const char *psFile, int nLine, node_t * pnHash, const char * psKey, int nType, ... );
+NODE_API node_t * node_hash_set_dbgW( const char *psFile, int nLine, node_t * pnHash, const wchar_t * psKey, int nType, ... );
 
 NODE_API void node_set_name_dbgA( const char *psFile, int nLine, node_t * pn, const char * psName );
 NODE_API void node_set_name_dbgW( const char *psFile, int nLine, node_t * pn, const wchar_t * psName );
@@ -474,6 +700,7 @@ NODE_API int node_parse_from_data_dbgA( const char *psFile, int nLine, const voi
 NODE_API int node_parse_from_data_dbgW( const char *psFile, int nLine, const void * pv, size_t nBytes, node_t ** ppn );
 
 NODE_API node_t * node_copy_dbg( const char *psFile, int nLine, const node_t * pn );
+NODE_API node_t * node_compact_dbg( const char *psFile, int nLine, const node_t * pn, node_arena_t pArena );
 
 NODE_API node_t * node_hash_keys_dbgA( const char *psFile, int nLine, const node_t * pnHash );
 NODE_API node_t * node_hash_keys_dbgW( const char *psFile, int nLine, const node_t * pnHash );
@@ -491,9 +718,19 @@ typedef void (*node_assert_func_t)( void * psExpr, void * psFile, unsigned int n
 #define NODE_MEMORY_FAIL	0
 #define NODE_MEMORY_RETRY	1
 
+/* Values From node_get_error */
+#define NODE_ERROR_NONE		0
+#define NODE_ERROR_MEMORY	1	/* the system refused an allocation */
+#define NODE_ERROR_BUDGET	2	/* the arena reached its node_arena_set_budget limit */
+
 NODE_API void node_set_error_funcs( node_error_func_t pErrFunc, node_memory_func_t pMemFunc, 
 								    node_assert_func_t pAssertFunc );
 
+/** the first allocation failure on this thread since node_clear_error; functions
+ *  that allocate return NULL (or NP_NOMEM) and leave their inputs unchanged */
+NODE_API int node_get_error();
+NODE_API void node_clear_error();
+
 /***********************************
  Definitions to support generic char
  ***********************************/
@@ -503,7 +740,14 @@ NODE_API void node_set_error_funcs( node_error_func_t pErrFunc, node_memory_func
 #define NODE_STRING						NODE_STRINGA
 #define node_get_string					node_get_stringA
 #define node_hash_add					node_hash_addA
+#define node_hash_set					node_hash_setA
 #define node_hash_get					node_hash_getA
+#define node_hash_add_n					node_hash_add_nA
+#define node_hash_get_n					node_hash_get_nA
+#define node_hash_delete_n				node_hash_delete_nA
+#define node_key_init					node_key_initA
+#define node_hash_get_many				node_hash_get_manyA
+#define NODE_KEY						NODE_KEYA
 #define node_hash_keys					node_hash_keysA
 #define node_get_name					node_get_nameA
 #define node_set_name					node_set_nameA
@@ -511,13 +755,23 @@ NODE_API void node_set_error_funcs( node_error_func_t pErrFunc, node_memory_func
 #define node_parse_from_string			node_parse_from_stringA
 #define node_parse_from_data			node_parse_from_dataA
 #define node_dump						node_dumpA
+#define node_hash_add_ctx				node_hash_add_ctxA
+#define node_parse_from_string_ctx		node_parse_from_string_ctxA
+#define node_dump_ctx					node_dump_ctxA
 
 #else
 
 #define NODE_STRING						NODE_STRINGW
 #define node_get_string					node_get_stringW
 #define node_hash_add					node_hash_addW
+#define node_hash_set					node_hash_setW
 #define node_hash_get					node_hash_getW
+#define node_hash_add_n					node_hash_add_nW
+#define node_hash_get_n					node_hash_get_nW
+#define node_hash_delete_n				node_hash_delete_nW
+#define node_key_init					node_key_initW
+#define node_hash_get_many				node_hash_get_manyW
+#define NODE_KEY						NODE_KEYW
 #define node_hash_keys					node_hash_keysW
 #define node_get_name					node_get_nameW
 #define node_set_name					node_set_nameW
@@ -525,6 +779,9 @@ NODE_API void node_set_error_funcs( node_error_func_t pErrFunc, node_memory_func
 #define node_parse_from_string			node_parse_from_stringW
 #define node_parse_from_data			node_parse_from_dataW
 #define node_dump						node_dumpW
+#define node_hash_add_ctx				node_hash_add_ctxW
+#define node_parse_from_string_ctx		node_parse_from_string_ctxW
+#define node_dump_ctx					node_dump_ctxW
 
 #endif
 
@@ -545,12 +802,18 @@ NODE_API void node_set_error_funcs( node_error_func_t pErrFunc, node_memory_func
 #define node_list_add(n,t,v)		node_list_add_dbg( __FILE__, __LINE__, n, t, v )
 #define node_push(n,t,v)			node_push_dbg( __FILE__, __LINE__, n, t, v )
 #define node_copy(n)				node_copy_dbg( __FILE__, __LINE__, n )
+#define node_compact(n,a)			node_compact_dbg( __FILE__, __LINE__, n, a )
 #define node_set_data(n,l,d)		node_set_data_dbg( __FILE__, __LINE__, n, l, d )
 
 #define node_get_stringA(n)				node_get_string_dbgA( __FILE__, __LINE__, n )
 #define node_get_stringW(n)				node_get_string_dbgW( __FILE__, __LINE__, n )
 #define node_hash_addA(n,na,t,v)		node_hash_add_dbgA( __FILE__, __LINE__, n, na, t, v )
 #define node_hash_addW(n,na,t,v)		node_hash_add_dbgW( __FILE__, __LINE__, n, na, t, v )
+#define node_hash_add_nA(n,na,c,t,v)		node_hash_add_n_dbgA( __FILE__, __LINE__, n, na, c, t, v )
+#define node_hash_add_nW(n,na,c,t,v)		node_hash_add_n_dbgW( __FILE__, __LINE__, n, na, c, t, v )
+#define node_hash_add_key(n,k,t,v)			node_hash_add_key_dbg( __FILE__, __LINE__, n, k, t, v )
+#define node_hash_setA(n,na,t,v)		node_hash_set_dbgA( __FILE__, __LINE__, n, na, t, v )
+#define node_hash_setW(n,na,t,v)		node_hash_set_dbgW( __FILE__, __LINE__, n, na, t, v )
 #define node_set_nameA(n,na)			node_set_name_dbgA( __FILE__, __LINE__, n, na )
 #define node_set_nameW(n,na)			node_set_name_dbgW( __FILE__, __LINE__, n, na )
 
@@ -571,4 +834,106 @@ NODE_API void node_set_error_funcs( node_error_func_t pErrFunc, node_memory_func
 } /* extern "C" */
 #endif
 
+/********************************
+ Compile-time keys (C++11 and up)
+ ********************************/
+
+#if defined(__cplusplus) && ( __cplusplus >= 201103L || ( defined(_MSC_VER) && _MSC_VER >= 1900 ) )
+
+/* the key hash of node.cpp, one character at a time: it must give the same values */
+namespace node_key_hash
+{
+	const unsigned long long ONES = 0x0101010101010101ULL;
+	const unsigned long long MUL = 0x9E3779B97F4A7C15ULL;
+
+	constexpr unsigned long long fold_upper( unsigned long long w, unsigned long long nLow )
+	{
+		return w | ( ( ( nLow + ONES * ( 0x80 - 'A' ) ) ^ ( nLow + ONES * ( 0x80 - 'Z' - 1 ) ) ) & ~w & ( ONES * 0x80 ) ) >> 2;
+	}
+
+	constexpr unsigned long long fold( unsigned long long w )
+	{
+		return fold_upper( w, w & ( ONES * 0x7F ) ) | ( w & ( ONES * 0x80 ) ) >> 2;
+	}
+
+	constexpr unsigned long long word( const char * ps, size_t cb, size_t i )
+	{
+		return ( i < cb && i < 8 ) ? ( (unsigned long long)(unsigned char)ps[i] << ( i * 8 ) ) | word( ps, cb, i + 1 ) : 0;
+	}
+
+	constexpr unsigned long long shift32( unsigned long long n )
+	{
+		return n ^ ( n >> 32 );
+	}
+
+	constexpr unsigned long long mix( unsigned long long nHash, unsigned long long w )
+	{
+		return shift32( ( nHash ^ w ) * MUL );
+	}
+
+	constexpr unsigned long long shift33( unsigned long long n )
+	{
+		return n ^ ( n >> 33 );
+	}
+
+	constexpr unsigned int finish( unsigned long long nHash, size_t nLength )
+	{
+		return (unsigned int)shift33( shift33( shift33( nHash ^ nLength ) * 0xFF51AFD7ED558CCDULL ) * 0xC4CEB9FE1A85EC53ULL );
+	}
+
+	/* a key of one word */
+	constexpr unsigned int finish_word( unsigned long long nHash, size_t nLength )
+	{
+		return (unsigned int)( ( nHash ^ ( nHash >> 32 ) ^ nLength ) * 0xFF51AFD7ED558CCDULL >> 32 );
+	}
+
+	/* eight bytes at a time */
+	constexpr unsigned long long bytes( const char * ps, size_t cb, unsigned long long nHash )
+	{
+		return cb == 0 ? nHash : bytes( ps + ( cb < 8 ? cb : 8 ), cb < 8 ? 0 : cb - 8, mix( nHash, fold( word( ps, cb, 0 ) ) ) );
+	}
+
+	constexpr unsigned int keyA( const char * ps, size_t cch )
+	{
+		return cch <= 8 ? finish_word( ( 0x53378008 ^ fold( word( ps, cch, 0 ) ) ) * MUL, cch ) : finish( bytes( ps, cch, 0x53378008 ), cch );
+	}
+
+	/* four characters at a time */
+	constexpr unsigned long long fold_char( unsigned int c )
+	{
+		return ( c - 'A' <= 'Z' - 'A' || c >= 0x80 ) ? ( c | 0x20 ) : c;
+	}
+
+	constexpr unsigned long long chars_word( const wchar_t * ps, size_t cch, size_t i )
+	{
+		return ( i < cch && i < 4 ) ? ( fold_char( (unsigned short)ps[i] ) << ( i * 16 ) ) | chars_word( ps, cch, i + 1 ) : 0;
+	}
+
+	constexpr unsigned long long chars( const wchar_t * ps, size_t cch, unsigned long long nHash )
+	{
+		return cch == 0 ? nHash : chars( ps + ( cch < 4 ? cch : 4 ), cch < 4 ? 0 : cch - 4, mix( nHash, chars_word( ps, cch, 0 ) ) );
+	}
+
+	constexpr unsigned int keyW( const wchar_t * ps, size_t cch )
+	{
+		return cch <= 4 ? finish_word( ( 0x55378008 ^ chars_word( ps, cch, 0 ) ) * MUL, cch ) : finish( chars( ps, cch, 0x55378008 ), cch );
+	}
+}
+
+/* constexpr node_key_t keyId = NODE_KEYA( "Id" ), keyIdW = NODE_KEYW( L"Id" ); */
+template <size_t N> constexpr node_key_t node_key_literalA( const char (&ps)[N] )
+{
+	return node_key_t{ ps, N - 1, node_key_hash::keyA( ps, N - 1 ), 0 };
+}
+
+template <size_t N> constexpr node_key_t node_key_literalW( const wchar_t (&ps)[N] )
+{
+	return node_key_t{ ps, N - 1, node_key_hash::keyW( ps, N - 1 ), 1 };
+}
+
+#define NODE_KEYA( s )		node_key_literalA( s )
+#define NODE_KEYW( s )		node_key_literalW( s )
+
+#endif
+
 #endif /* _NODE_H */
@@ -504,6 +504,13 @@ void** mspace_independent_comalloc(mspace msp, size_t n_elements,
 */
 size_t mspace_footprint(mspace msp);
 
+/*
+  mspace_set_footprint_limit() caps the bytes the space may obtain from
+  the system; allocations that would need more fail instead. 0 means no
+  limit.
+*/
+size_t mspace_set_footprint_limit(mspace msp, size_t bytes);
+
 
 #if !NO_MALLINFO
 /*
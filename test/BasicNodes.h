@@ -7,11 +7,13 @@
 #include <tchar.h>
 #include <crtdbg.h>
 #include <io.h>
+#include <time.h>
 
 #include "resource.h"
 
 #define NODE_TRANSPARENT
 #include "node.h"
+#include "node_shared.h"
 
 #ifdef _WIN32
 #   include <windows.h>
@@ -135,18 +137,45 @@ public:
 
 #if _WIN64
 #ifdef _DEBUG
-		TS_ASSERT_EQUALS( nSize, 64 );
+		TS_ASSERT_EQUALS( nSize, 48 );
 #else
-		TS_ASSERT_EQUALS( nSize, 64 );
+		TS_ASSERT_EQUALS( nSize, 40 );
 #endif
 #else
 #ifdef _DEBUG
-		TS_ASSERT_EQUALS( nSize, 40 );
+		TS_ASSERT_EQUALS( nSize, 32 );
 #else
-		TS_ASSERT_EQUALS( nSize, 40 );
+		TS_ASSERT_EQUALS( nSize, 32 );
 #endif
 #endif
 	}
+
+	void test_one_name()
+	{
+		node_t * pn = node_alloc();
+		node_set( pn, NODE_INT, 42 );
+
+		/* a node has one name: the last one set, in its encoding */
+		node_set_nameA( pn, "Narrow" );
+		node_set_nameW( pn, L"Wide" );
+		TS_ASSERT( wcscmp( node_get_nameW( pn ), L"Wide" ) == 0 );
+		TS_ASSERT( node_get_nameA( pn ) == NULL );
+
+		node_set_nameA( pn, "Narrow" );
+		TS_ASSERT( strcmp( node_get_nameA( pn ), "Narrow" ) == 0 );
+		TS_ASSERT( node_get_nameW( pn ) == NULL );
+
+		/* scalars still coerce to both encodings */
+		TS_ASSERT( strcmp( node_get_stringA( pn ), "42" ) == 0 );
+		TS_ASSERT( wcscmp( node_get_stringW( pn ), L"42" ) == 0 );
+		TS_ASSERT( strcmp( node_get_stringA( pn ), "42" ) == 0 );
+		TS_ASSERT_EQUALS( node_get_int( pn ), 42 );
+
+		node_set( pn, NODE_STRINGA, node_get_stringA( pn ) );
+		TS_ASSERT_EQUALS( node_get_int( pn ), 42 );
+
+		node_free( pn );
+	}
 };
 
 class Case8921 : public CxxTest::TestSuite
@@ -881,7 +910,7 @@ public:
 		TS_ASSERT( pn != NULL );
 		TS_ASSERT( _tcscmp( node_get_name( pn ), _T("Hash") ) == 0 );
 		TS_ASSERT( node_get_elements( pn ) == 257 );
-//		TS_ASSERT( pn->nHashBuckets > 8 );
+//		TS_ASSERT( pn->nHashSlots > 8 );
 		
 		node_free( pn );
 	}
@@ -969,6 +998,428 @@ public:
 		node_set_arena( pOld );
 		node_delete_arena( pArena );
 	}
+
+	void test_arena_recreate()
+	{
+		/* nodes cached for a deleted arena must not leak into its successor */
+		for( int j = 0; j < 3; j++ )
+		{
+			node_arena_t pArena = node_create_arena( 0 );
+			node_arena_t pOld = node_set_arena( pArena );
+
+			node_t * pnList = node_list_alloc();
+			for( int i = 0; i < 500; i++ )
+				node_list_add( pnList, NODE_INT, i );
+			TS_ASSERT_EQUALS( node_get_elements( pnList ), 500 );
+
+			node_t * pnKeep = node_pop( pnList );
+			node_free( pnList );
+			TS_ASSERT_EQUALS( node_get_int( pnKeep ), 0 );
+
+			node_set_arena( pOld );
+			node_delete_arena( pArena );
+		}
+	}
+
+	void test_arena_reset()
+	{
+		node_arena_t pArena = node_create_arena( 0 );
+		node_arena_t pOld = node_set_arena( pArena );
+
+		for( int j = 0; j < 3; j++ )
+		{
+			node_t * pnHash = node_hash_alloc2( 64 );
+			for( int i = 0; i < 2000; i++ )
+			{
+				_TCHAR acBuffer[20] = {0};
+				_stprintf( acBuffer, _T("key%d"), i );
+				node_hash_add( pnHash, acBuffer, NODE_STRING, _T("a value too long to fit in any bag at all") );
+			}
+			TS_ASSERT_EQUALS( node_get_elements( pnHash ), 2000 );
+			TS_ASSERT( _tcscmp( node_get_string( node_hash_get( pnHash, _T("key1999") ) ), 
+				_T("a value too long to fit in any bag at all") ) == 0 );
+
+			/* drop the whole request without freeing anything */
+			if( pArena != NULL )
+				node_arena_reset( pArena );
+			else
+				node_free( pnHash );	/* no arenas in this build */
+		}
+
+		node_set_arena( pOld );
+		node_delete_arena( pArena );
+	}
+
+	void test_arena_monotonic()
+	{
+		node_arena_t pArena = node_create_arena2( 0, NODE_ARENA_MONOTONIC, 0 );
+		node_arena_t pOld = node_set_arena( pArena );
+
+		const char * psNode = "Root: {\n"
+			"Name: 'a string long enough that it will not fit in the bag'\n"
+			"List: (\n"
+			": 1\n"
+			": 2.5\n"
+			")\n"
+			"}\n";
+
+		for( int j = 0; j < 3; j++ )
+		{
+			node_t * pn = NULL;
+			int nResult = node_parse_from_stringA( psNode, &pn );
+			TS_ASSERT( nResult == NP_NODE );
+			TS_ASSERT( strcmp( node_get_stringA( node_hash_getA( pn, "Name" ) ), 
+				"a string long enough that it will not fit in the bag" ) == 0 );
+
+			/* too big for a bump slab: gets a block of its own */
+			static data_t ab[0x80000];
+			node_hash_addA( pn, "Blob", NODE_DATA, sizeof(ab), ab );
+			int nLength = 0;
+			node_get_data( node_hash_getA( pn, "Blob" ), &nLength );
+			TS_ASSERT_EQUALS( nLength, (int)sizeof(ab) );
+
+			/* frees are allowed, they just don't give memory back */
+			node_free( pn );
+			if( pArena != NULL )
+				node_arena_reset( pArena );
+		}
+
+		node_set_arena( pOld );
+		node_delete_arena( pArena );
+	}
+
+	void test_arena_slabs()
+	{
+		/* huge pages silently fall back to normal pages without the privilege */
+		int anFlags[] = { 0, NODE_ARENA_PREFAULT, NODE_ARENA_HUGEPAGES, NODE_ARENA_HUGEPAGES|NODE_ARENA_PREFAULT|NODE_ARENA_MONOTONIC };
+		for( int j = 0; j < (int)(sizeof(anFlags)/sizeof(anFlags[0])); j++ )
+		{
+			node_arena_t pArena = node_create_arena2( 0, anFlags[j], 4*1024*1024 );
+			node_arena_t pOld = node_set_arena( pArena );
+
+			node_t * pnList = node_list_alloc();
+			for( int i = 0; i < 100000; i++ )
+				node_list_add( pnList, NODE_INT, i );
+			TS_ASSERT_EQUALS( node_get_elements( pnList ), 100000 );
+			TS_ASSERT_EQUALS( node_get_int( node_first( pnList ) ), 0 );
+			node_free( pnList );
+
+			node_set_arena( pOld );
+			node_delete_arena( pArena );
+		}
+	}
+
+	void test_arena_stats()
+	{
+		node_arena_t pArena = node_create_arena( 0 );
+		node_arena_t pOld = node_set_arena( pArena );
+		node_arena_stats_t stats;
+
+		const char * psLong = "a string value long enough that it can never fit in the bag of the node that holds it";
+		node_t * pnList = node_list_alloc();
+		for( int i = 0; i < 1000; i++ )
+		{
+			node_t * pn = node_list_add( pnList, NODE_STRINGA, psLong );
+			node_set_nameA( pn, "x" );
+		}
+
+		node_arena_stats( pArena, &stats );
+		if( pArena != NULL )
+		{
+			TS_ASSERT_EQUALS( stats.nLiveNodes, 1001 );
+			TS_ASSERT( stats.nSlabs >= 1 );
+			TS_ASSERT( stats.cbStrings >= 1000 * strlen( psLong ) );
+			TS_ASSERT( stats.nBagMisses >= 1000 );
+			TS_ASSERT( stats.cbFootprint >= stats.cbStrings );
+		}
+
+		node_free( pnList );
+
+		node_arena_stats( pArena, &stats );
+		TS_ASSERT_EQUALS( stats.nLiveNodes, 0 );
+		TS_ASSERT_EQUALS( stats.cbStrings, 0 );
+		if( pArena != NULL )
+			TS_ASSERT( stats.nFreeNodes >= 1001 );
+
+		node_set_arena( pOld );
+		node_delete_arena( pArena );
+	}
+
+	void test_arena_bag_names()
+	{
+		node_arena_t pArena = node_create_arena( 0 );
+		node_arena_t pOld = node_set_arena( pArena );
+		node_arena_stats_t stats;
+
+		char ach[32];
+		node_t * pnHash = node_hash_alloc();
+		for( int i = 0; i < 1000; i++ )
+		{
+			sprintf( ach, "k%d", i );
+			node_hash_addA( pnHash, ach, NODE_INT, i );
+		}
+
+		/* short names live in their node's bag */
+		node_arena_stats( pArena, &stats );
+		if( pArena != NULL )
+		{
+			TS_ASSERT_EQUALS( stats.cbStrings, 0 );
+			TS_ASSERT( stats.nBagHits >= 1000 );
+		}
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "k999" ) ), 999 );
+
+		/* ...beside a short value, whichever is set first */
+		node_t * pn = node_hash_getA( pnHash, "k7" );
+		node_set( pn, NODE_STRINGA, "seven" );
+		TS_ASSERT( strcmp( node_get_stringA( pn ), "seven" ) == 0 );
+		TS_ASSERT( strcmp( node_get_nameA( pn ), "k7" ) == 0 );
+
+		pn = node_alloc();
+		node_set_nameW( pn, L"wide" );
+		node_set( pn, NODE_STRINGA, "value" );
+		TS_ASSERT( strcmp( node_get_stringA( pn ), "value" ) == 0 );
+		TS_ASSERT( wcscmp( node_get_nameW( pn ), L"wide" ) == 0 );
+		node_free( pn );
+
+		pn = node_alloc();
+		node_set_nameA( pn, "name" );
+		node_set( pn, NODE_STRINGW, L"value" );
+		node_set_nameA( pn, "a name far too long to share a bag with anything else" );
+		node_set( pn, NODE_DATA, 4, "data" );
+		TS_ASSERT( strcmp( node_get_nameA( pn ), "a name far too long to share a bag with anything else" ) == 0 );
+		int nLength = 0;
+		TS_ASSERT( memcmp( node_get_data( pn, &nLength ), "data", 4 ) == 0 );
+		TS_ASSERT_EQUALS( nLength, 4 );
+		node_free( pn );
+
+		node_free( pnHash );
+		node_arena_stats( pArena, &stats );
+		TS_ASSERT_EQUALS( stats.cbStrings, 0 );
+
+		node_set_arena( pOld );
+		node_delete_arena( pArena );
+	}
+
+	void test_arena_compact()
+	{
+		char ach[32];
+		node_t * pnHash = node_hash_alloc();
+		for( int i = 0; i < 2000; i++ )
+		{
+			sprintf( ach, "key%d", i );
+			node_hash_addA( pnHash, ach, NODE_INT, i );
+		}
+		/* churn, as a long-lived tree would see */
+		for( int i = 0; i < 2000; i += 2 )
+		{
+			sprintf( ach, "key%d", i );
+			node_hash_delete( pnHash, node_hash_getA( pnHash, ach ) );
+		}
+		node_t * pnList = node_list_alloc();
+		node_list_add( pnList, NODE_STRINGA, "short" );
+		node_list_add( pnList, NODE_STRINGA, "a string value long enough that it can never fit in the bag of its node" );
+		node_hash_addA( pnHash, "a name long enough that it can never fit in the bag of its node", NODE_INT, -1 );
+		node_hash_addA( pnHash, "List", NODE_LIST, pnList );
+		node_free( pnList );
+		node_t * pnWide = node_hash_alloc();
+		node_hash_addW( pnWide, L"wide", NODE_STRINGW, L"value" );
+		node_hash_addA( pnHash, "Wide", NODE_HASH, pnWide );
+		node_free( pnWide );
+
+		node_arena_t pArena = node_create_arena( 0 );
+		node_t * pnCompact = node_compact( pnHash, pArena );
+		node_free( pnHash );
+
+		TS_ASSERT_EQUALS( node_get_elements( pnCompact ), 1003 );
+		for( int i = 1; i < 2000; i += 2 )
+		{
+			sprintf( ach, "key%d", i );
+			node_t * pn = node_hash_getA( pnCompact, ach );
+			TS_ASSERT( pn != NULL && node_get_int( pn ) == i );
+			TS_ASSERT( pn != NULL && strcmp( node_get_nameA( pn ), ach ) == 0 );
+		}
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnCompact, "a name long enough that it can never fit in the bag of its node" ) ), -1 );
+		TS_ASSERT( wcscmp( node_get_stringW( node_hash_getW( node_hash_getA( pnCompact, "Wide" ), L"wide" ) ), L"value" ) == 0 );
+		pnList = node_hash_getA( pnCompact, "List" );
+		TS_ASSERT_EQUALS( node_get_elements( pnList ), 2 );
+		TS_ASSERT( strcmp( node_get_stringA( node_first( pnList ) ), "short" ) == 0 );
+
+		/* a name kept in the bag must survive new values and renames */
+		node_t * pn = node_hash_getA( pnCompact, "key1" );
+		node_set( pn, NODE_STRINGA, "a new value" );
+		TS_ASSERT( strcmp( node_get_nameA( pn ), "key1" ) == 0 );
+		TS_ASSERT( strcmp( node_get_stringA( pn ), "a new value" ) == 0 );
+		node_set_nameA( pn, "renamed" );
+		TS_ASSERT( strcmp( node_get_nameA( pn ), "renamed" ) == 0 );
+		TS_ASSERT( strcmp( node_get_stringA( pn ), "a new value" ) == 0 );
+
+		node_free( pnCompact );
+		node_delete_arena( pArena );
+	}
+
+	void test_arena_budget()
+	{
+		node_arena_t pArena = node_create_arena( 0 );
+		node_arena_t pOld = node_set_arena( pArena );
+		node_arena_set_budget( pArena, 256*1024 );
+		node_clear_error();
+
+		/* no budget without arenas: stop before exhausting the process */
+		char ach[1024];
+		memset( ach, 'x', sizeof(ach)-1 );
+		ach[sizeof(ach)-1] = '\0';
+
+		node_t * pnHash = node_hash_alloc();
+		node_hash_addA( pnHash, "k", NODE_INT, 1 );
+
+		node_t * pnList = node_list_alloc();
+		int nAdded = 0;
+		while( nAdded < 1000 && node_list_add( pnList, NODE_STRINGA, ach ) != NULL )
+			nAdded++;
+		TS_ASSERT_EQUALS( node_get_elements( pnList ), nAdded );
+
+		if( pArena != NULL )
+		{
+			TS_ASSERT( nAdded < 1000 );
+			TS_ASSERT_EQUALS( node_get_error(), NODE_ERROR_BUDGET );
+
+			/* a failed hash add leaves the old element in place */
+			TS_ASSERT( node_hash_addA( pnHash, "k", NODE_STRINGA, ach ) == NULL );
+			TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "k" ) ), 1 );
+			TS_ASSERT_EQUALS( node_get_elements( pnHash ), 1 );
+
+			/* ...and so does a failed set, in place or not */
+			TS_ASSERT( node_hash_setA( pnHash, "k", NODE_STRINGA, ach ) == NULL );
+			TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "k" ) ), 1 );
+			TS_ASSERT( node_set_data( node_hash_getA( pnHash, "k" ), sizeof(ach), ach ) == NULL );
+			TS_ASSERT_EQUALS( node_get_type( node_hash_getA( pnHash, "k" ) ), NODE_INT );
+			TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "k" ) ), 1 );
+
+			node_t * pn = NULL;
+			char achNode[sizeof(ach) + 16];
+			sprintf( achNode, "Big: '%s'\n", ach );
+			TS_ASSERT_EQUALS( node_parse_from_stringA( achNode, &pn ), NP_NOMEM );
+			TS_ASSERT( pn == NULL );
+
+			/* a dump that runs out of memory stops before the record it could not escape */
+			node_clear_error();
+			FILE * pf = fopen( g_psFileName, "wb" );
+			node_dumpA( pnList, pf, 0 );
+			long cbDump = ftell( pf );
+			fclose( pf );
+			TS_ASSERT_EQUALS( node_get_error(), NODE_ERROR_BUDGET );
+			TS_ASSERT_EQUALS( cbDump, (long)strlen( ": (\r\n" ) );
+		}
+
+		/* freeing makes room again */
+		node_free( pnHash );
+		node_free( pnList );
+		node_clear_error();
+		TS_ASSERT_EQUALS( node_get_error(), NODE_ERROR_NONE );
+		pnList = node_list_alloc();
+		TS_ASSERT( node_list_add( pnList, NODE_STRINGA, ach ) != NULL );
+		node_free( pnList );
+
+		node_set_arena( pOld );
+		node_delete_arena( pArena );
+	}
+};
+
+class Context : public CxxTest::TestSuite
+{
+public:
+	void test_ctx()
+	{
+		node_arena_t pArena = node_create_arena( 0 );
+		node_arena_t pOld = node_set_arena( pArena );
+		node_ctx_t ctx = node_get_ctx();
+		TS_ASSERT( ctx != NULL );
+
+		node_t * pnList = node_list_alloc_ctx( ctx );
+		for( int i = 0; i < 10000; i++ )
+			node_list_add_ctx( ctx, pnList, NODE_INT, i );
+		TS_ASSERT_EQUALS( node_get_elements( pnList ), 10000 );
+		TS_ASSERT_EQUALS( node_get_int( node_first( pnList ) ), 0 );
+
+		node_t * pnHash = node_hash_alloc_ctx( ctx );
+		node_hash_add_ctxA( ctx, pnHash, "List", NODE_LIST, pnList );
+		node_hash_add_ctxA( ctx, pnHash, "Name", NODE_STRINGA, "value" );
+		node_hash_add_ctxA( ctx, pnHash, "Name", NODE_INT, 7 );
+		node_free( pnList );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 2 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "Name" ) ), 7 );
+
+		node_t * pnCopy = node_copy_ctx( ctx, pnHash );
+		TS_ASSERT_EQUALS( node_get_elements( node_hash_getA( pnCopy, "List" ) ), 10000 );
+		node_free( pnCopy );
+
+		FILE * pf = fopen( g_psFileName, "wb" );
+		node_dump_ctxA( ctx, node_hash_getA( pnHash, "Name" ), pf, 0 );
+		fclose( pf );
+
+		char acBuffer[64] = {0};
+		pf = fopen( g_psFileName, "rb" );
+		fread( acBuffer, 1, sizeof(acBuffer)-1, pf );
+		fclose( pf );
+
+		node_t * pnRead = NULL;
+		TS_ASSERT_EQUALS( node_parse_from_string_ctxA( ctx, acBuffer, &pnRead ), NP_NODE );
+		TS_ASSERT( strcmp( node_get_nameA( pnRead ), "Name" ) == 0 );
+		TS_ASSERT_EQUALS( node_get_int( pnRead ), 7 );
+		node_free( pnRead );
+
+		node_free( pnHash );
+		node_set_arena( pOld );
+		node_delete_arena( pArena );
+	}
+};
+
+class Intern : public CxxTest::TestSuite
+{
+public:
+	void test_intern()
+	{
+		TS_ASSERT( !node_get_intern() );
+		node_set_intern( TRUE );
+
+		node_t * pnHash1 = node_hash_alloc();
+		node_t * pnHash2 = node_hash_alloc();
+		node_hash_addA( pnHash1, "Key", NODE_INT, 1 );
+		node_hash_addA( pnHash2, "Key", NODE_INT, 2 );
+		node_hash_addA( pnHash2, "Other", NODE_INT, 3 );
+
+		/* one copy of the name, shared by both elements and by copies */
+		const char * psKey = node_get_nameA( node_hash_getA( pnHash1, "Key" ) );
+		TS_ASSERT_EQUALS( node_get_nameA( node_hash_getA( pnHash2, "key" ) ), psKey );
+
+		node_t * pnCopy = node_copy( pnHash2 );
+		TS_ASSERT_EQUALS( node_get_nameA( node_hash_getA( pnCopy, psKey ) ), psKey );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnCopy, psKey ) ), 2 );
+
+		/* the name outlives the nodes that interned it, as long as one holds it */
+		node_free( pnHash1 );
+		node_free( pnHash2 );
+		TS_ASSERT( strcmp( node_get_nameA( node_hash_getA( pnCopy, "KEY" ) ), "Key" ) == 0 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnCopy, "Other" ) ), 3 );
+
+		node_t * pnW = node_alloc();
+		node_set( pnW, NODE_INT, 0 );
+		node_set_nameW( pnW, L"Wide" );
+		node_t * pnW2 = node_copy( pnW );
+		TS_ASSERT_EQUALS( node_get_nameW( pnW2 ), node_get_nameW( pnW ) );
+		node_free( pnW );
+		TS_ASSERT( wcscmp( node_get_nameW( pnW2 ), L"Wide" ) == 0 );
+		node_free( pnW2 );
+
+		/* names set with interning off are the node's own */
+		node_set_intern( FALSE );
+		node_t * pn = node_alloc();
+		node_set_nameA( pn, "Key" );
+		TS_ASSERT( node_get_nameA( pn ) != node_get_nameA( node_hash_getA( pnCopy, "Key" ) ) );
+		node_free( pn );
+
+		node_free( pnCopy );
+	}
 };
 
 class Int64 : public CxxTest::TestSuite
@@ -1935,6 +2386,29 @@ public:
 		}
 	}
 
+	void test_PushThenAdd()
+	{
+		int i;
+		node_t * pn = NULL;
+
+		/* a push onto an empty list makes the tail too */
+		node_push( pnList, NODE_INT, 1 );
+		node_list_add( pnList, NODE_INT, 2 );
+
+		pn = node_pop( pnList );
+		node_free( pn );
+		pn = node_pop( pnList );
+		node_free( pn );
+
+		node_push( pnList, NODE_INT, 2 );
+		node_push( pnList, NODE_INT, 1 );
+		node_list_add( pnList, NODE_INT, 3 );
+
+		for( i = 1, pn = node_first( pnList ); pn != NULL; pn = node_next( pn ), ++i )
+			TS_ASSERT_EQUALS( i, node_get_int( pn ) );
+		TS_ASSERT_EQUALS( i, 4 );
+	}
+
 	void test_Pop_Underflow()
 	{
 		node_push( pnList, NODE_INT, 1 );
@@ -2634,6 +3108,26 @@ public:
 		node_free( pnHash );
 	}
 
+	void testShareAssert()
+	{
+		node_arena_t pArena = node_create_arena( 0 );
+		if( pArena == NULL )
+			return;
+
+		/* a thread's own arena is not locked, so its hashes cannot be shared */
+		node_arena_t pOld = node_set_arena( pArena );
+		node_t * pnHash = node_hash_alloc();
+		ASSERT_SETUP;
+
+		TS_ASSERT( !node_hash_share( pnHash ) );
+		TS_ASSERT( ASSERT_AFTER == 1 );
+		TS_ASSERT( !node_hash_shared( pnHash ) );
+
+		node_free( pnHash );
+		node_set_arena( pOld );
+		node_delete_arena( pArena );
+	}
+
 	void testSet()
 	{
 		node_t * pn = node_alloc();
@@ -3242,10 +3736,14 @@ public:
 //#define NODE_SIZE 72
 
 #if defined(_WIN64)
-#define NODE_SIZE 128
+#define NODE_SIZE 112
+#ifdef _DEBUG
 #define BAG_SIZE 64
+#else
+#define BAG_SIZE 72
+#endif
 #elif defined(_WIN32)
-#define NODE_SIZE 80
+#define NODE_SIZE 64
 #define BAG_SIZE 32
 #endif
 class NoBag : public CxxTest::TestSuite
@@ -3275,8 +3773,10 @@ public:
 		node_set( pn2, NODE_STRINGA, "123456789012345678901234567890123456789012345678901234567890123" ); /* 63 */
 		TS_ASSERT_EQUALS( pn2->bBagUsed, BAG_SIZE == 32 ? 0 : 1 );
 		node_set( pn2, NODE_STRINGA, "1234567890123456789012345678901234567890123456789012345678901234" ); /* 64 */
-		TS_ASSERT_EQUALS( pn2->bBagUsed, 0 );
+		TS_ASSERT_EQUALS( pn2->bBagUsed, BAG_SIZE > 64 ? 1 : 0 );
 		node_set( pn2, NODE_STRINGA, "12345678901234567890123456789012345678901234567890123456789012345" ); /* 65 */
+		TS_ASSERT_EQUALS( pn2->bBagUsed, BAG_SIZE > 65 ? 1 : 0 );
+		node_set( pn2, NODE_STRINGA, "123456789012345678901234567890123456789012345678901234567890123456789012" ); /* 72 */
 		TS_ASSERT_EQUALS( pn2->bBagUsed, 0 );
 
 		BYTE bLoAfter = *((BYTE *)pn2 - 1);
@@ -3313,8 +3813,10 @@ public:
 		node_set( pn2, NODE_STRINGW, L"1234567890123456789012345678901" ); /* 31 */
 		TS_ASSERT_EQUALS( pn2->bBagUsed, BAG_SIZE == 32 ? 0 : 1 );
 		node_set( pn2, NODE_STRINGW, L"12345678901234567890123456789012" ); /* 32 */
-		TS_ASSERT_EQUALS( pn2->bBagUsed, 0 );
+		TS_ASSERT_EQUALS( pn2->bBagUsed, BAG_SIZE > 64 ? 1 : 0 );
 		node_set( pn2, NODE_STRINGW, L"123456789012345678901234567890123" ); /* 33 */
+		TS_ASSERT_EQUALS( pn2->bBagUsed, BAG_SIZE > 66 ? 1 : 0 );
+		node_set( pn2, NODE_STRINGW, L"123456789012345678901234567890123456" ); /* 36 */
 		TS_ASSERT_EQUALS( pn2->bBagUsed, 0 );
 
 		BYTE bLoAfter = *((BYTE *)pn2 - 1);
@@ -3341,6 +3843,7 @@ public:
 						'\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', \
 						'\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', \
 						'\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', \
+						'\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', \
 						'\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB', '\xBB' };
 		data_t * pv = (data_t *)ac;
 
@@ -3362,6 +3865,8 @@ public:
 		node_set_data( pn2, 64, pv );
 		TS_ASSERT_EQUALS( pn2->bBagUsed, BAG_SIZE == 32 ? 0 : 1 );
 		node_set_data( pn2, 65, pv );
+		TS_ASSERT_EQUALS( pn2->bBagUsed, BAG_SIZE >= 65 ? 1 : 0 );
+		node_set_data( pn2, 73, pv );
 		TS_ASSERT_EQUALS( pn2->bBagUsed, 0 );
 
 		BYTE bLoAfter = *((BYTE *)pn2 - 1);
@@ -3569,47 +4074,506 @@ public:
 		
 		node_free( node_copy( pnHash ) );
 	}
-};
-
-/* explicitly test Hash functions for W string keys */
-class HashWNode : public CxxTest::TestSuite
-{
-	node_t * pnHash;
-public:
-	void setUp() { pnHash = node_hash_alloc(); }
-	void tearDown() { node_free( pnHash ); }
 
-	void test_Exists()
+	void test_Grow()
 	{
-		TS_ASSERT( pnHash != NULL );
-		TS_ASSERT( node_get_type( pnHash ) == NODE_HASH );
-		wait();
-	}
+		char ach[32];
+		int i;
 
-	void test_Add()
-	{
-		node_hash_addW( pnHash, L"One", NODE_INT, 1 );
-		TS_ASSERT( node_get_int( node_hash_getW( pnHash, L"One" ) ) == 1 );
-		TS_ASSERT( node_get_elements( pnHash ) == 1 );
-		wait();
-	}
+		/* grow well past the default table, deleting as we go so deleted slots pile up */
+		for( i = 0; i < 5000; i++ )
+		{
+			sprintf( ach, "Setting.Item%d", i );
+			node_hash_addA( pnHash, ach, NODE_INT, i );
 
-	void test_Add2()
-	{
-		node_hash_addW( pnHash, L"One", NODE_INT, 1 );
-		node_hash_addW( pnHash, L"Two", NODE_INT, 2 );
-		TS_ASSERT( node_get_int( node_hash_getW( pnHash, L"One" ) ) == 1 );
-		TS_ASSERT( node_get_int( node_hash_getW( pnHash, L"Two" ) ) == 2 );
-		TS_ASSERT( node_get_elements( pnHash ) == 2 );
-		wait();
+			if( i % 3 == 0 )
+			{
+				sprintf( ach, "Setting.Item%d", i / 2 );
+				node_t * pn = node_hash_getA( pnHash, ach );
+				if( pn != NULL )
+				{
+					node_hash_delete( pnHash, pn );
+					node_free( pn );
+				}
+			}
+		}
+
+		int nFound = 0;
+		for( i = 0; i < 5000; i++ )
+		{
+			sprintf( ach, "SETTING.ITEM%d", i );
+			node_t * pn = node_hash_getA( pnHash, ach );
+			if( pn != NULL )
+			{
+				TS_ASSERT_EQUALS( node_get_int( pn ), i );
+				nFound++;
+			}
+		}
+		TS_ASSERT_EQUALS( nFound, node_get_elements( pnHash ) );
+		TS_ASSERT( nFound > 3000 );
+
+		node_t * pnCopy = node_copy( pnHash );
+		TS_ASSERT_EQUALS( node_get_elements( pnCopy ), nFound );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnCopy, "Setting.Item4999" ) ), 4999 );
+		node_free( pnCopy );
 	}
 
-	void test_Delete1()
+	void test_GrowIncrementally()
 	{
-		node_hash_addW( pnHash, L"One", NODE_INT, 1 );
-		node_hash_addW( pnHash, L"Two", NODE_INT, 2 );
+		char ach[32];
+		int i;
 
-		node_t * pn = node_hash_getW( pnHash, L"One" );
+		/* children not yet moved out of the old table must still be found, replaced and copied */
+		for( i = 0; i < 100000; i++ )
+		{
+			sprintf( ach, "Key%d", i );
+			node_hash_addA( pnHash, ach, NODE_INT, i );
+
+			sprintf( ach, "Key%d", i / 2 );
+			TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, ach ) ), i / 2 );
+
+			if( i % 1000 == 999 )
+			{
+				/* replace a child added long ago */
+				sprintf( ach, "Key%d", i / 4 );
+				node_hash_addA( pnHash, ach, NODE_INT, -1 );
+
+				node_t * pnCopy = node_copy( pnHash );
+				TS_ASSERT_EQUALS( node_get_elements( pnCopy ), i + 1 );
+				TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnCopy, ach ) ), -1 );
+				node_free( pnCopy );
+
+				node_t * pnKeys = node_hash_keysA( pnHash );
+				TS_ASSERT_EQUALS( node_get_elements( pnKeys ), i + 1 );
+				node_free( pnKeys );
+			}
+		}
+
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 100000 );
+		for( i = 0; i < 100000; i += 7 )
+		{
+			sprintf( ach, "Key%d", i );
+			node_t * pn = node_hash_getA( pnHash, ach );
+			TS_ASSERT( pn != NULL );
+			node_hash_delete( pnHash, pn );
+			node_free( pn );
+		}
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 100000 - 14286 );
+	}
+
+	void test_LengthDelimited()
+	{
+		/* keys sliced out of a buffer, none of them terminated */
+		const char * psBuffer = "Alpha,Beta,GAMMA,alphabet";
+
+		TS_ASSERT( node_hash_add_nA( pnHash, psBuffer, 5, NODE_INT, 1 ) != NULL );
+		TS_ASSERT( node_hash_add_nA( pnHash, psBuffer + 6, 4, NODE_INT, 2 ) != NULL );
+		TS_ASSERT( node_hash_add_nA( pnHash, psBuffer + 11, 5, NODE_INT, 3 ) != NULL );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 3 );
+
+		/* the names are terminated copies */
+		TS_ASSERT( strcmp( node_get_nameA( node_hash_getA( pnHash, "alpha" ) ), "Alpha" ) == 0 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "BETA" ) ), 2 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "gamma" ) ), 3 );
+
+		/* a prefix of a longer word is its own key */
+		TS_ASSERT_EQUALS( node_get_int( node_hash_get_nA( pnHash, psBuffer + 17, 5 ) ), 1 );
+		TS_ASSERT( node_hash_get_nA( pnHash, psBuffer + 17, 8 ) == NULL );
+		TS_ASSERT( node_hash_get_nA( pnHash, psBuffer, 4 ) == NULL );
+		TS_ASSERT( node_hash_get_nA( pnHash, psBuffer, 0 ) == NULL );
+
+		/* replace */
+		node_hash_add_nA( pnHash, "GAMMA RAY", 5, NODE_INT, 4 );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 3 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_get_nA( pnHash, psBuffer + 11, 5 ) ), 4 );
+
+		/* delete */
+		node_t * pn = node_hash_delete_nA( pnHash, "betamax", 4 );
+		TS_ASSERT_EQUALS( node_get_int( pn ), 2 );
+		node_free( pn );
+		TS_ASSERT( node_hash_delete_nA( pnHash, "betamax", 4 ) == NULL );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 2 );
+		TS_ASSERT( node_hash_getA( pnHash, "Beta" ) == NULL );
+
+		/* a key too long for the table to keep its length is still compared in full */
+		const size_t cchLong = 70000;
+		char * psLong = (char *)malloc( cchLong + 2 );
+		memset( psLong, 'k', cchLong + 1 );
+		psLong[cchLong + 1] = 0;
+
+		node_hash_add_nA( pnHash, psLong, cchLong, NODE_INT, 5 );
+		TS_ASSERT_EQUALS( strlen( node_get_nameA( node_hash_get_nA( pnHash, psLong, cchLong ) ) ), cchLong );
+		TS_ASSERT( node_hash_get_nA( pnHash, psLong, cchLong + 1 ) == NULL );
+		TS_ASSERT( node_hash_getA( pnHash, psLong ) == NULL );
+		psLong[cchLong] = 0;
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, psLong ) ), 5 );
+
+		/* interned names are terminated too */
+		node_set_intern( TRUE );
+		node_hash_add_nA( pnHash, psBuffer + 6, 4, NODE_INT, 6 );
+		node_hash_add_nA( pnHash, psLong, 300, NODE_INT, 7 );
+		node_set_intern( FALSE );
+		TS_ASSERT( strcmp( node_get_nameA( node_hash_getA( pnHash, "beta" ) ), "Beta" ) == 0 );
+		TS_ASSERT_EQUALS( strlen( node_get_nameA( node_hash_get_nA( pnHash, psLong, 300 ) ) ), 300u );
+		free( psLong );
+	}
+
+	void test_PrehashedKeys()
+	{
+		node_key_t keyId, keyTime;
+		TS_ASSERT( node_key_initA( &keyId, "Id" ) == &keyId );
+		node_key_initA( &keyTime, "TIMESTAMP" );
+
+		node_t * pnOther = node_hash_alloc();
+		node_hash_add_key( pnHash, &keyId, NODE_INT, 1 );
+		node_hash_addA( pnHash, "Timestamp", NODE_INT, 2 );
+		node_hash_add_key( pnOther, &keyTime, NODE_INT, 3 );
+
+		/* the same key in any number of hashes, found as if by name */
+		TS_ASSERT_EQUALS( node_get_int( node_hash_get_key( pnHash, &keyId ) ), 1 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_get_key( pnHash, &keyTime ) ), 2 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_get_key( pnOther, &keyTime ) ), 3 );
+		TS_ASSERT( node_hash_get_key( pnOther, &keyId ) == NULL );
+		TS_ASSERT( strcmp( node_get_nameA( node_hash_getA( pnHash, "id" ) ), "Id" ) == 0 );
+		TS_ASSERT( strcmp( node_get_nameA( node_hash_getA( pnOther, "timestamp" ) ), "TIMESTAMP" ) == 0 );
+
+		/* replace */
+		node_hash_add_key( pnHash, &keyTime, NODE_INT, 4 );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 2 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "Timestamp" ) ), 4 );
+		node_free( pnOther );
+
+#ifdef NODE_KEYA
+		/* built at compile time, hashed as at run time */
+		static const char * apsKeys[] = { "", "a", "Id", "Name", "Setting.Group.Item42", "LONGER THAN SIXTEEN CHARACTERS", "Caf\xC9" };
+		constexpr node_key_t akeyLiterals[] = { NODE_KEYA( "" ), NODE_KEYA( "a" ), NODE_KEYA( "Id" ), NODE_KEYA( "Name" ),
+			NODE_KEYA( "Setting.Group.Item42" ), NODE_KEYA( "LONGER THAN SIXTEEN CHARACTERS" ), NODE_KEYA( "Caf\xC9" ) };
+		for( int i = 0; i < (int)( sizeof(apsKeys) / sizeof(apsKeys[0]) ); i++ )
+		{
+			node_key_t key;
+			node_key_initA( &key, apsKeys[i] );
+			TS_ASSERT_EQUALS( akeyLiterals[i].nHash, key.nHash );
+			TS_ASSERT_EQUALS( akeyLiterals[i].cchKey, key.cchKey );
+		}
+
+		constexpr node_key_t keyLiteral = NODE_KEYA( "id" );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_get_key( pnHash, &keyLiteral ) ), 1 );
+#endif
+	}
+
+	void test_Iterate()
+	{
+		node_hash_iter_t it;
+		TS_ASSERT( node_hash_iter_begin( pnHash, &it ) == NULL );
+		TS_ASSERT( node_hash_iter_next( &it ) == NULL );
+
+		/* every child once, including those a growing hash has not moved yet */
+		char ach[32];
+		int i, nSum = 0, nCount = 0;
+		for( i = 0; i < 1000; i++ )
+		{
+			sprintf( ach, "Key%d", i );
+			node_hash_addA( pnHash, ach, NODE_INT, i );
+		}
+		for( node_t * pn = node_hash_iter_begin( pnHash, &it ); pn != NULL; pn = node_hash_iter_next( &it ) )
+		{
+			TS_ASSERT( node_hash_getA( pnHash, node_get_nameA( pn ) ) == pn );
+			nSum += node_get_int( pn );
+			nCount++;
+		}
+		TS_ASSERT_EQUALS( nCount, 1000 );
+		TS_ASSERT_EQUALS( nSum, 999 * 1000 / 2 );
+
+		/* the child just returned may be deleted */
+		for( node_t * pn = node_hash_iter_begin( pnHash, &it ); pn != NULL; pn = node_hash_iter_next( &it ) )
+		{
+			if( node_get_int( pn ) % 2 == 0 )
+			{
+				node_hash_delete( pnHash, pn );
+				node_free( pn );
+			}
+		}
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 500 );
+
+		nCount = 0;
+		for( node_t * pn = node_hash_iter_begin( pnHash, &it ); pn != NULL; pn = node_hash_iter_next( &it ) )
+		{
+			TS_ASSERT( node_get_int( pn ) % 2 == 1 );
+			nCount++;
+		}
+		TS_ASSERT_EQUALS( nCount, 500 );
+	}
+
+	void test_GetMany()
+	{
+		/* more keys than one batch, some missing, while the hash is still growing */
+		char ach[40][16];
+		const char * apsKeys[40];
+		node_t * apn[40];
+		int i;
+		for( i = 0; i < 1000; i++ )
+		{
+			sprintf( ach[0], "Key%d", i );
+			node_hash_addA( pnHash, ach[0], NODE_INT, i );
+		}
+		for( i = 0; i < 40; i++ )
+		{
+			sprintf( ach[i], ( i % 4 == 3 ) ? "Missing%d" : "KEY%d", i * 25 );
+			apsKeys[i] = ach[i];
+		}
+
+		TS_ASSERT_EQUALS( node_hash_get_manyA( pnHash, apsKeys, 40, apn ), 30 );
+		for( i = 0; i < 40; i++ )
+		{
+			TS_ASSERT( apn[i] == node_hash_getA( pnHash, apsKeys[i] ) );
+			if( i % 4 != 3 )
+				TS_ASSERT_EQUALS( node_get_int( apn[i] ), i * 25 );
+		}
+
+		/* prehashed */
+		node_key_t aKeys[40];
+		for( i = 0; i < 40; i++ )
+			node_key_initA( &aKeys[i], apsKeys[39 - i] );
+		TS_ASSERT_EQUALS( node_hash_get_many_key( pnHash, aKeys, 40, apn ), 30 );
+		for( i = 0; i < 40; i++ )
+			TS_ASSERT( apn[i] == node_hash_getA( pnHash, apsKeys[39 - i] ) );
+
+		TS_ASSERT_EQUALS( node_hash_get_manyA( pnHash, apsKeys, 0, NULL ), 0 );
+	}
+
+	void test_Set()
+	{
+		/* a miss adds, a hit keeps the child and its name */
+		node_t * pn = node_hash_setA( pnHash, "Count", NODE_INT, 1 );
+		TS_ASSERT_EQUALS( node_get_int( pn ), 1 );
+		TS_ASSERT( node_hash_setA( pnHash, "COUNT", NODE_INT, 2 ) == pn );
+		TS_ASSERT( node_hash_setA( pnHash, "count", NODE_STRINGA, "three" ) == pn );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 1 );
+		TS_ASSERT( strcmp( node_get_stringA( node_hash_getA( pnHash, "Count" ) ), "three" ) == 0 );
+		TS_ASSERT( strcmp( node_get_nameA( pn ), "Count" ) == 0 );
+
+		/* a scalar set on a collection child frees its contents */
+		node_t * pnList = node_list_alloc();
+		node_list_add( pnList, NODE_INT, 1 );
+		node_t * pnChild = node_hash_addA( pnHash, "List", NODE_LIST, pnList );
+		TS_ASSERT( node_hash_setA( pnHash, "list", NODE_REAL, 2.5 ) == pnChild );
+		TS_ASSERT_EQUALS( node_get_type( pnChild ), NODE_REAL );
+
+		/* a collection replaces the child, as an add does */
+		node_t * pnNew = node_hash_setA( pnHash, "List", NODE_LIST, pnList );
+		TS_ASSERT( pnNew != NULL );
+		TS_ASSERT_EQUALS( node_get_type( pnNew ), NODE_LIST );
+		TS_ASSERT_EQUALS( node_get_elements( node_hash_getA( pnHash, "List" ) ), 1 );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 2 );
+		node_free( pnList );
+
+		/* constant updates leave no deleted slots behind */
+		char ach[32];
+		for( int i = 0; i < 1000; i++ )
+		{
+			sprintf( ach, "Key%d", i % 10 );
+			node_hash_setA( pnHash, ach, NODE_INT, i );
+		}
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 12 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "key9" ) ), 999 );
+	}
+
+	static int CompareHashIndex( const void * pv1, const void * pv2 )
+	{
+		unsigned __int64 n1 = *(const unsigned __int64 *)pv1, n2 = *(const unsigned __int64 *)pv2;
+		return n1 < n2 ? -1 : n1 > n2 ? 1 : 0;
+	}
+
+	void test_Freeze()
+	{
+		TS_ASSERT( !node_hash_freeze( pnHash ) );
+		TS_ASSERT( !node_hash_frozen( pnHash ) );
+
+		char ach[32];
+		int i;
+		for( i = 0; i < 1000; i++ )
+		{
+			sprintf( ach, "Key%d", i );
+			node_hash_addA( pnHash, ach, NODE_INT, i );
+		}
+		TS_ASSERT( node_hash_freeze( pnHash ) );
+		TS_ASSERT( node_hash_frozen( pnHash ) );
+
+		/* found as before, in any case, and walked once each */
+		for( i = 0; i < 1000; i++ )
+		{
+			sprintf( ach, "KEY%d", i );
+			TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, ach ) ), i );
+			sprintf( ach, "Key%dx", i );
+			TS_ASSERT( node_hash_getA( pnHash, ach ) == NULL );
+		}
+		node_hash_iter_t it;
+		int nSum = 0;
+		for( node_t * pn = node_hash_iter_begin( pnHash, &it ); pn != NULL; pn = node_hash_iter_next( &it ) )
+			nSum += node_get_int( pn );
+		TS_ASSERT_EQUALS( nSum, 999 * 1000 / 2 );
+
+		/* a copy is frozen too */
+		node_t * pnCopy = node_copy( pnHash );
+		TS_ASSERT( node_hash_frozen( pnCopy ) );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnCopy, "key500" ) ), 500 );
+		node_free( pnCopy );
+
+		/* setting a value leaves it frozen; adding and deleting thaw it */
+		node_hash_setA( pnHash, "Key7", NODE_INT, -7 );
+		TS_ASSERT( node_hash_frozen( pnHash ) );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "key7" ) ), -7 );
+		node_hash_addA( pnHash, "Extra", NODE_INT, 1000 );
+		TS_ASSERT( !node_hash_frozen( pnHash ) );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 1001 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "key999" ) ), 999 );
+
+		TS_ASSERT( node_hash_freeze( pnHash ) );
+		node_free( node_hash_delete_nA( pnHash, "Extra", 5 ) );
+		TS_ASSERT( !node_hash_frozen( pnHash ) );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 1000 );
+		TS_ASSERT( node_hash_getA( pnHash, "Extra" ) == NULL );
+	}
+
+	void test_Share()
+	{
+		char ach[32];
+		int i;
+		for( i = 0; i < 100; i++ )
+		{
+			sprintf( ach, "Key%d", i );
+			node_hash_addA( pnHash, ach, NODE_INT, i );
+		}
+		TS_ASSERT( node_hash_share( pnHash ) );
+		TS_ASSERT( node_hash_shared( pnHash ) );
+		TS_ASSERT( !node_hash_freeze( pnHash ) );
+
+		/* growing replaces the table */
+		for( ; i < 5000; i++ )
+		{
+			sprintf( ach, "Key%d", i );
+			node_hash_addA( pnHash, ach, NODE_INT, i );
+		}
+		node_read_begin();
+		for( i = 0; i < 5000; i++ )
+		{
+			sprintf( ach, "KEY%d", i );
+			TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, ach ) ), i );
+		}
+		node_read_end();
+
+		/* a set replaces the child, which stays readable until the section ends */
+		node_read_begin();
+		node_t * pnOld = node_hash_getA( pnHash, "Key7" );
+		node_t * pnNew = node_hash_setA( pnHash, "Key7", NODE_INT, -7 );
+		TS_ASSERT( pnNew != pnOld );
+		TS_ASSERT_EQUALS( node_get_int( pnOld ), 7 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "key7" ) ), -7 );
+		node_read_end();
+
+		/* deleted children are retired rather than freed, and their slots not reused */
+		for( int nRound = 0; nRound < 20; nRound++ )
+		{
+			for( i = 0; i < 5000; i += 2 )
+			{
+				sprintf( ach, "Key%d", i );
+				node_hash_retire( pnHash, node_hash_delete_nA( pnHash, ach, strlen( ach ) ) );
+				node_hash_addA( pnHash, ach, NODE_INT, i + nRound );
+			}
+		}
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 5000 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "Key10" ) ), 29 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, "Key11" ) ), 11 );
+
+		node_hash_iter_t it;
+		int nCount = 0;
+		for( node_t * pn = node_hash_iter_begin( pnHash, &it ); pn != NULL; pn = node_hash_iter_next( &it ) )
+			nCount++;
+		TS_ASSERT_EQUALS( nCount, 5000 );
+
+		/* a copy is an ordinary hash */
+		node_t * pnCopy = node_copy( pnHash );
+		TS_ASSERT( !node_hash_shared( pnCopy ) );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnCopy, "key4999" ) ), 4999 );
+		node_free( pnCopy );
+	}
+
+	void test_FreezeSameHash()
+	{
+		/* find two keys with the same full hash, which no slot can tell apart */
+		const int nKeys = 1 << 18;
+		unsigned __int64 * pnHashes = new unsigned __int64[nKeys];
+		char ach[32];
+		int i;
+		for( i = 0; i < nKeys; i++ )
+		{
+			node_key_t key;
+			sprintf( ach, "Item%d", i );
+			pnHashes[i] = ( (unsigned __int64)node_key_initA( &key, ach )->nHash << 32 ) | i;
+		}
+		qsort( pnHashes, nKeys, sizeof(unsigned __int64), CompareHashIndex );
+		for( i = 1; i < nKeys && ( pnHashes[i] >> 32 ) != ( pnHashes[i - 1] >> 32 ); i++ )
+			/* empty */;
+		TS_ASSERT( i < nKeys );
+		if( i < nKeys )
+		{
+			int n1 = (int)( pnHashes[i - 1] & 0xFFFFFFFF ), n2 = (int)( pnHashes[i] & 0xFFFFFFFF );
+			for( int j = 0; j < 100; j++ )
+			{
+				sprintf( ach, "Item%d", j == 0 ? n1 : j == 1 ? n2 : nKeys + j );
+				node_hash_addA( pnHash, ach, NODE_INT, j );
+			}
+			TS_ASSERT( node_hash_freeze( pnHash ) );
+			for( int j = 0; j < 100; j++ )
+			{
+				sprintf( ach, "ITEM%d", j == 0 ? n1 : j == 1 ? n2 : nKeys + j );
+				TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, ach ) ), j );
+			}
+			TS_ASSERT( node_hash_getA( pnHash, "Item0x" ) == NULL );
+		}
+		delete [] pnHashes;
+	}
+};
+
+/* explicitly test Hash functions for W string keys */
+class HashWNode : public CxxTest::TestSuite
+{
+	node_t * pnHash;
+public:
+	void setUp() { pnHash = node_hash_alloc(); }
+	void tearDown() { node_free( pnHash ); }
+
+	void test_Exists()
+	{
+		TS_ASSERT( pnHash != NULL );
+		TS_ASSERT( node_get_type( pnHash ) == NODE_HASH );
+		wait();
+	}
+
+	void test_Add()
+	{
+		node_hash_addW( pnHash, L"One", NODE_INT, 1 );
+		TS_ASSERT( node_get_int( node_hash_getW( pnHash, L"One" ) ) == 1 );
+		TS_ASSERT( node_get_elements( pnHash ) == 1 );
+		wait();
+	}
+
+	void test_Add2()
+	{
+		node_hash_addW( pnHash, L"One", NODE_INT, 1 );
+		node_hash_addW( pnHash, L"Two", NODE_INT, 2 );
+		TS_ASSERT( node_get_int( node_hash_getW( pnHash, L"One" ) ) == 1 );
+		TS_ASSERT( node_get_int( node_hash_getW( pnHash, L"Two" ) ) == 2 );
+		TS_ASSERT( node_get_elements( pnHash ) == 2 );
+		wait();
+	}
+
+	void test_Delete1()
+	{
+		node_hash_addW( pnHash, L"One", NODE_INT, 1 );
+		node_hash_addW( pnHash, L"Two", NODE_INT, 2 );
+
+		node_t * pn = node_hash_getW( pnHash, L"One" );
 		node_hash_delete( pnHash, pn );
 		node_free( pn );
 
@@ -3684,6 +4648,100 @@ public:
 		node_hash_addW( pnHash, L"Test", NODE_REAL, 2.0 );
 		TS_ASSERT_EQUALS( node_get_real( node_hash_getW( pnHash, L"Test" ) ), 2.0 );
 	}
+
+	void test_LengthDelimited()
+	{
+		const wchar_t * psBuffer = L"Alpha,Beta,GAMMA,alphabet";
+
+		TS_ASSERT( node_hash_add_nW( pnHash, psBuffer, 5, NODE_INT, 1 ) != NULL );
+		TS_ASSERT( node_hash_add_nW( pnHash, psBuffer + 6, 4, NODE_INT, 2 ) != NULL );
+		TS_ASSERT( node_hash_add_nW( pnHash, psBuffer + 11, 5, NODE_INT, 3 ) != NULL );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 3 );
+
+		TS_ASSERT( wcscmp( node_get_nameW( node_hash_getW( pnHash, L"alpha" ) ), L"Alpha" ) == 0 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getW( pnHash, L"BETA" ) ), 2 );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_get_nW( pnHash, psBuffer + 17, 5 ) ), 1 );
+		TS_ASSERT( node_hash_get_nW( pnHash, psBuffer + 17, 8 ) == NULL );
+		TS_ASSERT( node_hash_get_nW( pnHash, psBuffer, 4 ) == NULL );
+
+		node_t * pn = node_hash_delete_nW( pnHash, L"GAMMA RAY", 5 );
+		TS_ASSERT_EQUALS( node_get_int( pn ), 3 );
+		node_free( pn );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 2 );
+		TS_ASSERT( node_hash_getW( pnHash, L"Gamma" ) == NULL );
+	}
+
+	void test_PrehashedKeys()
+	{
+		node_key_t keyId;
+		node_key_initW( &keyId, L"Id" );
+		node_hash_add_key( pnHash, &keyId, NODE_INT, 1 );
+		node_hash_addW( pnHash, L"Timestamp", NODE_INT, 2 );
+
+		TS_ASSERT_EQUALS( node_get_int( node_hash_get_key( pnHash, &keyId ) ), 1 );
+		TS_ASSERT( wcscmp( node_get_nameW( node_hash_getW( pnHash, L"ID" ) ), L"Id" ) == 0 );
+
+#ifdef NODE_KEYW
+		static const wchar_t * apsKeys[] = { L"", L"a", L"Name", L"Setting.Group.Item42", L"Caf\x00C9", L"\x0100\x0130" };
+		constexpr node_key_t akeyLiterals[] = { NODE_KEYW( L"" ), NODE_KEYW( L"a" ), NODE_KEYW( L"Name" ),
+			NODE_KEYW( L"Setting.Group.Item42" ), NODE_KEYW( L"Caf\x00C9" ), NODE_KEYW( L"\x0100\x0130" ) };
+		for( int i = 0; i < (int)( sizeof(apsKeys) / sizeof(apsKeys[0]) ); i++ )
+		{
+			node_key_t key;
+			node_key_initW( &key, apsKeys[i] );
+			TS_ASSERT_EQUALS( akeyLiterals[i].nHash, key.nHash );
+		}
+
+		constexpr node_key_t keyLiteral = NODE_KEYW( L"TIMESTAMP" );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_get_key( pnHash, &keyLiteral ) ), 2 );
+#endif
+	}
+
+	void test_Iterate()
+	{
+		node_hash_addW( pnHash, L"One", NODE_INT, 1 );
+		node_hash_addW( pnHash, L"Two", NODE_INT, 2 );
+
+		node_hash_iter_t it;
+		int nSum = 0;
+		for( node_t * pn = node_hash_iter_begin( pnHash, &it ); pn != NULL; pn = node_hash_iter_next( &it ) )
+		{
+			TS_ASSERT( node_hash_getW( pnHash, node_get_nameW( pn ) ) == pn );
+			nSum += node_get_int( pn );
+		}
+		TS_ASSERT_EQUALS( nSum, 3 );
+	}
+
+	void test_GetMany()
+	{
+		node_hash_addW( pnHash, L"One", NODE_INT, 1 );
+		node_hash_addW( pnHash, L"Two", NODE_INT, 2 );
+
+		const wchar_t * apsKeys[] = { L"TWO", L"Three", L"one" };
+		node_t * apn[3];
+		TS_ASSERT_EQUALS( node_hash_get_manyW( pnHash, apsKeys, 3, apn ), 2 );
+		TS_ASSERT_EQUALS( node_get_int( apn[0] ), 2 );
+		TS_ASSERT( apn[1] == NULL );
+		TS_ASSERT_EQUALS( node_get_int( apn[2] ), 1 );
+	}
+
+	void test_Set()
+	{
+		node_t * pn = node_hash_setW( pnHash, L"Count", NODE_INT, 1 );
+		TS_ASSERT( node_hash_setW( pnHash, L"COUNT", NODE_STRINGW, L"two" ) == pn );
+		TS_ASSERT_EQUALS( node_get_elements( pnHash ), 1 );
+		TS_ASSERT( wcscmp( node_get_stringW( node_hash_getW( pnHash, L"count" ) ), L"two" ) == 0 );
+		TS_ASSERT( wcscmp( node_get_nameW( pn ), L"Count" ) == 0 );
+	}
+
+	void test_Freeze()
+	{
+		node_hash_addW( pnHash, L"One", NODE_INT, 1 );
+		node_hash_addW( pnHash, L"Two", NODE_INT, 2 );
+		TS_ASSERT( node_hash_freeze( pnHash ) );
+		TS_ASSERT_EQUALS( node_get_int( node_hash_getW( pnHash, L"TWO" ) ), 2 );
+		TS_ASSERT( node_hash_getW( pnHash, L"Three" ) == NULL );
+	}
 };
 
 /* explicitly test Hash functions for mixed string keys (note: this behaviour is illegal!) */
@@ -5071,6 +6129,53 @@ public:
 		node_free( pnHash );
 	}
 
+	void test_longSimilarKeys()
+	{
+		node_t * pnHash = node_hash_alloc();
+		char ach[80];
+		wchar_t awc[80];
+		int i, c;
+
+		/* keys long enough to be compared a block at a time, differing late */
+		for( i = 0; i < 300; i++ )
+		{
+			sprintf( ach, "Setting.Group.SomeLongerName.Item%d", i );
+			node_hash_addA( pnHash, ach, NODE_INT, i );
+		}
+		for( i = 0; i < 300; i++ )
+		{
+			sprintf( ach, "SETTING.group.somelongername.ITEM%d", i );
+			TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, ach ) ), i );
+		}
+		TS_ASSERT( node_hash_getA( pnHash, "Setting.Group.SomeLongerName.Item300" ) == NULL );
+		TS_ASSERT( node_hash_getA( pnHash, "Setting.Group.SomeLongerName.Item1 " ) == NULL );
+
+		/* folding is for letters only */
+		node_hash_addA( pnHash, "Setting.Group.SomeLongerName.@[", NODE_INT, 1 );
+		TS_ASSERT( node_hash_getA( pnHash, "setting.group.somelongername.`{" ) == NULL );
+		TS_ASSERT( node_hash_getA( pnHash, "SETTING.GROUP.SOMELONGERNAME.@[" ) != NULL );
+
+		node_free( pnHash );
+
+		pnHash = node_hash_alloc();
+		for( i = 0; i < 300; i++ )
+		{
+			sprintf( ach, "Setting.Group.SomeLongerName.Item%d", i );
+			for( c = 0; ( awc[c] = ach[c] ) != 0; c++ );
+			node_hash_addW( pnHash, awc, NODE_INT, i );
+		}
+		for( i = 0; i < 300; i++ )
+		{
+			sprintf( ach, "SETTING.group.somelongername.ITEM%d", i );
+			for( c = 0; ( awc[c] = ach[c] ) != 0; c++ );
+			TS_ASSERT_EQUALS( node_get_int( node_hash_getW( pnHash, awc ) ), i );
+		}
+		TS_ASSERT( node_hash_getW( pnHash, L"Setting.Group.SomeLongerName.Item300" ) == NULL );
+		TS_ASSERT( node_hash_getW( pnHash, L"setting.group.somelongername.`{" ) == NULL );
+
+		node_free( pnHash );
+	}
+
 //	void test_addSensitive()
 //	{
 //		node_t * pnHash = node_hash_alloc_sensitive(8);
@@ -5193,6 +6298,10 @@ class NodeThread : public CxxTest::TestSuite
 static node_t * m_pnThreadStack;
 static CRITICAL_SECTION m_csStack;
 static int m_nFilesInStack;
+static node_t * m_pnShared;
+static volatile long m_bWriting;
+static volatile long m_nMisreads;
+static volatile long m_nWriters;
 
 #define PRODUCER_RUNNING 0
 #define CONSUMER_RUNNING 1
@@ -5395,16 +6504,363 @@ public:
 			SetEvent( pe->hEvent );
 	}
 
+	void test_threadedBatchAllocFree()
+	{
+#define BATCH_THREADS	8
+		struct EventAndCount e = {0};
+		e.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+		e.nCount = 0;
+
+		for( int i = 0; i < BATCH_THREADS; i++ )
+		{
+			InterlockedIncrement( &(e.nCount) );
+			_beginthread( threadmain_batch, 0, &e );
+		}
+
+		WaitForSingleObject( e.hEvent, INFINITE );
+
+		CloseHandle( e.hEvent );
+
+		TS_ASSERT( 1 );
+	}
+
+	static void threadmain_batch( void * pv )
+	{
+		node_set_error_funcs( node_error, node_memory, (node_assert_func_t)node_assert );
+
+		/* enough nodes per round that thread caches spill batches back and forth */
+		for( int j = 0; j < 20; j++ )
+		{
+			node_t * pnList = node_list_alloc();
+			int i = 0;
+			for( i = 0; i < 1000; i++ )
+				node_list_add( pnList, NODE_INT, i );
+
+			i = 0;
+			for( node_t * pn = node_first( pnList ); pn != NULL; pn = node_next( pn ) )
+				TS_ASSERT_EQUALS( node_get_int( pn ), i++ );
+			TS_ASSERT_EQUALS( i, 1000 );
+
+			node_free( pnList );
+		}
+
+		struct EventAndCount * pe = (struct EventAndCount *)pv;
+		if( InterlockedDecrement( &(pe->nCount) ) == 0 )
+			SetEvent( pe->hEvent );
+	}
+
+	void test_threadedRemoteFree()
+	{
+#define REMOTE_TREES	100
+		node_arena_t pArena = node_create_arena( 0 );
+		node_arena_t pOld = node_set_arena( pArena );
+
+		/* this thread builds, another frees */
+		m_pnThreadStack = node_list_alloc();
+		for( int i = 0; i < REMOTE_TREES; i++ )
+		{
+			node_t * pnHash = node_hash_alloc();
+			node_hash_addA( pnHash, "Name", NODE_STRINGA, "a string value long enough that it can never fit in the bag of its node" );
+			node_hash_addA( pnHash, "Index", NODE_INT, i );
+			node_list_add( m_pnThreadStack, NODE_REF, pnHash );
+		}
+
+		HANDLE hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+		_beginthread( threadmain_remotefree, 0, hEvent );
+		WaitForSingleObject( hEvent, INFINITE );
+		CloseHandle( hEvent );
+
+		node_arena_stats_t stats;
+		node_arena_stats( pArena, &stats );
+		if( pArena != NULL )
+			TS_ASSERT_EQUALS( stats.nRemoteNodes, REMOTE_TREES );
+
+		/* the next free or allocation on the owning thread frees them */
+		node_free( m_pnThreadStack );
+		node_t * pn = node_alloc();
+		node_arena_stats( pArena, &stats );
+		TS_ASSERT_EQUALS( stats.nRemoteNodes, 0 );
+		if( pArena != NULL )
+		{
+			TS_ASSERT_EQUALS( stats.nLiveNodes, 1 );
+			TS_ASSERT_EQUALS( stats.cbStrings, 0 );
+		}
+		node_free( pn );
+
+		node_set_arena( pOld );
+		node_delete_arena( pArena );
+	}
+
+	struct ThreadExit
+	{
+		HANDLE hEvent;
+		node_arena_t pArena;
+	};
+
+	void test_threadExit()
+	{
+		node_arena_t pArena = node_create_arena( 0 );
+		if( pArena == NULL )
+			return;
+
+		ThreadExit te = { CreateEvent( NULL, TRUE, FALSE, NULL ), pArena };
+		_beginthread( threadmain_exit, 0, &te );
+		WaitForSingleObject( te.hEvent, INFINITE );
+		CloseHandle( te.hEvent );
+
+		/* what the thread counted and cached went back to the arena as it left */
+		node_arena_stats_t stats;
+		node_arena_stats( pArena, &stats );
+		TS_ASSERT_EQUALS( stats.nLiveNodes, 1 );
+		TS_ASSERT( stats.nFreeNodes > 0 );
+		TS_ASSERT( stats.cbStrings > 0 );
+
+		node_delete_arena( pArena );
+	}
+
+	static void threadmain_exit( void * pv )
+	{
+		ThreadExit * pte = (ThreadExit *)pv;
+		node_set_error_funcs( node_error, node_memory, (node_assert_func_t)node_assert );
+		node_set_arena( pte->pArena );
+
+		char achLong[1024];
+		memset( achLong, 'x', sizeof(achLong) - 1 );
+		achLong[sizeof(achLong) - 1] = '\0';
+		node_t * pnKeep = node_alloc();
+		node_set( pnKeep, NODE_STRINGA, achLong );
+		for( int i = 0; i < 100; i++ )
+			node_free( node_alloc() );
+
+		node_thread_exit();
+		SetEvent( pte->hEvent );
+	}
+
+	void test_threadedRemoteFreeIdleOwner()
+	{
+		node_arena_t pArena = node_create_arena( 0 );
+		if( pArena == NULL )
+			return;
+		node_arena_t pOld = node_set_arena( pArena );
+		node_t * pnKeep = node_alloc();
+
+		/* this thread builds, another frees, and this one never allocates again */
+		node_arena_stats_t stats;
+		for( int nRound = 0; nRound < 2; nRound++ )
+		{
+			m_pnThreadStack = node_list_alloc();
+			for( int i = 0; i < REMOTE_TREES; i++ )
+			{
+				node_t * pnHash = node_hash_alloc();
+				node_hash_addA( pnHash, "Name", NODE_STRINGA, "a string value long enough that it can never fit in the bag of its node" );
+				node_list_add( m_pnThreadStack, NODE_REF, pnHash );
+			}
+
+			HANDLE hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+			_beginthread( threadmain_remotefree, 0, hEvent );
+			WaitForSingleObject( hEvent, INFINITE );
+			CloseHandle( hEvent );
+
+			node_arena_stats( pArena, &stats );
+			TS_ASSERT_EQUALS( stats.nRemoteNodes, REMOTE_TREES );
+
+			/* a free takes them back the first time, leaving the arena the second */
+			if( nRound == 0 )
+				node_free( pnKeep );
+			else
+				node_set_arena( pOld );
+
+			node_arena_stats( pArena, &stats );
+			TS_ASSERT_EQUALS( stats.nRemoteNodes, 0 );
+			node_free( m_pnThreadStack );
+		}
+
+		node_arena_stats( pArena, &stats );
+		TS_ASSERT_EQUALS( stats.nLiveNodes, 0 );
+		TS_ASSERT_EQUALS( stats.cbStrings, 0 );
+
+		node_delete_arena( pArena );
+	}
+
+	void test_threadedSharedHash()
+	{
+#define SHARED_READERS	4
+#define SHARED_KEYS		1000
+		m_pnShared = node_hash_alloc();
+		for( int i = 0; i < SHARED_KEYS; i++ )
+		{
+			char ach[32];
+			sprintf( ach, "Stable%d", i );
+			node_hash_addA( m_pnShared, ach, NODE_INT, i );
+		}
+		TS_ASSERT( node_hash_share( m_pnShared ) );
+
+		struct EventAndCount e = {0};
+		e.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+		m_bWriting = TRUE;
+		m_nMisreads = 0;
+		for( int i = 0; i < SHARED_READERS; i++ )
+		{
+			InterlockedIncrement( &(e.nCount) );
+			_beginthread( threadmain_sharedreader, 0, &e );
+		}
+
+		/* replace, add and delete under the readers, growing the table several times */
+		for( int nRound = 0; nRound < 20; nRound++ )
+		{
+			for( int i = 0; i < SHARED_KEYS; i++ )
+			{
+				char ach[32];
+				sprintf( ach, "Stable%d", i );
+				node_hash_setA( m_pnShared, ach, NODE_INT, i );
+				sprintf( ach, "Churn%d", nRound * SHARED_KEYS + i );
+				node_hash_addA( m_pnShared, ach, NODE_INT, i );
+				if( nRound > 0 )
+				{
+					sprintf( ach, "Churn%d", ( nRound - 1 ) * SHARED_KEYS + i );
+					node_hash_retire( m_pnShared, node_hash_delete_nA( m_pnShared, ach, strlen( ach ) ) );
+				}
+			}
+		}
+		m_bWriting = FALSE;
+
+		WaitForSingleObject( e.hEvent, INFINITE );
+		CloseHandle( e.hEvent );
+
+		TS_ASSERT_EQUALS( m_nMisreads, 0 );
+		TS_ASSERT_EQUALS( node_get_elements( m_pnShared ), 2 * SHARED_KEYS );
+		node_free( m_pnShared );
+	}
+
+	void test_threadedStripedWriters()
+	{
+#define STRIPED_WRITERS	4
+		m_pnShared = node_hash_alloc();
+		for( int i = 0; i < SHARED_KEYS; i++ )
+		{
+			char ach[32];
+			sprintf( ach, "Stable%d", i );
+			node_hash_addA( m_pnShared, ach, NODE_INT, i );
+		}
+		TS_ASSERT( node_hash_share( m_pnShared ) );
+
+		struct EventAndCount eReaders = {0};
+		eReaders.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+		m_bWriting = TRUE;
+		m_nMisreads = 0;
+		for( int i = 0; i < SHARED_READERS; i++ )
+		{
+			InterlockedIncrement( &(eReaders.nCount) );
+			_beginthread( threadmain_sharedreader, 0, &eReaders );
+		}
+
+		/* writers of their own keys at once, growing the table under each other */
+		struct EventAndCount eWriters = {0};
+		eWriters.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+		m_nWriters = 0;
+		for( int i = 0; i < STRIPED_WRITERS; i++ )
+		{
+			InterlockedIncrement( &(eWriters.nCount) );
+			_beginthread( threadmain_stripedwriter, 0, &eWriters );
+		}
+		WaitForSingleObject( eWriters.hEvent, INFINITE );
+		CloseHandle( eWriters.hEvent );
+		m_bWriting = FALSE;
+
+		WaitForSingleObject( eReaders.hEvent, INFINITE );
+		CloseHandle( eReaders.hEvent );
+
+		TS_ASSERT_EQUALS( m_nMisreads, 0 );
+
+		/* each writer leaves the second half of its keys, set to their last value */
+		TS_ASSERT_EQUALS( node_get_elements( m_pnShared ), SHARED_KEYS + STRIPED_WRITERS * SHARED_KEYS / 2 );
+		for( int nWriter = 0; nWriter < STRIPED_WRITERS; nWriter++ )
+		{
+			for( int i = 0; i < SHARED_KEYS; i++ )
+			{
+				char ach[32];
+				sprintf( ach, "Writer%d.%d", nWriter, i );
+				node_t * pn = node_hash_getA( m_pnShared, ach );
+				if( i < SHARED_KEYS / 2 )
+					TS_ASSERT( pn == NULL );
+				else
+					TS_ASSERT( pn != NULL && node_get_int( pn ) == -i );
+			}
+		}
+		node_free( m_pnShared );
+	}
+
+	static void threadmain_stripedwriter( void * pv )
+	{
+		node_set_error_funcs( node_error, node_memory, (node_assert_func_t)node_assert );
+
+		int nWriter = InterlockedIncrement( &m_nWriters ) - 1;
+		for( int nRound = 0; nRound < 5; nRound++ )
+		{
+			for( int i = 0; i < SHARED_KEYS; i++ )
+			{
+				char ach[32];
+				sprintf( ach, "Writer%d.%d", nWriter, i );
+				node_hash_addA( m_pnShared, ach, NODE_INT, i );
+				node_hash_setA( m_pnShared, ach, NODE_INT, -i );
+				if( i < SHARED_KEYS / 2 || nRound < 4 )
+					node_hash_retire( m_pnShared, node_hash_delete_nA( m_pnShared, ach, strlen( ach ) ) );
+			}
+		}
+
+		struct EventAndCount * pe = (struct EventAndCount *)pv;
+		if( InterlockedDecrement( &(pe->nCount) ) == 0 )
+			SetEvent( pe->hEvent );
+	}
+
+	static void threadmain_sharedreader( void * pv )
+	{
+		node_set_error_funcs( node_error, node_memory, (node_assert_func_t)node_assert );
+
+		/* every stable key is always there, with its value */
+		for( int nRead = 0; m_bWriting || nRead < SHARED_KEYS; nRead++ )
+		{
+			char ach[32];
+			int i = (int)( ( (unsigned int)nRead * 7919 ) % SHARED_KEYS );
+			sprintf( ach, "Stable%d", i );
+
+			node_read_begin();
+			node_t * pn = node_hash_getA( m_pnShared, ach );
+			if( pn == NULL || node_get_int( pn ) != i )
+				InterlockedIncrement( &m_nMisreads );
+			node_read_end();
+		}
+
+		struct EventAndCount * pe = (struct EventAndCount *)pv;
+		if( InterlockedDecrement( &(pe->nCount) ) == 0 )
+			SetEvent( pe->hEvent );
+	}
+
+	static void threadmain_remotefree( void * pv )
+	{
+		node_set_error_funcs( node_error, node_memory, (node_assert_func_t)node_assert );
+
+		node_t * pn = NULL;
+		while( (pn = node_pop( m_pnThreadStack )) != NULL )
+			node_free( pn );
+
+		SetEvent( (HANDLE)pv );
+	}
+
 };
 
 
 node_t * NodeThread::m_pnThreadStack = NULL;
 CRITICAL_SECTION NodeThread::m_csStack = {0};
 int NodeThread::m_nFilesInStack = 0;
+node_t * NodeThread::m_pnShared = NULL;
+volatile long NodeThread::m_bWriting = FALSE;
+volatile long NodeThread::m_nMisreads = 0;
+volatile long NodeThread::m_nWriters = 0;
 
 
-/* hash a string */
-unsigned int node_hashA( const char * psKey )
+/* the key hash before it went a word at a time: kept to measure the library's against */
+unsigned int old_node_hashA( const char * psKey )
 {
 	unsigned int nHash = 0x53378008;
 	const char * pc = NULL;
@@ -5419,7 +6875,7 @@ unsigned int node_hashA( const char * psKey )
 	return (nHash & NODE_HASH_MASK);
 }
 
-unsigned int node_hashW( const wchar_t * psKey )
+unsigned int old_node_hashW( const wchar_t * psKey )
 {
     unsigned int nHash = 0x55378008;
     const wchar_t * pc = NULL;
@@ -5442,16 +6898,16 @@ public:
 	void testCollideA()
 	{
 //		Collision: '100110' and '810006' hash to 27314311
-		int nKey1 = node_hashA( "100110" );
-		int nKey2 = node_hashA( "810006" );
+		int nKey1 = old_node_hashA( "100110" );
+		int nKey2 = old_node_hashA( "810006" );
 
 		TS_ASSERT_EQUALS( nKey1, nKey2 );
 		TS_ASSERT_EQUALS( nKey1, 27314311 );
 	}
 	void testCollideW()
 	{
-		int nKey1 = node_hashW( L"100110" );
-		int nKey2 = node_hashW( L"810006" );
+		int nKey1 = old_node_hashW( L"100110" );
+		int nKey2 = old_node_hashW( L"810006" );
 
 		TS_ASSERT_EQUALS( nKey1, nKey2 );
 		TS_ASSERT_EQUALS( nKey1, 27314311 );
@@ -5500,3 +6956,506 @@ public:
 	
 
 };
+
+/* the library's key hash against the one it replaced: 25-bit collisions, chains in a
+   table of a bucket per key, and hashing throughput */
+class HashBenchmark : public CxxTest::TestSuite
+{
+	typedef unsigned int (*hash_func_t)( const char * psKey );
+
+	static unsigned int NewHashA( const char * psKey ) { return node_hashA( psKey ); }
+
+	static int CompareUInt( const void * pv1, const void * pv2 )
+	{
+		unsigned int n1 = *(const unsigned int *)pv1, n2 = *(const unsigned int *)pv2;
+		return n1 < n2 ? -1 : n1 > n2;
+	}
+
+	/* keys whose hash another key already has, and the longest and mean chains */
+	int Measure( const char * psName, hash_func_t pfn, char ** ppsKeys, int nKeys, int * pnLongest )
+	{
+		int nBuckets = 1;
+		while( nBuckets < nKeys )
+			nBuckets <<= 1;
+
+		unsigned int * pnHashes = new unsigned int[nKeys];
+		int * pnChains = new int[nBuckets];
+		memset( pnChains, 0, nBuckets * sizeof(int) );
+
+		int nLongest = 0, nUsed = 0;
+		for( int i = 0; i < nKeys; i++ )
+		{
+			pnHashes[i] = pfn( ppsKeys[i] ) & NODE_HASH_MASK;
+			int & nChain = pnChains[pnHashes[i] & ( nBuckets - 1 )];
+			if( nChain++ == 0 )
+				nUsed++;
+			nLongest = __max( nLongest, nChain );
+		}
+
+		qsort( pnHashes, nKeys, sizeof(unsigned int), CompareUInt );
+		int nCollisions = 0;
+		for( int i = 1; i < nKeys; i++ )
+			if( pnHashes[i] == pnHashes[i - 1] )
+				nCollisions++;
+
+		/* hash the set over and over for the throughput */
+		size_t cbKeys = 0;
+		for( int i = 0; i < nKeys; i++ )
+			cbKeys += strlen( ppsKeys[i] );
+
+		unsigned int nSink = 0;
+		int nRounds = 0;
+		clock_t tStart = clock();
+		do
+		{
+			for( int i = 0; i < nKeys; i++ )
+				nSink += pfn( ppsKeys[i] );
+			nRounds++;
+		} while( clock() - tStart < CLOCKS_PER_SEC / 10 );
+		double dfSeconds = (double)( clock() - tStart ) / CLOCKS_PER_SEC;
+
+		char acBuffer[256];
+		sprintf( acBuffer, "%-8s %-12s %6d keys: %5d collisions, chains %d longest %.2f mean, %7.1f MB/s (%u)",
+			psName, ppsKeys[0], nKeys, nCollisions, nLongest, (double)nKeys / nUsed,
+			(double)cbKeys * nRounds / dfSeconds / ( 1024 * 1024 ), nSink & 1 );
+		TS_TRACE( acBuffer );
+
+		delete [] pnHashes;
+		delete [] pnChains;
+
+		*pnLongest = nLongest;
+		return nCollisions;
+	}
+
+	char ** MakeKeys( const char * psFormat, int nKeys )
+	{
+		char ** ppsKeys = new char *[nKeys];
+		for( int i = 0; i < nKeys; i++ )
+		{
+			char ach[128];
+			sprintf( ach, psFormat, i, i );
+			ppsKeys[i] = _strdup( ach );
+		}
+		return ppsKeys;
+	}
+
+	void FreeKeys( char ** ppsKeys, int nKeys )
+	{
+		for( int i = 0; i < nKeys; i++ )
+			free( ppsKeys[i] );
+		delete [] ppsKeys;
+	}
+
+public:
+	void test_CaseFolding()
+	{
+		TS_ASSERT_EQUALS( node_hashA( "Setting.ITEM@[1]" ), node_hashA( "setting.item@[1]" ) );
+		TS_ASSERT_DIFFERS( node_hashA( "setting.item@[1]" ), node_hashA( "setting.item`{1}" ) );
+		TS_ASSERT_EQUALS( node_hashW( L"Setting.ITEM@[1]" ), node_hashW( L"setting.item@[1]" ) );
+		TS_ASSERT_DIFFERS( node_hashW( L"setting.item@[1]" ), node_hashW( L"setting.item`{1}" ) );
+
+		/* past ASCII, case pairs a bit apart still hash together */
+		TS_ASSERT_EQUALS( node_hashA( "\xC9t\xC9" ), node_hashA( "\xE9t\xE9" ) );
+		TS_ASSERT_EQUALS( node_hashW( L"\x0416\x0430" ), node_hashW( L"\x0436\x0410" ) );
+	}
+
+	void test_Punctuation()
+	{
+		/* two characters of lower case ASCII and punctuation: '| 0x20' folded '@' into '`' and '[' into '{' */
+		char ** ppsKeys = new char *[95 * 95];
+		int nKeys = 0;
+		for( int c1 = 0x20; c1 < 0x7F; c1++ )
+			for( int c2 = 0x20; c2 < 0x7F; c2++ )
+			{
+				if( isupper( c1 ) || isupper( c2 ) )
+					continue;
+				char ach[3] = { (char)c1, (char)c2, 0 };
+				ppsKeys[nKeys++] = _strdup( ach );
+			}
+
+		int nOldLongest, nNewLongest;
+		int nOld = Measure( "old", old_node_hashA, ppsKeys, nKeys, &nOldLongest );
+		int nNew = Measure( "new", NewHashA, ppsKeys, nKeys, &nNewLongest );
+		TS_ASSERT( nNew * 10 < nOld );
+		TS_ASSERT( nNewLongest < nOldLongest );
+
+		FreeKeys( ppsKeys, nKeys );
+	}
+
+	void test_LongKeyLookups()
+	{
+		const int nKeys = 4096;
+		char ** ppsKeys = MakeKeys( "Setting.Group.SomeLongerName.Item%d", nKeys );
+
+		node_t * pnHash = node_hash_alloc();
+		for( int i = 0; i < nKeys; i++ )
+			node_hash_addA( pnHash, ppsKeys[i], NODE_INT, i );
+
+		/* look up other spellings, so no lookup is settled by the interned name alone */
+		char ** ppsLookups = MakeKeys( "SETTING.GROUP.SOMELONGERNAME.ITEM%d", nKeys );
+		int nFound = 0, nRounds = 0;
+		clock_t tStart = clock();
+		do
+		{
+			for( int i = 0; i < nKeys; i++ )
+				nFound += node_hash_getA( pnHash, ppsLookups[i] ) != NULL;
+			nRounds++;
+		} while( clock() - tStart < CLOCKS_PER_SEC / 10 );
+		double dfSeconds = (double)( clock() - tStart ) / CLOCKS_PER_SEC;
+
+		TS_ASSERT_EQUALS( nFound, nKeys * nRounds );
+
+		char acBuffer[128];
+		sprintf( acBuffer, "%d lookups of %s: %.1f million/s", nKeys * nRounds, ppsLookups[0], nKeys * nRounds / dfSeconds / 1e6 );
+		TS_TRACE( acBuffer );
+
+		node_free( pnHash );
+		FreeKeys( ppsKeys, nKeys );
+		FreeKeys( ppsLookups, nKeys );
+	}
+
+	void test_BatchedLookups()
+	{
+		/* a table well beyond the cache, looked up in a scattered order */
+		const int nKeys = 1 << 18;
+		char ** ppsKeys = MakeKeys( "Item%d", nKeys );
+
+		node_t * pnHash = node_hash_alloc();
+		for( int i = 0; i < nKeys; i++ )
+			node_hash_addA( pnHash, ppsKeys[i], NODE_INT, i );
+
+		const int nLookups = 4096;
+		const char ** apsLookups = new const char *[nLookups];
+		node_t ** apn = new node_t *[nLookups];
+		for( int i = 0; i < nLookups; i++ )
+			apsLookups[i] = ppsKeys[(int)( ( i * 2654435761u ) % nKeys )];
+
+		int nFound = 0, nRounds = 0;
+		clock_t tStart = clock();
+		do
+		{
+			for( int i = 0; i < nLookups; i++ )
+				nFound += node_hash_getA( pnHash, apsLookups[i] ) != NULL;
+			nRounds++;
+		} while( clock() - tStart < CLOCKS_PER_SEC / 10 );
+		double dfSingle = nLookups * nRounds / ( (double)( clock() - tStart ) / CLOCKS_PER_SEC );
+		TS_ASSERT_EQUALS( nFound, nLookups * nRounds );
+
+		nFound = nRounds = 0;
+		tStart = clock();
+		do
+		{
+			nFound += node_hash_get_manyA( pnHash, apsLookups, nLookups, apn );
+			nRounds++;
+		} while( clock() - tStart < CLOCKS_PER_SEC / 10 );
+		double dfBatched = nLookups * nRounds / ( (double)( clock() - tStart ) / CLOCKS_PER_SEC );
+		TS_ASSERT_EQUALS( nFound, nLookups * nRounds );
+
+		char acBuffer[128];
+		sprintf( acBuffer, "lookups in %d children: %.1f million/s one at a time, %.1f million/s batched", nKeys, dfSingle / 1e6, dfBatched / 1e6 );
+		TS_TRACE( acBuffer );
+
+		delete [] apn;
+		delete [] apsLookups;
+		node_free( pnHash );
+		FreeKeys( ppsKeys, nKeys );
+	}
+
+	void test_Updates()
+	{
+		const int nKeys = 64;
+		char ** ppsKeys = MakeKeys( "State.Counter%d", nKeys );
+
+		/* the same keys overwritten again and again, by add then by set */
+		double adfRate[2];
+		for( int bSet = 0; bSet < 2; bSet++ )
+		{
+			node_t * pnHash = node_hash_alloc();
+			int nRounds = 0;
+			clock_t tStart = clock();
+			do
+			{
+				for( int i = 0; i < nKeys; i++ )
+				{
+					if( bSet )
+						node_hash_setA( pnHash, ppsKeys[i], NODE_INT, nRounds );
+					else
+						node_hash_addA( pnHash, ppsKeys[i], NODE_INT, nRounds );
+				}
+				nRounds++;
+			} while( clock() - tStart < CLOCKS_PER_SEC / 10 );
+			adfRate[bSet] = nKeys * nRounds / ( (double)( clock() - tStart ) / CLOCKS_PER_SEC );
+
+			TS_ASSERT_EQUALS( node_get_elements( pnHash ), nKeys );
+			TS_ASSERT_EQUALS( node_get_int( node_hash_getA( pnHash, ppsKeys[0] ) ), nRounds - 1 );
+			node_free( pnHash );
+		}
+
+		char acBuffer[128];
+		sprintf( acBuffer, "updates of %d keys: %.1f million/s by add, %.1f million/s by set", nKeys, adfRate[0] / 1e6, adfRate[1] / 1e6 );
+		TS_TRACE( acBuffer );
+
+		FreeKeys( ppsKeys, nKeys );
+	}
+
+	void test_FrozenLookups()
+	{
+		const int nKeys = 1 << 16;
+		char ** ppsKeys = MakeKeys( "Route.%d.Target", nKeys );
+
+		node_t * pnHash = node_hash_alloc();
+		for( int i = 0; i < nKeys; i++ )
+			node_hash_addA( pnHash, ppsKeys[i], NODE_INT, i );
+
+		/* the same lookups, before and after freezing */
+		double adfRate[2];
+		for( int bFrozen = 0; bFrozen < 2; bFrozen++ )
+		{
+			if( bFrozen )
+			{
+				clock_t tFreeze = clock();
+				TS_ASSERT( node_hash_freeze( pnHash ) );
+				char acBuffer[128];
+				sprintf( acBuffer, "froze %d children in %.1f ms", nKeys, (double)( clock() - tFreeze ) * 1000 / CLOCKS_PER_SEC );
+				TS_TRACE( acBuffer );
+			}
+
+			int nFound = 0, nRounds = 0;
+			clock_t tStart = clock();
+			do
+			{
+				for( int i = 0; i < nKeys; i++ )
+					nFound += node_hash_getA( pnHash, ppsKeys[( (unsigned int)i * 40503 ) & ( nKeys - 1 )] ) != NULL;
+				nRounds++;
+			} while( clock() - tStart < CLOCKS_PER_SEC / 10 );
+			adfRate[bFrozen] = nKeys * nRounds / ( (double)( clock() - tStart ) / CLOCKS_PER_SEC );
+			TS_ASSERT_EQUALS( nFound, nKeys * nRounds );
+		}
+
+		char acBuffer[128];
+		sprintf( acBuffer, "lookups in %d children: %.1f million/s probing, %.1f million/s frozen", nKeys, adfRate[0] / 1e6, adfRate[1] / 1e6 );
+		TS_TRACE( acBuffer );
+
+		node_free( pnHash );
+		FreeKeys( ppsKeys, nKeys );
+	}
+
+	struct SharedLookups
+	{
+		node_t * pnHash;
+		char ** ppsKeys;
+		int nKeys;
+		CRITICAL_SECTION * pcs;		/* taken around each get, or NULL */
+		volatile long nFound;
+		struct EventAndCount e;
+	};
+
+	static void threadmain_lookups( void * pv )
+	{
+		SharedLookups * pl = (SharedLookups *)pv;
+		long nFound = 0;
+		for( int nRound = 0; nRound < 10; nRound++ )
+		{
+			for( int i = 0; i < pl->nKeys; i++ )
+			{
+				const char * psKey = pl->ppsKeys[( (unsigned int)i * 40503 ) & ( pl->nKeys - 1 )];
+				if( pl->pcs != NULL )
+				{
+					EnterCriticalSection( pl->pcs );
+					nFound += node_hash_getA( pl->pnHash, psKey ) != NULL;
+					LeaveCriticalSection( pl->pcs );
+				}
+				else
+					nFound += node_hash_getA( pl->pnHash, psKey ) != NULL;
+			}
+		}
+
+		InterlockedExchangeAdd( &(pl->nFound), nFound );
+		if( InterlockedDecrement( &(pl->e.nCount) ) == 0 )
+			SetEvent( pl->e.hEvent );
+	}
+
+	void test_SharedLookups()
+	{
+		const int nKeys = 1 << 16;
+		char ** ppsKeys = MakeKeys( "Route.%d.Target", nKeys );
+
+		node_t * pnHash = node_hash_alloc();
+		for( int i = 0; i < nKeys; i++ )
+			node_hash_addA( pnHash, ppsKeys[i], NODE_INT, i );
+		TS_ASSERT( node_hash_share( pnHash ) );
+
+		CRITICAL_SECTION cs;
+		InitializeCriticalSection( &cs );
+
+		/* the same lookups on more threads, without a lock and with one */
+		for( int nThreads = 1; nThreads <= 4; nThreads *= 2 )
+		{
+			double adfRate[2];
+			for( int bLocked = 0; bLocked < 2; bLocked++ )
+			{
+				SharedLookups l = { pnHash, ppsKeys, nKeys, bLocked ? &cs : NULL, 0 };
+				l.e.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+				l.e.nCount = nThreads;
+
+				clock_t tStart = clock();
+				for( int i = 0; i < nThreads; i++ )
+					_beginthread( threadmain_lookups, 0, &l );
+				WaitForSingleObject( l.e.hEvent, INFINITE );
+				CloseHandle( l.e.hEvent );
+
+				adfRate[bLocked] = 10.0 * nKeys * nThreads / ( (double)__max( clock() - tStart, 1 ) / CLOCKS_PER_SEC );
+				TS_ASSERT_EQUALS( l.nFound, 10 * nKeys * nThreads );
+			}
+
+			char acBuffer[128];
+			sprintf( acBuffer, "%d threads: %.1f million lookups/s lock-free, %.1f million/s under a lock", nThreads, adfRate[0] / 1e6, adfRate[1] / 1e6 );
+			TS_TRACE( acBuffer );
+		}
+
+		DeleteCriticalSection( &cs );
+		node_free( pnHash );
+		FreeKeys( ppsKeys, nKeys );
+	}
+
+	struct ConcurrentInserts
+	{
+		node_t * pnHash;
+		char ** ppsKeys;
+		int nPerThread;
+		CRITICAL_SECTION * pcs;		/* taken around each add, or NULL */
+		volatile long nNext;		/* the next thread's share of the keys */
+		struct EventAndCount e;
+	};
+
+	static void threadmain_inserts( void * pv )
+	{
+		ConcurrentInserts * pi = (ConcurrentInserts *)pv;
+		int nFirst = ( InterlockedIncrement( &(pi->nNext) ) - 1 ) * pi->nPerThread;
+		for( int i = nFirst; i < nFirst + pi->nPerThread; i++ )
+		{
+			if( pi->pcs != NULL )
+			{
+				EnterCriticalSection( pi->pcs );
+				node_hash_addA( pi->pnHash, pi->ppsKeys[i], NODE_INT, i );
+				LeaveCriticalSection( pi->pcs );
+			}
+			else
+				node_hash_addA( pi->pnHash, pi->ppsKeys[i], NODE_INT, i );
+		}
+
+		if( InterlockedDecrement( &(pi->e.nCount) ) == 0 )
+			SetEvent( pi->e.hEvent );
+	}
+
+	void test_ConcurrentInserts()
+	{
+		const int nKeys = 1 << 16;
+		char ** ppsKeys = MakeKeys( "Session.%d.State", nKeys );
+
+		CRITICAL_SECTION cs;
+		InitializeCriticalSection( &cs );
+
+		/* the same keys split among more threads, into a shared hash and into a plain one under one lock */
+		for( int nThreads = 1; nThreads <= 4; nThreads *= 2 )
+		{
+			double adfRate[2];
+			for( int bLocked = 0; bLocked < 2; bLocked++ )
+			{
+				node_t * pnHash = node_hash_alloc();
+				if( !bLocked )
+					TS_ASSERT( node_hash_share( pnHash ) );
+
+				ConcurrentInserts ci = { pnHash, ppsKeys, nKeys / nThreads, bLocked ? &cs : NULL, 0 };
+				ci.e.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+				ci.e.nCount = nThreads;
+
+				clock_t tStart = clock();
+				for( int i = 0; i < nThreads; i++ )
+					_beginthread( threadmain_inserts, 0, &ci );
+				WaitForSingleObject( ci.e.hEvent, INFINITE );
+				CloseHandle( ci.e.hEvent );
+
+				adfRate[bLocked] = nKeys / ( (double)__max( clock() - tStart, 1 ) / CLOCKS_PER_SEC );
+				TS_ASSERT_EQUALS( node_get_elements( pnHash ), nKeys );
+				TS_ASSERT( node_hash_getA( pnHash, ppsKeys[nKeys - 1] ) != NULL );
+				node_free( pnHash );
+			}
+
+			char acBuffer[128];
+			sprintf( acBuffer, "%d threads: %.1f million adds/s striped, %.1f million/s under one lock", nThreads, adfRate[0] / 1e6, adfRate[1] / 1e6 );
+			TS_TRACE( acBuffer );
+		}
+
+		DeleteCriticalSection( &cs );
+		FreeKeys( ppsKeys, nKeys );
+	}
+
+	void test_FullScan()
+	{
+		const int nKeys = 4096;
+		char ** ppsKeys = MakeKeys( "Setting.Group.Item%d", nKeys );
+
+		node_t * pnHash = node_hash_alloc();
+		for( int i = 0; i < nKeys; i++ )
+			node_hash_addA( pnHash, ppsKeys[i], NODE_INT, i );
+
+		/* the list of keys, then a lookup for each */
+		__int64 nSum = 0;
+		int nRounds = 0;
+		clock_t tStart = clock();
+		do
+		{
+			node_t * pnKeys = node_hash_keysA( pnHash );
+			for( node_t * pn = node_first( pnKeys ); pn != NULL; pn = node_next( pn ) )
+				nSum += node_get_int( node_hash_getA( pnHash, node_get_stringA( pn ) ) );
+			node_free( pnKeys );
+			nRounds++;
+		} while( clock() - tStart < CLOCKS_PER_SEC / 10 );
+		double dfKeys = nRounds / ( (double)( clock() - tStart ) / CLOCKS_PER_SEC );
+		TS_ASSERT_EQUALS( nSum, (__int64)nRounds * nKeys * ( nKeys - 1 ) / 2 );
+
+		/* the iterator */
+		node_hash_iter_t it;
+		nSum = 0;
+		nRounds = 0;
+		tStart = clock();
+		do
+		{
+			for( node_t * pn = node_hash_iter_begin( pnHash, &it ); pn != NULL; pn = node_hash_iter_next( &it ) )
+				nSum += node_get_int( pn );
+			nRounds++;
+		} while( clock() - tStart < CLOCKS_PER_SEC / 10 );
+		double dfIter = nRounds / ( (double)( clock() - tStart ) / CLOCKS_PER_SEC );
+		TS_ASSERT_EQUALS( nSum, (__int64)nRounds * nKeys * ( nKeys - 1 ) / 2 );
+
+		char acBuffer[128];
+		sprintf( acBuffer, "scans of %d children: %.0f/s with node_hash_keys and gets, %.0f/s iterating", nKeys, dfKeys, dfIter );
+		TS_TRACE( acBuffer );
+
+		node_free( pnHash );
+		FreeKeys( ppsKeys, nKeys );
+	}
+
+	void test_Keys()
+	{
+		static const char * apsFormats[] = { "Setting.Group.Item%d", "%d", "Item%d.Value%d",
+			"Setting.Group.SomeLongerName.WithMorePartsThanUsual.Item%d" };
+		const int nKeys = 65536;
+
+		for( int f = 0; f < sizeof(apsFormats) / sizeof(apsFormats[0]); f++ )
+		{
+			char ** ppsKeys = MakeKeys( apsFormats[f], nKeys );
+
+			int nOldLongest, nNewLongest;
+			Measure( "old", old_node_hashA, ppsKeys, nKeys, &nOldLongest );
+			int nNew = Measure( "new", NewHashA, ppsKeys, nKeys, &nNewLongest );
+
+			/* about what 65536 random 25-bit hashes would give */
+			TS_ASSERT( nNew < 200 );
+			TS_ASSERT( nNewLongest < 12 );
+
+			FreeKeys( ppsKeys, nKeys );
+		}
+	}
+};